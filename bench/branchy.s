@@ -0,0 +1,74 @@
+# Código cheio de desvios dependentes dos dados: passos de Collatz de 1 a N e
+# ordenação por inserção de um vetor pseudoaleatório.
+.text
+_start:
+  li s2, 0                 # checksum
+  # Collatz
+  li s0, 1
+  li s1, 6000
+collatz:
+  mv a0, s0
+  li a1, 0
+1:li t0, 1
+  beq a0, t0, 3f
+  andi t0, a0, 1
+  beqz t0, 2f
+  slli t1, a0, 1
+  add a0, a0, t1
+  addi a0, a0, 1
+  addi a1, a1, 1
+  j 1b
+2:srli a0, a0, 1
+  addi a1, a1, 1
+  j 1b
+3:add s2, s2, a1
+  addi s0, s0, 1
+  bne s0, s1, collatz
+  # ordenação, 12 vezes
+  li s3, 0x80010000
+  li s4, 800               # elementos
+  li s5, 12
+  li a2, 7
+  li t6, 1103515245
+sort_round:
+  mv t0, s3
+  mv t1, s4
+fill:
+  mul a2, a2, t6
+  addi a2, a2, 1013
+  srli t2, a2, 8
+  sw t2, 0(t0)
+  addi t0, t0, 4
+  addi t1, t1, -1
+  bnez t1, fill
+  li t0, 1                 # i
+outer:
+  slli t1, t0, 2
+  add t1, t1, s3
+  lw a0, 0(t1)             # chave
+inner:
+  beq t1, s3, 4f
+  lw a1, -4(t1)
+  bgeu a0, a1, 4f
+  sw a1, 0(t1)
+  addi t1, t1, -4
+  j inner
+4:sw a0, 0(t1)
+  addi t0, t0, 1
+  bne t0, s4, outer
+  # soma ponderada do vetor ordenado
+  mv t0, s3
+  mv t1, s4
+5:lw a0, 0(t0)
+  mul a0, a0, t1
+  add s2, s2, a0
+  addi t0, t0, 4
+  addi t1, t1, -1
+  bnez t1, 5b
+  addi s5, s5, -1
+  bnez s5, sort_round
+  mv a0, s2
+  call print_hex
+  ebreak
+
+.include "print.s"
@@ -0,0 +1,66 @@
+# CRC-32 (polinômio 0xEDB88320) com tabela de 256 entradas sobre um buffer de
+# 16 KiB, repetido; cada volta muda um byte do buffer.
+.text
+_start:
+  li s0, 0x80010000        # tabela
+  li s1, 0x80011000        # buffer
+  li s4, 16384             # bytes
+  # tabela
+  li t0, 0
+  li t6, 0xedb88320
+table:
+  mv a0, t0
+  li t1, 8
+1:andi t2, a0, 1
+  srli a0, a0, 1
+  beqz t2, 2f
+  xor a0, a0, t6
+2:addi t1, t1, -1
+  bnez t1, 1b
+  slli t2, t0, 2
+  add t2, t2, s0
+  sw a0, 0(t2)
+  addi t0, t0, 1
+  li t1, 256
+  bne t0, t1, table
+  # buffer: bytes de um gerador congruencial
+  mv t0, s1
+  add t1, s1, s4
+  li a0, 1
+  li t3, 1103515245
+fill:
+  mul a0, a0, t3
+  addi a0, a0, 1013
+  srli t2, a0, 16
+  sb t2, 0(t0)
+  addi t0, t0, 1
+  bne t0, t1, fill
+  li s5, 160               # voltas
+  li s2, 0
+round:
+  li a0, -1
+  mv t0, s1
+  add t1, s1, s4
+crc:
+  lbu t2, 0(t0)
+  xor t2, t2, a0
+  andi t2, t2, 255
+  slli t2, t2, 2
+  add t2, t2, s0
+  lw t3, 0(t2)
+  srli a0, a0, 8
+  xor a0, a0, t3
+  addi t0, t0, 1
+  bne t0, t1, crc
+  not a0, a0
+  add s2, s2, a0
+  andi t2, s5, 1023
+  add t2, t2, s1
+  sb a0, 0(t2)
+  addi s5, s5, -1
+  bnez s5, round
+  mv a0, s2
+  call print_hex
+  ebreak
+
+.include "print.s"
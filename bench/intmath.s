@@ -0,0 +1,35 @@
+# Núcleos inteiros: gerador congruencial, mul/mulh, div/rem e mdc de Euclides.
+.text
+_start:
+  li s0, 200000            # voltas
+  li s1, 12345             # estado do gerador
+  li s2, 0                 # checksum
+  li s3, 1103515245
+loop:
+  mul s1, s1, s3
+  addi s1, s1, 1013
+  srli a0, s1, 8
+  mulhu a1, s1, s3
+  ori a1, a1, 1
+  divu t0, a0, a1
+  remu t1, a0, a1
+  add s2, s2, t0
+  xor s2, s2, t1
+  # mdc(a0 | 1, a1)
+  ori a0, a0, 1
+gcd:
+  remu t2, a0, a1
+  mv a0, a1
+  mv a1, t2
+  bnez a1, gcd
+  slli t3, s2, 5
+  srli t4, s2, 27
+  or s2, t3, t4
+  add s2, s2, a0
+  addi s0, s0, -1
+  bnez s0, loop
+  mv a0, s2
+  call print_hex
+  ebreak
+
+.include "print.s"
@@ -0,0 +1,84 @@
+# Multiplicação de matrizes 32x32 de inteiros, repetida (C = A * B, depois
+# A = C com os elementos rodados).
+.text
+_start:
+  li s0, 0x80010000        # A
+  li s1, 0x80011000        # B
+  li s2, 0x80012000        # C
+  li s3, 32                # N
+  # A[i] = i*7+1, B[i] = i^0x55
+  li t0, 0
+  li t1, 1024
+init:
+  slli t2, t0, 2
+  li t3, 7
+  mul t3, t0, t3
+  addi t3, t3, 1
+  add t4, s0, t2
+  sw t3, 0(t4)
+  xori t3, t0, 0x55
+  add t4, s1, t2
+  sw t3, 0(t4)
+  addi t0, t0, 1
+  bne t0, t1, init
+  li s5, 24                # voltas
+round:
+  li a0, 0                 # i
+row:
+  li a1, 0                 # j
+col:
+  li a3, 0                 # soma
+  slli t0, a0, 7           # &A[i][0]
+  add t0, t0, s0
+  slli t1, a1, 2           # &B[0][j]
+  add t1, t1, s1
+  mv a2, s3
+dot:
+  lw t2, 0(t0)
+  lw t3, 0(t1)
+  mul t2, t2, t3
+  add a3, a3, t2
+  addi t0, t0, 4
+  addi t1, t1, 128
+  addi a2, a2, -1
+  bnez a2, dot
+  slli t0, a0, 7
+  slli t1, a1, 2
+  add t0, t0, t1
+  add t0, t0, s2
+  sw a3, 0(t0)
+  addi a1, a1, 1
+  bne a1, s3, col
+  addi a0, a0, 1
+  bne a0, s3, row
+  # A = C rodado de 3 bits
+  li t0, 0
+  li t1, 4096
+copy:
+  add t2, s2, t0
+  lw t3, 0(t2)
+  slli t4, t3, 3
+  srli t3, t3, 29
+  or t3, t3, t4
+  add t2, s0, t0
+  sw t3, 0(t2)
+  addi t0, t0, 4
+  bne t0, t1, copy
+  addi s5, s5, -1
+  bnez s5, round
+  # checksum de C
+  li a0, 0
+  li t0, 0
+sum:
+  add t2, s2, t0
+  lw t3, 0(t2)
+  xor a0, a0, t3
+  slli t4, a0, 1
+  srli a0, a0, 31
+  or a0, a0, t4
+  addi t0, t0, 4
+  bne t0, t1, sum
+  call print_hex
+  ebreak
+
+.include "print.s"
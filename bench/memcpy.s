@@ -0,0 +1,70 @@
+# Cópia de memória: palavras com o laço desenrolado e bytes com a origem
+# desalinhada, entre dois buffers de 16 KiB.
+.text
+_start:
+  li s0, 0x80010000        # A
+  li s1, 0x80014000        # B
+  li s4, 4096              # palavras por buffer
+  # preenche A
+  mv t0, s0
+  mv t1, s4
+  li t2, 0x9e3779b9
+fill:
+  mul t3, t1, t2
+  xor t3, t3, t1
+  sw t3, 0(t0)
+  addi t0, t0, 4
+  addi t1, t1, -1
+  bnez t1, fill
+  li s5, 150               # voltas
+round:
+  # A -> B, 4 palavras por volta
+  mv t0, s0
+  mv t1, s1
+  add t2, s0, s4
+  add t2, t2, s4
+  add t2, t2, s4
+  add t2, t2, s4
+words:
+  lw a0, 0(t0)
+  lw a1, 4(t0)
+  lw a2, 8(t0)
+  lw a3, 12(t0)
+  sw a0, 0(t1)
+  sw a1, 4(t1)
+  sw a2, 8(t1)
+  sw a3, 12(t1)
+  addi t0, t0, 16
+  addi t1, t1, 16
+  bne t0, t2, words
+  # B+1 -> A, byte a byte (16 KiB - 1)
+  addi t0, s1, 1
+  mv t1, s0
+  li t3, 16383
+  add t2, t0, t3
+bytes:
+  lbu a0, 0(t0)
+  sb a0, 0(t1)
+  addi t0, t0, 1
+  addi t1, t1, 1
+  bne t0, t2, bytes
+  addi s5, s5, -1
+  bnez s5, round
+  # checksum de A
+  mv t0, s0
+  mv t1, s4
+  li s2, 0
+sum:
+  lw a0, 0(t0)
+  slli t3, s2, 1
+  srli t4, s2, 31
+  or s2, t3, t4
+  xor s2, s2, a0
+  addi t0, t0, 4
+  addi t1, t1, -1
+  bnez t1, sum
+  mv a0, s2
+  call print_hex
+  ebreak
+
+.include "print.s"
@@ -0,0 +1,15 @@
+#!/bin/sh
+# Remonta os .hex das cargas a partir dos .s (precisa de llvm-mc e
+# llvm-objcopy). Uso: bench/mkhex.sh [carga.s...]
+set -e
+dir=$(dirname "$0")
+[ $# -gt 0 ] || set -- $(ls "$dir"/*.s | grep -v '/print\.s$')
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+for s in "$@"; do
+    name=$(basename "$s" .s)
+    llvm-mc -triple=riscv32 -mattr=+m,-relax -filetype=obj -I "$dir" "$s" -o "$tmp/$name.o"
+    llvm-objcopy -O binary -j .text "$tmp/$name.o" "$tmp/$name.bin"
+    { echo "@80000000"; od -An -v -tx1 -w16 "$tmp/$name.bin" | sed 's/^ //' | tr a-f A-F; } > "$dir/$name.hex"
+    echo "$dir/$name.hex"
+done
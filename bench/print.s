@@ -0,0 +1,27 @@
+# Rotinas comuns das cargas: print_hex imprime a0 em hexadecimal (8 dígitos e
+# '\n') na UART. Usa t5, t6, s9-s11.
+putc:
+  li t6, 0x10000000
+1:lbu t5, 5(t6)            # LSR.THRE
+  andi t5, t5, 0x20
+  beqz t5, 1b
+  sb a0, 0(t6)
+  ret
+
+print_hex:
+  mv s11, ra
+  mv s9, a0
+  li s10, 28
+1:srl a0, s9, s10
+  andi a0, a0, 15
+  li t5, 10
+  blt a0, t5, 2f
+  addi a0, a0, 39
+2:addi a0, a0, 48
+  call putc
+  addi s10, s10, -4
+  bgez s10, 1b
+  li a0, 10
+  call putc
+  mv ra, s11
+  ret
@@ -0,0 +1,34 @@
+#!/bin/sh
+# Roda as cargas de referência com --no-trace --stats, confere a saída da UART
+# com expected.txt e imprime os MIPS de cada uma e do conjunto.
+# Uso: bench/run.sh [poxim] [opções do poxim...]   (padrão: ./poxim)
+dir=$(dirname "$0")
+case "$1" in
+    ''|-*) poxim=./poxim ;;
+    *) poxim=$1; shift ;;
+esac
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+: > "$tmp/in"
+
+fail=0
+printf '%-10s %12s %9s %9s  %s\n' carga instrucoes segundos MIPS saida
+while read -r name expected; do
+    case "$name" in ''|'#'*) continue ;; esac
+    "$poxim" --no-trace --stats "$@" "$dir/$name.hex" /dev/null "$tmp/in" "$tmp/out" 2> "$tmp/err"
+    out=$(cat "$tmp/out")
+    instret=$(sed -n '/^--- estatisticas/,/^MIPS/s/^instrucoes: *//p' "$tmp/err") # --timing repete a linha
+    seconds=$(sed -n 's/^tempo (host): *\([0-9.]*\).*/\1/p' "$tmp/err")
+    mips=$(sed -n 's/^MIPS: *//p' "$tmp/err")
+    if [ "$out" = "$expected" ]; then
+        status=ok
+        echo "$instret $seconds" >> "$tmp/total"
+    else
+        status="ERRO (esperado $expected)"
+        fail=1
+    fi
+    printf '%-10s %12s %9s %9s  %s %s\n' "$name" "${instret:--}" "${seconds:--}" "${mips:--}" "$out" "$status"
+done < "$dir/expected.txt"
+
+[ -f "$tmp/total" ] && awk '{ i += $1; s += $2 } END { printf "%-10s %12d %9.3f %9.2f\n", "total", i, s, (s > 0 ? i / s / 1e6 : 0) }' "$tmp/total"
+exit $fail
@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "poxim.h"
+
+// Tradução antecipada de um programa fixo: grava o C com um bloco por cabeça
+// alcançável (ver "Tradução Antecipada (AOT)" no README). Usa a libpoxim para
+// carregar o programa e gerar o C (por isso as funções daqui são static);
+// compilar com:
+//   gcc -O2 -pthread -DPOXIM_LIBRARY -o poxim-aot poxim-aot.c poxim.c
+
+// --- Leitura de Arquivos ---
+static uint8_t *read_file(const char *path, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+    size_t cap = 1 << 16, n = 0, got;
+    uint8_t *buf = (uint8_t*)malloc(cap);
+    while ((got = fread(buf + n, 1, cap - n, f)) > 0) {
+        n += got;
+        if (n == cap) buf = (uint8_t*)realloc(buf, cap *= 2);
+    }
+    fclose(f);
+    *len = n;
+    return buf;
+}
+
+// Alvos: um endereço em hexa por linha (o <prefixo>.targets do --profile);
+// '#' começa um comentário.
+static uint32_t *read_targets(const char *path, size_t *count) {
+    FILE *f = fopen(path, "r");
+    if (!f) return NULL;
+    size_t cap = 256;
+    uint32_t *targets = (uint32_t*)malloc(cap * sizeof(uint32_t));
+    char line[256];
+    *count = 0;
+    while (fgets(line, sizeof(line), f)) {
+        char *p = line, *end;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '#' || *p == '\n' || *p == '\0') continue;
+        unsigned long v = strtoul(p, &end, 16);
+        if (end == p) {
+            fprintf(stderr, "Alvo invalido em %s: %s", path, line);
+            continue;
+        }
+        if (*count == cap) targets = (uint32_t*)realloc(targets, (cap *= 2) * sizeof(uint32_t));
+        targets[(*count)++] = (uint32_t)v;
+    }
+    fclose(f);
+    return targets;
+}
+
+static void print_usage(const char *prog) {
+    fprintf(stderr, "Uso: %s [opcoes] <hex_in> <saida.c>\n", prog);
+    fprintf(stderr, "Opcoes:\n");
+    fprintf(stderr, "  --targets=<arq>  alvos de saltos indiretos e de traps (um endereco por linha,\n");
+    fprintf(stderr, "                   como o <prefixo>.targets do poxim --profile)\n");
+    fprintf(stderr, "  --name=<simbolo> nome do poxim_aot_t gerado (padrao: poxim_aot_image)\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *targets_path = NULL, *name = NULL;
+    int argi = 1;
+    for (; argi < argc && argv[argi][0] == '-'; argi++) {
+        if (strncmp(argv[argi], "--targets=", 10) == 0) {
+            targets_path = argv[argi] + 10;
+        } else if (strncmp(argv[argi], "--name=", 7) == 0) {
+            name = argv[argi] + 7;
+        } else {
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (argc - argi != 2) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    size_t len, target_count = 0;
+    uint8_t *image = read_file(argv[argi], &len);
+    if (!image) {
+        perror("Erro ao abrir o programa");
+        return EXIT_FAILURE;
+    }
+    uint32_t *targets = NULL;
+    if (targets_path && !(targets = read_targets(targets_path, &target_count))) {
+        perror("Erro ao abrir a lista de alvos");
+        free(image);
+        return EXIT_FAILURE;
+    }
+
+    poxim_config_t config = { 1, POXIM_ENGINE_CACHE, 0, 1 };
+    poxim_t *m = poxim_new(&config);
+    int blocks = -1;
+    if (m && poxim_load(m, image, len) == 0) blocks = poxim_aot_generate(m, argv[argi + 1], targets, target_count, name);
+    if (blocks >= 0) printf("%d blocos gravados em %s\n", blocks, argv[argi + 1]);
+
+    poxim_free(m);
+    free(targets);
+    free(image);
+    return blocks >= 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "poxim_trace.h"
+
+// Converte o trace binário do poxim (--trace-format=bin) para o mesmo texto
+// que o simulador grava com --trace-format=text.
+
+#define READ_BUFFER_SIZE (1 << 20)
+
+// --- Leitura em Blocos ---
+typedef struct {
+    FILE *file;
+    uint8_t *buf;
+    size_t pos, len;
+    int eof;
+} reader_t;
+
+int reader_fill(reader_t *r) {
+    if (r->pos < r->len) return 1;
+    r->len = fread(r->buf, 1, READ_BUFFER_SIZE, r->file);
+    r->pos = 0;
+    if (r->len == 0) r->eof = 1;
+    return r->len > 0;
+}
+
+int read_byte(reader_t *r, uint8_t *out) {
+    if (!reader_fill(r)) return 0;
+    *out = r->buf[r->pos++];
+    return 1;
+}
+
+int read_varint(reader_t *r, uint32_t *out) {
+    uint32_t v = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        uint8_t b;
+        if (!read_byte(r, &b)) return 0;
+        v |= (uint32_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) { *out = v; return 1; }
+    }
+    return 0;
+}
+
+int read_word(reader_t *r, uint32_t *out) {
+    uint8_t b[4];
+    for (int i = 0; i < 4; i++) {
+        if (!read_byte(r, &b[i])) return 0;
+    }
+    *out = (uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+    return 1;
+}
+
+// --- Conversão ---
+trace_bin_state_t state;
+
+int convert_insn(reader_t *r, uint8_t tag, FILE *out) {
+    trace_info_t t;
+    uint32_t v;
+
+    t.pc = state.expected_pc;
+    if (tag & TRACE_FLAG_PC) {
+        if (!read_varint(r, &v)) return 0;
+        t.pc += trace_unzigzag(v);
+    }
+    uint32_t slot = trace_insn_slot(t.pc);
+    if (tag & TRACE_FLAG_RAW) {
+        if (!read_word(r, &t.instruction)) return 0;
+        state.insn_cache[slot].pc = t.pc;
+        state.insn_cache[slot].insn = t.instruction;
+    } else {
+        if (state.insn_cache[slot].pc != t.pc) {
+            fprintf(stderr, "Trace corrompido: instrucao desconhecida em 0x%08x\n", t.pc);
+            return 0;
+        }
+        t.instruction = state.insn_cache[slot].insn;
+    }
+
+    t.rs1_val = state.regs[get_rs1(t.instruction)];
+    t.rs2_val = state.regs[get_rs2(t.instruction)];
+    t.rd_val = 0;
+    t.csr_old = t.csr_new = 0;
+    if (trace_insn_writes_rd(t.instruction)) {
+        if (!read_varint(r, &v)) return 0;
+        t.rd_val = state.regs[get_rd(t.instruction)] + trace_unzigzag(v);
+    }
+    if (trace_insn_is_csr(t.instruction)) {
+        if (!read_varint(r, &t.csr_old) || !read_varint(r, &t.csr_new)) return 0;
+    }
+    t.next_pc = trace_predict_next_pc(&state, t.pc, t.instruction);
+    if (tag & TRACE_FLAG_NEXT) {
+        if (!read_varint(r, &t.next_pc)) return 0;
+    }
+
+    char details_buffer[256];
+    format_trace_details(&t, details_buffer);
+    if (details_buffer[0] != '\0') {
+        fprintf(out, "0x%08x:%s\n", t.pc, details_buffer);
+    }
+    trace_bin_retire(&state, &t);
+    return 1;
+}
+
+int convert(reader_t *r, FILE *out) {
+    uint8_t magic[4], version;
+    for (int i = 0; i < 4; i++) {
+        if (!read_byte(r, &magic[i])) return 0;
+    }
+    if (memcmp(magic, TRACE_BIN_MAGIC, 4) != 0 || !read_byte(r, &version) || version != TRACE_BIN_VERSION) {
+        fprintf(stderr, "Arquivo nao e um trace binario do poxim (versao %d)\n", TRACE_BIN_VERSION);
+        return 0;
+    }
+    trace_bin_state_init(&state);
+    for (int i = 0; i < 32; i++) {
+        if (!read_varint(r, &state.regs[i])) return 0;
+    }
+    if (!read_varint(r, &state.expected_pc)) return 0;
+
+    uint8_t tag;
+    while (read_byte(r, &tag)) {
+        uint32_t cause, epc, tval, delta;
+        uint8_t rd;
+        switch (tag & TRACE_REC_KIND) {
+            case TRACE_REC_INSN:
+                if (!convert_insn(r, tag, out)) return 0;
+                break;
+            case TRACE_REC_TRAP:
+                if (!read_varint(r, &cause) || !read_varint(r, &epc) || !read_varint(r, &tval)) return 0;
+                fprintf(out, TRACE_TRAP_FMT, get_trap_name(cause), cause, epc, tval);
+                break;
+            case TRACE_REC_FATAL:
+                fprintf(out, TRACE_FATAL_LINE);
+                break;
+            case TRACE_REC_REG:
+                if (!read_byte(r, &rd) || rd >= 32 || !read_varint(r, &delta)) return 0;
+                state.regs[rd] += trace_unzigzag(delta);
+                break;
+        }
+    }
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Uso: %s <trace_bin> [trace_txt]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    reader_t r;
+    memset(&r, 0, sizeof(r));
+    r.file = fopen(argv[1], "rb");
+    if (!r.file) {
+        perror("Erro ao abrir trace binario");
+        return EXIT_FAILURE;
+    }
+
+    FILE *out = stdout;
+    if (argc == 3) {
+        out = fopen(argv[2], "w");
+        if (!out) {
+            perror("Erro ao criar trace de texto");
+            fclose(r.file);
+            return EXIT_FAILURE;
+        }
+    }
+    static char out_buffer[1 << 20];
+    setvbuf(out, out_buffer, _IOFBF, sizeof(out_buffer));
+
+    r.buf = (uint8_t*)malloc(READ_BUFFER_SIZE);
+    int ok = convert(&r, out);
+    if (!ok && !r.eof) fprintf(stderr, "Trace binario invalido ou truncado\n");
+    else if (!ok) fprintf(stderr, "Trace binario truncado\n");
+
+    free(r.buf);
+    fclose(r.file);
+    if (out != stdout) fclose(out);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,346 +1,2108 @@
+#define _GNU_SOURCE // fopencookie (trace da libpoxim)
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <errno.h>
+#include <endian.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <elf.h>
+
+#include "poxim_trace.h"
+#include "poxim.h"
+#include "poxim_aot.h"
 
 // --- Definições do Simulador ---
-#define MEMORY_SIZE (128 * 1024)
+#define MEMORY_SIZE (128 * 1024) // RAM principal padrão (--ram)
 #define NUM_REGISTERS 32
 #define PC_START_ADDRESS 0x80000000
 
+// Tamanho da RAM principal, em PC_START_ADDRESS. É o mesmo em todas as
+// máquinas do processo, como os caches de cada thread, que têm uma entrada por
+// palavra dela (ver "Mapa de Memória").
+uint32_t memory_size = MEMORY_SIZE;
+
 // --- Mapa de Memória dos Periféricos ---
 #define CLINT_BASE 0x02000000
 #define PLIC_BASE  0x0C000000
 #define UART_BASE  0x10000000
 #define UART_IRQ 10
-// --- Variáveis Globais de Estado da CPU ---
-uint32_t pc;
-uint32_t regs[NUM_REGISTERS];
-uint8_t memory[MEMORY_SIZE];
-int halt_flag = 0;
-int trap_pending_print = 0;
-
-// --- CSRs ---
-uint32_t mstatus = 0x00001800;
-uint32_t mie = 0, mtvec = 0, mepc = 0, mcause = 0, mtval = 0, mscratch = 0;
-uint32_t mip = 0;
-uint32_t misa = 0x40101101;
+#define BLK_BASE   0x10001000
+#define BLK_IRQ 1
+// --- Estado dos Harts ---
+// Tudo o que é de um hart (registradores, CSRs, mtimecmp, escalonador de
+// interrupções) fica em hart_t. Cada hart roda na sua própria thread do host e
+// 'hart' aponta para o hart da thread atual; a RAM e os periféricos são da
+// máquina (machine_t) e compartilhados entre os harts dela.
+//
+// mtime é contado por hart: cada instrução avança o relógio do hart que a
+// executou, e é esse valor que o hart lê no CLINT e compara com o seu
+// mtimecmp. Os dispositivos andam com o maior tempo já visto (uart_now). Com um
+// só hart isso é exatamente o mtime de sempre.
+#define MAX_HARTS 32
 
-// --- Periféricos ---
-uint64_t mtime = 0;
-// --- CORREÇÃO 2: Inicializado para o valor máximo para não disparar imediatamente.
-uint64_t mtimecmp = -1; 
-uint32_t plic_pending = 0;
-uint32_t plic_enable = 0;
-uint8_t uart_ier = 0;
-uint8_t uart_lsr = 1 << 5;
-
-// Ponteiro de arquivo para a saída da UART
-FILE* uart_outfile = NULL;
-FILE* uart_infile = NULL;
-
-const char *abi_name[NUM_REGISTERS] = {
-    "zero", "ra", "sp", "gp", "tp", "t0", "t1", "t2",
-    "s0", "s1", "a0", "a1", "a2", "a3", "a4", "a5",
-    "a6", "a7", "s2", "s3", "s4", "s5", "s6", "s7",
-    "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6"};
+typedef struct machine machine_t;
+typedef struct profile profile_t;
+typedef struct timing timing_t;
 
-// --- Funções Auxiliares ---
-const char *get_csr_name(uint32_t csr_addr) {
-    switch (csr_addr) {
-        case 0x300: return "mstatus"; case 0x304: return "mie";
-        case 0x305: return "mtvec";   case 0x341: return "mepc";
-        case 0x342: return "mcause";  case 0x343: return "mtval";
-        case 0x340: return "mscratch";case 0x301: return "misa";
-        case 0x344: return "mip";
-        default: return "unknown_csr";
+// TLB em software de cada hart (ver "Tradução de Endereços"), mapeado direto
+// pelo número da página virtual. Cada entrada guarda, por tipo de acesso, a
+// página virtual (endereço com os 12 bits baixos em 0) que pode ir direto ao
+// host, e o início dela no host. Um load, store ou busca custa uma comparação.
+#define TLB_ENTRIES 256
+#define TLB_EMPTY 0xFFFFFFFF  // nenhum endereço alinhado, mascarado, chega a ele
+#define TLB_NO_RAM 0xFFFFFFFF // página fora da RAM principal
+
+typedef struct {
+    uint32_t load, store, fetch;
+    uint32_t ram_page; // deslocamento da página na RAM principal (cache de instruções)
+    uint8_t *host;
+} tlb_entry_t;
+
+// Modos de privilégio e os campos de mstatus que os modos S e U usam.
+#define PRIV_U 0
+#define PRIV_S 1
+#define PRIV_M 3
+
+#define MSTATUS_SIE  (1u << 1)
+#define MSTATUS_MIE  (1u << 3)
+#define MSTATUS_SPIE (1u << 5)
+#define MSTATUS_MPIE (1u << 7)
+#define MSTATUS_SPP  (1u << 8)
+#define MSTATUS_MPP  (3u << 11)
+#define MSTATUS_MPRV (1u << 17)
+#define MSTATUS_SUM  (1u << 18)
+#define MSTATUS_MXR  (1u << 19)
+#define MSTATUS_TVM  (1u << 20)
+#define MSTATUS_TW   (1u << 21)
+#define MSTATUS_TSR  (1u << 22)
+#define SSTATUS_MASK (MSTATUS_SIE | MSTATUS_SPIE | MSTATUS_SPP | MSTATUS_SUM | MSTATUS_MXR)
+
+typedef struct {
+    uint32_t pc;
+    uint32_t regs[NUM_REGISTERS];
+    int halt_flag;
+    int trap_pending_print;
+
+    // CSRs
+    uint32_t mstatus, mie, mtvec, mepc, mcause, mtval, mscratch;
+    uint32_t mip; // outros harts mudam MSIP/MTIP: sempre com mip_set/mip_clear
+    uint32_t misa, mhartid;
+    uint32_t medeleg, mideleg, mcounteren;
+    // Modo S (sstatus, sie e sip são vistas de mstatus, mie e mip)
+    uint32_t stvec, sepc, scause, stval, sscratch, scounteren, satp;
+    uint32_t priv; // PRIV_M, PRIV_S ou PRIV_U
+
+    // Último trap tomado, em M ou em S: o trace e a detecção de double fault
+    // usam estes campos em vez dos CSRs do modo que recebeu o trap.
+    uint32_t trap_cause, trap_epc, trap_tval, trap_vector;
+
+    // Tradução (ver "Tradução de Endereços"). translate: Sv32 vale para a
+    // busca ou para os dados no modo atual; JIT, AOT, --simd e laços ociosos,
+    // que usam endereços físicos, só rodam sem ela. tlb_context identifica o
+    // que as entradas da TLB supõem (modos, SUM, MXR): mudou, a TLB esvazia.
+    int translate;
+    uint32_t tlb_context;
+    tlb_entry_t tlb[TLB_ENTRIES];
+
+    uint64_t mtime;
+    uint64_t mtimecmp; // -1 (valor máximo) para não disparar imediatamente
+    uint64_t stop_at;  // --checkpoint-at: a máquina para quando mtime chega aqui
+
+    // Escalonador de interrupções: check_interrupts() só refaz a checagem
+    // completa quando mtime alcança irq_next_check. Toda escrita que pode mudar
+    // o resultado (mstatus, mie, mip, mret, CLINT, PLIC, UART) zera o campo do
+    // hart afetado (irq_wake/hart_wake).
+    uint64_t irq_next_check;
+    uint32_t wake_count; // hart_wake() de outros harts, para não perder um aviso
+
+    // --profile-period (ver "Perfil") e --ff=N (ver "Avanço Rápido"):
+    // irq_next_check também para na próxima amostra e na instrução de parada;
+    // event_check guarda o prazo de verdade, que o wfi usa para não ser
+    // encurtado por elas (hart_next_event).
+    uint64_t profile_next, event_check;
+
+    // Fim da fase do --ff (ver "Avanço Rápido"), só no hart 0: a máquina para
+    // na instrução stop_instret, na stop_pc_hits-ésima chegada em stop_pc ou
+    // no stop_ecalls-ésimo ecall (contadores em 0: sem limite).
+    uint64_t stop_instret;
+    uint32_t stop_pc;
+    uint64_t stop_pc_hits, stop_ecalls;
+
+    uint32_t last_trap_pc, last_trap_cause; // detecção de double fault
+
+    // Contagem de instruções sem custo no laço: mtime já conta um passo por
+    // instrução, então basta descontar o tempo pulado pelo wfi e os passos que
+    // terminaram em trap (ver hart_instret).
+    uint64_t wfi_ticks;
+    uint64_t trap_count;
+    uint64_t interrupt_count; // dos traps, quantos foram interrupções
+    uint64_t stall_ticks;     // ciclos a mais do --timing (ver "Modelo de Tempo")
+
+    // Contadores (ver "Contadores"): valor = fonte + offset, por índice do CSR
+    // (0 mcycle, 2 minstret, 3-31 mhpmcounter).
+    uint64_t counter_offset[32];
+    uint32_t hpm_event[32];
+
+    // Reserva do lr.w (ver "Extensão A")
+    int reserved;
+    uint32_t reserved_address, reserved_value;
+
+    int sleeping;      // parado esperando outro hart (ver hart_sleep)
+    int trace_bin_open; // cabeçalho do trace binário já gravado em trace_file
+    uint64_t trace_sampled; // instruções já vistas pelo --trace-sample
+    profile_t *profile; // --profile (ver "Perfil")
+    timing_t *timing;   // --timing (ver "Modelo de Tempo")
+    FILE *trace_file;
+    machine_t *machine;
+} hart_t;
+
+// --- Máquina ---
+// Uma máquina completa: harts, RAM, periféricos, mapa de memória e os arquivos
+// do terminal. Nada do estado simulado é global, então várias máquinas podem
+// rodar ao mesmo tempo no mesmo processo (--batch). 'machine' aponta para a
+// máquina da thread atual.
+#define MEM_MAX_REGIONS 16
+#define MEM_SLOT_SHIFT 24
+#define MEM_SLOTS (1u << (32 - MEM_SLOT_SHIFT))
+
+typedef struct {
+    uint32_t base, size;
+    uint8_t *host;  // RAM e ROM: memória no host; NULL para MMIO
+    uint32_t (*read)(uint32_t offset, uint32_t size);
+    void (*write)(uint32_t offset, uint32_t value, uint32_t size);
+    uint32_t widths; // larguras aceitas, bits 1, 2 e 4 (MMIO); MEM_READONLY na ROM
+    // --lockstep: páginas de 4 KiB escritas desde a última comparação (NULL
+    // fora do --lockstep) e a lista delas (ver "Lockstep").
+    uint8_t *dirty;
+    uint32_t *dirty_pages;
+    uint32_t dirty_count;
+} mem_region_t;
+
+#define MEM_READONLY 8
+
+#define UART_HOST_BUFFER (64 * 1024)
+#define SEMI_MAX_FILES 16
+
+// Motivo da parada (o primeiro vence).
+#define MACHINE_RUNNING      0
+#define MACHINE_EBREAK       1
+#define MACHINE_DOUBLE_FAULT 2
+#define MACHINE_IDLE         3
+#define MACHINE_ERROR        4
+#define MACHINE_CHECKPOINT   5 // chegou em --checkpoint-at ou no fim de uma fase do --ff
+#define MACHINE_EXIT         6 // SYS_EXIT do semihosting, com exit_code
+
+struct machine {
+    uint8_t *memory; // RAM principal: memory_size bytes reservados com mem_reserve
+
+    hart_t harts[MAX_HARTS];
+    uint32_t hart_count;
+    int exit_reason;
+    int exit_code;   // código pedido pelo guest (MACHINE_EXIT)
+
+    // Motor e trace desta máquina: as opções da linha de comando, menos na
+    // máquina de referência do --lockstep (ver "Lockstep").
+    // O --ff troca os três (e o perfil e o modelo de tempo) entre as fases
+    // (ver "Avanço Rápido").
+    int engine, trace_level, trace_binary, profile, timing;
+    int quiet;       // sem avisos no stderr (a referência do --lockstep)
+    int lockstep;    // máquina do --lockstep: marca as páginas escritas das RAMs
+    int semihosting; // --semihosting
+    int idle_skip;   // laços ociosos podem ser pulados (ver "Laços Ociosos")
+    const poxim_aot_t *aot; // blocos do poxim-aot para --engine=aot (NULL: nenhum)
+    uint64_t serial; // identifica a máquina para os caches da thread (run_hart)
+
+    // Coordenação entre harts (ver "Coordenação entre Harts")
+    pthread_mutex_t hart_lock;
+    pthread_cond_t hart_cond;
+    pthread_mutex_t mmio_lock; // UART, CLINT e PLIC
+    uint32_t harts_sleeping;
+
+    mem_region_t mem_regions[MEM_MAX_REGIONS];
+    uint32_t mem_region_count;
+    uint8_t mem_slot[MEM_SLOTS];
+
+    // PLIC
+    uint32_t plic_pending;
+    uint32_t plic_enable[MAX_HARTS];  // um contexto (modo M) por hart
+    uint32_t plic_claimed;            // fontes em atendimento (claim sem complete)
+    uint8_t plic_claimer[32];         // contexto que fez o claim de cada fonte
+
+    // UART 16550 e buffers no host (ver "UART (16550)")
+    FILE *uart_outfile;
+    FILE *uart_infile;
+    uint8_t uart_ier;
+    uint8_t uart_lsr;
+    uint8_t uart_fcr;
+    int uart_thre_pending;
+    uint32_t uart_tx_count;       // caracteres ainda na FIFO de transmissão
+    uint64_t uart_tx_last;        // mtime em que o último caractere saiu
+    uint8_t uart_tx_buf[UART_HOST_BUFFER];
+    uint32_t uart_tx_len;
+    uint64_t uart_next_flush;
+    uint8_t uart_rx_buf[UART_HOST_BUFFER];
+    uint32_t uart_rx_head, uart_rx_tail;
+    uint32_t uart_rx_count;       // caracteres já na FIFO de recepção (com FIFO)
+    uint64_t uart_rx_last;        // mtime do último slot de chegada
+    uint64_t uart_rx_activity;    // mtime da última chegada ou leitura do RBR
+    uint64_t uart_now;            // maior mtime visto entre os harts (uart_sync)
+    uint64_t uart_rx_read;        // bytes lidos de term_in desde o início
+    int uart_rx_fd;
+    int uart_rx_eof;
+    // Callbacks da libpoxim no lugar dos arquivos (ver "Biblioteca (libpoxim)")
+    poxim_write_fn uart_tx_fn;
+    poxim_read_fn uart_rx_fn;
+    void *uart_tx_user, *uart_rx_user;
+
+    // Dispositivo de blocos (ver "Dispositivo de Blocos")
+    uint8_t *blk_image;           // imagem do --blk mapeada; NULL sem imagem
+    uint32_t blk_sectors;
+    int blk_writable;
+    uint32_t blk_sector, blk_addr, blk_count, blk_cmd, blk_status, blk_ier;
+
+    // Semihosting (ver "Semihosting")
+    int semi_files[SEMI_MAX_FILES]; // descritor no host de cada handle; -1 livre
+    uint32_t semi_errno;
+
+    // libpoxim: destino do trace e breakpoint de poxim_run
+    poxim_trace_fn trace_fn;
+    void *trace_user;
+    uint32_t breakpoint;
+
+    // Checkpoints (ver "Checkpoints"): só alocados quando um vai ser gravado.
+    uint8_t *base_image;          // RAM logo depois de carregar o hex
+    uint8_t *uart_log;            // tudo o que já foi para term_out
+    size_t uart_log_len, uart_log_cap;
+};
+
+__thread machine_t *machine;
+__thread hart_t *hart;
+
+void tlb_flush(hart_t *h) {
+    for (uint32_t i = 0; i < TLB_ENTRIES; i++) h->tlb[i].load = h->tlb[i].store = h->tlb[i].fetch = TLB_EMPTY;
+}
+
+void hart_init(hart_t *h, uint32_t id) {
+    memset(h, 0, sizeof(*h));
+    h->mstatus = 0x00001800;
+    h->misa = 0x40141101; // RV32IMA com os modos S e U
+    h->priv = PRIV_M;
+    tlb_flush(h);
+    h->mhartid = id;
+    h->mtimecmp = -1;
+    h->stop_at = UINT64_MAX;
+    h->profile_next = UINT64_MAX;
+    h->stop_instret = UINT64_MAX;
+    h->last_trap_pc = 0xFFFFFFFF;
+    h->last_trap_cause = 0xFFFFFFFF;
+}
+
+// Instruções executadas pelo hart (base de minstret e do resumo do --batch).
+// Voltas puladas de laços ociosos contam: o programa as executaria.
+static inline uint64_t hart_instret(const hart_t *h) {
+    return h->mtime - h->wfi_ticks - h->stall_ticks - h->trap_count;
+}
+
+static inline void mip_set(hart_t *h, uint32_t bits)   { __atomic_fetch_or(&h->mip, bits, __ATOMIC_RELAXED); }
+static inline void mip_clear(hart_t *h, uint32_t bits) { __atomic_fetch_and(&h->mip, ~bits, __ATOMIC_RELAXED); }
+
+static inline void irq_wake() { hart->irq_next_check = 0; }
+
+static inline uint64_t hart_next_event() {
+    return hart->irq_next_check ? hart->event_check : 0;
+}
+
+// --- Coordenação entre Harts ---
+// Escritas de um hart no estado de outro (msip, mtimecmp, PLIC, parada) sempre
+// terminam em hart_wake(), que zera irq_next_check do alvo: a próxima checagem
+// de interrupções dele (ou a cabeça do próximo bloco do JIT) enxerga a mudança.
+// Com um só hart nada disso usa locks.
+
+static inline void mmio_enter() { if (machine->hart_count > 1) pthread_mutex_lock(&machine->mmio_lock); }
+static inline void mmio_leave() { if (machine->hart_count > 1) pthread_mutex_unlock(&machine->mmio_lock); }
+
+void hart_wake(hart_t *h) {
+    __atomic_fetch_add(&h->wake_count, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&h->irq_next_check, 0, __ATOMIC_RELAXED);
+    if (machine->hart_count == 1) return;
+    pthread_mutex_lock(&machine->hart_lock);
+    if (h->sleeping) {
+        h->sleeping = 0;
+        machine->harts_sleeping--;
+        pthread_cond_broadcast(&machine->hart_cond);
+    }
+    pthread_mutex_unlock(&machine->hart_lock);
+}
+
+// Mudança num dispositivo compartilhado: todos os harts checam de novo.
+void irq_wake_all() {
+    for (uint32_t i = 0; i < machine->hart_count; i++) hart_wake(&machine->harts[i]);
+}
+
+// ebreak, double fault e falta de qualquer evento param a máquina inteira.
+// Uma dessas no mesmo passo vence a parada do --checkpoint-at, do --ff ou do
+// limite de poxim_run, que só marca onde continuar.
+void machine_halt(int reason) {
+    if (!__sync_bool_compare_and_swap(&machine->exit_reason, MACHINE_RUNNING, reason) && reason != MACHINE_CHECKPOINT) {
+        __sync_bool_compare_and_swap(&machine->exit_reason, MACHINE_CHECKPOINT, reason);
     }
+    for (uint32_t i = 0; i < machine->hart_count; i++) __atomic_store_n(&machine->harts[i].halt_flag, 1, __ATOMIC_RELAXED);
+    irq_wake_all();
 }
 
-const char *get_trap_name(uint32_t cause) {
-    if (cause & 0x80000000) {
-        switch (cause & 0x7FFFFFFF) {
-            case 3: return "interrupt:software";
-            case 7: return "interrupt:timer";
-            case 11: return "interrupt:external";
-            default: return "interrupt:unknown";
+// Hart sem nada que o acorde sozinho (wfi sem prazo): dorme até outro hart
+// mexer no seu msip, no seu mtimecmp ou no PLIC. Se todos dormem, ninguém mais
+// pode acordar ninguém e a simulação termina.
+void hart_sleep() {
+    pthread_mutex_lock(&machine->hart_lock);
+    if (hart->irq_next_check != 0 && !hart->halt_flag) {
+        hart->sleeping = 1;
+        if (++machine->harts_sleeping == machine->hart_count) {
+            fprintf(stderr, "Todos os harts ociosos sem nenhuma interrupcao possivel: fim da simulacao\n");
+            __sync_bool_compare_and_swap(&machine->exit_reason, MACHINE_RUNNING, MACHINE_IDLE);
+            for (uint32_t i = 0; i < machine->hart_count; i++) {
+                machine->harts[i].halt_flag = 1;
+                machine->harts[i].sleeping = 0;
+            }
+            machine->harts_sleeping = 0;
+            pthread_cond_broadcast(&machine->hart_cond);
         }
-    } else {
-        switch (cause) {
-            case 1: return "exception:instruction_fault";
-            case 2: return "exception:illegal_instruction";
-            case 5: return "exception:load_fault";
-            case 7: return "exception:store_fault";
-            case 11: return "exception:environment_call";
-            default: return "exception:unknown";
+        while (hart->sleeping) pthread_cond_wait(&machine->hart_cond, &machine->hart_lock);
+    }
+    pthread_mutex_unlock(&machine->hart_lock);
+}
+
+// --- Periféricos ---
+uint64_t uart_char_time = 64;     // ticks de mtime por caractere (com FIFO)
+uint64_t uart_flush_interval = 1000000; // ticks entre flushes; 0 = a cada byte
+
+// --- Cache de Instruções Pré-decodificadas ---
+// Uma entrada por palavra da RAM. A instrução é decodificada uma única vez e
+// as execuções seguintes chamam direto o handler com os operandos já extraídos.
+// Escritas na RAM invalidam a entrada da palavra escrita e o fence.i esvazia
+// o cache inteiro, então código auto-modificável continua funcionando.
+typedef struct decoded_insn decoded_insn_t;
+typedef void (*insn_handler_t)(const decoded_insn_t *d, uint32_t current_pc);
+
+struct decoded_insn {
+    insn_handler_t handler; // NULL = entrada inválida (precisa decodificar)
+    uint32_t raw;           // palavra original da instrução
+    int32_t imm;            // imediato já estendido (ou shamt / endereço do CSR)
+    uint8_t rd, rs1, rs2;
+};
+
+// --- Memória do Host ---
+// A RAM do guest e as tabelas com uma entrada por palavra dela são reservadas
+// com mmap(MAP_NORESERVE): as páginas só passam a ocupar memória do host no
+// primeiro acesso, então uma RAM de GiBs custa o que o programa tocar.
+void *mem_reserve(size_t len) {
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("Erro ao reservar memoria");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+// Zera [p, p + len) de uma reserva. Trechos grandes devolvem as páginas
+// inteiras ao host (madvise) em vez de escrever nelas.
+#define MEM_PAGE 4096
+#define MEM_DISCARD_MIN (256 * 1024)
+
+void mem_discard(void *p, size_t len) {
+    uintptr_t start = (uintptr_t)p, end = start + len;
+    uintptr_t lo = (start + MEM_PAGE - 1) & ~(uintptr_t)(MEM_PAGE - 1), hi = end & ~(uintptr_t)(MEM_PAGE - 1);
+    if (len < MEM_DISCARD_MIN || madvise((void*)lo, hi - lo, MADV_DONTNEED) != 0) {
+        memset(p, 0, len);
+        return;
+    }
+    memset(p, 0, lo - start);
+    memset((void*)hi, 0, end - hi);
+}
+
+// Copia para uma reserva nova só as páginas que não são zero: a cópia ocupa
+// tanto quanto o original.
+void mem_copy_touched(uint8_t *dest, const uint8_t *src, size_t len) {
+    static const uint8_t zero[MEM_PAGE];
+    for (size_t off = 0; off < len; off += MEM_PAGE) {
+        size_t n = len - off < MEM_PAGE ? len - off : MEM_PAGE;
+        if (memcmp(src + off, zero, n) != 0) memcpy(dest + off, src + off, n);
+    }
+}
+
+// Cada hart tem o seu (__thread): escritas só invalidam o cache do próprio
+// hart; código alterado por outro hart precisa de fence.i, como no RISC-V.
+// As tabelas desta seção são reservadas na primeira execução da thread
+// (thread_caches_init), com o tamanho da RAM principal.
+__thread decoded_insn_t *icache;
+
+// Pedaços de 64 bytes da RAM que contêm código decodificado (cache acima) ou
+// traduzido pelo JIT ou pelo poxim-aot. O JIT e os blocos AOT só precisam
+// tratar escritas em pedaços marcados.
+#define CODE_CHUNK_SHIFT 6
+#define CODE_MAP_DECODED 1
+#define CODE_MAP_JIT     2
+#define CODE_MAP_AOT     4
+__thread uint8_t *code_map;
+
+// --lockstep: um code_map com todos os pedaços marcados, que manda os stores do
+// JIT e do AOT pelo caminho lento (que marca as páginas escritas).
+uint8_t *lockstep_code_map;
+
+// Desvios para trás que não fecham um laço ocioso (ver "Laços Ociosos"),
+// indexados pela palavra do desvio. Só o fence.i limpa.
+__thread uint8_t *idle_rejected;
+
+// Pedaços [code_lo, code_hi) que podem ter algo no code_map, no cache ou em
+// idle_rejected: o fence.i só limpa esse trecho.
+__thread uint32_t code_lo, code_hi;
+
+// Alguma escrita caiu num pedaço com código decodificado (ver --simd: as
+// máquinas de um grupo dividem o cache e só então conferem as palavras).
+__thread int code_written;
+
+static inline __attribute__((always_inline))
+void code_touch(uint32_t chunk) {
+    if (chunk < code_lo) code_lo = chunk;
+    if (chunk >= code_hi) code_hi = chunk + 1;
+}
+
+static inline __attribute__((always_inline))
+void code_mark(uint32_t ram_offset, uint8_t kind) {
+    code_map[ram_offset >> CODE_CHUNK_SHIFT] |= kind;
+    code_touch(ram_offset >> CODE_CHUNK_SHIFT);
+}
+
+void jit_flush();
+void aot_invalidate(uint32_t ram_offset);
+void aot_validate();
+void ram_dirty(uint32_t ram_offset, uint32_t len);
+
+void icache_invalidate(uint32_t ram_offset) {
+    uint8_t chunk = code_map[ram_offset >> CODE_CHUNK_SHIFT];
+    icache[ram_offset >> 2].handler = NULL;
+    if (chunk) code_written = 1;
+    if (chunk & CODE_MAP_JIT) jit_flush();
+    if (chunk & CODE_MAP_AOT) aot_invalidate(ram_offset);
+}
+
+// Escrita em bloco (DMA): só os pedaços que têm código decodificado ou traduzido.
+void icache_invalidate_range(uint32_t ram_offset, uint32_t len) {
+    uint32_t first = ram_offset >> CODE_CHUNK_SHIFT, last = (ram_offset + len - 1) >> CODE_CHUNK_SHIFT;
+    if (first < code_lo) first = code_lo;
+    for (uint32_t chunk = first; chunk <= last && chunk < code_hi; chunk++) {
+        uint8_t kinds = code_map[chunk];
+        if (!kinds) continue;
+        code_written = 1;
+        for (uint32_t i = 0; i < (1u << CODE_CHUNK_SHIFT) / 4; i++) icache[(chunk << (CODE_CHUNK_SHIFT - 2)) + i].handler = NULL;
+        if (kinds & CODE_MAP_JIT) jit_flush();
+        if (kinds & CODE_MAP_AOT) {
+            for (uint32_t i = 0; i < (1u << CODE_CHUNK_SHIFT); i += 4) aot_invalidate((chunk << CODE_CHUNK_SHIFT) + i);
         }
     }
 }
 
+// fence.i: os blocos AOT não são descartados, só conferidos de novo com a RAM.
+void icache_flush() {
+    code_written = 1;
+    jit_flush();
+    if (code_lo < code_hi) {
+        uint32_t chunks = code_hi - code_lo, words = (1u << CODE_CHUNK_SHIFT) / 4;
+        mem_discard(icache + (size_t)code_lo * words, (size_t)chunks * words * sizeof(decoded_insn_t));
+        mem_discard(code_map + code_lo, chunks);
+        mem_discard(idle_rejected + (size_t)code_lo * words, (size_t)chunks * words);
+    }
+    code_lo = UINT32_MAX;
+    code_hi = 0;
+    aot_validate();
+}
+
+__thread uint8_t *aot_stale, *aot_words; // ver "Tradução Antecipada (AOT)"
+
+// Reserva as tabelas da thread (uma vez; a RAM principal tem o mesmo tamanho
+// em todas as máquinas).
+void thread_caches_init() {
+    if (icache) return;
+    size_t words = memory_size / 4;
+    icache = (decoded_insn_t*)mem_reserve(words * sizeof(decoded_insn_t));
+    code_map = (uint8_t*)mem_reserve(memory_size >> CODE_CHUNK_SHIFT);
+    idle_rejected = (uint8_t*)mem_reserve(words);
+    aot_stale = (uint8_t*)mem_reserve(words);
+    aot_words = (uint8_t*)mem_reserve(words);
+    code_lo = UINT32_MAX;
+    code_hi = 0;
+}
+
+// Fim da thread: devolve as tabelas.
+void thread_caches_release() {
+    if (!icache) return;
+    size_t words = memory_size / 4;
+    munmap(icache, words * sizeof(decoded_insn_t));
+    munmap(code_map, memory_size >> CODE_CHUNK_SHIFT);
+    munmap(idle_rejected, words);
+    munmap(aot_stale, words);
+    munmap(aot_words, words);
+    icache = NULL;
+}
+
+// --- Contadores ---
+// mcycle conta o mtime do hart (um ciclo por passo, mais as paradas do
+// --timing), minstret as instruções retiradas antes da atual e cada
+// mhpmcounter o evento escolhido no mhpmevent correspondente. Nada disso custa
+// no laço: o valor é a fonte mais um offset, e escrever no contador só muda o
+// offset. cycle/time/instret/hpmcounter são as cópias somente leitura do modo
+// usuário (rdcycle, rdtime, rdinstret).
+#define HPM_EVENT_EXCEPTIONS    1 // exceções tomadas
+#define HPM_EVENT_INTERRUPTS    2 // interrupções tomadas
+#define HPM_EVENT_WFI_CYCLES    3 // ciclos parados em wfi
+// Só contam com --timing (ver "Modelo de Tempo"); sem ele ficam em 0.
+#define HPM_EVENT_ICACHE_MISSES 4 // faltas no cache de instruções
+#define HPM_EVENT_DCACHE_MISSES 5 // faltas no cache de dados
+#define HPM_EVENT_BRANCH_MISSES 6 // desvios e saltos indiretos mal previstos
+#define HPM_EVENT_STALL_CYCLES  7 // ciclos a mais (faltas, mul/div, desvios, MMIO, traps)
+
+uint64_t timing_counter(const timing_t *t, uint32_t event);
+
+uint64_t counter_source(const hart_t *h, uint32_t index) {
+    if (index == 0) return h->mtime;
+    if (index == 2) return hart_instret(h) - 1; // a instrução atual ainda não retirou
+    switch (h->hpm_event[index]) {
+        case HPM_EVENT_EXCEPTIONS: return h->trap_count - h->interrupt_count;
+        case HPM_EVENT_INTERRUPTS: return h->interrupt_count;
+        case HPM_EVENT_WFI_CYCLES: return h->wfi_ticks;
+        case HPM_EVENT_STALL_CYCLES: return h->stall_ticks;
+        default: return timing_counter(h->timing, h->hpm_event[index]);
+    }
+}
+
+static inline uint64_t counter_read(const hart_t *h, uint32_t index) {
+    return counter_source(h, index) + h->counter_offset[index];
+}
+
+// O valor escrito em minstret é o que a próxima instrução lê (a escrita não
+// conta como retirada); nos outros contadores a fonte anda normalmente.
+void counter_write(hart_t *h, uint32_t index, uint64_t value) {
+    uint64_t source = counter_source(h, index);
+    if (index == 2) source++;
+    h->counter_offset[index] = value - source;
+}
+
+// Trocar o evento não muda o valor atual do contador. Eventos desconhecidos
+// viram 0 (contador parado), como um campo WARL.
+void hpm_select(hart_t *h, uint32_t index, uint32_t event) {
+    uint64_t value = counter_read(h, index);
+    h->hpm_event[index] = event <= HPM_EVENT_STALL_CYCLES ? event : 0;
+    h->counter_offset[index] = value - counter_source(h, index);
+}
+
+// 0xB00-0xB1F/0xB80-0xB9F (máquina), 0xC00-0xC1F/0xC80-0xC9F (usuário) e
+// mhpmevent3-31 em 0x323-0x33F. Outros endereços leem 0, como antes.
+uint32_t counter_csr_read(uint32_t addr) {
+    uint32_t base = addr & ~0x9Fu, index = addr & 0x1F;
+    if (addr >= 0x323 && addr <= 0x33F) return hart->hpm_event[index];
+    if (base != 0xB00 && base != 0xC00) return 0;
+    uint64_t value;
+    if (index == 1) value = base == 0xC00 ? hart->mtime : 0; // time; 0xB01 não existe
+    else value = counter_read(hart, index);
+    return (addr & 0x80) ? (uint32_t)(value >> 32) : (uint32_t)value;
+}
+
+void counter_csr_write(uint32_t addr, uint32_t value) {
+    uint32_t index = addr & 0x1F;
+    if (addr >= 0x323 && addr <= 0x33F) { hpm_select(hart, index, value); return; }
+    if ((addr & ~0x9Fu) != 0xB00 || index == 1) return; // cópias de usuário são só leitura
+    uint64_t current = counter_read(hart, index);
+    if (addr & 0x80) current = (current & 0xFFFFFFFFull) | ((uint64_t)value << 32);
+    else current = (current & ~0xFFFFFFFFull) | value;
+    counter_write(hart, index, current);
+}
+
+// --- Funções Auxiliares ---
+// Exceções que medeleg pode mandar para o modo S (todas menos o ecall do modo
+// M) e interrupções que mideleg pode mandar (as do modo S).
+#define MEDELEG_MASK 0x0000B3FF
+#define MIDELEG_MASK 0x00000222
+
+void mmu_update();
+
 uint32_t read_csr(uint32_t addr) {
     switch (addr) {
-        case 0x300: return mstatus; case 0x301: return misa;
-        case 0x304: return mie;     case 0x305: return mtvec;
-        case 0x340: return mscratch;case 0x341: return mepc;
-        case 0x342: return mcause;  case 0x343: return mtval;
-        case 0x344: return mip;
-        default: return 0;
+        case 0x300: return hart->mstatus; case 0x301: return hart->misa;
+        case 0x304: return hart->mie;     case 0x305: return hart->mtvec;
+        case 0x340: return hart->mscratch;case 0x341: return hart->mepc;
+        case 0x342: return hart->mcause;  case 0x343: return hart->mtval;
+        case 0x344: return hart->mip;
+        case 0x302: return hart->medeleg; case 0x303: return hart->mideleg;
+        case 0x306: return hart->mcounteren;
+        case 0x100: return hart->mstatus & SSTATUS_MASK;
+        case 0x104: return hart->mie & hart->mideleg;
+        case 0x144: return hart->mip & hart->mideleg;
+        case 0x105: return hart->stvec;   case 0x106: return hart->scounteren;
+        case 0x140: return hart->sscratch;case 0x141: return hart->sepc;
+        case 0x142: return hart->scause;  case 0x143: return hart->stval;
+        case 0x180: return hart->satp;
+        case 0xF14: return hart->mhartid;
+        default: return counter_csr_read(addr);
     }
 }
 
 void write_csr(uint32_t addr, uint32_t value) {
     switch (addr) {
-        case 0x300: mstatus = value; break; case 0x301: misa = value; break;
-        case 0x304: mie = value; break;     case 0x305: mtvec = value; break;
-        case 0x340: mscratch = value; break;case 0x341: mepc = value; break;
-        case 0x342: mcause = value; break;  case 0x343: mtval = value; break;
-        case 0x344: mip = value; break;
+        case 0x300:
+            if ((value & MSTATUS_MPP) == (2u << 11)) value &= ~MSTATUS_MPP; // MPP = 2 não existe: vira U
+            hart->mstatus = value;
+            break;
+        case 0x301: hart->misa = value; break;
+        case 0x304: hart->mie = value; break;     case 0x305: hart->mtvec = value; break;
+        case 0x340: hart->mscratch = value; break;case 0x341: hart->mepc = value; break;
+        case 0x342: hart->mcause = value; break;  case 0x343: hart->mtval = value; break;
+        case 0x344: __atomic_store_n(&hart->mip, value, __ATOMIC_RELAXED); break;
+        case 0x302: hart->medeleg = value & MEDELEG_MASK; break;
+        case 0x303: hart->mideleg = value & MIDELEG_MASK; break;
+        case 0x306: hart->mcounteren = value; break;
+        case 0x100: hart->mstatus = (hart->mstatus & ~SSTATUS_MASK) | (value & SSTATUS_MASK); break;
+        case 0x104: hart->mie = (hart->mie & ~hart->mideleg) | (value & hart->mideleg); break;
+        case 0x144: // só SSIP, e só se delegado
+            if (value & hart->mideleg & (1u << 1)) mip_set(hart, 1u << 1);
+            else mip_clear(hart, hart->mideleg & (1u << 1));
+            break;
+        case 0x105: hart->stvec = value; break;   case 0x106: hart->scounteren = value; break;
+        case 0x140: hart->sscratch = value; break;case 0x141: hart->sepc = value; break;
+        case 0x142: hart->scause = value; break;  case 0x143: hart->stval = value; break;
+        case 0x180: hart->satp = value; tlb_flush(hart); break;
+        default: counter_csr_write(addr, value); break;
+    }
+    if (addr == 0x300 || addr == 0x304 || addr == 0x344 || addr == 0x303 ||
+        addr == 0x100 || addr == 0x104 || addr == 0x144) irq_wake();
+    if (addr == 0x300 || addr == 0x100 || addr == 0x180) mmu_update();
+}
+
+// Fora do modo M um CSR só é acessível do modo dos bits 9:8 do endereço para
+// cima; os contadores de usuário dependem de mcounteren (e de scounteren no
+// modo U) e, com mstatus.TVM, satp é só do modo M. Senão, instrução ilegal.
+int csr_allowed(uint32_t addr) {
+    if (hart->priv == PRIV_M) return 1;
+    if (hart->priv < ((addr >> 8) & 3)) return 0;
+    if (addr == 0x180) return !(hart->mstatus & MSTATUS_TVM);
+    if ((addr & ~0x9Fu) == 0xC00) {
+        uint32_t bit = 1u << (addr & 0x1F);
+        return (hart->mcounteren & bit) && (hart->priv == PRIV_S || (hart->scounteren & bit));
     }
+    return 1;
 }
 
 void trigger_trap(uint32_t cause, uint32_t tval, uint32_t trap_pc) {
-    trap_pending_print = 1;
-    uint32_t mstatus_val = mstatus;
-    mstatus &= ~(1 << 3); // Desabilita interrupções globais (bit MIE)
-    mstatus |= ((mstatus_val >> 3) & 1) << 7; // Salva o estado anterior do MIE no MPIE
-    
-    mepc = trap_pc;   // Salva o PC da instrução que causou a falha
-    mcause = cause;   // Salva a causa da falha
-    mtval = tval;     // Salva o valor associado à falha (ex: endereço inválido)
+    hart->trap_pending_print = 1;
+    hart->trap_cause = cause;
+    hart->trap_epc = trap_pc;
+    hart->trap_tval = tval;
+
+    // Traps dos modos S e U delegados em medeleg/mideleg vão para o modo S.
+    uint32_t delegated = (cause & 0x80000000) ? hart->mideleg : hart->medeleg;
+    if (hart->priv != PRIV_M && ((delegated >> (cause & 0x1F)) & 1)) {
+        uint32_t sstatus_val = hart->mstatus;
+        hart->mstatus &= ~(MSTATUS_SIE | MSTATUS_SPIE | MSTATUS_SPP);
+        if (sstatus_val & MSTATUS_SIE) hart->mstatus |= MSTATUS_SPIE;
+        if (hart->priv == PRIV_S) hart->mstatus |= MSTATUS_SPP;
+        hart->sepc = trap_pc;
+        hart->scause = cause;
+        hart->stval = tval;
+        hart->priv = PRIV_S;
+        hart->trap_vector = hart->stvec;
+    } else {
+        uint32_t mstatus_val = hart->mstatus;
+        hart->mstatus &= ~(1 << 3); // Desabilita interrupções globais (bit MIE)
+        hart->mstatus |= ((mstatus_val >> 3) & 1) << 7; // Salva o estado anterior do MIE no MPIE
+        hart->mstatus = (hart->mstatus & ~MSTATUS_MPP) | (hart->priv << 11); // e o modo no MPP
+
+        hart->mepc = trap_pc;   // Salva o PC da instrução que causou a falha
+        hart->mcause = cause;   // Salva a causa da falha
+        hart->mtval = tval;     // Salva o valor associado à falha (ex: endereço inválido)
+        hart->priv = PRIV_M;
+        hart->trap_vector = hart->mtvec;
+    }
 
     // --- LÓGICA ALTERADA ---
     // Se o programa não configurou um handler de exceção (mtvec == 0),
     // o simulador irá simplesmente pular a instrução que causou a falha.
     // Isso evita a "Double Fault" e permite que a execução continue.
-    if (mtvec == 0) {
-        pc = mepc + 4;
+    // (O mesmo vale para stvec nos traps que vão para o modo S.)
+    if (hart->trap_vector == 0) {
+        hart->pc = trap_pc + 4;
     } else {
         // Se um handler foi configurado, pula para ele.
-        pc = mtvec & ~0x3;
+        hart->pc = hart->trap_vector & ~0x3;
+    }
+    mmu_update();
+}
+
+// sret, wfi e sfence.vma: modo M, ou S sem o bit de mstatus que os prende
+// (TSR, TW, TVM). Fora disso, instrução ilegal.
+static inline int priv_allowed(uint32_t trap_bit) {
+    return hart->priv == PRIV_M || (hart->priv == PRIV_S && !(hart->mstatus & trap_bit));
+}
+
+// mret (só no modo M): volta para o modo de MPP com MIE = MPIE, MPIE = 1 e
+// MPP = U. Um programa só de modo M continua nele, porque o trap grava MPP = M.
+void mret_execute() {
+    uint32_t prev_mstatus = hart->mstatus;
+    hart->pc = hart->mepc;
+    hart->mstatus &= ~(MSTATUS_MIE | MSTATUS_MPP);
+    hart->mstatus |= MSTATUS_MPIE;
+    if (prev_mstatus & MSTATUS_MPIE) hart->mstatus |= MSTATUS_MIE;
+    hart->priv = (prev_mstatus & MSTATUS_MPP) >> 11;
+    if (hart->priv != PRIV_M) hart->mstatus &= ~MSTATUS_MPRV;
+    mmu_update();
+    irq_wake();
+}
+
+// sret: volta para o modo de SPP com SIE = SPIE.
+void sret_execute() {
+    uint32_t prev_mstatus = hart->mstatus;
+    hart->pc = hart->sepc;
+    hart->mstatus &= ~(MSTATUS_SIE | MSTATUS_SPP | MSTATUS_MPRV);
+    hart->mstatus |= MSTATUS_SPIE;
+    if (prev_mstatus & MSTATUS_SPIE) hart->mstatus |= MSTATUS_SIE;
+    hart->priv = (prev_mstatus & MSTATUS_SPP) ? PRIV_S : PRIV_U;
+    mmu_update();
+    irq_wake();
+}
+
+// Nada pendente e nenhum prazo no escalonador: com um hart ele nunca mais sai
+// do lugar; com vários, outro hart ainda pode acordá-lo.
+void idle_halt(uint32_t current_pc) {
+    if (machine->hart_count > 1) {
+        hart_sleep();
+        return;
+    }
+    if (!machine->quiet) fprintf(stderr, "Hart ocioso em 0x%08x sem nenhuma interrupcao possivel: fim da simulacao\n", current_pc);
+    machine_halt(MACHINE_IDLE);
+}
+
+// wfi: sem interrupção pendente e habilitada em mie, mtime pula para a véspera
+// do próximo prazo do escalonador, e a checagem do passo seguinte já vê o
+// evento. Se o evento não gerar interrupção o wfi só termina antes (a
+// especificação permite), e o guest volta a esperar.
+void wait_for_interrupt(uint32_t current_pc) {
+    if (hart->mip & hart->mie) return;
+    uint64_t next_event = hart_next_event();
+    if (next_event == UINT64_MAX) { idle_halt(current_pc); return; }
+    if (next_event > hart->mtime + 1) {
+        hart->wfi_ticks += next_event - 1 - hart->mtime;
+        hart->mtime = next_event - 1;
     }
 }
 
 // --- Periféricos (MMIO) ---
-uint32_t uart_read(uint32_t address) {
-    uint32_t offset = address - UART_BASE;
+// --- UART (16550) ---
+// Os bytes passam por buffers grandes no host (uart_tx_buf/uart_rx_buf), lidos
+// e gravados em blocos. O guest vê FIFOs de 16 bytes quando FCR.0 está ligado,
+// e então a linha anda a um caractere a cada uart_char_time ticks de mtime nos
+// dois sentidos: RX dispara interrupção ao atingir o nível de FCR[7:6] (ou por
+// timeout, 4 caracteres sem atividade com algo na FIFO) e TX gera THRE quando
+// a FIFO esvazia.
+//
+// Sem FIFO a UART se comporta como antes: a entrada está sempre disponível,
+// THR esvazia na hora (LSR.THRE sempre 1) e, com IER == 0, toda escrita em THR
+// marca a IRQ da UART no PLIC.
+#define UART_FIFO_SIZE 16
+#define UART_RX_POLL_TICKS 4096
+
+// A UART anda com o maior mtime entre os harts que já a acessaram, então o
+// tempo dela nunca volta (ver "Estado dos Harts").
+static inline void uart_sync() { if (hart->mtime > machine->uart_now) machine->uart_now = hart->mtime; }
+
+// Grava no terminal do host (e no registro da saída, se há checkpoint).
+void uart_host_write(const uint8_t *data, size_t len) {
+    if (machine->uart_tx_fn) {
+        machine->uart_tx_fn(machine->uart_tx_user, data, len);
+    } else {
+        FILE *out = machine->uart_outfile ? machine->uart_outfile : stdout;
+        fwrite(data, 1, len, out);
+        fflush(out);
+    }
+    if (machine->uart_log_cap) {
+        if (machine->uart_log_len + len > machine->uart_log_cap) {
+            while (machine->uart_log_len + len > machine->uart_log_cap) machine->uart_log_cap *= 2;
+            machine->uart_log = (uint8_t*)realloc(machine->uart_log, machine->uart_log_cap);
+        }
+        memcpy(machine->uart_log + machine->uart_log_len, data, len);
+        machine->uart_log_len += len;
+    }
+}
+
+void uart_host_flush() {
+    if (machine->uart_tx_len == 0) return;
+    uart_host_write(machine->uart_tx_buf, machine->uart_tx_len);
+    machine->uart_tx_len = 0;
+}
+
+void uart_host_put(uint8_t c) {
+    if (machine->uart_tx_len == 0) machine->uart_next_flush = machine->uart_now + uart_flush_interval;
+    machine->uart_tx_buf[machine->uart_tx_len++] = c;
+    if (machine->uart_tx_len == UART_HOST_BUFFER || uart_flush_interval == 0) uart_host_flush();
+}
+
+// Lê mais entrada do host se houver espaço. Em pipes e terminais o descritor é
+// não bloqueante, então "sem dados agora" não trava a simulação; o callback da
+// libpoxim segue a mesma regra.
+void uart_host_fill() {
+    if ((machine->uart_rx_fd < 0 && !machine->uart_rx_fn) || machine->uart_rx_eof) return;
+    if (machine->uart_rx_head == machine->uart_rx_tail) machine->uart_rx_head = machine->uart_rx_tail = 0;
+    if (machine->uart_rx_tail == UART_HOST_BUFFER) {
+        if (machine->uart_rx_head == 0) return;
+        memmove(machine->uart_rx_buf, machine->uart_rx_buf + machine->uart_rx_head, machine->uart_rx_tail - machine->uart_rx_head);
+        machine->uart_rx_tail -= machine->uart_rx_head;
+        machine->uart_rx_head = 0;
+    }
+    uint8_t *buf = machine->uart_rx_buf + machine->uart_rx_tail;
+    size_t space = UART_HOST_BUFFER - machine->uart_rx_tail;
+    if (machine->uart_rx_fn) {
+        long n = machine->uart_rx_fn(machine->uart_rx_user, buf, space);
+        if (n > 0) {
+            machine->uart_rx_tail += n;
+            machine->uart_rx_read += n;
+        }
+        else if (n < 0) machine->uart_rx_eof = 1;
+        return;
+    }
+    ssize_t n = read(machine->uart_rx_fd, buf, space);
+    if (n > 0) {
+        machine->uart_rx_tail += n;
+        machine->uart_rx_read += n;
+    }
+    else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) machine->uart_rx_eof = 1;
+}
+
+int uart_fifo_enabled() { return machine->uart_fcr & 1; }
+int uart_paced() { return (machine->uart_fcr & 1) && uart_char_time; }
+
+// Chegada dos caracteres na FIFO de recepção até o mtime atual. A chegada para
+// quando a FIFO enche (controle de fluxo) e retoma quando há espaço.
+void uart_rx_advance() {
+    uint64_t slots = (machine->uart_now - machine->uart_rx_last) / uart_char_time;
+    if (slots == 0) return;
+    uint64_t start = machine->uart_rx_last;
+    machine->uart_rx_last += slots * uart_char_time;
+    for (uint64_t i = 1; i <= slots && machine->uart_rx_count < UART_FIFO_SIZE; i++) {
+        if (machine->uart_rx_tail - machine->uart_rx_head == machine->uart_rx_count) uart_host_fill();
+        if (machine->uart_rx_tail - machine->uart_rx_head == machine->uart_rx_count) break;
+        machine->uart_rx_count++;
+        machine->uart_rx_activity = start + i * uart_char_time;
+    }
+}
 
+// Bytes na FIFO de recepção (no máximo 1 sem FIFO).
+uint32_t uart_rx_level() {
+    if (uart_paced()) {
+        uart_rx_advance();
+        return machine->uart_rx_count;
+    }
+    uint32_t capacity = uart_fifo_enabled() ? UART_FIFO_SIZE : 1;
+    if (machine->uart_rx_tail - machine->uart_rx_head < capacity) uart_host_fill();
+    uint32_t level = machine->uart_rx_tail - machine->uart_rx_head;
+    return level < capacity ? level : capacity;
+}
+
+// Timeout de recepção: sobrou algo abaixo do nível de disparo e a linha ficou
+// parada. Sem ritmo de linha, parada quer dizer sem mais dados no host.
+int uart_rx_timeout(uint32_t level) {
+    if (level == 0) return 0;
+    if (uart_paced()) return machine->uart_now >= machine->uart_rx_activity + 4 * uart_char_time;
+    return machine->uart_rx_tail - machine->uart_rx_head == level;
+}
+
+// Desconta os caracteres que já foram transmitidos até o mtime atual.
+void uart_tx_advance() {
+    if (machine->uart_tx_count == 0) return;
+    uint64_t sent = uart_char_time ? (machine->uart_now - machine->uart_tx_last) / uart_char_time : machine->uart_tx_count;
+    if (sent >= machine->uart_tx_count) {
+        machine->uart_tx_last += machine->uart_tx_count * uart_char_time;
+        machine->uart_tx_count = 0;
+        machine->uart_thre_pending = 1;
+    } else {
+        machine->uart_tx_last += sent * uart_char_time;
+        machine->uart_tx_count -= sent;
+    }
+}
+
+// Valor do IIR (sem os bits de FIFO), pela prioridade do 16550.
+uint32_t uart_irq_id() {
+    if (machine->uart_ier & 1) {
+        static const uint32_t trigger_levels[4] = { 1, 4, 8, 14 };
+        uint32_t level = uart_rx_level();
+        uint32_t trigger = uart_fifo_enabled() ? trigger_levels[machine->uart_fcr >> 6] : 1;
+        if (level >= trigger) return 0x04;
+        if (uart_rx_timeout(level)) return 0x0C;
+    }
+    if ((machine->uart_ier & 2) && machine->uart_thre_pending) return 0x02;
+    return 0x01;
+}
+
+// A saída de interrupção da UART é um nível; o PLIC guarda o pedido até o
+// complete, e depois dele a UART é consultada de novo.
+void uart_update_irq() {
+    uart_sync();
+    if (machine->uart_ier == 0 || uart_irq_id() == 0x01) return;
+    if (!(machine->plic_pending & (1 << UART_IRQ))) {
+        machine->plic_pending |= (1 << UART_IRQ);
+        irq_wake_all();
+    }
+}
+
+// Eventos da UART para o escalonador de interrupções. Retorna o próximo mtime
+// em que algo muda sem intervenção do guest.
+uint64_t uart_tick() {
+    uint64_t next = UINT64_MAX;
+    uart_sync();
+    uart_tx_advance();
+    if (machine->uart_tx_len && machine->uart_now >= machine->uart_next_flush) uart_host_flush();
+    uart_update_irq();
+
+    if (machine->uart_tx_count && (machine->uart_ier & 2)) next = machine->uart_tx_last + machine->uart_tx_count * uart_char_time;
+    if (machine->uart_tx_len && machine->uart_next_flush < next) next = machine->uart_next_flush;
+    if (machine->uart_ier & 1) {
+        uint32_t level = uart_rx_level();
+        uint64_t rx_next = UINT64_MAX;
+        if (uart_paced()) {
+            // próxima chegada e prazo do timeout
+            if (level < UART_FIFO_SIZE && (machine->uart_rx_tail - machine->uart_rx_head > level || !machine->uart_rx_eof)) rx_next = machine->uart_rx_last + uart_char_time;
+            if (level > 0 && machine->uart_rx_activity + 4 * uart_char_time > machine->uart_now && machine->uart_rx_activity + 4 * uart_char_time < rx_next) {
+                rx_next = machine->uart_rx_activity + 4 * uart_char_time;
+            }
+        }
+        if (!machine->uart_rx_eof && machine->uart_rx_tail == machine->uart_rx_head && machine->uart_now + UART_RX_POLL_TICKS < rx_next) {
+            rx_next = machine->uart_now + UART_RX_POLL_TICKS; // esperando o host (pipe ou terminal)
+        }
+        if (rx_next < next) next = rx_next;
+    }
+    return next;
+}
+
+// Os registradores dos dispositivos recebem o offset dentro da região e a
+// largura do acesso (ver tabela de regiões em "Acesso à Memória").
+uint32_t uart_read(uint32_t offset, uint32_t size) {
+    (void)size;
+    uart_sync();
     // Lendo o Line Status Register (LSR)
     if (offset == 5) {
         // O bit 5 (Transmitter Empty) indica que o transmissor está pronto para um novo caractere.
-        uint8_t status = (1 << 5); 
-        
-        // Verifica se o arquivo de entrada foi aberto
-        if (uart_infile) {
-            // Espia o próximo caractere sem consumi-lo do stream
-            int c = fgetc(uart_infile);
-            if (c != EOF) {
-                ungetc(c, uart_infile); // Devolve o caractere para que a leitura do RBR possa pegá-lo
-                status |= 1;            // Seta o bit 0 (Data Ready), informando que há dados para ler.
-            }
-        }
+        uart_tx_advance();
+        uint8_t status = (machine->uart_tx_count == 0) ? (1 << 5) : 0;
+        if (uart_rx_level() > 0) status |= 1; // Data Ready
         return status;
     }
 
     // Lendo o Receive Buffer Register (RBR)
     if (offset == 0) {
-        // Verifica se o arquivo de entrada foi aberto
-        if (uart_infile) {
-            int c = fgetc(uart_infile); // Lê o próximo caractere do arquivo
-            if (c != EOF) {
-                return (uint8_t)c;
-            }
+        if (uart_rx_level() == 0) return 0; // Retorna 0 se não houver dados (ou no EOF)
+        uint8_t c = machine->uart_rx_buf[machine->uart_rx_head++];
+        if (uart_paced()) {
+            machine->uart_rx_count--;
+            machine->uart_rx_activity = machine->uart_now;
         }
-        return 0; // Retorna 0 se não houver arquivo ou se chegou ao fim (EOF)
+        uart_update_irq();
+        return c;
     }
     
     // Lendo o Interrupt Identification Register (IIR)
-    if (offset == 2) return 1;
+    if (offset == 2) {
+        uart_tx_advance();
+        uint32_t id = uart_irq_id();
+        if (id == 0x02) machine->uart_thre_pending = 0; // ler o IIR limpa a interrupção THRE
+        return id | (uart_fifo_enabled() ? 0xC0 : 0);
+    }
 
     return 0;
 }
 
-void uart_write(uint32_t address, uint32_t value, uint8_t size) {
-    uint32_t offset = address - UART_BASE;
-    if (offset == 0 && size == 1) {
-        if (uart_outfile) {
-            fputc((char)value, uart_outfile);
-            fflush(uart_outfile);
+// LSR como o guest o leria no instante t >= mtime, sem mudar nada visível
+// (usado para avançar laços ociosos que esperam a UART).
+uint32_t uart_lsr_at(uint64_t t) {
+    uart_sync();
+    uart_tx_advance();
+    uint32_t status = 0;
+    if (machine->uart_tx_count == 0 || t >= machine->uart_tx_last + machine->uart_tx_count * uart_char_time) status |= 1 << 5;
+    if (uart_rx_level() > 0) status |= 1;
+    else if (uart_paced() && t >= machine->uart_rx_last + uart_char_time) {
+        if (machine->uart_rx_tail == machine->uart_rx_head) uart_host_fill();
+        if (machine->uart_rx_tail != machine->uart_rx_head) status |= 1;
+    }
+    return status;
+}
+
+// Os registradores da UART têm 8 bits; acessos mais largos usam o byte baixo.
+void uart_write(uint32_t offset, uint32_t value, uint32_t size) {
+    (void)size;
+    // Só acorda os harts quando a escrita pode mudar a linha de interrupção
+    // ou os prazos da UART: IER e FCR, e em THR o THRI (IER.ETBEI), o pedido
+    // sem IER e o primeiro byte de uma janela do --uart-flush.
+    int wake = offset == 1 || offset == 2 ||
+               (offset == 0 && ((machine->uart_ier & 2) ||
+                                (machine->uart_ier == 0 && !(machine->plic_pending & (1 << UART_IRQ))) ||
+                                (machine->uart_tx_len == 0 && uart_flush_interval)));
+    if (wake) irq_wake_all();
+    uart_sync();
+    uart_tx_advance();
+    if (offset == 0) {
+        if (uart_fifo_enabled() && uart_char_time) {
+            if (machine->uart_tx_count == UART_FIFO_SIZE) return; // FIFO cheia: o byte se perde
+            if (machine->uart_tx_count == 0) machine->uart_tx_last = machine->uart_now;
+            machine->uart_tx_count++;
+            machine->uart_thre_pending = 0;
         } else {
-            printf("%c", (char)value);
-            fflush(stdout);
+            machine->uart_thre_pending = 1;
+        }
+        uart_host_put((uint8_t)value);
+        if (machine->uart_ier == 0) machine->plic_pending |= (1 << UART_IRQ);
+    } else if (offset == 1) {
+        if ((value & 2) && !(machine->uart_ier & 2) && machine->uart_tx_count == 0) machine->uart_thre_pending = 1;
+        machine->uart_ier = value & 0x0F;
+    } else if (offset == 2) {
+        int was_paced = uart_paced();
+        machine->uart_fcr = value & 0xC1;
+        if (uart_paced() && !was_paced) {
+            // a linha começa a andar agora, com a FIFO vazia
+            machine->uart_rx_count = 0;
+            machine->uart_rx_last = machine->uart_rx_activity = machine->uart_now;
+        }
+        if ((value & 1) && (value & 2)) { // limpa a FIFO de recepção
+            machine->uart_rx_head += uart_rx_level();
+            machine->uart_rx_count = 0;
         }
-        plic_pending |= (1 << UART_IRQ);
-    } else if (offset == 1 && size == 1) {
-        uart_ier = value;
+        if (((value & 1) && (value & 4)) || !uart_fifo_enabled()) { // limpa a FIFO de transmissão
+            if (machine->uart_tx_count) machine->uart_thre_pending = 1;
+            machine->uart_tx_count = 0;
+        }
+    }
+    uart_update_irq();
+}
+
+// Prepara a entrada do terminal para leituras em bloco.
+void uart_init() {
+    machine->uart_rx_fd = machine->uart_infile ? fileno(machine->uart_infile) : -1;
+    struct stat st;
+    if (machine->uart_rx_fd >= 0 && fstat(machine->uart_rx_fd, &st) == 0 && !S_ISREG(st.st_mode)) {
+        fcntl(machine->uart_rx_fd, F_SETFL, fcntl(machine->uart_rx_fd, F_GETFL) | O_NONBLOCK);
+    }
+}
+
+// --- Dispositivo de Blocos (DMA) ---
+// Disco de setores de 512 bytes com uma imagem do host (--blk) mapeada com
+// mmap. O guest descreve um pedido nos registradores (setor, endereço na RAM e
+// número de setores) e o escreve em CMD; a cópia inteira entre a imagem e
+// memory[] acontece nessa escrita, e o fim é sinalizado em STATUS e, com IER.0,
+// por uma interrupção no PLIC (fonte BLK_IRQ), como a saída de nível da UART.
+//
+// Registradores (32 bits):
+//   0x00 MAGIC   "PBLK" (0x4b4c4250), só leitura
+//   0x04 SECTORS capacidade em setores, só leitura
+//   0x08 SECTOR  primeiro setor do pedido
+//   0x0C ADDR    endereço do buffer na RAM
+//   0x10 COUNT   número de setores
+//   0x14 CMD     1 = ler do disco, 2 = gravar no disco, 3 = flush; lê o último
+//   0x18 STATUS  bit 0 = pedido concluído, bit 1 = erro; escrita limpa os bits em 1
+//   0x1C IER     bit 0 = interrupção na conclusão
+#define BLK_SECTOR_SIZE 512
+#define BLK_MAGIC 0x4b4c4250
+
+#define BLK_REG_MAGIC   0x00
+#define BLK_REG_SECTORS 0x04
+#define BLK_REG_SECTOR  0x08
+#define BLK_REG_ADDR    0x0C
+#define BLK_REG_COUNT   0x10
+#define BLK_REG_CMD     0x14
+#define BLK_REG_STATUS  0x18
+#define BLK_REG_IER     0x1C
+
+#define BLK_CMD_READ  1
+#define BLK_CMD_WRITE 2
+#define BLK_CMD_FLUSH 3
+
+#define BLK_STATUS_DONE  1
+#define BLK_STATUS_ERROR 2
+
+const char *blk_path;  // --blk
+int blk_private;       // --batch, --fork e --lockstep: gravações ficam na execução
+
+// Mapeia a imagem para a máquina atual. Um arquivo sem permissão de escrita
+// vira um disco só de leitura. Em caso de erro avisa no stderr e retorna 0.
+int blk_open(const char *path) {
+    int fd = open(path, O_RDWR);
+    int writable = fd >= 0;
+    if (fd < 0) fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("Erro ao abrir a imagem do --blk");
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("Erro ao abrir a imagem do --blk");
+        close(fd);
+        return 0;
+    }
+    uint64_t sectors = (uint64_t)st.st_size / BLK_SECTOR_SIZE;
+    if (sectors > UINT32_MAX) sectors = UINT32_MAX;
+    if (sectors > 0) {
+        // Cópia privada: as páginas gravadas pelo guest não vão para o arquivo.
+        int prot = (writable || blk_private) ? PROT_READ | PROT_WRITE : PROT_READ;
+        void *image = mmap(NULL, sectors * BLK_SECTOR_SIZE, prot, blk_private ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+        if (image == MAP_FAILED) {
+            perror("Erro ao mapear a imagem do --blk");
+            close(fd);
+            return 0;
+        }
+        machine->blk_image = (uint8_t*)image;
+    }
+    close(fd);
+    machine->blk_sectors = (uint32_t)sectors;
+    machine->blk_writable = writable || blk_private;
+    return 1;
+}
+
+void blk_close(machine_t *m) {
+    if (m->blk_image) munmap(m->blk_image, (size_t)m->blk_sectors * BLK_SECTOR_SIZE);
+    m->blk_image = NULL;
+}
+
+void blk_update_irq() {
+    if (!(machine->blk_ier & 1) || !(machine->blk_status & BLK_STATUS_DONE)) return;
+    if (!(machine->plic_pending & (1 << BLK_IRQ))) {
+        machine->plic_pending |= (1 << BLK_IRQ);
+        irq_wake_all();
+    }
+}
+
+// Executa o pedido dos registradores de uma vez. Buffer fora da RAM, setores
+// além do fim do disco ou gravação num disco só de leitura terminam em erro
+// sem copiar nada.
+void blk_execute(uint32_t cmd) {
+    uint32_t offset = machine->blk_addr - PC_START_ADDRESS;
+    uint64_t bytes = (uint64_t)machine->blk_count * BLK_SECTOR_SIZE;
+    int ok = (uint64_t)machine->blk_sector + machine->blk_count <= machine->blk_sectors &&
+             offset <= memory_size && bytes <= memory_size - offset;
+    machine->blk_cmd = cmd;
+    if (cmd == BLK_CMD_READ && ok) {
+        memcpy(machine->memory + offset, machine->blk_image + (uint64_t)machine->blk_sector * BLK_SECTOR_SIZE, bytes);
+        if (bytes) icache_invalidate_range(offset, (uint32_t)bytes);
+        ram_dirty(offset, (uint32_t)bytes);
+    } else if (cmd == BLK_CMD_WRITE && ok && machine->blk_writable) {
+        memcpy(machine->blk_image + (uint64_t)machine->blk_sector * BLK_SECTOR_SIZE, machine->memory + offset, bytes);
+    } else if (cmd == BLK_CMD_FLUSH) {
+        ok = !machine->blk_image || blk_private ||
+             msync(machine->blk_image, (size_t)machine->blk_sectors * BLK_SECTOR_SIZE, MS_SYNC) == 0;
+    } else {
+        ok = 0;
+    }
+    machine->blk_status = BLK_STATUS_DONE | (ok ? 0 : BLK_STATUS_ERROR);
+}
+
+uint32_t blk_read(uint32_t offset, uint32_t size) {
+    (void)size;
+    switch (offset) {
+        case BLK_REG_MAGIC:   return BLK_MAGIC;
+        case BLK_REG_SECTORS: return machine->blk_sectors;
+        case BLK_REG_SECTOR:  return machine->blk_sector;
+        case BLK_REG_ADDR:    return machine->blk_addr;
+        case BLK_REG_COUNT:   return machine->blk_count;
+        case BLK_REG_CMD:     return machine->blk_cmd;
+        case BLK_REG_STATUS:  return machine->blk_status;
+        case BLK_REG_IER:     return machine->blk_ier;
+    }
+    return 0;
+}
+
+void blk_write(uint32_t offset, uint32_t value, uint32_t size) {
+    (void)size;
+    switch (offset) {
+        case BLK_REG_SECTOR: machine->blk_sector = value; break;
+        case BLK_REG_ADDR:   machine->blk_addr = value; break;
+        case BLK_REG_COUNT:  machine->blk_count = value; break;
+        case BLK_REG_CMD:    blk_execute(value); break;
+        case BLK_REG_STATUS: machine->blk_status &= ~value; break;
+        case BLK_REG_IER:    machine->blk_ier = value & 1; break;
     }
+    blk_update_irq();
 }
 
-uint32_t clint_read(uint32_t address) {
-    if (address == CLINT_BASE + 0xBFF8) return (uint32_t)mtime;
-    if (address == CLINT_BASE + 0xBFFC) return (uint32_t)(mtime >> 32);
+// CLINT: msip do hart i em 4*i, mtimecmp do hart i em 0x4000 + 8*i e mtime
+// (o do hart que lê) em 0xBFF8.
+uint32_t clint_read(uint32_t offset, uint32_t size) {
+    (void)size;
+    if (offset == 0xBFF8) return (uint32_t)hart->mtime;
+    if (offset == 0xBFFC) return (uint32_t)(hart->mtime >> 32);
+    if (offset < 4 * machine->hart_count) return (machine->harts[offset / 4].mip >> 3) & 1;
+    if (offset >= 0x4000 && offset < 0x4000 + 8 * machine->hart_count) {
+        hart_t *h = &machine->harts[(offset - 0x4000) / 8];
+        return (offset & 4) ? (uint32_t)(h->mtimecmp >> 32) : (uint32_t)h->mtimecmp;
+    }
     return 0;
 }
 
 // --- CORREÇÃO 2: LÓGICA DO CLINT ---
-void clint_write(uint32_t address, uint32_t value) {
-    uint32_t offset = address - CLINT_BASE;
-    if (offset == 0x4000) { // mtimecmp low
-        mtimecmp = (mtimecmp & 0xFFFFFFFF00000000) | value;
-        mip &= ~(1 << 7); // 
-    } else if (offset == 0x4004) { // mtimecmp high
-        mtimecmp = (mtimecmp & 0x00000000FFFFFFFF) | ((uint64_t)value << 32);
-        mip &= ~(1 << 7);
-    } else if (offset == 0) { // msip
+void clint_write(uint32_t offset, uint32_t value, uint32_t size) {
+    (void)size;
+    irq_wake();
+    if (offset >= 0x4000 && offset < 0x4000 + 8 * machine->hart_count) {
+        hart_t *h = &machine->harts[(offset - 0x4000) / 8];
+        if (offset & 4) { // mtimecmp high
+            h->mtimecmp = (h->mtimecmp & 0x00000000FFFFFFFF) | ((uint64_t)value << 32);
+        } else { // mtimecmp low
+            h->mtimecmp = (h->mtimecmp & 0xFFFFFFFF00000000) | value;
+        }
+        mip_clear(h, 1 << 7);
+        hart_wake(h);
+    } else if (offset < 4 * machine->hart_count) { // msip
+        hart_t *h = &machine->harts[offset / 4];
         if (value & 1) {
-            mip |= (1 << 3); // 
+            mip_set(h, 1 << 3);
         } else {
-            mip &= ~(1 << 3); // 
+            mip_clear(h, 1 << 3);
         }
+        hart_wake(h);
+    }
+}
+
+// PLIC: um contexto (modo M) por hart, com enable em 0x2000 + 0x80*c e
+// claim/complete em 0x200004 + 0x1000*c. O claim não tira a fonte de pendente
+// (só o complete tira), mas enquanto um contexto a atende ela não interrompe
+// os outros.
+uint32_t plic_visible(uint32_t context) {
+    uint32_t visible = machine->plic_pending & machine->plic_enable[context];
+    for (uint32_t irq = 0; irq < 32; irq++) {
+        if (((machine->plic_claimed >> irq) & 1) && machine->plic_claimer[irq] != context) visible &= ~(1u << irq);
     }
+    return visible;
 }
 
-uint32_t plic_read(uint32_t address) {
-    if (address == PLIC_BASE + 0x200004) {
-        if ((plic_pending & plic_enable) & (1 << UART_IRQ)) {
-            //plic_pending &= ~(1 << UART_IRQ); // 
-            //mip &= ~(1 << 11); //
-            return UART_IRQ; // 
+// O claim entrega a fonte visível de menor número (as prioridades são iguais).
+uint32_t plic_read(uint32_t offset, uint32_t size) {
+    (void)size;
+    uint32_t context = (offset - 0x200004) / 0x1000;
+    if (offset >= 0x200004 && (offset - 0x200004) % 0x1000 == 0 && context < machine->hart_count) {
+        uint32_t visible = plic_visible(context);
+        if (visible) {
+            uint32_t irq = __builtin_ctz(visible);
+            machine->plic_claimed |= (1u << irq);
+            machine->plic_claimer[irq] = context;
+            return irq;
         }
     }
     return 0;
 }
 
-void plic_write(uint32_t address, uint32_t value) {
-     if (address >= PLIC_BASE + 0x2000 && address < PLIC_BASE + 0x2080) {
-        plic_enable = value;
-    } else if (address == PLIC_BASE + 0x200004) { 
-        if(value == UART_IRQ) {
-             plic_pending &= ~(1 << UART_IRQ);
+void plic_write(uint32_t offset, uint32_t value, uint32_t size) {
+    (void)size;
+    irq_wake_all();
+    uint32_t context = (offset - 0x200004) / 0x1000;
+    if (offset >= 0x2000 && offset < 0x2000 + 0x80 * machine->hart_count) {
+        machine->plic_enable[(offset - 0x2000) / 0x80] = value;
+    } else if (offset >= 0x200004 && (offset - 0x200004) % 0x1000 == 0 && context < machine->hart_count) {
+        if (value == UART_IRQ || value == BLK_IRQ) {
+             machine->plic_pending &= ~(1u << value);
+             machine->plic_claimed &= ~(1u << value);
+             if (value == UART_IRQ) uart_update_irq();
+             else blk_update_irq();
         }
-    } else if (address >= PLIC_BASE + 4 && address < PLIC_BASE + 0x1000) {
+    } else if (offset >= 4 && offset < 0x1000) {
         // Prioridade das fontes de interrupção
     }
 }
 
 // --- Acesso à Memória ---
-uint8_t memory_read_byte(uint32_t address, uint32_t current_pc) {
-    if (address >= UART_BASE && address < UART_BASE + 8) return uart_read(address);
-    if (address >= PC_START_ADDRESS && (address - PC_START_ADDRESS) < MEMORY_SIZE) {
-        return memory[address - PC_START_ADDRESS];
+// Mapa de memória: tabela de regiões ordenada por endereço. Cada região é
+// RAM ou ROM (ponteiro no host, acessado com memcpy little-endian) ou MMIO (funções
+// de leitura/escrita do dispositivo). mem_slot[] indexa os 8 bits altos do
+// endereço e aponta para a primeira região que pode conter aquele trecho, então
+// a busca olha uma região na prática.
+//
+// Regras iguais para todas as larguras: acesso desalinhado, fora de qualquer
+// região, que ultrapassa o fim da região ou com largura que o dispositivo não
+// aceita gera access fault (load = 5, store = 7).
+void mem_rebuild_slots() {
+    for (uint32_t slot = 0; slot < MEM_SLOTS; slot++) {
+        uint32_t i = 0;
+        uint64_t slot_start = (uint64_t)slot << MEM_SLOT_SHIFT;
+        while (i < machine->mem_region_count && (uint64_t)machine->mem_regions[i].base + machine->mem_regions[i].size <= slot_start) i++;
+        machine->mem_slot[slot] = i;
     }
-    trigger_trap(5, address, current_pc); return 0;
 }
 
-uint16_t memory_read_halfword(uint32_t address, uint32_t current_pc) {
-    if (address % 2 != 0) {
-        trigger_trap(5, address, current_pc); // Load access fault
+// Insere uma região mantendo a tabela ordenada. Regiões não podem se sobrepor.
+int mem_add_region(uint32_t base, uint32_t size, uint8_t *host,
+                   uint32_t (*read)(uint32_t, uint32_t), void (*write)(uint32_t, uint32_t, uint32_t), uint32_t widths) {
+    if (machine->mem_region_count == MEM_MAX_REGIONS || size == 0) return 0;
+    uint32_t i = 0;
+    while (i < machine->mem_region_count && machine->mem_regions[i].base < base) i++;
+    if (i > 0 && (uint64_t)machine->mem_regions[i - 1].base + machine->mem_regions[i - 1].size > base) return 0;
+    if (i < machine->mem_region_count && (uint64_t)base + size > machine->mem_regions[i].base) return 0;
+    memmove(&machine->mem_regions[i + 1], &machine->mem_regions[i], (machine->mem_region_count - i) * sizeof(mem_region_t));
+    mem_region_t *r = &machine->mem_regions[i];
+    r->base = base; r->size = size; r->host = host;
+    r->read = read; r->write = write; r->widths = widths;
+    r->dirty = NULL; r->dirty_pages = NULL; r->dirty_count = 0;
+    machine->mem_region_count++;
+    mem_rebuild_slots();
+    return 1;
+}
+
+// --- Mapa de Memória (--ram, --mem, --rom) ---
+// Além da RAM principal em PC_START_ADDRESS (memory_size bytes, a única com
+// cache de instruções, JIT e AOT; o código das outras regiões é decodificado a
+// cada execução), o mapa pode ter outras regiões de RAM e de ROM. Cada máquina
+// reserva as suas RAMs com mem_reserve. A ROM é um arquivo mapeado só para
+// leitura uma vez no processo, então as máquinas (e, pelo cache de páginas do
+// host, outros processos) dividem as mesmas páginas; escrever nela é store
+// access fault.
+#define MEMORY_MAX (1u << 30) // maior --ram
+#define MEM_LAYOUT_MAX 8
+
+typedef struct {
+    uint32_t base, size;
+    uint8_t *rom; // ROM: o arquivo mapeado; NULL para RAM
+} mem_layout_t;
+
+mem_layout_t mem_layout[MEM_LAYOUT_MAX];
+uint32_t mem_layout_count;
+
+// Número com sufixo K, M ou G opcional (potências de 2).
+uint64_t mem_parse_size(const char *s, char **end) {
+    uint64_t v = strtoull(s, end, 0);
+    if (**end == 'K' || **end == 'k') { v <<= 10; (*end)++; }
+    else if (**end == 'M' || **end == 'm') { v <<= 20; (*end)++; }
+    else if (**end == 'G' || **end == 'g') { v <<= 30; (*end)++; }
+    return v;
+}
+
+// --ram=TAMANHO
+int mem_set_ram(const char *spec) {
+    char *end;
+    uint64_t size = mem_parse_size(spec, &end);
+    if (*end || size < MEM_PAGE || size > MEMORY_MAX || size % MEM_PAGE) {
+        fprintf(stderr, "Tamanho do --ram invalido: %s (4K a 1G, multiplo de 4K)\n", spec);
         return 0;
     }
-    if (address >= PC_START_ADDRESS && (address - PC_START_ADDRESS + 1) < MEMORY_SIZE) {
-        return (uint16_t)memory[address - PC_START_ADDRESS] | ((uint16_t)memory[address - PC_START_ADDRESS + 1] << 8);
-    }
-    trigger_trap(5, address, current_pc); return 0;
+    memory_size = (uint32_t)size;
+    return 1;
 }
 
-uint32_t memory_read_word(uint32_t address, uint32_t current_pc) {
-    if (address % 4 != 0) {
-        trigger_trap(5, address, current_pc); // Load access fault
+// --mem=BASE:TAMANHO (RAM) e --rom=BASE:ARQUIVO (do tamanho do arquivo).
+int mem_layout_add(const char *spec, int rom) {
+    char *end;
+    uint64_t base = strtoull(spec, &end, 0), size;
+    uint8_t *host = NULL;
+    if (*end != ':' || base % MEM_PAGE) {
+        fprintf(stderr, "Regiao invalida: %s (a base precisa ser multiplo de 4K)\n", spec);
         return 0;
     }
-    if (address >= CLINT_BASE && address < CLINT_BASE + 0x10000) return clint_read(address);
-    if (address >= PLIC_BASE && address < PLIC_BASE + 0x4000000) return plic_read(address);
-    if (address >= PC_START_ADDRESS && (address - PC_START_ADDRESS + 3) < MEMORY_SIZE) {
-        return ((uint32_t)memory[address - PC_START_ADDRESS + 0] << 0) |
-               ((uint32_t)memory[address - PC_START_ADDRESS + 1] << 8) |
-               ((uint32_t)memory[address - PC_START_ADDRESS + 2] << 16) |
-               ((uint32_t)memory[address - PC_START_ADDRESS + 3] << 24);
+    if (mem_layout_count == MEM_LAYOUT_MAX) {
+        fprintf(stderr, "Regioes demais em --mem e --rom (maximo %d)\n", MEM_LAYOUT_MAX);
+        return 0;
     }
-    trigger_trap(5, address, current_pc); return 0;
-}
-
-void memory_write_byte(uint32_t address, uint8_t value, uint32_t current_pc) {
-    if (address >= UART_BASE && address < UART_BASE + 8) { uart_write(address, value, 1); return; }
-    if (address >= PC_START_ADDRESS && (address - PC_START_ADDRESS) < MEMORY_SIZE) {
-        memory[address - PC_START_ADDRESS] = value;
+    if (rom) {
+        struct stat st;
+        int fd = open(end + 1, O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            perror("Erro ao abrir a ROM");
+            if (fd >= 0) close(fd);
+            return 0;
+        }
+        size = ((uint64_t)st.st_size + MEM_PAGE - 1) & ~(uint64_t)(MEM_PAGE - 1);
+        if (size && base + size <= (1ull << 32)) {
+            void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) host = (uint8_t*)p;
+        }
+        close(fd);
+        if (!host) {
+            fprintf(stderr, "ROM vazia, grande demais ou que nao pode ser mapeada: %s\n", end + 1);
+            return 0;
+        }
     } else {
-        trigger_trap(7, address, current_pc);
+        size = mem_parse_size(end + 1, &end);
+        if (*end || size == 0 || size % MEM_PAGE || base + size > (1ull << 32) || size > UINT32_MAX) {
+            fprintf(stderr, "Regiao invalida: %s (tamanho multiplo de 4K, dentro dos 4G)\n", spec);
+            return 0;
+        }
     }
+    mem_layout[mem_layout_count++] = (mem_layout_t){ (uint32_t)base, (uint32_t)size, host };
+    return 1;
 }
 
-void memory_write_halfword(uint32_t address, uint16_t value, uint32_t current_pc) {
-    if (address % 2 != 0) {
-        trigger_trap(7, address, current_pc); // Store/AMO access fault
-        return;
-    }
-    if (address >= PC_START_ADDRESS && (address - PC_START_ADDRESS + 1) < MEMORY_SIZE) {
-        memory[address - PC_START_ADDRESS + 0] = (uint8_t)(value & 0xFF);
-        memory[address - PC_START_ADDRESS + 1] = (uint8_t)((value >> 8) & 0xFF);
-    } else {
-        trigger_trap(7, address, current_pc);
+// Periféricos, RAM principal e as regiões do mapa. Retorna 0 se alguma região
+// do --mem ou do --rom se sobrepõe a outra.
+int mem_init() {
+    machine->mem_region_count = 0;
+    mem_add_region(CLINT_BASE, 0x10000, NULL, clint_read, clint_write, 4);
+    mem_add_region(PLIC_BASE, 0x4000000, NULL, plic_read, plic_write, 4);
+    mem_add_region(UART_BASE, 8, NULL, uart_read, uart_write, 1 | 2 | 4);
+    mem_add_region(BLK_BASE, 0x20, NULL, blk_read, blk_write, 4);
+    mem_add_region(PC_START_ADDRESS, memory_size, machine->memory, NULL, NULL, 1 | 2 | 4);
+    int ok = 1;
+    for (uint32_t i = 0; i < mem_layout_count; i++) {
+        const mem_layout_t *l = &mem_layout[i];
+        uint8_t *host = l->rom ? l->rom : (uint8_t*)mem_reserve(l->size);
+        if (!mem_add_region(l->base, l->size, host, NULL, NULL, l->rom ? 1 | 2 | 4 | MEM_READONLY : 1 | 2 | 4)) {
+            if (!l->rom) munmap(host, l->size);
+            ok = 0;
+        }
     }
+    return ok;
 }
 
-void memory_write_word(uint32_t address, uint32_t value, uint32_t current_pc) {
-    if (address % 4 != 0) {
-        trigger_trap(7, address, current_pc); // Store/AMO access fault
-        return;
-    }
-    if (address >= CLINT_BASE && address < CLINT_BASE + 0x10000) { clint_write(address, value); return; }
-    if (address >= PLIC_BASE && address < PLIC_BASE + 0x4000000) { plic_write(address, value); return; }
-    if (address >= PC_START_ADDRESS && (address - PC_START_ADDRESS + 3) < MEMORY_SIZE) {
-         memory[address - PC_START_ADDRESS + 0] = (uint8_t)(value & 0xFF);
-        memory[address - PC_START_ADDRESS + 1] = (uint8_t)((value >> 8) & 0xFF);
-        memory[address - PC_START_ADDRESS + 2] = (uint8_t)((value >> 16) & 0xFF);
-        memory[address - PC_START_ADDRESS + 3] = (uint8_t)((value >> 24) & 0xFF);
-    } else {
-        trigger_trap(7, address, current_pc);
+// Topo da RAM mais alta do mapa, onde as pilhas começam (0 se ela vai até o
+// fim do espaço de endereços: o primeiro push já cai nela).
+uint32_t mem_stack_top() {
+    uint32_t top = 0;
+    for (uint32_t i = 0; i < machine->mem_region_count; i++) {
+        const mem_region_t *r = &machine->mem_regions[i];
+        if (r->host && !(r->widths & MEM_READONLY)) top = r->base + r->size;
     }
+    return top;
 }
 
-// --- Funções de Decodificação ---
-uint32_t fetch_instruction_from_pc() {
-    if (pc < PC_START_ADDRESS || (pc + 3) >= (PC_START_ADDRESS + MEMORY_SIZE) || (pc % 4 != 0)) {
-        trigger_trap(1, pc, pc);
-        return 0;
+// Região que contém [address, address + size), ou NULL.
+static inline __attribute__((always_inline))
+mem_region_t *mem_find(uint32_t address, uint32_t size) {
+    for (uint32_t i = machine->mem_slot[address >> MEM_SLOT_SHIFT]; i < machine->mem_region_count; i++) {
+        mem_region_t *r = &machine->mem_regions[i];
+        if (address < r->base) break;
+        if (address - r->base <= r->size - size) return r;
     }
-    return memory_read_word(pc, pc);
+    return NULL;
 }
 
-uint32_t get_opcode(uint32_t i) { return i & 0x7F; }
-uint32_t get_rd(uint32_t i) { return (i >> 7) & 0x1F; }
-uint32_t get_rs1(uint32_t i) { return (i >> 15) & 0x1F; }
-uint32_t get_rs2(uint32_t i) { return (i >> 20) & 0x1F; }
-uint32_t get_funct3(uint32_t i) { return (i >> 12) & 0x7; }
-uint32_t get_funct7(uint32_t i) { return (i >> 25) & 0x7F; }
-
-int32_t get_imm_I(uint32_t instruction) {
-    return (int32_t)(instruction) >> 20;
+static inline __attribute__((always_inline))
+uint32_t mem_load_le(const uint8_t *p, uint32_t size) {
+    if (size == 1) return *p;
+    if (size == 2) { uint16_t v; memcpy(&v, p, 2); return le16toh(v); }
+    uint32_t v; memcpy(&v, p, 4); return le32toh(v);
 }
 
-int32_t get_imm_S(uint32_t instruction) {
-    int32_t imm = ((instruction >> 25) << 5) | ((instruction >> 7) & 0x1F);
-    return (int32_t)(imm << 20) >> 20;
+static inline __attribute__((always_inline))
+void mem_store_le(uint8_t *p, uint32_t value, uint32_t size) {
+    if (size == 1) *p = (uint8_t)value;
+    else if (size == 2) { uint16_t v = htole16((uint16_t)value); memcpy(p, &v, 2); }
+    else { uint32_t v = htole32(value); memcpy(p, &v, 4); }
 }
 
-int32_t get_imm_B(uint32_t instruction) {
-    int32_t imm = (((instruction >> 31) & 0x1) << 12) |
-                  (((instruction >> 7) & 0x1) << 11) |
-                  (((instruction >> 25) & 0x3F) << 5)|
-                  (((instruction >> 8) & 0xF) << 1);
-    return (int32_t)(imm << 19) >> 19;
+// --lockstep: as páginas de [offset, offset + len) da região foram escritas.
+static inline void mem_dirty(mem_region_t *r, uint32_t offset, uint32_t len) {
+    if (!r->dirty || len == 0) return;
+    for (uint32_t page = offset >> 12; page <= (offset + len - 1) >> 12; page++) {
+        if (r->dirty[page]) continue;
+        r->dirty[page] = 1;
+        r->dirty_pages[r->dirty_count++] = page;
+    }
+}
+
+// O mesmo para escritas na RAM principal fora de memory_write (AMOs, DMA e
+// semihosting).
+void ram_dirty(uint32_t ram_offset, uint32_t len) {
+    if (machine->lockstep) mem_dirty(mem_find(PC_START_ADDRESS + ram_offset, 1), ram_offset, len);
+}
+
+// --- Tradução de Endereços (Sv32) ---
+// Com satp.MODE = 1, os modos S e U (e o M com mstatus.MPRV, nos dados)
+// traduzem os endereços pela tabela de páginas de dois níveis do Sv32. Cada
+// hart tem uma TLB mapeada diretamente pelo número da página virtual: a
+// entrada guarda o ponteiro do host para a página e uma etiqueta por tipo de
+// acesso (load, store, busca) com o endereço virtual da página. O load/store
+// comum é uma comparação da etiqueta com o endereço mascarado, que mantém os
+// bits de desalinhamento para eles nunca baterem.
+//
+// Sem tradução a TLB guarda a identidade e o modo M usa o mesmo caminho. Só
+// entram páginas de 4 KiB inteiras dentro de uma região de memória (MMIO fica
+// no caminho lento), a busca só na RAM principal (a do cache de instruções) e o
+// store nunca na ROM. A TLB esvazia no sfence.vma, em escritas no satp e quando
+// muda o que as entradas supõem (ver mmu_update). Falhas de página (12, 13,
+// 15) e de acesso à tabela passam por trigger_trap com o endereço virtual.
+#define MMU_FETCH 0
+#define MMU_LOAD  1
+#define MMU_STORE 2
+
+#define PTE_V (1u << 0)
+#define PTE_R (1u << 1)
+#define PTE_W (1u << 2)
+#define PTE_X (1u << 3)
+#define PTE_U (1u << 4)
+#define PTE_A (1u << 6)
+#define PTE_D (1u << 7)
+
+static const uint32_t mmu_page_fault[3]   = { 12, 13, 15 };
+static const uint32_t mmu_access_fault[3] = { 1, 5, 7 };
+
+// Modo dos loads e stores: o de MPP com mstatus.MPRV.
+static inline uint32_t mmu_data_priv() {
+    return (hart->mstatus & MSTATUS_MPRV) ? (hart->mstatus & MSTATUS_MPP) >> 11 : hart->priv;
+}
+
+// Depois de mudar o modo, mstatus ou satp: refaz translate e esvazia a TLB se
+// o contexto das entradas (modos da busca e dos dados, SUM, MXR) mudou.
+void mmu_update() {
+    uint32_t data_priv = mmu_data_priv(), context = 0;
+    hart->translate = (hart->satp >> 31) && (hart->priv != PRIV_M || data_priv != PRIV_M);
+    if (hart->translate)
+        context = 0x80000000 | hart->priv << 4 | data_priv << 2 | (hart->mstatus & (MSTATUS_SUM | MSTATUS_MXR));
+    if (context != hart->tlb_context) {
+        tlb_flush(hart);
+        hart->tlb_context = context;
+    }
+}
+
+// Endereço físico de vaddr para o acesso (MMU_*). Retorna 0 depois de gerar o
+// trap. A e D são marcados na PTE com compare-and-swap, como um AMO.
+int mmu_translate(uint32_t vaddr, int access, uint32_t *paddr, uint32_t current_pc) {
+    uint32_t priv = (access == MMU_FETCH) ? hart->priv : mmu_data_priv();
+    if (!(hart->satp >> 31) || priv == PRIV_M) {
+        *paddr = vaddr;
+        return 1;
+    }
+    uint32_t mstatus = hart->mstatus, pte;
+    uint64_t pte_address;
+    mem_region_t *r;
+    int level;
+
+walk:
+    pte_address = (uint64_t)(hart->satp & 0x3FFFFF) << 12;
+    for (level = 1; ; level--) {
+        pte_address += ((vaddr >> (12 + 10 * level)) & 0x3FF) * 4;
+        if ((pte_address >> 32) || !(r = mem_find((uint32_t)pte_address, 4)) || !r->host) goto access_fault;
+        pte = mem_load_le(r->host + ((uint32_t)pte_address - r->base), 4);
+        if (!(pte & PTE_V) || ((pte & PTE_W) && !(pte & PTE_R))) goto page_fault;
+        if (pte & (PTE_R | PTE_X)) break; // folha
+        if (level == 0) goto page_fault;
+        pte_address = (uint64_t)(pte >> 10) << 12;
+    }
+    if (level == 1 && ((pte >> 10) & 0x3FF)) goto page_fault; // superpágina desalinhada
+
+    // U: só páginas de usuário. S: páginas de usuário só com SUM, e nunca na busca.
+    if (priv == PRIV_U ? !(pte & PTE_U) : ((pte & PTE_U) && (access == MMU_FETCH || !(mstatus & MSTATUS_SUM))))
+        goto page_fault;
+    if (access == MMU_FETCH ? !(pte & PTE_X) :
+        access == MMU_LOAD ? !((pte & PTE_R) || ((mstatus & MSTATUS_MXR) && (pte & PTE_X))) :
+        !(pte & PTE_W)) goto page_fault;
+
+    uint32_t flags = PTE_A | (access == MMU_STORE ? PTE_D : 0);
+    if ((pte & flags) != flags) {
+        if (r->widths & MEM_READONLY) goto access_fault;
+        uint32_t *word = (uint32_t*)(r->host + ((uint32_t)pte_address - r->base));
+        uint32_t raw = htole32(pte);
+        // Outro hart mudou a PTE no meio: a tradução recomeça.
+        if (!__atomic_compare_exchange_n(word, &raw, htole32(pte | flags), 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) goto walk;
+        mem_dirty(r, (uint32_t)pte_address - r->base, 4);
+        if (r->host == machine->memory) icache_invalidate((uint32_t)pte_address - r->base);
+    }
+
+    uint64_t physical = (level == 1) ? ((uint64_t)(pte >> 20) << 22) | (vaddr & 0x3FFFFF)
+                                     : ((uint64_t)(pte >> 10) << 12) | (vaddr & 0xFFF);
+    if (physical >> 32) goto access_fault;
+    *paddr = (uint32_t)physical;
+    return 1;
+
+page_fault:
+    trigger_trap(mmu_page_fault[access], vaddr, current_pc);
+    return 0;
+access_fault:
+    trigger_trap(mmu_access_fault[access], vaddr, current_pc);
+    return 0;
+}
+
+// Coloca a página vaddr -> paddr na TLB para o acesso, se ela couber inteira na
+// região r. A entrada da mesma página e do mesmo host só ganha a etiqueta.
+void tlb_fill(uint32_t vaddr, uint32_t paddr, const mem_region_t *r, int access) {
+    uint32_t page = paddr & 0xFFFFF000, vpage = vaddr & 0xFFFFF000;
+    if (page < r->base || (uint64_t)(page - r->base) + 4096 > r->size) return;
+    if (access == MMU_STORE && (r->widths & MEM_READONLY)) return;
+    uint32_t ram_page = (r->host == machine->memory) ? page - r->base : TLB_NO_RAM;
+    if (access == MMU_FETCH && ram_page == TLB_NO_RAM) return;
+
+    tlb_entry_t *e = &hart->tlb[(vaddr >> 12) % TLB_ENTRIES];
+    uint8_t *host = r->host + (page - r->base);
+    if (e->host != host || (e->load != vpage && e->store != vpage && e->fetch != vpage)) {
+        e->load = e->store = e->fetch = TLB_EMPTY;
+        e->host = host;
+        e->ram_page = ram_page;
+    }
+    if (access == MMU_FETCH) e->fetch = vpage;
+    else if (access == MMU_LOAD) e->load = vpage;
+    else e->store = vpage;
+}
+
+// Falta na TLB: tradução, região e, se der, uma entrada nova.
+uint32_t memory_read_slow(uint32_t address, uint32_t size, uint32_t current_pc) {
+    uint32_t paddr = address;
+    mem_region_t *r;
+    if (address & (size - 1)) goto fault;
+    if (hart->translate && !mmu_translate(address, MMU_LOAD, &paddr, current_pc)) return 0;
+    if ((r = mem_find(paddr, size)) != NULL) {
+        if (r->host) {
+            tlb_fill(address, paddr, r, MMU_LOAD);
+            return mem_load_le(r->host + (paddr - r->base), size);
+        }
+        if (r->widths & size) {
+            mmio_enter();
+            uint32_t value = r->read(paddr - r->base, size);
+            mmio_leave();
+            return value;
+        }
+    }
+fault:
+    trigger_trap(5, address, current_pc); // Load access fault
+    return 0;
+}
+
+void memory_write_slow(uint32_t address, uint32_t value, uint32_t size, uint32_t current_pc) {
+    uint32_t paddr = address;
+    mem_region_t *r;
+    if (address & (size - 1)) goto fault;
+    if (hart->translate && !mmu_translate(address, MMU_STORE, &paddr, current_pc)) return;
+    if ((r = mem_find(paddr, size)) != NULL) {
+        if (r->host && !(r->widths & MEM_READONLY)) {
+            mem_dirty(r, paddr - r->base, size);
+            tlb_fill(address, paddr, r, MMU_STORE);
+            mem_store_le(r->host + (paddr - r->base), value, size);
+            // O cache de instruções só cobre memory[].
+            if (r->host == machine->memory) icache_invalidate(paddr - r->base);
+            return;
+        }
+        if (!r->host && (r->widths & size)) {
+            mmio_enter();
+            r->write(paddr - r->base, value, size);
+            mmio_leave();
+            return;
+        }
+    }
+fault:
+    trigger_trap(7, address, current_pc); // Store/AMO access fault
+}
+
+static inline __attribute__((always_inline))
+uint32_t memory_read(uint32_t address, uint32_t size, uint32_t current_pc) {
+    const tlb_entry_t *e = &hart->tlb[(address >> 12) % TLB_ENTRIES];
+    if (e->load == (address & (0xFFFFF000 | (size - 1)))) return mem_load_le(e->host + (address & 0xFFF), size);
+    return memory_read_slow(address, size, current_pc);
+}
+
+static inline __attribute__((always_inline))
+void memory_write(uint32_t address, uint32_t value, uint32_t size, uint32_t current_pc) {
+    const tlb_entry_t *e = &hart->tlb[(address >> 12) % TLB_ENTRIES];
+    if (e->store == (address & (0xFFFFF000 | (size - 1)))) {
+        mem_store_le(e->host + (address & 0xFFF), value, size);
+        if (e->ram_page != TLB_NO_RAM) icache_invalidate(e->ram_page + (address & 0xFFF));
+        return;
+    }
+    memory_write_slow(address, value, size, current_pc);
+}
+
+uint8_t memory_read_byte(uint32_t address, uint32_t current_pc)     { return memory_read(address, 1, current_pc); }
+uint16_t memory_read_halfword(uint32_t address, uint32_t current_pc) { return memory_read(address, 2, current_pc); }
+uint32_t memory_read_word(uint32_t address, uint32_t current_pc)     { return memory_read(address, 4, current_pc); }
+
+void memory_write_byte(uint32_t address, uint8_t value, uint32_t current_pc)      { memory_write(address, value, 1, current_pc); }
+void memory_write_halfword(uint32_t address, uint16_t value, uint32_t current_pc) { memory_write(address, value, 2, current_pc); }
+void memory_write_word(uint32_t address, uint32_t value, uint32_t current_pc)     { memory_write(address, value, 4, current_pc); }
+
+// --- Extensão A (Atômicos) ---
+// Só palavras alinhadas na RAM; no resto é falha de acesso (load fault no
+// lr.w, store/AMO fault nos demais). Cada AMO é um compare-and-swap no host,
+// então é atômico entre os harts. A reserva do lr.w guarda o endereço e o
+// valor lido e o sc.w só grava se a palavra ainda tiver esse valor.
+#define AMO_LR 0x02
+#define AMO_SC 0x03
+
+int amo_execute(uint32_t funct5, uint32_t address, uint32_t src, uint32_t *result, uint32_t current_pc) {
+    // Com Sv32 o lr.w traduz como load e os demais como store; a reserva fica
+    // com o endereço físico.
+    uint32_t paddr = address;
+    if (hart->translate && !(address & 3) &&
+        !mmu_translate(address, funct5 == AMO_LR ? MMU_LOAD : MMU_STORE, &paddr, current_pc)) return 0;
+    uint32_t offset = paddr - PC_START_ADDRESS;
+    if ((address & 3) || offset > memory_size - 4) {
+        trigger_trap(funct5 == AMO_LR ? 5 : 7, address, current_pc);
+        return 0;
+    }
+    uint32_t *word = (uint32_t*)(machine->memory + offset);
+    uint32_t raw = __atomic_load_n(word, __ATOMIC_SEQ_CST), old, value;
+
+    if (funct5 == AMO_LR) {
+        hart->reserved = 1;
+        hart->reserved_address = paddr;
+        hart->reserved_value = *result = le32toh(raw);
+        return 1;
+    }
+    if (funct5 == AMO_SC) {
+        *result = 1;
+        raw = htole32(hart->reserved_value);
+        if (hart->reserved && hart->reserved_address == paddr &&
+            __atomic_compare_exchange_n(word, &raw, htole32(src), 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            *result = 0;
+            icache_invalidate(offset);
+            ram_dirty(offset, 4);
+        }
+        hart->reserved = 0;
+        return 1;
+    }
+    do {
+        old = le32toh(raw);
+        switch (funct5) {
+            case 0x01: value = src; break;
+            case 0x00: value = old + src; break;
+            case 0x04: value = old ^ src; break;
+            case 0x0C: value = old & src; break;
+            case 0x08: value = old | src; break;
+            case 0x10: value = ((int32_t)old < (int32_t)src) ? old : src; break;
+            case 0x14: value = ((int32_t)old > (int32_t)src) ? old : src; break;
+            case 0x18: value = (old < src) ? old : src; break;
+            default:   value = (old > src) ? old : src; break; // amomaxu.w
+        }
+    } while (!__atomic_compare_exchange_n(word, &raw, htole32(value), 1, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+    *result = old;
+    icache_invalidate(offset);
+    ram_dirty(offset, 4);
+    return 1;
+}
+
+// --- Semihosting ---
+// Com --semihosting a sequência padrão do RISC-V
+//     slli x0, x0, 0x1f
+//     ebreak
+//     srai x0, x0, 7
+// é uma chamada ao host em vez de parar a simulação: a0 traz a operação, a1 o
+// argumento (quase sempre o endereço de um bloco de palavras) e o resultado
+// volta em a0. A numeração é a do semihosting do ARM, que o RISC-V adotou, mais
+// três operações do poxim (a partir de 0x100, a faixa livre da especificação)
+// para os laços que mais pesam no libc do guest. A chamada inteira conta como
+// uma instrução (o ebreak) e deixa uma linha só no trace. Um ebreak fora da
+// sequência continua parando a máquina.
+//
+// Só o modo M sem tradução chama o host: os endereços da sequência e dos
+// buffers são físicos. Nos modos S e U, ou com mstatus.MPRV ligando o Sv32 nos
+// dados, a sequência é um ebreak comum.
+//
+// Os handles 1, 2 e 3 são o console (":tt" aberto para leitura, escrita e
+// append): a entrada vem de term_in pelo buffer da UART e as duas saídas vão
+// para term_out, na ordem certa com o que a UART já escreveu. Os outros são
+// arquivos do host, abertos pelo caminho que o guest passa; a referência do
+// --lockstep grava os seus em /dev/null. Todo buffer precisa estar inteiro na
+// RAM, senão a operação falha (errno EFAULT) sem tocar em nada.
+#define SEMI_SLLI 0x01F01013 // slli x0, x0, 0x1f
+#define SEMI_SRAI 0x40705013 // srai x0, x0, 7
+
+#define SEMI_SYS_OPEN          0x01
+#define SEMI_SYS_CLOSE         0x02
+#define SEMI_SYS_WRITEC        0x03
+#define SEMI_SYS_WRITE0        0x04
+#define SEMI_SYS_WRITE         0x05
+#define SEMI_SYS_READ          0x06
+#define SEMI_SYS_READC         0x07
+#define SEMI_SYS_ISTTY         0x09
+#define SEMI_SYS_SEEK          0x0A
+#define SEMI_SYS_FLEN          0x0C
+#define SEMI_SYS_ERRNO         0x13
+#define SEMI_SYS_EXIT          0x18
+#define SEMI_SYS_EXIT_EXTENDED 0x20
+#define SEMI_POXIM_MEMCPY      0x100 // {dst, src, n} -> dst (pode sobrepor)
+#define SEMI_POXIM_MEMSET      0x101 // {dst, c, n} -> dst
+#define SEMI_POXIM_STRLEN      0x102 // {s} -> tamanho
+
+#define SEMI_TT_IN        1
+#define SEMI_TT_OUT       2
+#define SEMI_TT_ERR       3
+#define SEMI_FIRST_FILE   4
+#define SEMI_EXIT_NORMAL  0x20026 // ADP_Stopped_ApplicationExit
+
+// ":semihosting-features": o guest descobre que SYS_EXIT_EXTENDED existe.
+static const uint8_t semi_features[5] = { 'S', 'H', 'F', 'B', 0x01 };
+
+int semihosting_enabled; // --semihosting
+
+// Ponteiro no host para [address, address + len) se o trecho todo é RAM.
+uint8_t *semi_ram(uint32_t address, uint32_t len) {
+    uint32_t offset = address - PC_START_ADDRESS;
+    if (offset > memory_size || len > memory_size - offset) return NULL;
+    return machine->memory + offset;
+}
+
+int semi_args(uint32_t address, uint32_t *args, uint32_t count) {
+    const uint8_t *p = semi_ram(address, count * 4);
+    if (!p) return 0;
+    for (uint32_t i = 0; i < count; i++) args[i] = mem_load_le(p + i * 4, 4);
+    return 1;
+}
+
+// O ebreak em current_pc está entre as duas instruções marcadoras?
+int semi_sequence(uint32_t current_pc) {
+    uint32_t offset = current_pc - PC_START_ADDRESS;
+    return offset >= 4 && offset <= memory_size - 8 &&
+           mem_load_le(machine->memory + offset - 4, 4) == SEMI_SLLI &&
+           mem_load_le(machine->memory + offset + 4, 4) == SEMI_SRAI;
+}
+
+int semi_file(uint32_t handle) {
+    if (handle < SEMI_FIRST_FILE || handle - SEMI_FIRST_FILE >= SEMI_MAX_FILES) return -1;
+    return machine->semi_files[handle - SEMI_FIRST_FILE];
+}
+
+void semi_close_all(machine_t *m) {
+    for (uint32_t i = 0; i < SEMI_MAX_FILES; i++) {
+        if (m->semi_files[i] >= 0) close(m->semi_files[i]);
+        m->semi_files[i] = -1;
+    }
+}
+
+// Abre um arquivo do host com os modos do fopen numerados como na
+// especificação (r, rb, r+, r+b, w, wb, w+, w+b, a, ab, a+, a+b).
+uint32_t semi_open(const char *path, uint32_t mode) {
+    if (strcmp(path, ":tt") == 0) return mode < 4 ? SEMI_TT_IN : mode < 8 ? SEMI_TT_OUT : SEMI_TT_ERR;
+    uint32_t slot = 0;
+    while (slot < SEMI_MAX_FILES && machine->semi_files[slot] >= 0) slot++;
+    if (slot == SEMI_MAX_FILES || mode > 11) {
+        machine->semi_errno = slot == SEMI_MAX_FILES ? EMFILE : EINVAL;
+        return UINT32_MAX;
+    }
+    int fd;
+    if (strcmp(path, ":semihosting-features") == 0) {
+        FILE *f = tmpfile();
+        fd = -1;
+        if (f && fwrite(semi_features, 1, sizeof(semi_features), f) == sizeof(semi_features) && fflush(f) == 0) {
+            fd = dup(fileno(f));
+            if (fd >= 0) lseek(fd, 0, SEEK_SET);
+        }
+        if (f) fclose(f);
+    } else {
+        int plus = mode & 2, flags;
+        if (mode < 4) flags = plus ? O_RDWR : O_RDONLY;
+        else if (mode < 8) flags = (plus ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC;
+        else flags = (plus ? O_RDWR : O_WRONLY) | O_CREAT | O_APPEND;
+        if (machine->quiet && mode >= 4) path = "/dev/null";
+        fd = open(path, flags, 0666);
+    }
+    if (fd < 0) {
+        machine->semi_errno = errno;
+        return UINT32_MAX;
+    }
+    machine->semi_files[slot] = fd;
+    return SEMI_FIRST_FILE + slot;
+}
+
+// Entrada do console: o que já está no buffer da UART (inclusive o que está na
+// FIFO dela) e, se nada chegou, espera o host. Devolve quantos bytes leu.
+uint32_t semi_console_read(uint8_t *buf, uint32_t len) {
+    uint32_t n = 0;
+    while (n < len) {
+        uint32_t available = machine->uart_rx_tail - machine->uart_rx_head;
+        if (available == 0) {
+            if (n > 0 || machine->uart_rx_eof) break;
+            uart_host_fill();
+            if (machine->uart_rx_tail == machine->uart_rx_head) {
+                if (machine->uart_rx_fd < 0 || machine->uart_rx_eof) break;
+                struct pollfd p = { machine->uart_rx_fd, POLLIN, 0 };
+                poll(&p, 1, -1);
+            }
+            continue;
+        }
+        uint32_t k = available < len - n ? available : len - n;
+        memcpy(buf + n, machine->uart_rx_buf + machine->uart_rx_head, k);
+        machine->uart_rx_head += k;
+        machine->uart_rx_count -= k < machine->uart_rx_count ? k : machine->uart_rx_count;
+        n += k;
+    }
+    if (n > 0) {
+        uart_sync();
+        machine->uart_rx_activity = machine->uart_now;
+        uart_update_irq();
+    }
+    return n;
+}
+
+void semi_console_write(const uint8_t *data, uint32_t len) {
+    uart_host_flush();
+    uart_host_write(data, len);
+}
+
+// Escrita e leitura: devolvem quantos bytes NÃO foram transferidos.
+uint32_t semi_write(uint32_t handle, uint32_t address, uint32_t len) {
+    const uint8_t *p = semi_ram(address, len);
+    int fd = semi_file(handle);
+    if (!p) { machine->semi_errno = EFAULT; return len; }
+    if (handle == SEMI_TT_OUT || handle == SEMI_TT_ERR) {
+        semi_console_write(p, len);
+        return 0;
+    }
+    if (fd < 0) { machine->semi_errno = EBADF; return len; }
+    uint32_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, p + done, len - done);
+        if (n <= 0) { machine->semi_errno = errno; break; }
+        done += n;
+    }
+    return len - done;
+}
+
+uint32_t semi_read(uint32_t handle, uint32_t address, uint32_t len) {
+    uint8_t *p = semi_ram(address, len);
+    int fd = semi_file(handle);
+    uint32_t done = 0;
+    if (!p) { machine->semi_errno = EFAULT; return len; }
+    if (handle == SEMI_TT_IN) {
+        done = semi_console_read(p, len);
+    } else if (fd < 0) {
+        machine->semi_errno = EBADF;
+    } else {
+        while (done < len) {
+            ssize_t n = read(fd, p + done, len - done);
+            if (n < 0) machine->semi_errno = errno;
+            if (n <= 0) break;
+            done += n;
+        }
+    }
+    if (done) icache_invalidate_range(p - machine->memory, done);
+    ram_dirty(p - machine->memory, done);
+    return len - done;
+}
+
+// Executa a operação de a0 com o argumento de a1 e põe o resultado em a0.
+void semi_dispatch(uint32_t op, uint32_t arg) {
+    uint32_t args[3], result = UINT32_MAX;
+    uint8_t *p, *q;
+    char path[4096];
+    int fd;
+    struct stat st;
+
+    switch (op) {
+        case SEMI_SYS_OPEN:
+            if (!semi_args(arg, args, 3) || !(p = semi_ram(args[0], args[2]))) { machine->semi_errno = EFAULT; break; }
+            if (args[2] >= sizeof(path)) { machine->semi_errno = ENAMETOOLONG; break; }
+            memcpy(path, p, args[2]);
+            path[args[2]] = '\0';
+            result = semi_open(path, args[1]);
+            break;
+        case SEMI_SYS_CLOSE:
+            if (!semi_args(arg, args, 1)) { machine->semi_errno = EFAULT; break; }
+            if (args[0] >= SEMI_TT_IN && args[0] < SEMI_FIRST_FILE) { result = 0; break; }
+            if ((fd = semi_file(args[0])) < 0) { machine->semi_errno = EBADF; break; }
+            result = close(fd) == 0 ? 0 : UINT32_MAX;
+            machine->semi_files[args[0] - SEMI_FIRST_FILE] = -1;
+            break;
+        case SEMI_SYS_WRITEC:
+            if (!(p = semi_ram(arg, 1))) { machine->semi_errno = EFAULT; break; }
+            semi_console_write(p, 1);
+            result = 0;
+            break;
+        case SEMI_SYS_WRITE0:
+            if (!(p = semi_ram(arg, 1)) || !(q = memchr(p, 0, machine->memory + memory_size - p))) {
+                machine->semi_errno = EFAULT;
+                break;
+            }
+            semi_console_write(p, q - p);
+            result = 0;
+            break;
+        case SEMI_SYS_WRITE:
+            if (!semi_args(arg, args, 3)) { machine->semi_errno = EFAULT; break; }
+            result = semi_write(args[0], args[1], args[2]);
+            break;
+        case SEMI_SYS_READ:
+            if (!semi_args(arg, args, 3)) { machine->semi_errno = EFAULT; break; }
+            result = semi_read(args[0], args[1], args[2]);
+            break;
+        case SEMI_SYS_READC: {
+            uint8_t c;
+            if (semi_console_read(&c, 1)) result = c;
+            break;
+        }
+        case SEMI_SYS_ISTTY:
+            if (!semi_args(arg, args, 1)) { machine->semi_errno = EFAULT; break; }
+            result = args[0] >= SEMI_TT_IN && args[0] < SEMI_FIRST_FILE;
+            break;
+        case SEMI_SYS_SEEK:
+            if (!semi_args(arg, args, 2)) { machine->semi_errno = EFAULT; break; }
+            if ((fd = semi_file(args[0])) < 0) { machine->semi_errno = EBADF; break; }
+            if (lseek(fd, args[1], SEEK_SET) < 0) machine->semi_errno = errno;
+            else result = 0;
+            break;
+        case SEMI_SYS_FLEN:
+            if (!semi_args(arg, args, 1)) { machine->semi_errno = EFAULT; break; }
+            if ((fd = semi_file(args[0])) < 0) { machine->semi_errno = EBADF; break; }
+            if (fstat(fd, &st) != 0) machine->semi_errno = errno;
+            else result = st.st_size > INT32_MAX ? INT32_MAX : (uint32_t)st.st_size;
+            break;
+        case SEMI_SYS_ERRNO:
+            result = machine->semi_errno;
+            break;
+        case SEMI_SYS_EXIT:
+            // Em RV32 o motivo vem direto em a1; só a saída normal vale 0.
+            machine->exit_code = arg == SEMI_EXIT_NORMAL ? 0 : 1;
+            machine_halt(MACHINE_EXIT);
+            result = 0;
+            break;
+        case SEMI_SYS_EXIT_EXTENDED:
+            if (!semi_args(arg, args, 2)) { machine->semi_errno = EFAULT; break; }
+            machine->exit_code = args[0] == SEMI_EXIT_NORMAL ? (int)args[1] : 1;
+            machine_halt(MACHINE_EXIT);
+            result = 0;
+            break;
+        case SEMI_POXIM_MEMCPY:
+            if (!semi_args(arg, args, 3) || !(p = semi_ram(args[0], args[2])) || !(q = semi_ram(args[1], args[2]))) {
+                machine->semi_errno = EFAULT;
+                break;
+            }
+            memmove(p, q, args[2]);
+            if (args[2]) icache_invalidate_range(p - machine->memory, args[2]);
+            ram_dirty(p - machine->memory, args[2]);
+            result = args[0];
+            break;
+        case SEMI_POXIM_MEMSET:
+            if (!semi_args(arg, args, 3) || !(p = semi_ram(args[0], args[2]))) { machine->semi_errno = EFAULT; break; }
+            memset(p, (uint8_t)args[1], args[2]);
+            if (args[2]) icache_invalidate_range(p - machine->memory, args[2]);
+            ram_dirty(p - machine->memory, args[2]);
+            result = args[0];
+            break;
+        case SEMI_POXIM_STRLEN:
+            if (!semi_args(arg, args, 1) || !(p = semi_ram(args[0], 1)) ||
+                !(q = memchr(p, 0, machine->memory + memory_size - p))) {
+                machine->semi_errno = EFAULT;
+                break;
+            }
+            result = q - p;
+            break;
+        default:
+            machine->semi_errno = ENOSYS;
+            break;
+    }
+    hart->regs[10] = result;
 }
 
-int32_t get_imm_U(uint32_t instruction) {
-    return (int32_t)(instruction & 0xFFFFF000);
+// Chamada pelo ebreak: 1 se era uma chamada de semihosting (já atendida).
+int semihost_call(uint32_t current_pc) {
+    if (!machine->semihosting || hart->priv != PRIV_M || hart->translate || !semi_sequence(current_pc)) return 0;
+    mmio_enter();
+    semi_dispatch(hart->regs[10], hart->regs[11]);
+    mmio_leave();
+    return 1;
 }
 
-int32_t get_imm_J(uint32_t instruction) {
-    int32_t imm = (((instruction >> 31) & 0x1) << 20) |
-                  (((instruction >> 12) & 0xFF) << 12) |
-                  (((instruction >> 20) & 0x1) << 11) |
-                  (((instruction >> 21) & 0x3FF) << 1);
-    return (int32_t)(imm << 11) >> 11;
+// --- Funções de Decodificação ---
+// Instruções vêm de qualquer RAM ou ROM do mapa; MMIO e o resto são falha de
+// acesso. Com Sv32 o pc é traduzido antes.
+uint32_t fetch_instruction_from_pc() {
+    uint32_t paddr = hart->pc;
+    if (hart->pc % 4 == 0 && hart->translate && !mmu_translate(hart->pc, MMU_FETCH, &paddr, hart->pc)) return 0;
+    mem_region_t *r = (hart->pc % 4 == 0) ? mem_find(paddr, 4) : NULL;
+    if (!r || !r->host) {
+        trigger_trap(1, hart->pc, hart->pc);
+        return 0;
+    }
+    return mem_load_le(r->host + (paddr - r->base), 4);
 }
 
 // --- Decodificação e Execução ---
@@ -354,28 +2116,28 @@ void decode_and_execute(uint32_t instruction, uint32_t current_pc, char* details
     int32_t imm_u_sext = get_imm_U(instruction);
     int32_t imm_j_sext = get_imm_J(instruction);
 
-    uint32_t original_rs1_val = regs[rs1], original_rs2_val = regs[rs2];
+    uint32_t original_rs1_val = hart->regs[rs1], original_rs2_val = hart->regs[rs2];
     uint32_t effective_address;
     switch (opcode) {
         case 0x37:
-            if (rd != 0) regs[rd] = imm_u_sext;
-            sprintf(details_buffer, "lui    %s,0x%05x          %s=0x%08x", abi_name[rd], (imm_u_sext >> 12) & 0xFFFFF, abi_name[rd], rd != 0 ? regs[rd] : 0);
+            if (rd != 0) hart->regs[rd] = imm_u_sext;
+            sprintf(details_buffer, "lui    %s,0x%05x          %s=0x%08x", abi_name[rd], (imm_u_sext >> 12) & 0xFFFFF, abi_name[rd], rd != 0 ? hart->regs[rd] : 0);
             break;
         case 0x17:
-            if (rd != 0) regs[rd] = current_pc + imm_u_sext;
-            sprintf(details_buffer, "auipc  %s,0x%05x          %s=0x%08x+0x%08x=0x%08x", abi_name[rd], (imm_u_sext >> 12) & 0xFFFFF, abi_name[rd], current_pc, imm_u_sext, rd != 0 ? regs[rd] : 0);
+            if (rd != 0) hart->regs[rd] = current_pc + imm_u_sext;
+            sprintf(details_buffer, "auipc  %s,0x%05x          %s=0x%08x+0x%08x=0x%08x", abi_name[rd], (imm_u_sext >> 12) & 0xFFFFF, abi_name[rd], current_pc, imm_u_sext, rd != 0 ? hart->regs[rd] : 0);
             break;
         case 0x6F:
-            if (rd != 0) regs[rd] = current_pc + 4;
-            pc = current_pc + imm_j_sext;
-            sprintf(details_buffer, "jal    %s,0x%05x        pc=0x%08x,%s=0x%08x", abi_name[rd], (uint32_t)imm_j_sext & 0x1FFFFF, pc, abi_name[rd], rd != 0 ? regs[rd] : 0);
+            if (rd != 0) hart->regs[rd] = current_pc + 4;
+            hart->pc = current_pc + imm_j_sext;
+            sprintf(details_buffer, "jal    %s,0x%05x        pc=0x%08x,%s=0x%08x", abi_name[rd], (uint32_t)imm_j_sext & 0x1FFFFF, hart->pc, abi_name[rd], rd != 0 ? hart->regs[rd] : 0);
             break;
         case 0x67:
             {
                 uint32_t target_pc = (original_rs1_val + imm_i_sext) & ~1;
-                if (rd != 0) regs[rd] = current_pc + 4;
-                pc = target_pc;
-                sprintf(details_buffer, "jalr   %s,%s,0x%03x       pc=0x%08x+0x%08x,%s=0x%08x", abi_name[rd], abi_name[rs1], (uint32_t)imm_i_sext & 0xFFF, original_rs1_val, (uint32_t)imm_i_sext, abi_name[rd], rd != 0 ? regs[rd] : 0);
+                if (rd != 0) hart->regs[rd] = current_pc + 4;
+                hart->pc = target_pc;
+                sprintf(details_buffer, "jalr   %s,%s,0x%03x       pc=0x%08x+0x%08x,%s=0x%08x", abi_name[rd], abi_name[rs1], (uint32_t)imm_i_sext & 0xFFF, original_rs1_val, (uint32_t)imm_i_sext, abi_name[rd], rd != 0 ? hart->regs[rd] : 0);
             }
             break;
         case 0x63:
@@ -390,31 +2152,31 @@ void decode_and_execute(uint32_t instruction, uint32_t current_pc, char* details
                     case 0x7: op_name="bgeu"; if (original_rs1_val >= original_rs2_val) taken = 1; op_str = ">="; break;
                     default: trigger_trap(2, instruction, current_pc); return;
                 }
-                if (taken) pc = current_pc + imm_b_sext;
-                sprintf(details_buffer, "%-7s%s,%s,0x%03x       (%s(0x%08x)%s%s(0x%08x))=%u->pc=0x%08x", op_name, abi_name[rs1], abi_name[rs2], (uint32_t)imm_b_sext & 0x1FFF, (funct3 >= 6 ? "u" : ""), original_rs1_val, op_str, (funct3 >= 6 ? "u" : ""), original_rs2_val, taken, pc);
+                if (taken) hart->pc = current_pc + imm_b_sext;
+                sprintf(details_buffer, "%-7s%s,%s,0x%03x       (%s(0x%08x)%s%s(0x%08x))=%u->pc=0x%08x", op_name, abi_name[rs1], abi_name[rs2], (uint32_t)imm_b_sext & 0x1FFF, (funct3 >= 6 ? "u" : ""), original_rs1_val, op_str, (funct3 >= 6 ? "u" : ""), original_rs2_val, taken, hart->pc);
             }
             break;
         case 0x03:
             effective_address = original_rs1_val + imm_i_sext;
             const char* op_name_load = "?";
             switch (funct3) {
-                case 0x0: op_name_load="lb";  if(rd!=0) regs[rd] = (int32_t)(int8_t)memory_read_byte(effective_address, current_pc); break;
-                case 0x1: op_name_load="lh";  if(rd!=0) regs[rd] = (int32_t)(int16_t)memory_read_halfword(effective_address, current_pc); break;
-                case 0x2: op_name_load="lw";  if(rd!=0) regs[rd] = memory_read_word(effective_address, current_pc); break;
-                case 0x4: op_name_load="lbu"; if(rd!=0) regs[rd] = memory_read_byte(effective_address, current_pc); break;
-                case 0x5: op_name_load="lhu"; if(rd!=0) regs[rd] = memory_read_halfword(effective_address, current_pc); break;
+                case 0x0: op_name_load="lb";  if(rd!=0) hart->regs[rd] = (int32_t)(int8_t)memory_read_byte(effective_address, current_pc); break;
+                case 0x1: op_name_load="lh";  if(rd!=0) hart->regs[rd] = (int32_t)(int16_t)memory_read_halfword(effective_address, current_pc); break;
+                case 0x2: op_name_load="lw";  if(rd!=0) hart->regs[rd] = memory_read_word(effective_address, current_pc); break;
+                case 0x4: op_name_load="lbu"; if(rd!=0) hart->regs[rd] = memory_read_byte(effective_address, current_pc); break;
+                case 0x5: op_name_load="lhu"; if(rd!=0) hart->regs[rd] = memory_read_halfword(effective_address, current_pc); break;
                 default: trigger_trap(2, instruction, current_pc); return;
             }
-            if (!trap_pending_print) {
-                sprintf(details_buffer, "%-7s%s,0x%03x(%s)      %s=mem[0x%08x]=0x%08x", op_name_load, abi_name[rd], imm_i_sext & 0xFFF, abi_name[rs1], abi_name[rd], effective_address, rd != 0 ? regs[rd] : 0);
+            if (!hart->trap_pending_print) {
+                sprintf(details_buffer, "%-7s%s,0x%03x(%s)      %s=mem[0x%08x]=0x%08x", op_name_load, abi_name[rd], imm_i_sext & 0xFFF, abi_name[rs1], abi_name[rd], effective_address, rd != 0 ? hart->regs[rd] : 0);
             }
             break;
         case 0x23:
             effective_address = original_rs1_val + imm_s_sext;
             switch (funct3) {
-                case 0x0: memory_write_byte(effective_address, (uint8_t)original_rs2_val, current_pc); if(!trap_pending_print) sprintf(details_buffer, "sb     %s,0x%03x(%s)        mem[0x%08x]=0x%02x", abi_name[rs2], imm_s_sext & 0xFFF, abi_name[rs1], effective_address, original_rs2_val & 0xFF); break;
-                case 0x1: memory_write_halfword(effective_address, (uint16_t)original_rs2_val, current_pc); if(!trap_pending_print) sprintf(details_buffer, "sh     %s,0x%03x(%s)        mem[0x%08x]=0x%04x", abi_name[rs2], imm_s_sext & 0xFFF, abi_name[rs1], effective_address, original_rs2_val & 0xFFFF); break;
-                case 0x2: memory_write_word(effective_address, original_rs2_val, current_pc); if(!trap_pending_print) sprintf(details_buffer, "sw     %s,0x%03x(%s)        mem[0x%08x]=0x%08x", abi_name[rs2], imm_s_sext & 0xFFF, abi_name[rs1], effective_address, original_rs2_val); break;
+                case 0x0: memory_write_byte(effective_address, (uint8_t)original_rs2_val, current_pc); if(!hart->trap_pending_print) sprintf(details_buffer, "sb     %s,0x%03x(%s)        mem[0x%08x]=0x%02x", abi_name[rs2], imm_s_sext & 0xFFF, abi_name[rs1], effective_address, original_rs2_val & 0xFF); break;
+                case 0x1: memory_write_halfword(effective_address, (uint16_t)original_rs2_val, current_pc); if(!hart->trap_pending_print) sprintf(details_buffer, "sh     %s,0x%03x(%s)        mem[0x%08x]=0x%04x", abi_name[rs2], imm_s_sext & 0xFFF, abi_name[rs1], effective_address, original_rs2_val & 0xFFFF); break;
+                case 0x2: memory_write_word(effective_address, original_rs2_val, current_pc); if(!hart->trap_pending_print) sprintf(details_buffer, "sw     %s,0x%03x(%s)        mem[0x%08x]=0x%08x", abi_name[rs2], imm_s_sext & 0xFFF, abi_name[rs1], effective_address, original_rs2_val); break;
                 default: trigger_trap(2, instruction, current_pc); return;
             }
             break;
@@ -422,19 +2184,19 @@ void decode_and_execute(uint32_t instruction, uint32_t current_pc, char* details
              {
                 uint32_t result_val = 0;
                 switch (funct3) {
-                    case 0x0: result_val = original_rs1_val + imm_i_sext; if(rd!=0) regs[rd] = result_val; sprintf(details_buffer, "addi   %s,%s,0x%x       %s=0x%08x+0x%08x=0x%08x", abi_name[rd], abi_name[rs1], (uint32_t)imm_i_sext & 0xFFF, abi_name[rd], original_rs1_val, imm_i_sext, result_val); break;
-                    case 0x1: { uint32_t shamt = imm_i_sext & 0x1F; result_val = original_rs1_val << shamt; if(rd!=0) regs[rd] = result_val; sprintf(details_buffer, "slli   %s,%s,%d          %s=0x%08x<<%d=0x%08x", abi_name[rd], abi_name[rs1], shamt, abi_name[rd], original_rs1_val, shamt, result_val); } break;
-                    case 0x2: result_val = ((int32_t)original_rs1_val < imm_i_sext) ? 1 : 0; if(rd!=0) regs[rd] = result_val; sprintf(details_buffer, "slti   %s,%s,%d       %s=(0x%08x<%d)=%u", abi_name[rd], abi_name[rs1], imm_i_sext, abi_name[rd], original_rs1_val, imm_i_sext, result_val); break;
-                    case 0x3: result_val = (original_rs1_val < (uint32_t)imm_i_sext) ? 1 : 0; if(rd!=0) regs[rd] = result_val; sprintf(details_buffer, "sltiu  %s,%s,%d       %s=(0x%08x<%u)=%u", abi_name[rd], abi_name[rs1], imm_i_sext, abi_name[rd], original_rs1_val, (uint32_t)imm_i_sext, result_val); break;
-                    case 0x4: result_val = original_rs1_val ^ imm_i_sext; if(rd!=0) regs[rd] = result_val; sprintf(details_buffer, "xori   %s,%s,0x%03x       %s=0x%08x^0x%03x=0x%08x", abi_name[rd], abi_name[rs1], imm_i_sext & 0xFFF, abi_name[rd], original_rs1_val, imm_i_sext & 0xFFF, result_val); break;
+                    case 0x0: result_val = original_rs1_val + imm_i_sext; if(rd!=0) hart->regs[rd] = result_val; sprintf(details_buffer, "addi   %s,%s,0x%x       %s=0x%08x+0x%08x=0x%08x", abi_name[rd], abi_name[rs1], (uint32_t)imm_i_sext & 0xFFF, abi_name[rd], original_rs1_val, imm_i_sext, result_val); break;
+                    case 0x1: { uint32_t shamt = imm_i_sext & 0x1F; result_val = original_rs1_val << shamt; if(rd!=0) hart->regs[rd] = result_val; sprintf(details_buffer, "slli   %s,%s,%d          %s=0x%08x<<%d=0x%08x", abi_name[rd], abi_name[rs1], shamt, abi_name[rd], original_rs1_val, shamt, result_val); } break;
+                    case 0x2: result_val = ((int32_t)original_rs1_val < imm_i_sext) ? 1 : 0; if(rd!=0) hart->regs[rd] = result_val; sprintf(details_buffer, "slti   %s,%s,%d       %s=(0x%08x<%d)=%u", abi_name[rd], abi_name[rs1], imm_i_sext, abi_name[rd], original_rs1_val, imm_i_sext, result_val); break;
+                    case 0x3: result_val = (original_rs1_val < (uint32_t)imm_i_sext) ? 1 : 0; if(rd!=0) hart->regs[rd] = result_val; sprintf(details_buffer, "sltiu  %s,%s,%d       %s=(0x%08x<%u)=%u", abi_name[rd], abi_name[rs1], imm_i_sext, abi_name[rd], original_rs1_val, (uint32_t)imm_i_sext, result_val); break;
+                    case 0x4: result_val = original_rs1_val ^ imm_i_sext; if(rd!=0) hart->regs[rd] = result_val; sprintf(details_buffer, "xori   %s,%s,0x%03x       %s=0x%08x^0x%03x=0x%08x", abi_name[rd], abi_name[rs1], imm_i_sext & 0xFFF, abi_name[rd], original_rs1_val, imm_i_sext & 0xFFF, result_val); break;
                     case 0x5:
                         {
                             uint32_t shamt = imm_i_sext & 0x1F;
-                            if ((instruction >> 30) == 0x00) { result_val = original_rs1_val >> shamt; if(rd!=0) regs[rd] = result_val; sprintf(details_buffer, "srli   %s,%s,%d          %s=0x%08x>>%d=0x%08x", abi_name[rd], abi_name[rs1], shamt, abi_name[rd], original_rs1_val, shamt, result_val); }
-                            else { result_val = (int32_t)original_rs1_val >> shamt; if(rd!=0) regs[rd] = result_val; sprintf(details_buffer, "srai   %s,%s,%d          %s=0x%08x>>>%d=0x%08x", abi_name[rd], abi_name[rs1], shamt, abi_name[rd], original_rs1_val, shamt, result_val); }
+                            if ((instruction >> 30) == 0x00) { result_val = original_rs1_val >> shamt; if(rd!=0) hart->regs[rd] = result_val; sprintf(details_buffer, "srli   %s,%s,%d          %s=0x%08x>>%d=0x%08x", abi_name[rd], abi_name[rs1], shamt, abi_name[rd], original_rs1_val, shamt, result_val); }
+                            else { result_val = (int32_t)original_rs1_val >> shamt; if(rd!=0) hart->regs[rd] = result_val; sprintf(details_buffer, "srai   %s,%s,%d          %s=0x%08x>>>%d=0x%08x", abi_name[rd], abi_name[rs1], shamt, abi_name[rd], original_rs1_val, shamt, result_val); }
                         } break;
-                    case 0x6: result_val = original_rs1_val | imm_i_sext; if(rd!=0) regs[rd] = result_val; sprintf(details_buffer, "ori    %s,%s,0x%03x       %s=0x%08x|0x%03x=0x%08x", abi_name[rd], abi_name[rs1], imm_i_sext & 0xFFF, abi_name[rd], original_rs1_val, imm_i_sext & 0xFFF, result_val); break;
-                    case 0x7: result_val = original_rs1_val & imm_i_sext; if(rd!=0) regs[rd] = result_val; sprintf(details_buffer, "andi   %s,%s,0x%03x       %s=0x%08x&0x%03x=0x%08x", abi_name[rd], abi_name[rs1], imm_i_sext & 0xFFF, abi_name[rd], original_rs1_val, imm_i_sext & 0xFFF, result_val); break;
+                    case 0x6: result_val = original_rs1_val | imm_i_sext; if(rd!=0) hart->regs[rd] = result_val; sprintf(details_buffer, "ori    %s,%s,0x%03x       %s=0x%08x|0x%03x=0x%08x", abi_name[rd], abi_name[rs1], imm_i_sext & 0xFFF, abi_name[rd], original_rs1_val, imm_i_sext & 0xFFF, result_val); break;
+                    case 0x7: result_val = original_rs1_val & imm_i_sext; if(rd!=0) hart->regs[rd] = result_val; sprintf(details_buffer, "andi   %s,%s,0x%03x       %s=0x%08x&0x%03x=0x%08x", abi_name[rd], abi_name[rs1], imm_i_sext & 0xFFF, abi_name[rd], original_rs1_val, imm_i_sext & 0xFFF, result_val); break;
                     default: trigger_trap(2, instruction, current_pc); return;
                 }
             }
@@ -444,27 +2206,27 @@ void decode_and_execute(uint32_t instruction, uint32_t current_pc, char* details
                 uint32_t result_val = 0;
                 if (funct7 == 0x01) {
                     switch (funct3) {
-                        case 0x0: result_val = (int32_t)original_rs1_val * (int32_t)original_rs2_val; if(rd!=0) regs[rd] = result_val; sprintf(details_buffer, "mul    %s,%s,%s         %s=0x%08x*0x%08x=0x%08x", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, original_rs2_val, result_val); break;
-                        case 0x1: result_val = (uint32_t)(((int64_t)(int32_t)original_rs1_val * (int64_t)(int32_t)original_rs2_val) >> 32); if(rd!=0) regs[rd] = result_val; sprintf(details_buffer, "mulh   %s,%s,%s         %s=0x%08x*0x%08x=0x%08x", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, original_rs2_val, result_val); break;
-                        case 0x2: result_val = (uint32_t)(((int64_t)(int32_t)original_rs1_val * (uint64_t)original_rs2_val) >> 32); if(rd!=0) regs[rd] = result_val; sprintf(details_buffer, "mulhsu %s,%s,%s         %s=0x%08x*0x%08x=0x%08x", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, original_rs2_val, result_val); break;
-                        case 0x3: result_val = (uint32_t)(((uint64_t)original_rs1_val * (uint64_t)original_rs2_val) >> 32); if(rd!=0) regs[rd] = result_val; sprintf(details_buffer, "mulhu  %s,%s,%s         %s=0x%08x*0x%08x=0x%08x", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, original_rs2_val, result_val); break;
-                        case 0x4: if (original_rs2_val == 0) result_val = -1; else if (original_rs1_val == 0x80000000 && original_rs2_val == 0xFFFFFFFF) result_val = 0x80000000; else result_val = (int32_t)original_rs1_val / (int32_t)original_rs2_val; if(rd!=0) regs[rd] = result_val; sprintf(details_buffer, "div    %s,%s,%s         %s=0x%08x/0x%08x=0x%08x", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, original_rs2_val, result_val); break;
-                        case 0x5: if (original_rs2_val == 0) result_val = 0xFFFFFFFF; else result_val = original_rs1_val / original_rs2_val; if(rd!=0) regs[rd] = result_val; sprintf(details_buffer, "divu   %s,%s,%s         %s=0x%08x/0x%08x=0x%08x", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, original_rs2_val, result_val); break;
-                        case 0x6: if (original_rs2_val == 0) result_val = original_rs1_val; else if (original_rs1_val == 0x80000000 && original_rs2_val == 0xFFFFFFFF) result_val = 0; else result_val = (int32_t)original_rs1_val % (int32_t)original_rs2_val; if(rd!=0) regs[rd] = result_val; sprintf(details_buffer, "rem    %s,%s,%s         %s=0x%08x%%0x%08x=0x%08x", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, original_rs2_val, result_val); break;
-                        case 0x7: if (original_rs2_val == 0) result_val = original_rs1_val; else result_val = original_rs1_val % original_rs2_val; if(rd!=0) regs[rd] = result_val; sprintf(details_buffer, "remu   %s,%s,%s         %s=0x%08x%%0x%08x=0x%08x", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, original_rs2_val, result_val); break;
+                        case 0x0: result_val = (int32_t)original_rs1_val * (int32_t)original_rs2_val; if(rd!=0) hart->regs[rd] = result_val; sprintf(details_buffer, "mul    %s,%s,%s         %s=0x%08x*0x%08x=0x%08x", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, original_rs2_val, result_val); break;
+                        case 0x1: result_val = (uint32_t)(((int64_t)(int32_t)original_rs1_val * (int64_t)(int32_t)original_rs2_val) >> 32); if(rd!=0) hart->regs[rd] = result_val; sprintf(details_buffer, "mulh   %s,%s,%s         %s=0x%08x*0x%08x=0x%08x", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, original_rs2_val, result_val); break;
+                        case 0x2: result_val = (uint32_t)(((int64_t)(int32_t)original_rs1_val * (uint64_t)original_rs2_val) >> 32); if(rd!=0) hart->regs[rd] = result_val; sprintf(details_buffer, "mulhsu %s,%s,%s         %s=0x%08x*0x%08x=0x%08x", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, original_rs2_val, result_val); break;
+                        case 0x3: result_val = (uint32_t)(((uint64_t)original_rs1_val * (uint64_t)original_rs2_val) >> 32); if(rd!=0) hart->regs[rd] = result_val; sprintf(details_buffer, "mulhu  %s,%s,%s         %s=0x%08x*0x%08x=0x%08x", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, original_rs2_val, result_val); break;
+                        case 0x4: if (original_rs2_val == 0) result_val = -1; else if (original_rs1_val == 0x80000000 && original_rs2_val == 0xFFFFFFFF) result_val = 0x80000000; else result_val = (int32_t)original_rs1_val / (int32_t)original_rs2_val; if(rd!=0) hart->regs[rd] = result_val; sprintf(details_buffer, "div    %s,%s,%s         %s=0x%08x/0x%08x=0x%08x", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, original_rs2_val, result_val); break;
+                        case 0x5: if (original_rs2_val == 0) result_val = 0xFFFFFFFF; else result_val = original_rs1_val / original_rs2_val; if(rd!=0) hart->regs[rd] = result_val; sprintf(details_buffer, "divu   %s,%s,%s         %s=0x%08x/0x%08x=0x%08x", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, original_rs2_val, result_val); break;
+                        case 0x6: if (original_rs2_val == 0) result_val = original_rs1_val; else if (original_rs1_val == 0x80000000 && original_rs2_val == 0xFFFFFFFF) result_val = 0; else result_val = (int32_t)original_rs1_val % (int32_t)original_rs2_val; if(rd!=0) hart->regs[rd] = result_val; sprintf(details_buffer, "rem    %s,%s,%s         %s=0x%08x%%0x%08x=0x%08x", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, original_rs2_val, result_val); break;
+                        case 0x7: if (original_rs2_val == 0) result_val = original_rs1_val; else result_val = original_rs1_val % original_rs2_val; if(rd!=0) hart->regs[rd] = result_val; sprintf(details_buffer, "remu   %s,%s,%s         %s=0x%08x%%0x%08x=0x%08x", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, original_rs2_val, result_val); break;
                         default: trigger_trap(2, instruction, current_pc); return;
                     }
                 } else {
                     uint32_t shamt = original_rs2_val & 0x1F;
                     switch (funct3) {
-                        case 0x0: if (funct7 == 0x20) { result_val = original_rs1_val - original_rs2_val; if(rd!=0) regs[rd] = result_val; sprintf(details_buffer, "sub    %s,%s,%s         %s=0x%08x-0x%08x=0x%08x", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, original_rs2_val, result_val);} else { result_val = original_rs1_val + original_rs2_val; if(rd!=0) regs[rd] = result_val; sprintf(details_buffer, "add    %s,%s,%s         %s=0x%08x+0x%08x=0x%08x", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, original_rs2_val, result_val); } break;
-                        case 0x1: result_val = original_rs1_val << shamt; if(rd!=0) regs[rd] = result_val; sprintf(details_buffer, "sll    %s,%s,%s         %s=0x%08x<<%d=0x%08x", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, shamt, result_val); break;
-                        case 0x2: result_val = ((int32_t)original_rs1_val < (int32_t)original_rs2_val) ? 1 : 0; if(rd!=0) regs[rd] = result_val; sprintf(details_buffer, "slt    %s,%s,%s         %s=(0x%08x<0x%08x)=%u", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, original_rs2_val, result_val); break;
-                        case 0x3: result_val = (original_rs1_val < original_rs2_val) ? 1 : 0; if(rd!=0) regs[rd] = result_val; sprintf(details_buffer, "sltu   %s,%s,%s         %s=(0x%08x<0x%08x)=%u", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, original_rs2_val, result_val); break;
-                        case 0x4: result_val = original_rs1_val ^ original_rs2_val; if(rd!=0) regs[rd] = result_val; sprintf(details_buffer, "xor    %s,%s,%s         %s=0x%08x^0x%08x=0x%08x", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, original_rs2_val, result_val); break;
-                        case 0x5: if (funct7 == 0x20) { result_val = (int32_t)original_rs1_val >> shamt; if(rd!=0) regs[rd] = result_val; sprintf(details_buffer, "sra    %s,%s,%s         %s=0x%08x>>>%d=0x%08x", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, shamt, result_val); } else { result_val = original_rs1_val >> shamt; if(rd!=0) regs[rd] = result_val; sprintf(details_buffer, "srl    %s,%s,%s         %s=0x%08x>>%d=0x%08x", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, shamt, result_val); } break;
-                        case 0x6: result_val = original_rs1_val | original_rs2_val; if(rd!=0) regs[rd] = result_val; sprintf(details_buffer, "or     %s,%s,%s         %s=0x%08x|0x%08x=0x%08x", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, original_rs2_val, result_val); break;
-                        case 0x7: result_val = original_rs1_val & original_rs2_val; if(rd!=0) regs[rd] = result_val; sprintf(details_buffer, "and    %s,%s,%s         %s=0x%08x&0x%08x=0x%08x", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, original_rs2_val, result_val); break;
+                        case 0x0: if (funct7 == 0x20) { result_val = original_rs1_val - original_rs2_val; if(rd!=0) hart->regs[rd] = result_val; sprintf(details_buffer, "sub    %s,%s,%s         %s=0x%08x-0x%08x=0x%08x", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, original_rs2_val, result_val);} else { result_val = original_rs1_val + original_rs2_val; if(rd!=0) hart->regs[rd] = result_val; sprintf(details_buffer, "add    %s,%s,%s         %s=0x%08x+0x%08x=0x%08x", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, original_rs2_val, result_val); } break;
+                        case 0x1: result_val = original_rs1_val << shamt; if(rd!=0) hart->regs[rd] = result_val; sprintf(details_buffer, "sll    %s,%s,%s         %s=0x%08x<<%d=0x%08x", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, shamt, result_val); break;
+                        case 0x2: result_val = ((int32_t)original_rs1_val < (int32_t)original_rs2_val) ? 1 : 0; if(rd!=0) hart->regs[rd] = result_val; sprintf(details_buffer, "slt    %s,%s,%s         %s=(0x%08x<0x%08x)=%u", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, original_rs2_val, result_val); break;
+                        case 0x3: result_val = (original_rs1_val < original_rs2_val) ? 1 : 0; if(rd!=0) hart->regs[rd] = result_val; sprintf(details_buffer, "sltu   %s,%s,%s         %s=(0x%08x<0x%08x)=%u", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, original_rs2_val, result_val); break;
+                        case 0x4: result_val = original_rs1_val ^ original_rs2_val; if(rd!=0) hart->regs[rd] = result_val; sprintf(details_buffer, "xor    %s,%s,%s         %s=0x%08x^0x%08x=0x%08x", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, original_rs2_val, result_val); break;
+                        case 0x5: if (funct7 == 0x20) { result_val = (int32_t)original_rs1_val >> shamt; if(rd!=0) hart->regs[rd] = result_val; sprintf(details_buffer, "sra    %s,%s,%s         %s=0x%08x>>>%d=0x%08x", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, shamt, result_val); } else { result_val = original_rs1_val >> shamt; if(rd!=0) hart->regs[rd] = result_val; sprintf(details_buffer, "srl    %s,%s,%s         %s=0x%08x>>%d=0x%08x", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, shamt, result_val); } break;
+                        case 0x6: result_val = original_rs1_val | original_rs2_val; if(rd!=0) hart->regs[rd] = result_val; sprintf(details_buffer, "or     %s,%s,%s         %s=0x%08x|0x%08x=0x%08x", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, original_rs2_val, result_val); break;
+                        case 0x7: result_val = original_rs1_val & original_rs2_val; if(rd!=0) hart->regs[rd] = result_val; sprintf(details_buffer, "and    %s,%s,%s         %s=0x%08x&0x%08x=0x%08x", abi_name[rd], abi_name[rs1], abi_name[rs2], abi_name[rd], original_rs1_val, original_rs2_val, result_val); break;
                         default: trigger_trap(2, instruction, current_pc); return;
                     }
                 }
@@ -474,31 +2236,38 @@ void decode_and_execute(uint32_t instruction, uint32_t current_pc, char* details
             {
                 uint32_t csr_addr = (uint32_t)imm_i_sext & 0xFFF;
                 uint32_t uimm = rs1;
+                if (funct3 != 0x0 && !csr_allowed(csr_addr)) { trigger_trap(2, instruction, current_pc); return; }
                 switch(funct3) {
                     case 0x0:
-                        if (imm_i_sext == 0x0) { sprintf(details_buffer, "ecall"); trigger_trap(11, 0, current_pc); }
-                        else if (imm_i_sext == 0x1) { sprintf(details_buffer, "ebreak"); halt_flag = 1; mcause = 3; mepc = current_pc; }
-                        else if (imm_i_sext == 0x302) {
-                             pc = mepc;
-                             uint32_t prev_mstatus = mstatus;
-                             mstatus &= ~(1 << 7);
-                             mstatus |= ((prev_mstatus >> 3) & 1) << 3;
-                             sprintf(details_buffer, "mret                       pc=0x%08x", pc);
+                        if (imm_i_sext == 0x0) { sprintf(details_buffer, "ecall"); trigger_trap(8 + hart->priv, 0, current_pc); }
+                        else if (imm_i_sext == 0x1) {
+                            sprintf(details_buffer, "ebreak");
+                            if (!semihost_call(current_pc)) { machine_halt(MACHINE_EBREAK); hart->mcause = 3; hart->mepc = current_pc; }
                         }
+                        else if (imm_i_sext == 0x302 && hart->priv == PRIV_M) {
+                             mret_execute();
+                             sprintf(details_buffer, "mret                       pc=0x%08x", hart->pc);
+                        }
+                        else if (imm_i_sext == 0x102 && priv_allowed(MSTATUS_TSR)) {
+                             sret_execute();
+                             sprintf(details_buffer, "sret                       pc=0x%08x", hart->pc);
+                        }
+                        else if (imm_i_sext == 0x105 && priv_allowed(MSTATUS_TW)) { sprintf(details_buffer, "wfi"); wait_for_interrupt(current_pc); }
+                        else if (funct7 == 0x09 && rd == 0 && priv_allowed(MSTATUS_TVM)) { sprintf(details_buffer, "sfence.vma"); tlb_flush(hart); }
                         else { trigger_trap(2, instruction, current_pc); }
                         break;
                     case 0x1:
-                         { uint32_t temp = read_csr(csr_addr); if (rd != 0) regs[rd] = temp; write_csr(csr_addr, original_rs1_val); sprintf(details_buffer, "csrrw  %s,%s,%s       %s=%s=0x%08x,%s=0x%08x", abi_name[rd], get_csr_name(csr_addr), abi_name[rs1], abi_name[rd], get_csr_name(csr_addr), temp, get_csr_name(csr_addr), original_rs1_val); } break;
+                         { uint32_t temp = read_csr(csr_addr); if (rd != 0) hart->regs[rd] = temp; write_csr(csr_addr, original_rs1_val); sprintf(details_buffer, "csrrw  %s,%s,%s       %s=%s=0x%08x,%s=0x%08x", abi_name[rd], get_csr_name(csr_addr), abi_name[rs1], abi_name[rd], get_csr_name(csr_addr), temp, get_csr_name(csr_addr), original_rs1_val); } break;
                     case 0x2:
-                         { uint32_t temp = read_csr(csr_addr); if (rd != 0) regs[rd] = temp; if(rs1 != 0) write_csr(csr_addr, temp | original_rs1_val); sprintf(details_buffer, "csrrs  %s,%s,%s      %s=%s=0x%08x,%s|=0x%08x=0x%08x", abi_name[rd], get_csr_name(csr_addr), abi_name[rs1], abi_name[rd],get_csr_name(csr_addr), temp, get_csr_name(csr_addr), original_rs1_val, read_csr(csr_addr)); } break;
+                         { uint32_t temp = read_csr(csr_addr); if (rd != 0) hart->regs[rd] = temp; if(rs1 != 0) write_csr(csr_addr, temp | original_rs1_val); sprintf(details_buffer, "csrrs  %s,%s,%s      %s=%s=0x%08x,%s|=0x%08x=0x%08x", abi_name[rd], get_csr_name(csr_addr), abi_name[rs1], abi_name[rd],get_csr_name(csr_addr), temp, get_csr_name(csr_addr), original_rs1_val, read_csr(csr_addr)); } break;
                     case 0x3:
-                         { uint32_t temp = read_csr(csr_addr); if (rd != 0) regs[rd] = temp; if(rs1 != 0) write_csr(csr_addr, temp & ~original_rs1_val); sprintf(details_buffer, "csrrc  %s,%s,%s       %s=%s=0x%08x,%s&=~0x%08x=0x%08x", abi_name[rd], get_csr_name(csr_addr), abi_name[rs1], abi_name[rd],get_csr_name(csr_addr), temp, get_csr_name(csr_addr), original_rs1_val, read_csr(csr_addr)); } break;
+                         { uint32_t temp = read_csr(csr_addr); if (rd != 0) hart->regs[rd] = temp; if(rs1 != 0) write_csr(csr_addr, temp & ~original_rs1_val); sprintf(details_buffer, "csrrc  %s,%s,%s       %s=%s=0x%08x,%s&=~0x%08x=0x%08x", abi_name[rd], get_csr_name(csr_addr), abi_name[rs1], abi_name[rd],get_csr_name(csr_addr), temp, get_csr_name(csr_addr), original_rs1_val, read_csr(csr_addr)); } break;
                     case 0x5:
-                         { uint32_t temp = read_csr(csr_addr); if (rd != 0) regs[rd] = temp; write_csr(csr_addr, uimm); sprintf(details_buffer, "csrrwi %s,%s,%u      %s=%s=0x%08x,%s=%u", abi_name[rd], get_csr_name(csr_addr), uimm, abi_name[rd], get_csr_name(csr_addr), temp, get_csr_name(csr_addr), uimm); } break;
+                         { uint32_t temp = read_csr(csr_addr); if (rd != 0) hart->regs[rd] = temp; write_csr(csr_addr, uimm); sprintf(details_buffer, "csrrwi %s,%s,%u      %s=%s=0x%08x,%s=%u", abi_name[rd], get_csr_name(csr_addr), uimm, abi_name[rd], get_csr_name(csr_addr), temp, get_csr_name(csr_addr), uimm); } break;
                     case 0x6:
-                         { uint32_t temp = read_csr(csr_addr); if (rd != 0) regs[rd] = temp; if(uimm != 0) write_csr(csr_addr, temp | uimm); sprintf(details_buffer, "csrrsi %s,%s,%u      %s=%s=0x%08x,%s|=%u=0x%08x", abi_name[rd], get_csr_name(csr_addr), uimm, abi_name[rd], get_csr_name(csr_addr), temp, get_csr_name(csr_addr), uimm, read_csr(csr_addr)); } break;
+                         { uint32_t temp = read_csr(csr_addr); if (rd != 0) hart->regs[rd] = temp; if(uimm != 0) write_csr(csr_addr, temp | uimm); sprintf(details_buffer, "csrrsi %s,%s,%u      %s=%s=0x%08x,%s|=%u=0x%08x", abi_name[rd], get_csr_name(csr_addr), uimm, abi_name[rd], get_csr_name(csr_addr), temp, get_csr_name(csr_addr), uimm, read_csr(csr_addr)); } break;
                     case 0x7:
-                         { uint32_t temp = read_csr(csr_addr); if (rd != 0) regs[rd] = temp; if(uimm != 0) write_csr(csr_addr, temp & ~uimm); sprintf(details_buffer, "csrrci %s,%s,%u      %s=%s=0x%08x,csr&=~%u=0x%08x", abi_name[rd], get_csr_name(csr_addr), uimm, abi_name[rd], get_csr_name(csr_addr), temp, uimm, read_csr(csr_addr)); } break;
+                         { uint32_t temp = read_csr(csr_addr); if (rd != 0) hart->regs[rd] = temp; if(uimm != 0) write_csr(csr_addr, temp & ~uimm); sprintf(details_buffer, "csrrci %s,%s,%u      %s=%s=0x%08x,csr&=~%u=0x%08x", abi_name[rd], get_csr_name(csr_addr), uimm, abi_name[rd], get_csr_name(csr_addr), temp, uimm, read_csr(csr_addr)); } break;
                     default: trigger_trap(2, instruction, current_pc); return;
                 }
             }
@@ -507,175 +2276,5439 @@ void decode_and_execute(uint32_t instruction, uint32_t current_pc, char* details
             if (funct3 == 0x0) sprintf(details_buffer, "fence");
             else if (funct3 == 0x1) sprintf(details_buffer, "fence.i");
             break;
+        case 0x2F:
+            {
+                uint32_t result_val;
+                if (funct3 != 0x2 || !amo_name(funct7 >> 2)) { trigger_trap(2, instruction, current_pc); return; }
+                if (!amo_execute(funct7 >> 2, original_rs1_val, original_rs2_val, &result_val, current_pc)) return;
+                if (rd != 0) hart->regs[rd] = result_val;
+                trace_info_t t = { current_pc, instruction, original_rs1_val, original_rs2_val, result_val, hart->pc, 0, 0 };
+                format_trace_details(&t, details_buffer);
+            }
+            break;
         default:
             trigger_trap(2, instruction, current_pc);
     }
-    regs[0] = 0;
+    hart->regs[0] = 0;
+}
+
+// --- Handlers do Cache de Instruções ---
+// Mesma semântica de decode_and_execute(), separada por instrução. Os handlers
+// não formatam nada: o trace é montado depois por format_trace_details().
+// Escritas em rd == 0 são desfeitas pelo laço principal (regs[0] = 0).
+void exec_lui(const decoded_insn_t *d, uint32_t current_pc) { (void)current_pc; hart->regs[d->rd] = d->imm; }
+void exec_auipc(const decoded_insn_t *d, uint32_t current_pc) { hart->regs[d->rd] = current_pc + d->imm; }
+void exec_jal(const decoded_insn_t *d, uint32_t current_pc) { hart->regs[d->rd] = current_pc + 4; hart->pc = current_pc + d->imm; }
+void exec_jalr(const decoded_insn_t *d, uint32_t current_pc) {
+    uint32_t target_pc = (hart->regs[d->rs1] + d->imm) & ~1;
+    hart->regs[d->rd] = current_pc + 4;
+    hart->pc = target_pc;
+}
+
+void exec_beq(const decoded_insn_t *d, uint32_t current_pc)  { if (hart->regs[d->rs1] == hart->regs[d->rs2]) hart->pc = current_pc + d->imm; }
+void exec_bne(const decoded_insn_t *d, uint32_t current_pc)  { if (hart->regs[d->rs1] != hart->regs[d->rs2]) hart->pc = current_pc + d->imm; }
+void exec_blt(const decoded_insn_t *d, uint32_t current_pc)  { if ((int32_t)hart->regs[d->rs1] < (int32_t)hart->regs[d->rs2]) hart->pc = current_pc + d->imm; }
+void exec_bge(const decoded_insn_t *d, uint32_t current_pc)  { if ((int32_t)hart->regs[d->rs1] >= (int32_t)hart->regs[d->rs2]) hart->pc = current_pc + d->imm; }
+void exec_bltu(const decoded_insn_t *d, uint32_t current_pc) { if (hart->regs[d->rs1] < hart->regs[d->rs2]) hart->pc = current_pc + d->imm; }
+void exec_bgeu(const decoded_insn_t *d, uint32_t current_pc) { if (hart->regs[d->rs1] >= hart->regs[d->rs2]) hart->pc = current_pc + d->imm; }
+
+void exec_lb(const decoded_insn_t *d, uint32_t current_pc)  { hart->regs[d->rd] = (int32_t)(int8_t)memory_read_byte(hart->regs[d->rs1] + d->imm, current_pc); }
+void exec_lh(const decoded_insn_t *d, uint32_t current_pc)  { hart->regs[d->rd] = (int32_t)(int16_t)memory_read_halfword(hart->regs[d->rs1] + d->imm, current_pc); }
+void exec_lw(const decoded_insn_t *d, uint32_t current_pc)  { hart->regs[d->rd] = memory_read_word(hart->regs[d->rs1] + d->imm, current_pc); }
+void exec_lbu(const decoded_insn_t *d, uint32_t current_pc) { hart->regs[d->rd] = memory_read_byte(hart->regs[d->rs1] + d->imm, current_pc); }
+void exec_lhu(const decoded_insn_t *d, uint32_t current_pc) { hart->regs[d->rd] = memory_read_halfword(hart->regs[d->rs1] + d->imm, current_pc); }
+
+void exec_sb(const decoded_insn_t *d, uint32_t current_pc) { memory_write_byte(hart->regs[d->rs1] + d->imm, (uint8_t)hart->regs[d->rs2], current_pc); }
+void exec_sh(const decoded_insn_t *d, uint32_t current_pc) { memory_write_halfword(hart->regs[d->rs1] + d->imm, (uint16_t)hart->regs[d->rs2], current_pc); }
+void exec_sw(const decoded_insn_t *d, uint32_t current_pc) { memory_write_word(hart->regs[d->rs1] + d->imm, hart->regs[d->rs2], current_pc); }
+
+void exec_addi(const decoded_insn_t *d, uint32_t current_pc)  { (void)current_pc; hart->regs[d->rd] = hart->regs[d->rs1] + d->imm; }
+void exec_slli(const decoded_insn_t *d, uint32_t current_pc)  { (void)current_pc; hart->regs[d->rd] = hart->regs[d->rs1] << d->imm; }
+void exec_slti(const decoded_insn_t *d, uint32_t current_pc)  { (void)current_pc; hart->regs[d->rd] = ((int32_t)hart->regs[d->rs1] < d->imm) ? 1 : 0; }
+void exec_sltiu(const decoded_insn_t *d, uint32_t current_pc) { (void)current_pc; hart->regs[d->rd] = (hart->regs[d->rs1] < (uint32_t)d->imm) ? 1 : 0; }
+void exec_xori(const decoded_insn_t *d, uint32_t current_pc)  { (void)current_pc; hart->regs[d->rd] = hart->regs[d->rs1] ^ d->imm; }
+void exec_srli(const decoded_insn_t *d, uint32_t current_pc)  { (void)current_pc; hart->regs[d->rd] = hart->regs[d->rs1] >> d->imm; }
+void exec_srai(const decoded_insn_t *d, uint32_t current_pc)  { (void)current_pc; hart->regs[d->rd] = (int32_t)hart->regs[d->rs1] >> d->imm; }
+void exec_ori(const decoded_insn_t *d, uint32_t current_pc)   { (void)current_pc; hart->regs[d->rd] = hart->regs[d->rs1] | d->imm; }
+void exec_andi(const decoded_insn_t *d, uint32_t current_pc)  { (void)current_pc; hart->regs[d->rd] = hart->regs[d->rs1] & d->imm; }
+
+void exec_add(const decoded_insn_t *d, uint32_t current_pc)  { (void)current_pc; hart->regs[d->rd] = hart->regs[d->rs1] + hart->regs[d->rs2]; }
+void exec_sub(const decoded_insn_t *d, uint32_t current_pc)  { (void)current_pc; hart->regs[d->rd] = hart->regs[d->rs1] - hart->regs[d->rs2]; }
+void exec_sll(const decoded_insn_t *d, uint32_t current_pc)  { (void)current_pc; hart->regs[d->rd] = hart->regs[d->rs1] << (hart->regs[d->rs2] & 0x1F); }
+void exec_slt(const decoded_insn_t *d, uint32_t current_pc)  { (void)current_pc; hart->regs[d->rd] = ((int32_t)hart->regs[d->rs1] < (int32_t)hart->regs[d->rs2]) ? 1 : 0; }
+void exec_sltu(const decoded_insn_t *d, uint32_t current_pc) { (void)current_pc; hart->regs[d->rd] = (hart->regs[d->rs1] < hart->regs[d->rs2]) ? 1 : 0; }
+void exec_xor(const decoded_insn_t *d, uint32_t current_pc)  { (void)current_pc; hart->regs[d->rd] = hart->regs[d->rs1] ^ hart->regs[d->rs2]; }
+void exec_srl(const decoded_insn_t *d, uint32_t current_pc)  { (void)current_pc; hart->regs[d->rd] = hart->regs[d->rs1] >> (hart->regs[d->rs2] & 0x1F); }
+void exec_sra(const decoded_insn_t *d, uint32_t current_pc)  { (void)current_pc; hart->regs[d->rd] = (int32_t)hart->regs[d->rs1] >> (hart->regs[d->rs2] & 0x1F); }
+void exec_or(const decoded_insn_t *d, uint32_t current_pc)   { (void)current_pc; hart->regs[d->rd] = hart->regs[d->rs1] | hart->regs[d->rs2]; }
+void exec_and(const decoded_insn_t *d, uint32_t current_pc)  { (void)current_pc; hart->regs[d->rd] = hart->regs[d->rs1] & hart->regs[d->rs2]; }
+
+void exec_mul(const decoded_insn_t *d, uint32_t current_pc)    { (void)current_pc; hart->regs[d->rd] = (int32_t)hart->regs[d->rs1] * (int32_t)hart->regs[d->rs2]; }
+void exec_mulh(const decoded_insn_t *d, uint32_t current_pc)   { (void)current_pc; hart->regs[d->rd] = (uint32_t)(((int64_t)(int32_t)hart->regs[d->rs1] * (int64_t)(int32_t)hart->regs[d->rs2]) >> 32); }
+void exec_mulhsu(const decoded_insn_t *d, uint32_t current_pc) { (void)current_pc; hart->regs[d->rd] = (uint32_t)(((int64_t)(int32_t)hart->regs[d->rs1] * (uint64_t)hart->regs[d->rs2]) >> 32); }
+void exec_mulhu(const decoded_insn_t *d, uint32_t current_pc)  { (void)current_pc; hart->regs[d->rd] = (uint32_t)(((uint64_t)hart->regs[d->rs1] * (uint64_t)hart->regs[d->rs2]) >> 32); }
+void exec_div(const decoded_insn_t *d, uint32_t current_pc) {
+    (void)current_pc;
+    uint32_t a = hart->regs[d->rs1], b = hart->regs[d->rs2];
+    if (b == 0) hart->regs[d->rd] = -1;
+    else if (a == 0x80000000 && b == 0xFFFFFFFF) hart->regs[d->rd] = 0x80000000;
+    else hart->regs[d->rd] = (int32_t)a / (int32_t)b;
+}
+void exec_divu(const decoded_insn_t *d, uint32_t current_pc) {
+    (void)current_pc;
+    uint32_t a = hart->regs[d->rs1], b = hart->regs[d->rs2];
+    hart->regs[d->rd] = (b == 0) ? 0xFFFFFFFF : a / b;
+}
+void exec_rem(const decoded_insn_t *d, uint32_t current_pc) {
+    (void)current_pc;
+    uint32_t a = hart->regs[d->rs1], b = hart->regs[d->rs2];
+    if (b == 0) hart->regs[d->rd] = a;
+    else if (a == 0x80000000 && b == 0xFFFFFFFF) hart->regs[d->rd] = 0;
+    else hart->regs[d->rd] = (int32_t)a % (int32_t)b;
+}
+void exec_remu(const decoded_insn_t *d, uint32_t current_pc) {
+    (void)current_pc;
+    uint32_t a = hart->regs[d->rs1], b = hart->regs[d->rs2];
+    hart->regs[d->rd] = (b == 0) ? a : a % b;
+}
+
+void exec_ecall(const decoded_insn_t *d, uint32_t current_pc) { (void)d; trigger_trap(8 + hart->priv, 0, current_pc); }
+void exec_ebreak(const decoded_insn_t *d, uint32_t current_pc) {
+    (void)d;
+    if (semihost_call(current_pc)) return;
+    machine_halt(MACHINE_EBREAK); hart->mcause = 3; hart->mepc = current_pc;
+}
+void exec_mret(const decoded_insn_t *d, uint32_t current_pc) {
+    if (hart->priv != PRIV_M) { trigger_trap(2, d->raw, current_pc); return; }
+    mret_execute();
+}
+void exec_sret(const decoded_insn_t *d, uint32_t current_pc) {
+    if (!priv_allowed(MSTATUS_TSR)) { trigger_trap(2, d->raw, current_pc); return; }
+    sret_execute();
+}
+void exec_wfi(const decoded_insn_t *d, uint32_t current_pc) {
+    if (!priv_allowed(MSTATUS_TW)) { trigger_trap(2, d->raw, current_pc); return; }
+    wait_for_interrupt(current_pc);
+}
+// Esvazia a TLB inteira (os operandos de endereço e ASID são ignorados).
+void exec_sfence_vma(const decoded_insn_t *d, uint32_t current_pc) {
+    if (!priv_allowed(MSTATUS_TVM)) { trigger_trap(2, d->raw, current_pc); return; }
+    tlb_flush(hart);
+}
+
+// Nos CSRs, imm guarda o endereço do CSR e rs1 guarda o uimm das formas *i.
+// O valor de rs1 é lido antes de escrever rd, como na versão de referência.
+// CSR fora do alcance do modo atual: instrução ilegal.
+static inline __attribute__((always_inline))
+int csr_denied(const decoded_insn_t *d, uint32_t current_pc) {
+    if (csr_allowed(d->imm)) return 0;
+    trigger_trap(2, d->raw, current_pc);
+    return 1;
+}
+
+void exec_csrrw(const decoded_insn_t *d, uint32_t current_pc) {
+    if (csr_denied(d, current_pc)) return;
+    uint32_t src = hart->regs[d->rs1], temp = read_csr(d->imm);
+    hart->regs[d->rd] = temp; write_csr(d->imm, src);
+}
+void exec_csrrs(const decoded_insn_t *d, uint32_t current_pc) {
+    if (csr_denied(d, current_pc)) return;
+    uint32_t src = hart->regs[d->rs1], temp = read_csr(d->imm);
+    hart->regs[d->rd] = temp; if (d->rs1 != 0) write_csr(d->imm, temp | src);
+}
+void exec_csrrc(const decoded_insn_t *d, uint32_t current_pc) {
+    if (csr_denied(d, current_pc)) return;
+    uint32_t src = hart->regs[d->rs1], temp = read_csr(d->imm);
+    hart->regs[d->rd] = temp; if (d->rs1 != 0) write_csr(d->imm, temp & ~src);
+}
+void exec_csrrwi(const decoded_insn_t *d, uint32_t current_pc) {
+    if (csr_denied(d, current_pc)) return;
+    uint32_t temp = read_csr(d->imm);
+    hart->regs[d->rd] = temp; write_csr(d->imm, d->rs1);
+}
+void exec_csrrsi(const decoded_insn_t *d, uint32_t current_pc) {
+    if (csr_denied(d, current_pc)) return;
+    uint32_t temp = read_csr(d->imm);
+    hart->regs[d->rd] = temp; if (d->rs1 != 0) write_csr(d->imm, temp | d->rs1);
+}
+void exec_csrrci(const decoded_insn_t *d, uint32_t current_pc) {
+    if (csr_denied(d, current_pc)) return;
+    uint32_t temp = read_csr(d->imm);
+    hart->regs[d->rd] = temp; if (d->rs1 != 0) write_csr(d->imm, temp & ~(uint32_t)d->rs1);
+}
+
+void exec_fence_i(const decoded_insn_t *d, uint32_t current_pc) { (void)d; (void)current_pc; icache_flush(); }
+void exec_amo(const decoded_insn_t *d, uint32_t current_pc) {
+    uint32_t result;
+    if (amo_execute(d->imm, hart->regs[d->rs1], hart->regs[d->rs2], &result, current_pc)) hart->regs[d->rd] = result;
+}
+void exec_nop(const decoded_insn_t *d, uint32_t current_pc) { (void)d; (void)current_pc; }
+void exec_illegal(const decoded_insn_t *d, uint32_t current_pc) { trigger_trap(2, d->raw, current_pc); }
+
+// Preenche uma entrada do cache. Segue exatamente a mesma árvore de decisão de
+// decode_and_execute(), inclusive nos casos que a versão de referência aceita
+// sem checar todos os campos (ex.: funct7 de add/srl).
+void exec_jal_profile(const decoded_insn_t *d, uint32_t current_pc);
+void exec_jalr_profile(const decoded_insn_t *d, uint32_t current_pc);
+
+void decode_instruction(uint32_t instruction, decoded_insn_t *d) {
+    uint32_t opcode = get_opcode(instruction), funct3 = get_funct3(instruction), funct7 = get_funct7(instruction);
+    insn_handler_t h = exec_illegal;
+
+    d->raw = instruction;
+    d->rd = get_rd(instruction);
+    d->rs1 = get_rs1(instruction);
+    d->rs2 = get_rs2(instruction);
+    d->imm = get_imm_I(instruction);
+
+    switch (opcode) {
+        case 0x37: h = exec_lui;   d->imm = get_imm_U(instruction); break;
+        case 0x17: h = exec_auipc; d->imm = get_imm_U(instruction); break;
+        case 0x6F: h = exec_jal;   d->imm = get_imm_J(instruction); break;
+        case 0x67: h = exec_jalr; break;
+        case 0x63:
+            {
+                static const insn_handler_t branches[8] = { exec_beq, exec_bne, exec_illegal, exec_illegal,
+                                                            exec_blt, exec_bge, exec_bltu, exec_bgeu };
+                h = branches[funct3];
+                d->imm = get_imm_B(instruction);
+            }
+            break;
+        case 0x03:
+            {
+                static const insn_handler_t loads[8] = { exec_lb, exec_lh, exec_lw, exec_illegal,
+                                                         exec_lbu, exec_lhu, exec_illegal, exec_illegal };
+                h = loads[funct3];
+                // A referência não acessa a memória quando rd == zero.
+                if (d->rd == 0 && h != exec_illegal) h = exec_nop;
+            }
+            break;
+        case 0x23:
+            if (funct3 == 0x0) h = exec_sb;
+            else if (funct3 == 0x1) h = exec_sh;
+            else if (funct3 == 0x2) h = exec_sw;
+            d->imm = get_imm_S(instruction);
+            break;
+        case 0x13:
+            switch (funct3) {
+                case 0x0: h = exec_addi; break;
+                case 0x1: h = exec_slli; d->imm &= 0x1F; break;
+                case 0x2: h = exec_slti; break;
+                case 0x3: h = exec_sltiu; break;
+                case 0x4: h = exec_xori; break;
+                case 0x5: h = ((instruction >> 30) == 0x00) ? exec_srli : exec_srai; d->imm &= 0x1F; break;
+                case 0x6: h = exec_ori; break;
+                case 0x7: h = exec_andi; break;
+            }
+            break;
+        case 0x33:
+            if (funct7 == 0x01) {
+                static const insn_handler_t muldiv[8] = { exec_mul, exec_mulh, exec_mulhsu, exec_mulhu,
+                                                          exec_div, exec_divu, exec_rem, exec_remu };
+                h = muldiv[funct3];
+            } else {
+                switch (funct3) {
+                    case 0x0: h = (funct7 == 0x20) ? exec_sub : exec_add; break;
+                    case 0x1: h = exec_sll; break;
+                    case 0x2: h = exec_slt; break;
+                    case 0x3: h = exec_sltu; break;
+                    case 0x4: h = exec_xor; break;
+                    case 0x5: h = (funct7 == 0x20) ? exec_sra : exec_srl; break;
+                    case 0x6: h = exec_or; break;
+                    case 0x7: h = exec_and; break;
+                }
+            }
+            break;
+        case 0x73:
+            {
+                static const insn_handler_t csr_ops[8] = { exec_illegal, exec_csrrw, exec_csrrs, exec_csrrc,
+                                                           exec_illegal, exec_csrrwi, exec_csrrsi, exec_csrrci };
+                if (funct3 == 0x0) {
+                    if (d->imm == 0x0) h = exec_ecall;
+                    else if (d->imm == 0x1) h = exec_ebreak;
+                    else if (d->imm == 0x302) h = exec_mret;
+                    else if (d->imm == 0x102) h = exec_sret;
+                    else if (d->imm == 0x105) h = exec_wfi;
+                    else if (funct7 == 0x09 && d->rd == 0) h = exec_sfence_vma;
+                } else {
+                    h = csr_ops[funct3];
+                    d->imm &= 0xFFF;
+                }
+            }
+            break;
+        case 0x0F:
+            h = (funct3 == 0x1) ? exec_fence_i : exec_nop;
+            break;
+        case 0x2F:
+            if (funct3 == 0x2 && amo_name(funct7 >> 2)) h = exec_amo;
+            d->imm = funct7 >> 2; // funct5 (aq/rl são ignorados: tudo é sequencialmente consistente)
+            break;
+    }
+    // Com --profile, chamadas e retornos passam pela pilha sombra do perfil.
+    if (hart->profile && h == exec_jal) h = exec_jal_profile;
+    if (hart->profile && h == exec_jalr) h = exec_jalr_profile;
+    d->handler = h;
+}
+
+// Fora da RAM principal não há cache: a instrução (da ROM ou de outra RAM do
+// --mem) é decodificada a cada execução numa entrada da thread (com Sv32,
+// traduzida de novo).
+__thread decoded_insn_t fetch_uncached;
+
+decoded_insn_t *fetch_decoded_outside() {
+    decode_instruction(fetch_instruction_from_pc(), &fetch_uncached);
+    return &fetch_uncached;
+}
+
+// Entrada do cache pelo deslocamento na RAM principal, decodificando na
+// primeira vez.
+static inline __attribute__((always_inline))
+decoded_insn_t *fetch_decoded_ram(uint32_t offset) {
+    decoded_insn_t *d = &icache[offset >> 2];
+    if (!d->handler) {
+        decode_instruction(mem_load_le(machine->memory + offset, 4), d);
+        code_mark(offset, CODE_MAP_DECODED);
+    }
+    return d;
+}
+
+// Falta na TLB: traduz o pc e, se ele cair na RAM principal, guarda a página.
+decoded_insn_t *fetch_decoded_slow() {
+    uint32_t paddr = hart->pc;
+    if (hart->pc % 4 != 0) return fetch_decoded_outside();
+    if (hart->translate && !mmu_translate(hart->pc, MMU_FETCH, &paddr, hart->pc)) {
+        decode_instruction(0, &fetch_uncached);
+        return &fetch_uncached;
+    }
+    uint32_t offset = paddr - PC_START_ADDRESS;
+    if (offset > memory_size - 4) return fetch_decoded_outside();
+    tlb_fill(hart->pc, paddr, mem_find(paddr, 4), MMU_FETCH);
+    // Com --simd a entrada pode ser da palavra de outra lane.
+    decoded_insn_t *d = &icache[offset >> 2];
+    if (code_written && d->handler && d->raw != mem_load_le(machine->memory + offset, 4)) d->handler = NULL;
+    return fetch_decoded_ram(offset);
+}
+
+// Busca a entrada pré-decodificada do pc atual: com a página na TLB, uma
+// comparação e o cache. Mesmas condições de falha de fetch_instruction_from_pc().
+decoded_insn_t *fetch_decoded_from_pc() {
+    const tlb_entry_t *e = &hart->tlb[(hart->pc >> 12) % TLB_ENTRIES];
+    if (e->fetch != (hart->pc & 0xFFFFF003)) return fetch_decoded_slow();
+    return fetch_decoded_ram(e->ram_page + (hart->pc & 0xFFF));
 }
 
-void load_program_from_hex_string(const char* hex_string) {
-    const char *p = hex_string;
-    uint32_t address = 0;
+// --- Carga do Programa ---
+// O arquivo de entrada é mapeado com mmap e decodificado direto para a RAM do
+// guest, sem cópia intermediária. Pode ser um ELF32 RISC-V (reconhecido pelo
+// cabeçalho) ou o formato hex com diretivas @.
+
+// Valor + 1 de cada dígito hexadecimal; 0 para o resto.
+static const uint8_t hex_digit[256] = {
+    ['0'] = 1,  ['1'] = 2,  ['2'] = 3,  ['3'] = 4,  ['4'] = 5,  ['5'] = 6,  ['6'] = 7,  ['7'] = 8,
+    ['8'] = 9,  ['9'] = 10,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+};
+
+static inline int hex_space(uint8_t c) { return c == ' ' || c == '\n' || c == '\r' || c == '\t'; }
+
+// Byte do programa fora da RAM principal: vai para a RAM do mapa que o
+// contém. 0 se não há nenhuma.
+int mem_load_byte(uint32_t address, uint8_t value) {
+    mem_region_t *r = mem_find(address, 1);
+    if (!r || !r->host || (r->widths & MEM_READONLY)) return 0;
+    r->host[address - r->base] = value;
+    return 1;
+}
+
+// Hex: pares de dígitos separados por espaços, e "@endereço" muda o endereço
+// de carga (o primeiro também é o pc inicial; sem nenhum, o pc é o início da
+// RAM). Um par com caractere inválido vale o que os dígitos válidos do começo
+// valem. Bytes que não caem em nenhuma RAM do mapa (ROM e MMIO inclusive) são
+// descartados com um aviso.
+void load_program_hex(const uint8_t *p, size_t len) {
+    const uint8_t *end = p + len;
+    uint32_t address = 0, dropped = 0, first_dropped = 0, ram_size = memory_size;
     int has_address = 0;
 
-    while (*p != '\0') {
-        while (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t') {
+    while (p < end && *p != '\0') {
+        if (hex_space(*p)) {
             p++;
+            continue;
         }
-        if (*p == '\0') break;
 
         if (*p == '@') {
             p++;
-            address = (uint32_t)strtoul(p, (char**)&p, 16);
+            while (p < end && (hex_space(*p) || *p == '\v' || *p == '\f')) p++;
+            if (end - p >= 3 && p[0] == '0' && (p[1] | 0x20) == 'x' && hex_digit[p[2]]) p += 2;
+            uint64_t value = 0; // como o strtoul: satura em 64 bits
+            while (p < end && hex_digit[*p]) {
+                value = (value >> 60) ? UINT64_MAX : (value << 4) | (hex_digit[*p] - 1);
+                p++;
+            }
+            address = (uint32_t)value;
             if (!has_address) {
-                pc = address;
+                hart->pc = address;
                 has_address = 1;
             }
             continue;
         }
 
-        char hex_byte_str[3] = {p[0], p[1], '\0'};
-        uint8_t byte_val = (uint8_t)strtoul(hex_byte_str, NULL, 16);
-
-        if (address >= PC_START_ADDRESS && (address - PC_START_ADDRESS) < MEMORY_SIZE) {
-            memory[address - PC_START_ADDRESS] = byte_val;
-        }
+        uint32_t hi = hex_digit[p[0]], lo = (p + 1 < end) ? hex_digit[p[1]] : 0;
+        uint8_t byte_val = !hi ? 0 : !lo ? hi - 1 : ((hi - 1) << 4) | (lo - 1);
+        uint32_t offset = address - PC_START_ADDRESS;
+        if (offset < ram_size) machine->memory[offset] = byte_val;
+        else if (!mem_load_byte(address, byte_val) && dropped++ == 0) first_dropped = address;
         address++;
         p += 2;
+        if (p < end && hex_space(*p)) p++; // o separador mais comum, sem outra volta
     }
 
     if (!has_address) {
-        pc = PC_START_ADDRESS;
+        hart->pc = PC_START_ADDRESS;
+    }
+    if (dropped && !machine->quiet) {
+        fprintf(stderr, "Aviso: %u bytes do hex fora da RAM foram ignorados, o primeiro em 0x%08x\n",
+                dropped, first_dropped);
     }
 }
 
-// --- CÓDIGO CORRIGIDO ---
-int main(int argc, char *argv[]) {
-    if (argc != 5) {
-        fprintf(stderr, "Uso: %s <hex_in> <trace_out> <term_in> <term_out>\n", argv[0]);
-        return EXIT_FAILURE;
+// ELF32 little-endian para RISC-V: cada PT_LOAD é copiado do arquivo mapeado
+// para o seu endereço físico (p_paddr), o resto do segmento (.bss) é zerado e
+// o pc começa em e_entry. Segmentos que não cabem inteiros numa RAM do mapa
+// são um erro.
+int load_program_elf(const uint8_t *data, size_t len) {
+    Elf32_Ehdr eh;
+    if (len < sizeof(eh)) {
+        fprintf(stderr, "Arquivo ELF invalido: cabecalho truncado\n");
+        return 0;
     }
-
-    FILE *infile = fopen(argv[1], "r");
-    if (!infile) {
-        perror("Erro ao abrir arquivo de entrada hex");
-        return EXIT_FAILURE;
+    memcpy(&eh, data, sizeof(eh));
+    if (eh.e_ident[EI_CLASS] != ELFCLASS32 || eh.e_ident[EI_DATA] != ELFDATA2LSB || le16toh(eh.e_machine) != EM_RISCV) {
+        fprintf(stderr, "Arquivo ELF invalido: esperado ELF32 little-endian para RISC-V\n");
+        return 0;
     }
-
-    FILE *outfile = fopen(argv[2], "w");
-    if (!outfile) {
-        perror("Erro ao abrir arquivo de saida trace");
-        fclose(infile);
-        return EXIT_FAILURE;
+    uint32_t phoff = le32toh(eh.e_phoff), phnum = le16toh(eh.e_phnum);
+    if (le16toh(eh.e_phentsize) != sizeof(Elf32_Phdr) || phoff > len || (len - phoff) / sizeof(Elf32_Phdr) < phnum) {
+        fprintf(stderr, "Arquivo ELF invalido: tabela de program headers fora do arquivo\n");
+        return 0;
     }
 
-    // Abre o arquivo de entrada do terminal (argv[3])
-    uart_infile = fopen(argv[3], "r");
-    if (!uart_infile) {
-        perror("Erro ao abrir arquivo de entrada do terminal");
-        fclose(infile);
-        fclose(outfile);
-        return EXIT_FAILURE;
+    int ok = 1, loaded = 0;
+    for (uint32_t i = 0; i < phnum; i++) {
+        Elf32_Phdr ph;
+        memcpy(&ph, data + phoff + i * sizeof(Elf32_Phdr), sizeof(ph));
+        uint32_t paddr = le32toh(ph.p_paddr), memsz = le32toh(ph.p_memsz);
+        uint32_t filesz = le32toh(ph.p_filesz), offset = le32toh(ph.p_offset);
+        if (le32toh(ph.p_type) != PT_LOAD || memsz == 0) continue;
+
+        mem_region_t *r = mem_find(paddr, 1);
+        if (!r || !r->host || (r->widths & MEM_READONLY) || memsz > r->size - (paddr - r->base)) {
+            fprintf(stderr, "Segmento ELF %u fora da RAM: 0x%08x-0x%08llx\n", i, paddr, (unsigned long long)paddr + memsz - 1);
+            ok = 0;
+            continue;
+        }
+        if (filesz > memsz || offset > len || filesz > len - offset) {
+            fprintf(stderr, "Arquivo ELF invalido: segmento %u passa do fim do arquivo\n", i);
+            ok = 0;
+            continue;
+        }
+        uint8_t *dest = r->host + (paddr - r->base);
+        memcpy(dest, data + offset, filesz);
+        mem_discard(dest + filesz, memsz - filesz); // um .bss grande não ocupa memória do host
+        loaded++;
+    }
+    if (ok && loaded == 0) {
+        fprintf(stderr, "Arquivo ELF sem nenhum segmento PT_LOAD\n");
+        ok = 0;
     }
+    hart->pc = le32toh(eh.e_entry);
+    return ok;
+}
 
-    uart_outfile = fopen(argv[4], "w");
-    if (!uart_outfile) {
-        perror("Erro ao criar arquivo de saida do terminal");
-        fclose(infile);
-        fclose(outfile);
-        fclose(uart_infile); // Garante que todos os arquivos abertos sejam fechados
-        return EXIT_FAILURE;
+// Carrega o programa do descritor (ELF ou hex). Arquivos comuns são mapeados;
+// pipes e afins são lidos para um buffer. Retorna 0 (com aviso) em erro.
+int load_program(int fd) {
+    struct stat st;
+    uint8_t *data = NULL;
+    size_t len = 0;
+    void *map = MAP_FAILED;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            data = (uint8_t*)map;
+            len = st.st_size;
+            madvise(map, len, MADV_SEQUENTIAL);
+        }
+    }
+    if (map == MAP_FAILED) {
+        size_t cap = 0;
+        ssize_t n;
+        do {
+            if (len == cap) {
+                cap = cap ? cap * 2 : 64 * 1024;
+                data = (uint8_t*)realloc(data, cap);
+            }
+            n = read(fd, data + len, cap - len);
+            if (n > 0) len += n;
+        } while (n > 0 || (n < 0 && errno == EINTR));
+        if (n < 0) {
+            perror("Erro ao ler arquivo de entrada hex");
+            free(data);
+            return 0;
+        }
     }
 
-    fseek(infile, 0, SEEK_END);
-    long file_size = ftell(infile);
-    fseek(infile, 0, SEEK_SET);
-    char *program_hex_string = (char*)malloc(file_size + 1);
-    fread(program_hex_string, 1, file_size, infile);
-    program_hex_string[file_size] = '\0';
-    fclose(infile);
+    int ok = 1;
+    if (len >= SELFMAG && memcmp(data, ELFMAG, SELFMAG) == 0) ok = load_program_elf(data, len);
+    else load_program_hex(data, len);
 
-    memset(regs, 0, sizeof(regs));
-    memset(memory, 0, MEMORY_SIZE);
-    regs[2] = PC_START_ADDRESS + MEMORY_SIZE;
+    if (map != MAP_FAILED) munmap(map, len);
+    else free(data);
+    return ok;
+}
 
-    load_program_from_hex_string(program_hex_string);
-    free(program_hex_string);
+// --- Perfil (--profile) ---
+// Perfil do programa simulado, sem passar pelo trace. Cada amostra conta a
+// instrução no seu pc e na função do topo de uma pilha de chamadas sombra,
+// montada pelos handlers de jal/jalr: rd = ra é uma chamada e jalr zero, 0(ra)
+// um retorno. Há dois modos:
+//  - período 1 (padrão): laços próprios do cache de instruções contam toda
+//    instrução executada e toda entrada em bloco básico (destino de desvio
+//    tomado, salto ou trap);
+//  - período N > 1: os laços normais rodam sem mudança e a próxima amostra é
+//    mais um prazo do escalonador de interrupções (como o --checkpoint-at), então
+//    o custo é uma checagem completa a cada N ciclos. Os blocos são então os
+//    estáticos, somando as amostras das instruções de cada um.
+// No fim, profile_write() grava as pilhas no formato "folded" do flamegraph.pl
+// e um relatório com os pontos mais quentes, com nomes tirados da tabela de
+// símbolos de um ELF ou de um arquivo de mapa.
+#define PROFILE_MAX_DEPTH 1024
+#define PROFILE_TOP 20
 
-    char details_buffer[256];
+const char *profile_prefix;      // --profile
+const char *profile_symbols_path; // --profile-symbols
+uint64_t profile_period = 1;     // --profile-period
 
-    uint32_t last_trap_pc = 0xFFFFFFFF;
-    uint32_t last_trap_cause = 0xFFFFFFFF;
+typedef struct {
+    uint32_t parent, func;       // nó pai na árvore de chamadas e entrada da função
+    uint64_t samples, calls;
+} profile_node_t;
 
-// --- CÓDIGO CORRIGIDO ---
-while (!halt_flag) {
-    uint32_t current_instruction_pc = pc;
+struct profile {
+    uint64_t period, samples;
+    uint64_t *pc_samples;        // por palavra da RAM principal
+    uint64_t *block_entries;
 
-    // --- Tratamento de Interrupções (pode gerar um trap) ---
-    mtime++;
-    if (mtimecmp != (uint64_t)-1 && mtime >= mtimecmp) {
-        mip |= (1 << 7);
-    }
-    if ((plic_pending & plic_enable) & (1 << UART_IRQ)) {
-        mip |= (1 << 11);
-    }
+    // Árvore de chamadas: o nó 0 é a função de entrada; os filhos são achados
+    // por (pai, função) numa tabela de endereçamento aberto (id + 1, 0 = vazio).
+    profile_node_t *nodes;
+    uint32_t node_count, node_cap;
+    uint32_t *child_table;
+    uint32_t child_mask;
 
-    uint32_t pending_and_enabled = mip & mie;
-    if ((mstatus & (1 << 3)) && pending_and_enabled) {
-        uint32_t trap_cause = 0;
-        if (pending_and_enabled & (1 << 11)) trap_cause = 0x8000000B; // External
-        else if (pending_and_enabled & (1 << 3)) trap_cause = 0x80000003; // Software
-        else if (pending_and_enabled & (1 << 7)) trap_cause = 0x80000007; // Timer
+    // Pilha sombra: stack[0] é a raiz e stack[depth] a função atual.
+    struct { uint32_t node, ret; } stack[PROFILE_MAX_DEPTH];
+    uint32_t depth;
+    uint32_t overflow;           // chamadas que não couberam na pilha
+};
 
-        if (trap_cause != 0) {
-             trigger_trap(trap_cause, 0, current_instruction_pc);
+profile_t *profile_new(uint64_t period, uint32_t entry) {
+    profile_t *p = (profile_t*)calloc(1, sizeof(profile_t));
+    p->period = period;
+    p->pc_samples = (uint64_t*)mem_reserve((size_t)(memory_size / 4) * sizeof(uint64_t));
+    p->block_entries = (uint64_t*)mem_reserve((size_t)(memory_size / 4) * sizeof(uint64_t));
+    p->node_cap = 1024;
+    p->nodes = (profile_node_t*)malloc(p->node_cap * sizeof(profile_node_t));
+    p->nodes[0] = (profile_node_t){0, entry, 0, 0};
+    p->node_count = 1;
+    p->child_mask = 4095;
+    p->child_table = (uint32_t*)calloc(p->child_mask + 1, sizeof(uint32_t));
+    return p;
+}
+
+void profile_free(profile_t *p) {
+    if (!p) return;
+    munmap(p->pc_samples, (size_t)(memory_size / 4) * sizeof(uint64_t));
+    munmap(p->block_entries, (size_t)(memory_size / 4) * sizeof(uint64_t));
+    free(p->nodes);
+    free(p->child_table);
+    free(p);
+}
+
+static inline uint32_t profile_slot(const profile_t *p, uint32_t parent, uint32_t func) {
+    return ((parent * 0x9E3779B1u) ^ ((func >> 2) * 0x85EBCA6Bu)) & p->child_mask;
+}
+
+void profile_rehash(profile_t *p) {
+    free(p->child_table);
+    p->child_mask = p->child_mask * 2 + 1;
+    p->child_table = (uint32_t*)calloc(p->child_mask + 1, sizeof(uint32_t));
+    for (uint32_t id = 1; id < p->node_count; id++) {
+        uint32_t i = profile_slot(p, p->nodes[id].parent, p->nodes[id].func);
+        while (p->child_table[i]) i = (i + 1) & p->child_mask;
+        p->child_table[i] = id + 1;
+    }
+}
+
+uint32_t profile_child(profile_t *p, uint32_t parent, uint32_t func) {
+    uint32_t i = profile_slot(p, parent, func);
+    for (; p->child_table[i]; i = (i + 1) & p->child_mask) {
+        profile_node_t *n = &p->nodes[p->child_table[i] - 1];
+        if (n->parent == parent && n->func == func) return p->child_table[i] - 1;
+    }
+    if (p->node_count == p->node_cap) {
+        p->node_cap *= 2;
+        p->nodes = (profile_node_t*)realloc(p->nodes, p->node_cap * sizeof(profile_node_t));
+    }
+    uint32_t id = p->node_count++;
+    p->nodes[id] = (profile_node_t){parent, func, 0, 0};
+    p->child_table[i] = id + 1;
+    if (p->node_count * 2 > p->child_mask) profile_rehash(p);
+    return id;
+}
+
+void profile_sample(profile_t *p, uint32_t pc, uint64_t weight) {
+    p->samples += weight;
+    if (pc - PC_START_ADDRESS < memory_size) p->pc_samples[(pc - PC_START_ADDRESS) >> 2] += weight;
+    p->nodes[p->stack[p->depth].node].samples += weight;
+}
+
+void profile_call(profile_t *p, uint32_t target, uint32_t ret) {
+    if (p->depth + 1 == PROFILE_MAX_DEPTH) {
+        p->overflow++;
+        return;
+    }
+    uint32_t node = profile_child(p, p->stack[p->depth].node, target);
+    p->nodes[node].calls++;
+    p->depth++;
+    p->stack[p->depth].node = node;
+    p->stack[p->depth].ret = ret;
+}
+
+// Volta ao quadro cujo endereço de retorno é 'target', desempilhando os que
+// ficaram para trás. Retornos que não batem com nenhum quadro (longjmp, troca
+// de pilha) são ignorados.
+void profile_return(profile_t *p, uint32_t target) {
+    if (p->overflow) {
+        p->overflow--;
+        return;
+    }
+    for (uint32_t i = p->depth; i > 0; i--) {
+        if (p->stack[i].ret == target) {
+            p->depth = i - 1;
+            return;
         }
     }
-    
-    // --- Busca e Execução da Instrução ---
-    uint32_t instruction_hex = fetch_instruction_from_pc();
-
-    // Se fetch_instruction_from_pc ou o handler de interrupção causaram um trap,
-    // trap_pending_print estará setado.
-    if (!trap_pending_print) {
-        // Se não há trap pendente, executa a instrução.
-        details_buffer[0] = '\0';
-        decode_and_execute(instruction_hex, current_instruction_pc, details_buffer);
-    }
-
-    // --- Lógica Centralizada de Pós-Execução ---
-    if (trap_pending_print) {
-        // Um trap ocorreu (seja por interrupção, fetch ou execução).
-        if (mepc == last_trap_pc && mcause == last_trap_cause) {
-            fprintf(outfile, ">FATAL: Double fault detected. Halting simulation.\n");
-            halt_flag = 1;
+}
+
+static inline void profile_block(profile_t *p, uint32_t pc) {
+    uint32_t offset = pc - PC_START_ADDRESS;
+    if (offset < memory_size) p->block_entries[offset >> 2]++;
+}
+
+static inline int profile_ends_block(uint32_t insn) {
+    uint32_t opcode = get_opcode(insn);
+    return opcode == 0x63 || opcode == 0x6F || opcode == 0x67 || opcode == 0x73;
+}
+
+// pc seguiu para a instrução seguinte: depois de um desvio não tomado (ou de
+// uma instrução de sistema) ela começa um bloco. Chegadas em sequência num
+// início de bloco vindas de outras instruções são somadas no relatório.
+static inline void profile_fallthrough(profile_t *p, uint32_t insn, uint32_t pc) {
+    if (profile_ends_block(insn)) profile_block(p, pc);
+}
+
+void exec_jal_profile(const decoded_insn_t *d, uint32_t current_pc) {
+    exec_jal(d, current_pc);
+    if (d->rd == 1) profile_call(hart->profile, hart->pc, current_pc + 4);
+}
+
+void exec_jalr_profile(const decoded_insn_t *d, uint32_t current_pc) {
+    exec_jalr(d, current_pc);
+    if (d->rd == 1) profile_call(hart->profile, hart->pc, current_pc + 4);
+    else if (d->rd == 0 && d->rs1 == 1) profile_return(hart->profile, hart->pc);
+}
+
+// --- Símbolos do Perfil ---
+// Da tabela .symtab de um ELF (funções e rótulos, sem os locais .L*) ou de um
+// mapa de texto com linhas "endereço [tipo] nome", como a saída do nm.
+typedef struct {
+    uint32_t addr;
+    char *name;
+} profile_symbol_t;
+
+profile_symbol_t *profile_symbols;
+uint32_t profile_symbol_count, profile_symbol_cap;
+
+void profile_add_symbol(uint32_t addr, const char *name, size_t len) {
+    if (len == 0 || name[0] == '$' || (len >= 2 && name[0] == '.' && name[1] == 'L')) return;
+    if (profile_symbol_count == profile_symbol_cap) {
+        profile_symbol_cap = profile_symbol_cap ? profile_symbol_cap * 2 : 256;
+        profile_symbols = (profile_symbol_t*)realloc(profile_symbols, profile_symbol_cap * sizeof(profile_symbol_t));
+    }
+    profile_symbol_t *s = &profile_symbols[profile_symbol_count++];
+    s->addr = addr;
+    s->name = strndup(name, len);
+}
+
+void profile_symbols_elf(const uint8_t *data, size_t len) {
+    const Elf32_Ehdr *eh = (const Elf32_Ehdr*)data;
+    if (len < sizeof(Elf32_Ehdr) || eh->e_ident[EI_CLASS] != ELFCLASS32 || eh->e_shentsize != sizeof(Elf32_Shdr) ||
+        eh->e_shoff > len || (size_t)eh->e_shnum * sizeof(Elf32_Shdr) > len - eh->e_shoff) return;
+    const Elf32_Shdr *sh = (const Elf32_Shdr*)(data + eh->e_shoff);
+    for (uint32_t i = 0; i < eh->e_shnum; i++) {
+        if (sh[i].sh_type != SHT_SYMTAB || sh[i].sh_link >= eh->e_shnum) continue;
+        const Elf32_Shdr *strtab = &sh[sh[i].sh_link];
+        if (sh[i].sh_offset > len || sh[i].sh_size > len - sh[i].sh_offset ||
+            strtab->sh_offset > len || strtab->sh_size > len - strtab->sh_offset) continue;
+        const Elf32_Sym *sym = (const Elf32_Sym*)(data + sh[i].sh_offset);
+        const char *names = (const char*)(data + strtab->sh_offset);
+        for (uint32_t k = 0; k < sh[i].sh_size / sizeof(Elf32_Sym); k++) {
+            uint32_t type = ELF32_ST_TYPE(sym[k].st_info);
+            if ((type != STT_FUNC && type != STT_NOTYPE) || sym[k].st_shndx == SHN_UNDEF ||
+                sym[k].st_shndx == SHN_ABS || sym[k].st_name >= strtab->sh_size) continue;
+            const char *name = names + sym[k].st_name;
+            profile_add_symbol(sym[k].st_value, name, strnlen(name, strtab->sh_size - sym[k].st_name));
+        }
+    }
+}
+
+void profile_symbols_map(const char *text, size_t len) {
+    const char *end = text + len;
+    for (const char *line = text; line < end;) {
+        const char *eol = memchr(line, '\n', end - line);
+        if (!eol) eol = end;
+        char *after;
+        unsigned long addr = strtoul(line, &after, 16);
+        if (after != line && after < eol && (*after == ' ' || *after == '\t')) {
+            const char *name_end = eol;
+            while (name_end > after && (name_end[-1] == ' ' || name_end[-1] == '\t' || name_end[-1] == '\r')) name_end--;
+            const char *name = name_end;
+            while (name > after && name[-1] != ' ' && name[-1] != '\t') name--;
+            profile_add_symbol((uint32_t)addr, name, name_end - name);
+        }
+        line = eol + 1;
+    }
+}
+
+int profile_symbol_cmp(const void *a, const void *b) {
+    uint32_t x = ((const profile_symbol_t*)a)->addr, y = ((const profile_symbol_t*)b)->addr;
+    return x < y ? -1 : x > y;
+}
+
+// 'required': o arquivo foi pedido em --profile-symbols (erros são avisados).
+void profile_load_symbols(const char *path, int required) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        if (required) fprintf(stderr, "Nao foi possivel ler os simbolos de %s\n", path);
+        if (fd >= 0) close(fd);
+        return;
+    }
+    uint8_t *data = (uint8_t*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return;
+    if ((size_t)st.st_size >= SELFMAG && memcmp(data, ELFMAG, SELFMAG) == 0) profile_symbols_elf(data, st.st_size);
+    else if (required) {
+        char *text = strndup((const char*)data, st.st_size); // strtoul precisa do '\0' no fim
+        profile_symbols_map(text, strlen(text));
+        free(text);
+    }
+    munmap(data, st.st_size);
+    qsort(profile_symbols, profile_symbol_count, sizeof(profile_symbol_t), profile_symbol_cmp);
+}
+
+void profile_free_symbols() {
+    for (uint32_t i = 0; i < profile_symbol_count; i++) free(profile_symbols[i].name);
+    free(profile_symbols);
+    profile_symbols = NULL;
+    profile_symbol_count = profile_symbol_cap = 0;
+}
+
+// Símbolo que contém 'addr', mais um (0: nenhum).
+static uint32_t profile_symbol_at(uint32_t addr) {
+    uint32_t lo = 0, hi = profile_symbol_count;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (profile_symbols[mid].addr <= addr) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Nome de um endereço: "símbolo", "símbolo+0x10" ou o endereço em hex.
+const char *profile_name(uint32_t addr, char *buf) {
+    uint32_t lo = profile_symbol_at(addr);
+    if (lo == 0) sprintf(buf, "0x%08x", addr);
+    else if (profile_symbols[lo - 1].addr == addr) snprintf(buf, 128, "%s", profile_symbols[lo - 1].name);
+    else snprintf(buf, 128, "%s+0x%x", profile_symbols[lo - 1].name, addr - profile_symbols[lo - 1].addr);
+    return buf;
+}
+
+// Endereço seguido do nome ("0x80000040 main+0x10"); sem símbolo, só o endereço.
+const char *profile_addr_name(uint32_t addr, char *buf, size_t size) {
+    char name[128];
+    if (profile_symbol_at(addr) == 0) snprintf(buf, size, "0x%08x", addr);
+    else snprintf(buf, size, "0x%08x %s", addr, profile_name(addr, name));
+    return buf;
+}
+
+// --- Relatório do Perfil ---
+typedef struct {
+    uint32_t a, b;     // chave
+    uint64_t n, m;     // contagens
+} profile_row_t;
+
+typedef struct {
+    profile_row_t *rows;
+    uint32_t count, cap;
+} profile_table_t;
+
+void profile_row_add(profile_table_t *t, uint32_t a, uint32_t b, uint64_t n, uint64_t m) {
+    if (t->count == t->cap) {
+        t->cap = t->cap ? t->cap * 2 : 256;
+        t->rows = (profile_row_t*)realloc(t->rows, t->cap * sizeof(profile_row_t));
+    }
+    t->rows[t->count++] = (profile_row_t){a, b, n, m};
+}
+
+int profile_row_key_cmp(const void *x, const void *y) {
+    const profile_row_t *a = (const profile_row_t*)x, *b = (const profile_row_t*)y;
+    if (a->a != b->a) return a->a < b->a ? -1 : 1;
+    return a->b < b->b ? -1 : a->b > b->b;
+}
+
+int profile_row_count_cmp(const void *x, const void *y) {
+    const profile_row_t *a = (const profile_row_t*)x, *b = (const profile_row_t*)y;
+    if (a->n != b->n) return a->n > b->n ? -1 : 1;
+    return profile_row_key_cmp(x, y);
+}
+
+// Soma as linhas de mesma chave e ordena pela primeira contagem.
+void profile_table_finish(profile_table_t *t) {
+    qsort(t->rows, t->count, sizeof(profile_row_t), profile_row_key_cmp);
+    uint32_t out = 0;
+    for (uint32_t i = 0; i < t->count; i++) {
+        if (out > 0 && t->rows[out - 1].a == t->rows[i].a && t->rows[out - 1].b == t->rows[i].b) {
+            t->rows[out - 1].n += t->rows[i].n;
+            t->rows[out - 1].m += t->rows[i].m;
+        } else {
+            t->rows[out++] = t->rows[i];
+        }
+    }
+    t->count = out;
+    qsort(t->rows, t->count, sizeof(profile_row_t), profile_row_count_cmp);
+}
+
+static inline uint32_t profile_ram_word(const machine_t *m, uint32_t addr) {
+    return mem_load_le(&m->memory[addr - PC_START_ADDRESS], 4);
+}
+
+// Mnemônico e operandos, pelo mesmo texto do trace (sem os valores).
+void profile_disasm(uint32_t insn, char *mnemonic, char *text) {
+    trace_info_t t;
+    char details[256], operands[128] = "";
+    memset(&t, 0, sizeof(t));
+    t.instruction = insn;
+    format_trace_details(&t, details);
+    mnemonic[0] = '\0';
+    sscanf(details, "%31s %127s", mnemonic, operands);
+    if (mnemonic[0] == '\0') {
+        strcpy(mnemonic, "?");
+        sprintf(text, ".word 0x%08x", insn);
+    } else if (operands[0] == '\0' || strchr(operands, '=')) {
+        strcpy(text, mnemonic);
+    } else {
+        sprintf(text, "%s %s", mnemonic, operands);
+    }
+}
+
+// Tamanho do bloco que começa em 'addr': até o primeiro desvio, salto ou
+// instrução de sistema, ou até o próximo início de bloco visto na execução.
+uint32_t profile_block_length(const machine_t *m, const profile_t *p, uint32_t addr) {
+    uint32_t n = 0;
+    while (n < 64 && addr - PC_START_ADDRESS <= memory_size - 4) {
+        if (n > 0 && p->block_entries[(addr - PC_START_ADDRESS) >> 2]) break;
+        n++;
+        if (profile_ends_block(profile_ram_word(m, addr))) break;
+        addr += 4;
+    }
+    return n;
+}
+
+// Início do bloco que contém 'addr' (modo com período).
+uint32_t profile_block_start(const machine_t *m, const profile_t *p, uint32_t addr) {
+    for (uint32_t n = 0; n < 64 && addr > PC_START_ADDRESS; n++) {
+        if (p->block_entries[(addr - PC_START_ADDRESS) >> 2]) break;
+        if (profile_ends_block(profile_ram_word(m, addr - 4))) break;
+        addr -= 4;
+    }
+    return addr;
+}
+
+static inline double profile_pct(uint64_t n, uint64_t total) { return total ? 100.0 * n / total : 0.0; }
+
+void profile_write_folded(FILE *f, machine_t *m) {
+    uint32_t path[PROFILE_MAX_DEPTH + 1];
+    char name[128];
+    for (uint32_t h = 0; h < m->hart_count; h++) {
+        profile_t *p = m->harts[h].profile;
+        if (!p) continue;
+        for (uint32_t id = 0; id < p->node_count; id++) {
+            if (!p->nodes[id].samples) continue;
+            uint32_t depth = 0;
+            for (uint32_t n = id; depth <= PROFILE_MAX_DEPTH; n = p->nodes[n].parent) {
+                path[depth++] = n;
+                if (n == 0) break;
+            }
+            if (m->hart_count > 1) fprintf(f, "hart%u;", h);
+            while (depth-- > 0) fprintf(f, "%s%c", profile_name(p->nodes[path[depth]].func, name), depth ? ';' : ' ');
+            fprintf(f, "%llu\n", (unsigned long long)p->nodes[id].samples);
+        }
+    }
+}
+
+void profile_write_report(FILE *f, machine_t *m) {
+    profile_table_t funcs = {0}, pcs = {0}, blocks = {0}, calls = {0}, opcodes = {0};
+    char name[128], name2[128], mnemonic[32], text[160];
+    const char *mnemonics[64];
+    uint32_t mnemonic_count = 0, path[PROFILE_MAX_DEPTH + 1];
+    uint64_t total = 0;
+
+    for (uint32_t h = 0; h < m->hart_count; h++) {
+        profile_t *p = m->harts[h].profile;
+        if (!p) continue;
+        total += p->samples;
+        for (uint32_t i = 0; i < memory_size / 4; i++) {
+            uint32_t addr = PC_START_ADDRESS + i * 4;
+            if (p->pc_samples[i]) profile_row_add(&pcs, addr, 0, p->pc_samples[i], 0);
+            if (p->pc_samples[i] && profile_period > 1) {
+                uint32_t start = profile_block_start(m, p, addr);
+                profile_row_add(&blocks, start, profile_block_length(m, p, start), p->pc_samples[i], 0);
+            }
+            if (p->block_entries[i]) {
+                // a instrução anterior, se não termina bloco, sempre segue para esta
+                uint64_t entries = p->block_entries[i];
+                if (i > 0 && profile_period == 1 && !profile_ends_block(profile_ram_word(m, addr - 4))) entries += p->pc_samples[i - 1];
+                uint32_t len = profile_block_length(m, p, addr);
+                profile_row_add(&blocks, addr, len, entries * len, entries);
+            }
+        }
+        // Própria: amostras no nó; total: uma vez por função em cada caminho.
+        for (uint32_t id = 0; id < p->node_count; id++) {
+            profile_node_t *node = &p->nodes[id];
+            if (id > 0) profile_row_add(&calls, p->nodes[node->parent].func, node->func, node->calls, 0);
+            if (!node->samples) continue;
+            profile_row_add(&funcs, node->func, 0, node->samples, 0);
+            uint32_t depth = 0;
+            for (uint32_t n = id; depth <= PROFILE_MAX_DEPTH; n = p->nodes[n].parent) {
+                uint32_t seen = 0;
+                for (uint32_t k = 0; k < depth && !seen; k++) seen = path[k] == p->nodes[n].func;
+                if (!seen) {
+                    path[depth++] = p->nodes[n].func;
+                    profile_row_add(&funcs, p->nodes[n].func, 0, 0, node->samples);
+                }
+                if (n == 0) break;
+            }
+        }
+    }
+    for (uint32_t i = 0; i < pcs.count; i++) {
+        profile_disasm(profile_ram_word(m, pcs.rows[i].a), mnemonic, text);
+        uint32_t k = 0;
+        while (k < mnemonic_count && strcmp(mnemonics[k], mnemonic) != 0) k++;
+        if (k == mnemonic_count && k < 64) mnemonics[mnemonic_count++] = strdup(mnemonic);
+        if (k < 64) profile_row_add(&opcodes, k, 0, pcs.rows[i].n, 0);
+    }
+    profile_table_finish(&funcs);
+    profile_table_finish(&pcs);
+    profile_table_finish(&blocks);
+    profile_table_finish(&calls);
+    profile_table_finish(&opcodes);
+
+    fprintf(f, "perfil: %llu amostras, periodo %llu%s, %u hart(s)\n", (unsigned long long)total,
+            (unsigned long long)profile_period, profile_period == 1 ? " (toda instrucao)" : " ciclos", m->hart_count);
+
+    fprintf(f, "\nfuncoes (pilha de chamadas)            proprias        %%        total        %%\n");
+    for (uint32_t i = 0; i < funcs.count && i < PROFILE_TOP; i++) {
+        profile_row_t *r = &funcs.rows[i];
+        fprintf(f, "  %-34s %12llu %7.2f%% %12llu %7.2f%%\n", profile_name(r->a, name), (unsigned long long)r->n,
+                profile_pct(r->n, total), (unsigned long long)r->m, profile_pct(r->m, total));
+    }
+
+    fprintf(f, "\ninstrucoes mais quentes                amostras        %%  instrucao\n");
+    for (uint32_t i = 0; i < pcs.count && i < PROFILE_TOP; i++) {
+        profile_row_t *r = &pcs.rows[i];
+        profile_disasm(profile_ram_word(m, r->a), mnemonic, text);
+        profile_addr_name(r->a, name2, sizeof(name2));
+        fprintf(f, "  %-34s %12llu %7.2f%%  %s\n", name2, (unsigned long long)r->n, profile_pct(r->n, total), text);
+    }
+
+    if (profile_period == 1) fprintf(f, "\nblocos basicos                         entradas  instr  instr*entradas\n");
+    else fprintf(f, "\nblocos basicos (estaticos)             amostras        %%  instr\n");
+    for (uint32_t i = 0; i < blocks.count && i < PROFILE_TOP; i++) {
+        profile_row_t *r = &blocks.rows[i];
+        profile_addr_name(r->a, name2, sizeof(name2));
+        if (profile_period == 1) {
+            fprintf(f, "  %-34s %12llu %6u %15llu\n", name2, (unsigned long long)r->m, r->b, (unsigned long long)r->n);
         } else {
-            last_trap_pc = mepc;
-            last_trap_cause = mcause;
-            fprintf(outfile, ">%s                   cause=0x%08x,epc=0x%08x,tval=0x%08x\n", get_trap_name(mcause), mcause, mepc, mtval);
-            
-            // Lógica para pular a instrução se não houver handler
-            if (mtvec == 0) {
-                pc = mepc + 4; 
+            fprintf(f, "  %-34s %12llu %7.2f%% %6u\n", name2, (unsigned long long)r->n, profile_pct(r->n, total), r->b);
+        }
+    }
+
+    fprintf(f, "\nchamadas                                  vezes\n");
+    for (uint32_t i = 0; i < calls.count && i < PROFILE_TOP; i++) {
+        profile_row_t *r = &calls.rows[i];
+        snprintf(text, sizeof(text), "%s -> %s", profile_name(r->a, name), profile_name(r->b, name2));
+        fprintf(f, "  %-34s %12llu\n", text, (unsigned long long)r->n);
+    }
+
+    fprintf(f, "\nopcodes                                amostras        %%\n");
+    for (uint32_t i = 0; i < opcodes.count; i++) {
+        profile_row_t *r = &opcodes.rows[i];
+        fprintf(f, "  %-34s %12llu %7.2f%%\n", mnemonics[r->a], (unsigned long long)r->n, profile_pct(r->n, total));
+    }
+
+    for (uint32_t k = 0; k < mnemonic_count; k++) free((char*)mnemonics[k]);
+    free(funcs.rows);
+    free(pcs.rows);
+    free(blocks.rows);
+    free(calls.rows);
+    free(opcodes.rows);
+}
+
+// Todo pc em que um bloco começou (alvos de saltos, inclusive indiretos,
+// instruções depois de desvios e entradas de traps), um por linha: os alvos
+// do poxim-aot.
+void profile_write_targets(FILE *f, machine_t *m) {
+    for (uint32_t i = 0; i < memory_size / 4; i++) {
+        for (uint32_t h = 0; h < m->hart_count; h++) {
+            profile_t *p = m->harts[h].profile;
+            if (p && p->block_entries[i]) {
+                fprintf(f, "0x%08x\n", PC_START_ADDRESS + i * 4);
+                break;
             }
         }
-        trap_pending_print = 0;
+    }
+}
+
+// Grava <prefixo>.folded, <prefixo>.txt e <prefixo>.targets. Sem
+// --profile-symbols, os nomes vêm do próprio programa quando ele é um ELF.
+int profile_write(machine_t *m, const char *prefix, const char *program) {
+    if (profile_symbols_path) profile_load_symbols(profile_symbols_path, 1);
+    else profile_load_symbols(program, 0);
+
+    size_t len = strlen(prefix) + 9;
+    char *path = (char*)malloc(len);
+    int ok = 1;
+    snprintf(path, len, "%s.folded", prefix);
+    FILE *f = fopen(path, "w");
+    if (f) {
+        profile_write_folded(f, m);
+        fclose(f);
     } else {
-        // A instrução executou com sucesso.
-        if (strlen(details_buffer) > 0) {
-            fprintf(outfile, "0x%08x:%s\n", current_instruction_pc, details_buffer);
+        perror("Erro ao criar o arquivo do perfil");
+        ok = 0;
+    }
+    snprintf(path, len, "%s.txt", prefix);
+    f = fopen(path, "w");
+    if (f) {
+        profile_write_report(f, m);
+        fclose(f);
+    } else {
+        perror("Erro ao criar o relatorio do perfil");
+        ok = 0;
+    }
+    snprintf(path, len, "%s.targets", prefix);
+    f = fopen(path, "w");
+    if (f) {
+        profile_write_targets(f, m);
+        fclose(f);
+    } else {
+        perror("Erro ao criar a lista de alvos do perfil");
+        ok = 0;
+    }
+    free(path);
+    profile_free_symbols();
+    return ok;
+}
+
+// --- Modelo de Tempo (--timing) ---
+// Ciclos aproximados de um núcleo simples, em ordem. Cada instrução custa o
+// ciclo do seu passo de mtime mais as paradas:
+//  - busca: cache de instruções associativo por conjunto (LRU), consultado só
+//    quando o pc muda de linha; uma falta custa 'imiss' ciclos;
+//  - loads, stores e AMOs na RAM passam pelo cache de dados (stores também
+//    alocam a linha; write-back não é modelado), com 'dmiss' ciclos por falta;
+//    MMIO não tem cache e cada acesso leva 'mmio' ciclos;
+//  - mul/mulh* levam 'mul' ciclos e div/rem 'div' ciclos, no total;
+//  - desvios condicionais são previstos por contadores de 2 bits por pc, e
+//    saltos indiretos por uma pilha de retornos (jalr zero, 0(ra)) e pelo
+//    último destino de cada jalr; um erro de previsão e cada trap custam
+//    'branch' ciclos.
+// As paradas avançam mtime (mcycle, o CLINT e a UART andam junto) e somam em
+// stall_ticks, que hart_instret desconta. Como o perfil, o modelo só existe
+// nos laços do cache de instruções, que ganham versões próprias (o custo fica
+// nelas); as voltas puladas de laços ociosos contam um ciclo por instrução.
+#define TIMING_MAX_WAYS 16
+#define TIMING_BHT_ENTRIES 4096
+#define TIMING_BTB_ENTRIES 256
+#define TIMING_RAS_DEPTH 8
+
+// Motivos das paradas
+#define TIMING_STALL_ICACHE 0
+#define TIMING_STALL_DCACHE 1
+#define TIMING_STALL_MULDIV 2
+#define TIMING_STALL_BRANCH 3
+#define TIMING_STALL_MMIO   4
+#define TIMING_STALL_TRAP   5
+#define TIMING_STALLS       6
+
+typedef struct {
+    uint32_t size, ways, line; // bytes, vias e bytes por linha; size 0 = cache ideal
+} timing_cache_config_t;
+
+typedef struct {
+    timing_cache_config_t icache, dcache;
+    uint32_t imiss, dmiss, mul, div, branch, mmio; // ciclos
+} timing_config_t;
+
+int timing_enabled;  // --timing
+timing_config_t timing_config = { {8192, 2, 32}, {8192, 4, 32}, 20, 20, 3, 34, 3, 10 };
+
+typedef struct {
+    uint32_t ways, line_shift, set_mask;
+    uint32_t *lines; // por conjunto, da linha mais recente para a mais antiga; 0 = vazia
+} timing_cache_t;
+
+typedef struct {
+    uint64_t accesses, misses, cycles; // cycles: paradas causadas pela região
+} timing_region_t;
+
+struct timing {
+    timing_cache_t icache, dcache;
+    uint32_t fetch_line; // linha da última busca
+    uint32_t ram_region; // índice da RAM em mem_regions
+    uint8_t bht[TIMING_BHT_ENTRIES];
+    uint32_t btb[TIMING_BTB_ENTRIES];
+    uint32_t ras[TIMING_RAS_DEPTH], ras_top;
+
+    uint64_t fetches, fetch_misses;
+    uint64_t branches, branch_misses, jumps, jump_misses;
+    uint64_t stalls[TIMING_STALLS];
+    timing_region_t regions[MEM_MAX_REGIONS]; // acessos de dados, por região do mapa
+
+    // Estado do hart quando o modelo foi ligado (o --ff liga só no detalhe)
+    uint64_t start_mtime, start_instret, start_wfi;
+};
+
+static int timing_pow2(uint32_t x) { return x && !(x & (x - 1)); }
+
+// --timing=chave=valor,...: icache e dcache como <bytes>:<vias>:<linha> (ou
+// off, cache ideal) e as latências imiss, dmiss, mul, div, branch e mmio.
+int timing_parse(const char *spec) {
+    char *copy = strdup(spec), *save = NULL;
+    int ok = 1;
+    for (char *item = strtok_r(copy, ",", &save); item && ok; item = strtok_r(NULL, ",", &save)) {
+        char *value = strchr(item, '='), *end, extra;
+        ok = value != NULL;
+        if (!ok) break;
+        *value++ = '\0';
+        if (strcmp(item, "icache") == 0 || strcmp(item, "dcache") == 0) {
+            timing_cache_config_t *c = (item[0] == 'i') ? &timing_config.icache : &timing_config.dcache;
+            if (strcmp(value, "off") == 0) {
+                c->size = 0;
+                continue;
+            }
+            ok = sscanf(value, "%u:%u:%u%c", &c->size, &c->ways, &c->line, &extra) == 3 &&
+                 timing_pow2(c->size) && timing_pow2(c->ways) && timing_pow2(c->line) &&
+                 c->ways <= TIMING_MAX_WAYS && c->line >= 4 && c->size >= c->ways * c->line;
+            continue;
         }
-        
-        // Se o PC não foi alterado por um jump/branch, nós o incrementamos.
-        if (pc == current_instruction_pc) {
-            pc += 4;
+        uint32_t *latency = NULL;
+        if (strcmp(item, "imiss") == 0) latency = &timing_config.imiss;
+        else if (strcmp(item, "dmiss") == 0) latency = &timing_config.dmiss;
+        else if (strcmp(item, "mul") == 0) latency = &timing_config.mul;
+        else if (strcmp(item, "div") == 0) latency = &timing_config.div;
+        else if (strcmp(item, "branch") == 0) latency = &timing_config.branch;
+        else if (strcmp(item, "mmio") == 0) latency = &timing_config.mmio;
+        ok = latency != NULL;
+        if (ok) *latency = strtoul(value, &end, 0);
+        ok = ok && end != value && *end == '\0';
+        // mul, div e mmio contam o próprio ciclo da instrução
+        if (ok && latency != &timing_config.imiss && latency != &timing_config.dmiss &&
+            latency != &timing_config.branch) ok = *latency >= 1;
+    }
+    if (!ok) fprintf(stderr, "Parametro invalido em --timing: %s\n", spec);
+    free(copy);
+    return ok;
+}
+
+void timing_cache_init(timing_cache_t *c, const timing_cache_config_t *config) {
+    if (config->size == 0) return;
+    uint32_t sets = config->size / (config->ways * config->line);
+    c->ways = config->ways;
+    c->line_shift = __builtin_ctz(config->line);
+    c->set_mask = sets - 1;
+    c->lines = (uint32_t*)calloc((size_t)sets * c->ways, sizeof(uint32_t));
+}
+
+timing_t *timing_new(const hart_t *h) {
+    timing_t *t = (timing_t*)calloc(1, sizeof(timing_t));
+    timing_cache_init(&t->icache, &timing_config.icache);
+    timing_cache_init(&t->dcache, &timing_config.dcache);
+    memset(t->bht, 1, sizeof(t->bht)); // fracamente "não toma"
+    t->ram_region = mem_find(PC_START_ADDRESS, 1) - machine->mem_regions;
+    t->start_mtime = h->mtime;
+    t->start_instret = hart_instret(h);
+    t->start_wfi = h->wfi_ticks;
+    return t;
+}
+
+void timing_free(timing_t *t) {
+    if (!t) return;
+    free(t->icache.lines);
+    free(t->dcache.lines);
+    free(t);
+}
+
+uint64_t timing_counter(const timing_t *t, uint32_t event) {
+    if (!t) return 0;
+    switch (event) {
+        case HPM_EVENT_ICACHE_MISSES: return t->fetch_misses;
+        case HPM_EVENT_DCACHE_MISSES: {
+            uint64_t misses = 0; // só RAM e ROM têm faltas
+            for (uint32_t r = 0; r < MEM_MAX_REGIONS; r++) misses += t->regions[r].misses;
+            return misses;
         }
+        case HPM_EVENT_BRANCH_MISSES: return t->branch_misses + t->jump_misses;
+        default: return 0;
     }
 }
-    // Fecha todos os arquivos abertos
-    fclose(outfile);
-    if(uart_outfile) fclose(uart_outfile);
-    if(uart_infile) fclose(uart_infile); // --- ADICIONADO ---
-    
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+
+// Retorna 1 se a linha estava no cache; em qualquer caso ela vira a mais recente
+// do conjunto. Linhas da RAM nunca são 0, o valor das vias vazias.
+static inline __attribute__((always_inline))
+int timing_cache_access(timing_cache_t *c, uint32_t line) {
+    uint32_t *set = c->lines + (line & c->set_mask) * c->ways;
+    if (set[0] == line) return 1;
+    uint32_t way = 1;
+    while (way < c->ways && set[way] != line) way++;
+    int hit = way < c->ways;
+    if (!hit) way = c->ways - 1;
+    memmove(set + 1, set, way * sizeof(uint32_t));
+    set[0] = line;
+    return hit;
+}
+
+static inline __attribute__((always_inline))
+void timing_stall(timing_t *t, uint32_t reason, uint64_t cycles) {
+    t->stalls[reason] += cycles;
+    hart->mtime += cycles;
+    hart->stall_ticks += cycles;
+}
+
+void timing_data(timing_t *t, uint32_t address) {
+    mem_region_t *region = (address - PC_START_ADDRESS < memory_size) ? &machine->mem_regions[t->ram_region] :
+                           mem_find(address, 1);
+    if (!region) return;
+    timing_region_t *r = &t->regions[region - machine->mem_regions];
+    r->accesses++;
+    if (region->host) { // RAM e ROM passam pelo cache de dados
+        if (t->dcache.ways && !timing_cache_access(&t->dcache, address >> t->dcache.line_shift)) {
+            r->misses++;
+            r->cycles += timing_config.dmiss;
+            timing_stall(t, TIMING_STALL_DCACHE, timing_config.dmiss);
+        }
+        return;
+    }
+    r->cycles += timing_config.mmio - 1;
+    timing_stall(t, TIMING_STALL_MMIO, timing_config.mmio - 1);
+}
+
+static inline void timing_ras_push(timing_t *t, uint32_t ret) {
+    t->ras_top = (t->ras_top + 1) & (TIMING_RAS_DEPTH - 1);
+    t->ras[t->ras_top] = ret;
+}
+
+void timing_jalr(timing_t *t, const decoded_insn_t *d, uint32_t pc) {
+    uint32_t target = hart->pc, predicted;
+    if (d->rd == 0 && d->rs1 == 1) {
+        predicted = t->ras[t->ras_top];
+        t->ras_top = (t->ras_top - 1) & (TIMING_RAS_DEPTH - 1);
+    } else {
+        uint32_t *entry = &t->btb[(pc >> 2) & (TIMING_BTB_ENTRIES - 1)];
+        predicted = *entry;
+        *entry = target;
+    }
+    if (d->rd == 1) timing_ras_push(t, pc + 4);
+    t->jumps++;
+    if (predicted != target) {
+        t->jump_misses++;
+        timing_stall(t, TIMING_STALL_BRANCH, timing_config.branch);
+    }
+}
+
+// Antes de executar: a busca, e o endereço de dados da instrução (o load pode
+// sobrescrever rs1).
+static inline __attribute__((always_inline))
+uint32_t timing_fetch(timing_t *t, const decoded_insn_t *d, uint32_t pc) {
+    t->fetches++;
+    uint32_t line = pc >> t->icache.line_shift;
+    if (line != t->fetch_line && t->icache.ways) {
+        t->fetch_line = line;
+        if (!timing_cache_access(&t->icache, line)) {
+            t->fetch_misses++;
+            timing_stall(t, TIMING_STALL_ICACHE, timing_config.imiss);
+        }
+    }
+    return hart->regs[d->rs1] + ((d->raw & 0x7F) == 0x2F ? 0 : d->imm);
+}
+
+// Depois de executar sem trap (o trap paga em timing_trap).
+static inline __attribute__((always_inline))
+void timing_retire(timing_t *t, const decoded_insn_t *d, uint32_t pc, uint32_t address) {
+    uint32_t raw = d->raw;
+    switch (raw & 0x7F) {
+        case 0x03:
+            if (d->handler != exec_nop) timing_data(t, address);
+            break;
+        case 0x23: case 0x2F:
+            timing_data(t, address);
+            break;
+        case 0x33:
+            if ((raw >> 25) == 0x01) {
+                timing_stall(t, TIMING_STALL_MULDIV, ((raw & 0x4000) ? timing_config.div : timing_config.mul) - 1);
+            }
+            break;
+        case 0x63: {
+            uint8_t *counter = &t->bht[(pc >> 2) & (TIMING_BHT_ENTRIES - 1)];
+            int taken = hart->pc != pc;
+            t->branches++;
+            if ((*counter >= 2) != taken) {
+                t->branch_misses++;
+                timing_stall(t, TIMING_STALL_BRANCH, timing_config.branch);
+            }
+            if (taken && *counter < 3) (*counter)++;
+            else if (!taken && *counter > 0) (*counter)--;
+            break;
+        }
+        case 0x6F:
+            if (d->rd == 1) timing_ras_push(t, pc + 4);
+            break;
+        case 0x67:
+            timing_jalr(t, d, pc);
+            break;
+    }
+}
+
+static inline void timing_trap(timing_t *t) { timing_stall(t, TIMING_STALL_TRAP, timing_config.branch); }
+
+const char *timing_region_name(const mem_region_t *r) {
+    if (r->host) return (r->widths & MEM_READONLY) ? "ROM" : "RAM";
+    if (r->read == clint_read) return "CLINT";
+    if (r->read == plic_read) return "PLIC";
+    if (r->read == uart_read) return "UART";
+    if (r->read == blk_read) return "BLK";
+    return "MMIO";
+}
+
+static double timing_percent(uint64_t part, uint64_t total) { return total ? 100.0 * part / total : 0.0; }
+
+void timing_report_cache(FILE *f, const char *name, const timing_cache_config_t *c) {
+    if (c->size) fprintf(f, "%-14s%u B, %u vias, linhas de %u B\n", name, c->size, c->ways, c->line);
+    else fprintf(f, "%-14sideal (sem simulacao)\n", name);
+}
+
+// Relatório no stderr ao fim: CPI, paradas por motivo e faltas por região.
+void timing_report(FILE *f, machine_t *m) {
+    for (uint32_t i = 0; i < m->hart_count; i++) {
+        const hart_t *h = &m->harts[i];
+        const timing_t *t = h->timing;
+        if (!t) continue;
+        uint64_t instret = hart_instret(h) - t->start_instret, wfi = h->wfi_ticks - t->start_wfi;
+        uint64_t cycles = h->mtime - t->start_mtime;
+        fprintf(f, "--- modelo de tempo (hart %u) ---\n", i);
+        fprintf(f, "instrucoes:   %llu\n", (unsigned long long)instret);
+        fprintf(f, "ciclos:       %llu (%llu em wfi)\n", (unsigned long long)cycles, (unsigned long long)wfi);
+        fprintf(f, "CPI:          %.3f (sem wfi)\n", instret ? (double)(cycles - wfi) / instret : 0.0);
+        fprintf(f, "paradas:      cache I %llu, cache D %llu, mul/div %llu, desvios %llu, MMIO %llu, traps %llu\n",
+                (unsigned long long)t->stalls[TIMING_STALL_ICACHE], (unsigned long long)t->stalls[TIMING_STALL_DCACHE],
+                (unsigned long long)t->stalls[TIMING_STALL_MULDIV], (unsigned long long)t->stalls[TIMING_STALL_BRANCH],
+                (unsigned long long)t->stalls[TIMING_STALL_MMIO], (unsigned long long)t->stalls[TIMING_STALL_TRAP]);
+        timing_report_cache(f, "cache I:", &timing_config.icache);
+        timing_report_cache(f, "cache D:", &timing_config.dcache);
+        fprintf(f, "desvios:      %llu, %llu mal previstos (%.2f%%)\n", (unsigned long long)t->branches,
+                (unsigned long long)t->branch_misses, timing_percent(t->branch_misses, t->branches));
+        fprintf(f, "saltos jalr:  %llu, %llu mal previstos (%.2f%%)\n", (unsigned long long)t->jumps,
+                (unsigned long long)t->jump_misses, timing_percent(t->jump_misses, t->jumps));
+        fprintf(f, "%-14s%-12s%14s%12s%9s%14s\n", "regiao", "base", "acessos", "faltas", "taxa", "ciclos");
+        const mem_region_t *ram = &m->mem_regions[t->ram_region];
+        fprintf(f, "%-14s0x%08x  %14llu%12llu%8.2f%%%14llu\n", "RAM (busca)", ram->base, (unsigned long long)t->fetches,
+                (unsigned long long)t->fetch_misses, timing_percent(t->fetch_misses, t->fetches),
+                (unsigned long long)t->stalls[TIMING_STALL_ICACHE]);
+        for (uint32_t r = 0; r < m->mem_region_count; r++) {
+            const timing_region_t *s = &t->regions[r];
+            if (!s->accesses) continue;
+            char name[32];
+            snprintf(name, sizeof(name), "%s%s", timing_region_name(&m->mem_regions[r]), r == t->ram_region ? " (dados)" : "");
+            fprintf(f, "%-14s0x%08x  %14llu%12llu%8.2f%%%14llu\n", name, m->mem_regions[r].base,
+                    (unsigned long long)s->accesses, (unsigned long long)s->misses,
+                    timing_percent(s->misses, s->accesses), (unsigned long long)s->cycles);
+        }
+    }
+}
+
+// --- Laço Principal ---
+// Níveis de trace. Com TRACE_TRAPS só as linhas de trap ('>') são escritas e
+// com TRACE_NONE nada é escrito; a execução é a mesma nos três níveis.
+#define TRACE_NONE  0
+#define TRACE_TRAPS 1
+#define TRACE_FULL  2
+
+// Motores de execução (--engine=).
+#define ENGINE_CACHE 0
+#define ENGINE_REF   1
+#define ENGINE_JIT   2
+#define ENGINE_AOT   3
+
+// --- Tratamento de Interrupções (pode gerar um trap) ---
+// Checagem completa. Depois dela, enquanto nada for escrito, a próxima
+// checagem só pode ter resultado diferente quando mtime alcançar mtimecmp ou o
+// próximo evento da UART (uart_tick): mip já reflete o PLIC e, se havia interrupção habilitada, o trap já foi
+// gerado aqui (e mret/CSRs acordam o escalonador de novo).
+void update_interrupts(uint32_t current_instruction_pc) {
+    uint32_t wakes = __atomic_load_n(&hart->wake_count, __ATOMIC_ACQUIRE);
+    mmio_enter();
+    uint64_t uart_deadline = uart_tick();
+    if (hart->mtimecmp != (uint64_t)-1 && hart->mtime >= hart->mtimecmp) {
+        mip_set(hart, 1 << 7);
+    }
+    // MEIP acompanha o PLIC: cai depois do complete se a fonte não pediu de novo.
+    if (plic_visible(hart->mhartid)) {
+        mip_set(hart, 1 << 11);
+    } else {
+        mip_clear(hart, 1 << 11);
+    }
+    mmio_leave();
+
+    // As interrupções delegadas em mideleg são do modo S: valem abaixo dele ou
+    // nele com SIE. As outras valem abaixo do modo M ou com MIE.
+    uint32_t enabled = 0;
+    if (hart->priv != PRIV_M || (hart->mstatus & (1 << 3))) enabled |= ~hart->mideleg;
+    if (hart->priv == PRIV_U || (hart->priv == PRIV_S && (hart->mstatus & MSTATUS_SIE))) enabled |= hart->mideleg;
+    uint32_t pending_and_enabled = hart->mip & hart->mie & enabled;
+    if (pending_and_enabled) {
+        uint32_t trap_cause = 0;
+        if (pending_and_enabled & (1 << 11)) trap_cause = 0x8000000B; // External
+        else if (pending_and_enabled & (1 << 3)) trap_cause = 0x80000003; // Software
+        else if (pending_and_enabled & (1 << 7)) trap_cause = 0x80000007; // Timer
+        else if (pending_and_enabled & (1 << 9)) trap_cause = 0x80000009; // External do modo S
+        else if (pending_and_enabled & (1 << 1)) trap_cause = 0x80000001; // Software do modo S
+        else if (pending_and_enabled & (1 << 5)) trap_cause = 0x80000005; // Timer do modo S
+
+        if (trap_cause != 0) {
+             trigger_trap(trap_cause, 0, current_instruction_pc);
+        }
+    }
+
+    if (hart->trap_pending_print) hart->irq_next_check = 0;
+    else if (hart->mtimecmp == (uint64_t)-1 || (hart->mip & (1 << 7))) hart->irq_next_check = uart_deadline;
+    else hart->irq_next_check = (hart->mtimecmp < uart_deadline) ? hart->mtimecmp : uart_deadline;
+    // outro hart mudou algo durante a checagem: olha de novo na próxima instrução
+    if (__atomic_load_n(&hart->wake_count, __ATOMIC_ACQUIRE) != wakes) hart->irq_next_check = 0;
+
+    // --checkpoint-at: o passo que leva mtime até stop_at é o último. Wfi,
+    // laços ociosos e blocos do JIT nunca passam de irq_next_check, então a
+    // parada acontece exatamente nesse instante em todos os motores.
+    if (hart->mtime >= hart->stop_at) machine_halt(MACHINE_CHECKPOINT);
+    else if (hart->stop_at < hart->irq_next_check) hart->irq_next_check = hart->stop_at;
+    hart->event_check = hart->irq_next_check;
+
+    // --ff=N: a instrução atual já conta em hart_instret, a não ser que o passo
+    // vire trap. A parada é mais um prazo, que o wfi ignora (o tempo dele não
+    // conta instruções) e os laços ociosos respeitam (ver idle_skip).
+    if (hart->stop_instret != UINT64_MAX) {
+        uint64_t done = hart_instret(hart) - (hart->trap_pending_print != 0);
+        if (done >= hart->stop_instret) machine_halt(MACHINE_CHECKPOINT);
+        else if (hart->irq_next_check > hart->mtime && hart->stop_instret - done < hart->irq_next_check - hart->mtime) {
+            hart->irq_next_check = hart->mtime + (hart->stop_instret - done);
+        }
+    }
+
+    // --profile-period > 1: a próxima amostra é mais um prazo, que o wfi e os
+    // laços ociosos ignoram (ver hart_next_event). O tempo pulado
+    // por wfi e laços ociosos conta uma amostra só: o perfil é do que executa.
+    profile_t *p = hart->profile;
+    if (p && p->period > 1) {
+        if (hart->mtime >= hart->profile_next) {
+            profile_sample(p, current_instruction_pc, 1);
+            hart->profile_next = hart->mtime + p->period;
+        }
+        if (hart->profile_next < hart->irq_next_check) hart->irq_next_check = hart->profile_next;
+    }
+}
+
+// Chamada antes de cada instrução. mtime avança sempre; o resto só quando um
+// prazo foi alcançado ou algo relevante foi escrito.
+static inline __attribute__((always_inline))
+void check_interrupts(uint32_t current_instruction_pc) {
+    hart->mtime++;
+    if (hart->mtime >= hart->irq_next_check) update_interrupts(current_instruction_pc);
+}
+
+// --- Laços Ociosos ---
+// Um laço curto cujo corpo só tem ALU e loads sem efeito colateral (RAM, CLINT,
+// PLIC e o LSR da UART), fechado por um desvio para trás, e que volta ao início
+// com os mesmos valores nos registradores que lê antes de escrever, repete a
+// volta anterior até que algum load veja outro valor. A RAM e o PLIC só mudam
+// em eventos do escalonador; mtime e o LSR são avaliados no instante de cada
+// volta (idle_iterate). Então mtime avança de uma vez pelas voltas que dariam o
+// mesmo resultado, sem chegar ao próximo prazo do escalonador, e a execução
+// segue na volta seguinte. Se nada pode mudar o resultado, a simulação termina.
+//
+// A checagem roda a cada desvio para trás de até IDLE_MAX_INSNS instruções nos
+// três motores, e só sem trace completo (as voltas puladas não são gravadas).
+// Um laço que chega IDLE_MAX_MISSES vezes seguidas com entradas diferentes
+// (contador, ponteiro) vai para idle_rejected e o JIT passa a ligar o desvio.
+#define IDLE_MAX_INSNS 8
+#define IDLE_MAX_MISSES 16
+#define IDLE_SLOTS 64
+#define IDLE_MAX_SKIP (1ull << 30) // ticks por avanço quando mtime é lido
+
+// Entradas que mudam com o tempo, vistas por idle_iterate().
+#define IDLE_INPUT_MTIME 1
+#define IDLE_INPUT_UART  2
+
+typedef struct {
+    uint32_t head, tail, length;
+    uint32_t live;    // registradores lidos antes de escritos no corpo
+    uint32_t misses;
+    int has_snapshot;
+    uint32_t snapshot[NUM_REGISTERS];
+    decoded_insn_t body[IDLE_MAX_INSNS];
+} idle_loop_t;
+
+__thread idle_loop_t idle_loops[IDLE_SLOTS];
+int idle_skip_enabled = 1; // --no-idle-skip; cada máquina guarda o seu em idle_skip
+
+// Decodifica o corpo [head, tail]. Retorna 0 se alguma instrução tem efeito
+// colateral ou desvia antes do fim.
+int idle_analyze(idle_loop_t *e, uint32_t head, uint32_t tail) {
+    uint32_t written = 1;
+    e->head = head;
+    e->tail = tail;
+    e->length = (tail - head) / 4 + 1;
+    e->live = 0;
+    e->misses = 0;
+    e->has_snapshot = 0;
+    for (uint32_t i = 0; i < e->length; i++) {
+        decoded_insn_t *d = &e->body[i];
+        decode_instruction(mem_load_le(machine->memory + (head - PC_START_ADDRESS) + 4 * i, 4), d);
+        uint32_t opcode = get_opcode(d->raw), reads = 0;
+        if (d->handler == exec_illegal) return 0;
+        if (i == e->length - 1) {
+            if (opcode == 0x63) reads = (1u << d->rs1) | (1u << d->rs2);
+            else if (opcode != 0x6F) return 0;
+        } else if (opcode == 0x03 || opcode == 0x13) {
+            if (d->handler != exec_nop) reads = 1u << d->rs1;
+        } else if (opcode == 0x33) {
+            reads = (1u << d->rs1) | (1u << d->rs2);
+        } else if (opcode != 0x37 && opcode != 0x17 && d->handler != exec_nop) {
+            return 0;
+        }
+        e->live |= reads & ~written;
+        if (opcode != 0x63) written |= 1u << d->rd;
+    }
+    return 1;
+}
+
+int idle_body_matches(const idle_loop_t *e) {
+    for (uint32_t i = 0; i < e->length; i++) {
+        if (mem_load_le(machine->memory + (e->head - PC_START_ADDRESS) + 4 * i, 4) != e->body[i].raw) return 0;
+    }
+    return 1;
+}
+
+// Executa uma volta do corpo como se ela começasse em mtime == t, sem deixar
+// rastro no estado. Retorna 1 se a volta termina no desvio para head, 0 se ela
+// sai do laço e -1 se um load não é permitido (falha ou registrador com efeito
+// colateral, como o RBR da UART).
+int idle_iterate(const idle_loop_t *e, uint64_t t, int *inputs) {
+    uint32_t saved_regs[NUM_REGISTERS], saved_pc = hart->pc;
+    memcpy(saved_regs, hart->regs, sizeof(hart->regs));
+    int result = 1;
+    for (uint32_t i = 0; i + 1 < e->length && result == 1; i++) {
+        const decoded_insn_t *d = &e->body[i];
+        if (get_opcode(d->raw) != 0x03 || d->handler == exec_nop) {
+            d->handler(d, e->head + 4 * i);
+            hart->regs[0] = 0;
+            continue;
+        }
+        insn_handler_t h = d->handler;
+        uint32_t size = (h == exec_lw) ? 4 : (h == exec_lh || h == exec_lhu) ? 2 : 1;
+        uint32_t address = hart->regs[d->rs1] + d->imm, value = 0;
+        mem_region_t *r = (address & (size - 1)) ? NULL : mem_find(address, size);
+        if (!r || (!r->host && !(r->widths & size))) result = -1;
+        else if (r->host) value = mem_load_le(r->host + (address - r->base), size);
+        else if (r->read == clint_read) {
+            uint64_t now = hart->mtime;
+            hart->mtime = t + i + 1; // check_interrupts() já contou esta instrução
+            value = clint_read(address - r->base, size);
+            hart->mtime = now;
+            *inputs |= IDLE_INPUT_MTIME;
+        } else if (r->read == plic_read) value = plic_read(address - r->base, size);
+        else if (r->read == uart_read && address - r->base == 5) {
+            value = uart_lsr_at(t + i + 1);
+            *inputs |= IDLE_INPUT_UART;
+        } else result = -1;
+        if (h == exec_lb) value = (int32_t)(int8_t)value;
+        else if (h == exec_lh) value = (int32_t)(int16_t)value;
+        hart->regs[d->rd] = value;
+    }
+    if (result == 1) {
+        const decoded_insn_t *d = &e->body[e->length - 1];
+        hart->pc = e->tail;
+        d->handler(d, e->tail);
+        result = (hart->pc == e->head);
+    }
+    memcpy(hart->regs, saved_regs, sizeof(hart->regs));
+    hart->pc = saved_pc;
+    return result;
+}
+
+// Avança mtime pelas próximas voltas que repetem a atual. A volta j começa em
+// mtime + j * length; pular k voltas faz as checagens de interrupção delas
+// (até mtime + k * length) e todas precisam ficar antes de irq_next_check.
+// Retorna 0 se o laço não pode ser ocioso.
+int idle_skip(idle_loop_t *e) {
+    int inputs = 0;
+    uint64_t now = hart->mtime, length = e->length;
+    int first = idle_iterate(e, now, &inputs);
+    if (first != 1) return first == 0;
+
+    uint64_t next_event = hart_next_event();
+    // --ff=N: as voltas puladas são instruções, então param antes da instrução de parada.
+    if (hart->stop_instret != UINT64_MAX) {
+        uint64_t done = hart_instret(hart);
+        uint64_t stop = now + (hart->stop_instret > done ? hart->stop_instret - done : 0);
+        if (stop < next_event) next_event = stop;
+    }
+    uint64_t limit = (next_event > now) ? (next_event - now - 1) / length : 0;
+    int waiting_host = !machine->uart_rx_eof && machine->uart_rx_tail == machine->uart_rx_head;
+    if ((inputs & IDLE_INPUT_UART) && waiting_host && limit > UART_RX_POLL_TICKS / length) {
+        limit = UART_RX_POLL_TICKS / length; // a entrada do host pode chegar a qualquer momento
+    }
+    uint64_t skip = limit;
+    if (inputs) {
+        if (limit > IDLE_MAX_SKIP / length) limit = IDLE_MAX_SKIP / length;
+        // Busca exponencial e depois binária pela primeira volta que sai (o
+        // resultado das comparações com mtime e com o LSR só muda uma vez).
+        uint64_t good = 0, bad = limit + 1, step = 1;
+        while (good < limit) {
+            uint64_t probe = (step < limit - good) ? good + step : limit;
+            if (idle_iterate(e, now + probe * length, &inputs) != 1) { bad = probe; break; }
+            good = probe;
+            step *= 2;
+        }
+        while (bad - good > 1) {
+            uint64_t mid = good + (bad - good) / 2;
+            if (idle_iterate(e, now + mid * length, &inputs) == 1) good = mid;
+            else bad = mid;
+        }
+        skip = (good + 1 < limit) ? good + 1 : limit;
+        // Só o LSR, já estável e sem eventos pela frente: nada mais muda.
+        if (!(inputs & IDLE_INPUT_MTIME) && !waiting_host && next_event == UINT64_MAX && bad > limit) {
+            idle_halt(e->tail);
+            return 1;
+        }
+    } else if (next_event == UINT64_MAX) {
+        idle_halt(e->tail);
+        return 1;
+    }
+    hart->mtime += skip * length;
+    return 1;
+}
+
+// Chamada depois que o desvio em tail voltou para head (head < tail).
+void idle_check(uint32_t head, uint32_t tail) {
+    if (hart->translate) return; // a análise lê o laço pelo endereço físico
+    uint32_t slot = (tail - PC_START_ADDRESS) >> 2;
+    if (tail - PC_START_ADDRESS >= memory_size || idle_rejected[slot]) return; // só laços da RAM principal
+    code_touch(slot >> (CODE_CHUNK_SHIFT - 2)); // o fence.i limpa idle_rejected[slot]
+    if (hart->stop_pc_hits && hart->stop_pc - head <= tail - head) return; // cada chegada em --ff-pc conta
+    // jalr para trás não é laço; não mexe na tabela (o JIT nunca chega aqui)
+    uint32_t opcode = machine->memory[tail - PC_START_ADDRESS] & 0x7F;
+    if (opcode != 0x63 && opcode != 0x6F) return;
+
+    idle_loop_t *e = &idle_loops[slot % IDLE_SLOTS];
+    if (e->head != head || e->tail != tail || !idle_body_matches(e)) {
+        if (head - PC_START_ADDRESS >= memory_size || !idle_analyze(e, head, tail)) {
+            e->head = e->tail = 0;
+            idle_rejected[slot] = 1;
+            return;
+        }
+    }
+    int same = e->has_snapshot;
+    for (uint32_t r = 1; r < NUM_REGISTERS && same; r++) {
+        if (((e->live >> r) & 1) && e->snapshot[r] != hart->regs[r]) same = 0;
+    }
+    if (same) {
+        e->misses = 0;
+        if (!idle_skip(e)) {
+            e->head = e->tail = 0;
+            idle_rejected[slot] = 1;
+            return;
+        }
+    } else if (e->has_snapshot && ++e->misses > IDLE_MAX_MISSES) {
+        e->head = e->tail = 0;
+        idle_rejected[slot] = 1;
+        return;
+    }
+    memcpy(e->snapshot, hart->regs, sizeof(hart->regs));
+    e->has_snapshot = 1;
+}
+
+// --- Filtros do Trace ---
+// Com --trace=full, escolhem as instruções que viram linha (ou registro no
+// trace binário). A faixa de pc e a janela de instruções são conferidas antes
+// de qualquer cópia de operandos: uma instrução fora delas passa pelo mesmo
+// caminho do laço sem trace, com duas comparações a mais. Mudanças de
+// registrador/CSR e a amostragem são conferidas depois da execução, antes de
+// formatar. As linhas de trap sempre saem (--trace=traps dá só elas).
+#define TRACE_MAX_RANGES 16
+
+typedef struct {
+    uint32_t lo, hi; // [lo, hi)
+} trace_range_t;
+
+trace_range_t trace_ranges[TRACE_MAX_RANGES];
+uint32_t trace_range_count;
+const char *trace_pc_specs[TRACE_MAX_RANGES]; // --trace-pc, resolvidos em trace_resolve_ranges
+uint32_t trace_pc_spec_count;
+uint64_t trace_from = 0, trace_count = UINT64_MAX; // janela, em instruções retiradas pelo hart
+uint64_t trace_sample = 1;                          // --trace-sample=K: uma linha a cada K
+int trace_changes_only;                             // --trace-changes
+int trace_filtered;                                 // algum dos filtros acima
+
+// Antes da instrução: faixa de pc e janela.
+static inline __attribute__((always_inline)) int trace_selected(uint32_t pc) {
+    if (!trace_filtered) return 1;
+    uint64_t index = hart_instret(hart) - 1; // a instrução atual já conta
+    if (index < trace_from || index - trace_from >= trace_count) return 0;
+    if (trace_range_count == 0) return 1;
+    for (uint32_t i = 0; i < trace_range_count; i++) {
+        if (pc - trace_ranges[i].lo < trace_ranges[i].hi - trace_ranges[i].lo) return 1;
+    }
+    return 0;
+}
+
+// Depois da instrução selecionada: mudou algum registrador ou CSR, e a amostragem.
+static inline int trace_kept(uint32_t insn, uint32_t rd_old, uint32_t rd_new, uint32_t csr_old, uint32_t csr_new) {
+    if (!trace_filtered) return 1;
+    if (trace_changes_only && !(trace_insn_writes_rd(insn) && get_rd(insn) != 0 && rd_old != rd_new) &&
+        !(trace_insn_is_csr(insn) && csr_old != csr_new)) return 0;
+    return trace_sample == 1 || hart->trace_sampled++ % trace_sample == 0;
+}
+
+// Nome de símbolo em --trace-pc: do símbolo até o próximo endereço com símbolo.
+int trace_symbol_range(const char *name, trace_range_t *r) {
+    for (uint32_t i = 0; i < profile_symbol_count; i++) {
+        if (strcmp(profile_symbols[i].name, name) != 0) continue;
+        r->lo = profile_symbols[i].addr;
+        r->hi = PC_START_ADDRESS + memory_size;
+        for (uint32_t k = i + 1; k < profile_symbol_count; k++) {
+            if (profile_symbols[k].addr > r->lo) {
+                r->hi = profile_symbols[k].addr;
+                break;
+            }
+        }
+        return r->hi > r->lo;
+    }
+    return 0;
+}
+
+// Endereço de --trace-pc: sempre em hex, com ou sem "0x". 0 se não começa com
+// um dígito ou não cabe em 32 bits.
+int trace_parse_addr(const char *s, uint32_t *value, char **end) {
+    *end = (char*)s;
+    if (!*s || !strchr("0123456789abcdefABCDEF", *s)) return 0;
+    errno = 0;
+    uint64_t v = strtoull(s, end, 16);
+    if (errno || v > UINT32_MAX) return 0;
+    *value = (uint32_t)v;
+    return 1;
+}
+
+// Cada --trace-pc é uma lista "início-fim" (em hex, fim exclusivo) ou nomes de
+// símbolo, separados por vírgula. Os nomes vêm de --profile-symbols ou do
+// próprio programa, se for ELF.
+int trace_resolve_ranges(const char *program) {
+    int ok = 1;
+    if (profile_symbols_path) profile_load_symbols(profile_symbols_path, 1);
+    else if (program) profile_load_symbols(program, 0);
+    for (uint32_t s = 0; s < trace_pc_spec_count && ok; s++) {
+        char *copy = strdup(trace_pc_specs[s]), *save = NULL;
+        for (char *item = strtok_r(copy, ",", &save); item && ok; item = strtok_r(NULL, ",", &save)) {
+            trace_range_t *r = &trace_ranges[trace_range_count];
+            char *end;
+            if (trace_range_count == TRACE_MAX_RANGES) {
+                fprintf(stderr, "Faixas demais em --trace-pc (maximo %d)\n", TRACE_MAX_RANGES);
+                ok = 0;
+                break;
+            }
+            if (trace_parse_addr(item, &r->lo, &end) && *end == '-') {
+                ok = trace_parse_addr(end + 1, &r->hi, &end) && *end == '\0' && r->hi > r->lo;
+            } else {
+                ok = trace_symbol_range(item, r);
+            }
+            if (ok) trace_range_count++;
+            else fprintf(stderr, "Faixa de pc invalida (A-B em hex, B > A) ou simbolo desconhecido em --trace-pc: %s\n", item);
+        }
+        free(copy);
+    }
+    profile_free_symbols();
+    return ok;
+}
+
+// --- Trace Binário ---
+// Registros vão para um buffer grande e só são gravados em blocos. O formato
+// está descrito em poxim_trace.h; poxim-tracefmt converte de volta para texto.
+#define TRACE_BIN_BUFFER_SIZE (8 * 1024 * 1024)
+
+__thread uint8_t *trace_bin_buffer = NULL;
+__thread size_t trace_bin_used = 0;
+__thread trace_bin_state_t trace_bin_state;
+
+void trace_bin_flush(FILE *outfile) {
+    if (trace_bin_used > 0) fwrite(trace_bin_buffer, 1, trace_bin_used, outfile);
+    trace_bin_used = 0;
+}
+
+uint8_t *trace_bin_reserve(FILE *outfile) {
+    if (trace_bin_used + TRACE_REC_MAX > TRACE_BIN_BUFFER_SIZE) trace_bin_flush(outfile);
+    return trace_bin_buffer + trace_bin_used;
+}
+
+// Cabeçalho com o estado inicial; chamado depois de carregar o programa. Sem
+// 'header' o trace continua de onde a última execução da máquina nesta thread
+// parou (--lockstep roda a máquina em trechos).
+void trace_bin_begin(FILE *outfile, int header) {
+    (void)outfile;
+    trace_bin_buffer = (uint8_t*)malloc(TRACE_BIN_BUFFER_SIZE);
+    trace_bin_used = 0;
+    if (!header) return;
+    trace_bin_state_init(&trace_bin_state);
+    uint8_t *p = trace_bin_buffer;
+    memcpy(p, TRACE_BIN_MAGIC, 4); p += 4;
+    *p++ = TRACE_BIN_VERSION;
+    for (int i = 0; i < NUM_REGISTERS; i++) {
+        p = trace_put_varint(p, hart->regs[i]);
+        trace_bin_state.regs[i] = hart->regs[i];
+    }
+    p = trace_put_varint(p, hart->pc);
+    trace_bin_state.expected_pc = hart->pc;
+    trace_bin_used = p - trace_bin_buffer;
+}
+
+void trace_bin_end(FILE *outfile) {
+    trace_bin_flush(outfile);
+    free(trace_bin_buffer);
+    trace_bin_buffer = NULL;
+}
+
+void trace_bin_insn(FILE *outfile, const trace_info_t *t) {
+    trace_bin_state_t *st = &trace_bin_state;
+    uint8_t *start = trace_bin_reserve(outfile), *p = start + 1;
+    uint8_t tag = TRACE_REC_INSN;
+
+    if (t->pc != st->expected_pc) {
+        tag |= TRACE_FLAG_PC;
+        p = trace_put_varint(p, trace_zigzag((int32_t)(t->pc - st->expected_pc)));
+    }
+    uint32_t slot = trace_insn_slot(t->pc);
+    if (st->insn_cache[slot].pc != t->pc || st->insn_cache[slot].insn != t->instruction) {
+        tag |= TRACE_FLAG_RAW;
+        p[0] = (uint8_t)t->instruction; p[1] = (uint8_t)(t->instruction >> 8);
+        p[2] = (uint8_t)(t->instruction >> 16); p[3] = (uint8_t)(t->instruction >> 24);
+        p += 4;
+        st->insn_cache[slot].pc = t->pc;
+        st->insn_cache[slot].insn = t->instruction;
+    }
+    if (trace_insn_writes_rd(t->instruction)) {
+        p = trace_put_varint(p, trace_zigzag((int32_t)(t->rd_val - st->regs[get_rd(t->instruction)])));
+    }
+    if (trace_insn_is_csr(t->instruction)) {
+        p = trace_put_varint(p, t->csr_old);
+        p = trace_put_varint(p, t->csr_new);
+    }
+    if (t->next_pc != trace_predict_next_pc(st, t->pc, t->instruction)) {
+        tag |= TRACE_FLAG_NEXT;
+        p = trace_put_varint(p, t->next_pc);
+    }
+    *start = tag;
+    trace_bin_used = p - trace_bin_buffer;
+    trace_bin_retire(st, t);
+}
+
+// Uma instrução que gerou trap ainda pode ter alterado rd (load com falha
+// escreve 0), e com filtros o leitor não vê as instruções que ficaram de
+// fora; registra a mudança para ele não perder a sincronia.
+void trace_bin_sync_reg(FILE *outfile, uint32_t rd) {
+    if (rd == 0 || hart->regs[rd] == trace_bin_state.regs[rd]) return;
+    uint8_t *start = trace_bin_reserve(outfile), *p = start;
+    *p++ = TRACE_REC_REG;
+    *p++ = (uint8_t)rd;
+    p = trace_put_varint(p, trace_zigzag((int32_t)(hart->regs[rd] - trace_bin_state.regs[rd])));
+    trace_bin_used = p - trace_bin_buffer;
+    trace_bin_state.regs[rd] = hart->regs[rd];
+}
+
+void trace_bin_trap(FILE *outfile, uint32_t cause, uint32_t epc, uint32_t tval) {
+    uint8_t *start = trace_bin_reserve(outfile), *p = start;
+    *p++ = TRACE_REC_TRAP;
+    p = trace_put_varint(p, cause);
+    p = trace_put_varint(p, epc);
+    p = trace_put_varint(p, tval);
+    trace_bin_used = p - trace_bin_buffer;
+}
+
+void trace_bin_fatal(FILE *outfile) {
+    *trace_bin_reserve(outfile) = TRACE_REC_FATAL;
+    trace_bin_used++;
+}
+
+// Um trap ocorreu (seja por interrupção, fetch ou execução).
+// Double fault é a mesma exceção duas vezes seguidas no mesmo pc. Interrupções
+// são assíncronas e podem chegar várias vezes no mesmo pc (laço de espera).
+void finish_trap(FILE *outfile, int trace_level, int binary) {
+    hart->trap_count++;
+    if (hart->trap_cause & 0x80000000) hart->interrupt_count++;
+    if (hart->trap_epc == hart->last_trap_pc && hart->trap_cause == hart->last_trap_cause && !(hart->trap_cause & 0x80000000)) {
+        if (trace_level != TRACE_NONE) {
+            if (binary) trace_bin_fatal(outfile);
+            else fprintf(outfile, TRACE_FATAL_LINE);
+        }
+        machine_halt(MACHINE_DOUBLE_FAULT);
+    } else {
+        hart->last_trap_pc = hart->trap_epc;
+        hart->last_trap_cause = hart->trap_cause;
+        if (trace_level != TRACE_NONE) {
+            if (binary) trace_bin_trap(outfile, hart->trap_cause, hart->trap_epc, hart->trap_tval);
+            else fprintf(outfile, TRACE_TRAP_FMT, get_trap_name(hart->trap_cause), hart->trap_cause, hart->trap_epc, hart->trap_tval);
+        }
+
+        // Lógica para pular a instrução se não houver handler
+        if (hart->trap_vector == 0) {
+            hart->pc = hart->trap_epc + 4;
+        }
+        // --ff-ecall: a fase acaba depois do trap do ecall marcador (de qualquer modo)
+        if ((hart->trap_cause == 8 || hart->trap_cause == 9 || hart->trap_cause == 11) &&
+            hart->stop_ecalls && --hart->stop_ecalls == 0) machine_halt(MACHINE_CHECKPOINT);
+    }
+    hart->trap_pending_print = 0;
+}
+
+// O laço de cada motor segue enquanto o hart não parou. Com --ff-pc a
+// stop_pc_hits-ésima chegada em stop_pc para a máquina antes da instrução.
+static inline __attribute__((always_inline)) int hart_running() {
+    if (hart->pc == hart->stop_pc && hart->stop_pc_hits && !hart->halt_flag && --hart->stop_pc_hits == 0) {
+        machine_halt(MACHINE_CHECKPOINT);
+    }
+    return !hart->halt_flag;
+}
+
+// Laço do interpretador de referência: decodifica tudo a cada instrução.
+void run_reference(FILE *outfile, int trace_level) {
+    char details_buffer[256];
+
+    while (hart_running()) {
+        uint32_t current_instruction_pc = hart->pc;
+        check_interrupts(current_instruction_pc);
+
+        // --- Busca e Execução da Instrução ---
+        uint32_t instruction_hex = fetch_instruction_from_pc();
+
+        // Se fetch_instruction_from_pc ou o handler de interrupção causaram um trap,
+        // trap_pending_print estará setado.
+        int traced = 0;
+        if (!hart->trap_pending_print) {
+            // Se não há trap pendente, executa a instrução.
+            traced = trace_level == TRACE_FULL && trace_selected(current_instruction_pc);
+            uint32_t rd = get_rd(instruction_hex), csr = instruction_hex >> 20;
+            uint32_t rd_old = hart->regs[rd], csr_old = 0, csr_new = 0;
+            if (traced && trace_changes_only && trace_insn_is_csr(instruction_hex)) csr_old = read_csr(csr);
+            details_buffer[0] = '\0';
+            decode_and_execute(instruction_hex, current_instruction_pc, details_buffer);
+            if (traced && trace_changes_only && trace_insn_is_csr(instruction_hex)) csr_new = read_csr(csr);
+            traced = traced && !hart->trap_pending_print && trace_kept(instruction_hex, rd_old, hart->regs[rd], csr_old, csr_new);
+        }
+
+        // --- Lógica Centralizada de Pós-Execução ---
+        if (hart->trap_pending_print) {
+            finish_trap(outfile, trace_level, 0);
+        } else {
+            // A instrução executou com sucesso.
+            if (traced && strlen(details_buffer) > 0) {
+                fprintf(outfile, "0x%08x:%s\n", current_instruction_pc, details_buffer);
+            }
+
+            // Se o PC não foi alterado por um jump/branch, nós o incrementamos.
+            if (hart->pc == current_instruction_pc) {
+                hart->pc += 4;
+            } else if (trace_level != TRACE_FULL && machine->idle_skip &&
+                       hart->pc < current_instruction_pc && current_instruction_pc - hart->pc < IDLE_MAX_INSNS * 4) {
+                idle_check(hart->pc, current_instruction_pc);
+            }
+        }
+    }
+}
+
+// Um passo do cache de instruções. É sempre expandido com trace_level, binary,
+// profile e timing constantes, então as versões sem trace completo não têm
+// nenhum código de formatação (nem snapshot de operandos, nem sprintf/fprintf
+// por instrução), a versão binária só codifica registros, sem gerar texto, e
+// só as versões com perfil ou modelo de tempo pagam pela contagem.
+static inline __attribute__((always_inline))
+void step_cached(FILE *outfile, const int trace_level, const int binary, const int profile, const int timing) {
+    char details_buffer[256];
+    if (trace_level == TRACE_FULL) details_buffer[0] = '\0'; // fica vazio se a instrução não for selecionada
+    uint32_t current_instruction_pc = hart->pc;
+    check_interrupts(current_instruction_pc);
+
+    decoded_insn_t *d = fetch_decoded_from_pc();
+    if (!hart->trap_pending_print) {
+        uint32_t data_address = 0;
+        if (timing) data_address = timing_fetch(hart->timing, d, current_instruction_pc);
+        if (trace_level == TRACE_FULL && trace_selected(current_instruction_pc)) {
+            trace_info_t t;
+            t.pc = current_instruction_pc;
+            t.instruction = d->raw;
+            t.rs1_val = hart->regs[d->rs1];
+            t.rs2_val = hart->regs[d->rs2];
+            t.csr_old = t.csr_new = 0;
+            int is_csr = trace_insn_is_csr(d->raw);
+            if (is_csr) t.csr_old = read_csr(d->imm);
+            uint32_t rd_old = hart->regs[d->rd];
+            if (binary && trace_filtered) {
+                trace_bin_sync_reg(outfile, get_rs1(d->raw));
+                trace_bin_sync_reg(outfile, get_rs2(d->raw));
+            }
+
+            d->handler(d, current_instruction_pc);
+            t.rd_val = hart->regs[d->rd];
+            hart->regs[0] = 0;
+
+            if (!hart->trap_pending_print) {
+                t.next_pc = hart->pc;
+                if (is_csr) t.csr_new = read_csr(d->imm);
+                if (trace_kept(d->raw, rd_old, t.rd_val, t.csr_old, t.csr_new)) {
+                    if (binary) trace_bin_insn(outfile, &t);
+                    else format_trace_details(&t, details_buffer);
+                }
+                if (binary && d->handler == exec_ebreak) trace_bin_sync_reg(outfile, 10); // resultado do semihosting
+            } else if (binary) {
+                trace_bin_sync_reg(outfile, d->rd);
+            }
+        } else {
+            d->handler(d, current_instruction_pc);
+            hart->regs[0] = 0;
+            if (profile && !hart->trap_pending_print) profile_sample(hart->profile, current_instruction_pc, 1);
+        }
+        if (timing && !hart->trap_pending_print) timing_retire(hart->timing, d, current_instruction_pc, data_address);
+    }
+
+    if (hart->trap_pending_print) {
+        finish_trap(outfile, trace_level, binary);
+        if (profile) profile_block(hart->profile, hart->pc);
+        if (timing) timing_trap(hart->timing);
+    } else {
+        if (trace_level == TRACE_FULL && !binary && details_buffer[0] != '\0') {
+            fprintf(outfile, "0x%08x:%s\n", current_instruction_pc, details_buffer);
+        }
+        if (hart->pc == current_instruction_pc) {
+            hart->pc += 4;
+            if (profile) profile_fallthrough(hart->profile, d->raw, hart->pc);
+        } else {
+            if (profile) profile_block(hart->profile, hart->pc);
+            if (trace_level != TRACE_FULL && machine->idle_skip &&
+                hart->pc < current_instruction_pc && current_instruction_pc - hart->pc < IDLE_MAX_INSNS * 4) {
+                idle_check(hart->pc, current_instruction_pc);
+            }
+        }
+    }
+}
+
+// Laço do cache de instruções.
+static inline __attribute__((always_inline))
+void run_cached(FILE *outfile, const int trace_level, const int binary, const int profile, const int timing) {
+    while (hart_running()) {
+        step_cached(outfile, trace_level, binary, profile, timing);
+    }
+}
+
+void run_cached_full(FILE *outfile)      { run_cached(outfile, TRACE_FULL, 0, 0, 0); }
+void run_cached_traps(FILE *outfile)     { run_cached(outfile, TRACE_TRAPS, 0, 0, 0); }
+void run_cached_full_bin(FILE *outfile)  { run_cached(outfile, TRACE_FULL, 1, 0, 0); }
+void run_cached_traps_bin(FILE *outfile) { run_cached(outfile, TRACE_TRAPS, 1, 0, 0); }
+void run_cached_silent(FILE *outfile)    { run_cached(outfile, TRACE_NONE, 0, 0, 0); }
+
+void run_cached_profile_traps(FILE *outfile)     { run_cached(outfile, TRACE_TRAPS, 0, 1, 0); }
+void run_cached_profile_traps_bin(FILE *outfile) { run_cached(outfile, TRACE_TRAPS, 1, 1, 0); }
+void run_cached_profile_silent(FILE *outfile)    { run_cached(outfile, TRACE_NONE, 0, 1, 0); }
+
+void run_cached_timing_full(FILE *outfile)      { run_cached(outfile, TRACE_FULL, 0, 0, 1); }
+void run_cached_timing_traps(FILE *outfile)     { run_cached(outfile, TRACE_TRAPS, 0, 0, 1); }
+void run_cached_timing_full_bin(FILE *outfile)  { run_cached(outfile, TRACE_FULL, 1, 0, 1); }
+void run_cached_timing_traps_bin(FILE *outfile) { run_cached(outfile, TRACE_TRAPS, 1, 0, 1); }
+void run_cached_timing_silent(FILE *outfile)    { run_cached(outfile, TRACE_NONE, 0, 0, 1); }
+
+// --- Tradução Dinâmica (JIT x86-64) ---
+// Blocos básicos da RAM são traduzidos para código x86-64 num cache mmap'd.
+// Cada instrução do bloco faz o mesmo que o handler do cache de instruções; os
+// registradores ficam em regs[] e são lidos/escritos a cada instrução.
+//
+// check_interrupts() roda antes de toda instrução. A cabeça de cada bloco
+// confere se mtime não alcança irq_next_check dentro dele, ou seja, se nenhuma
+// dessas checagens faria algo além de mtime++ (CSRs, MMIO e traps, que podem
+// acordar o escalonador, sempre terminam o bloco). Quando a cabeça recusa, o
+// despachante executa uma instrução no interpretador, que trata a interrupção
+// normalmente.
+//
+// Registradores do host fixos durante a execução dos blocos:
+//   rbx = regs, rbp = code_map, r12 = memory, r13 = &mtime, r14 = &pc,
+//   r15 = &trap_pending_print.
+// mtime só é atualizado nas saídas do bloco e antes de chamar funções C.
+#if defined(__x86_64__)
+
+#define JIT_CODE_SIZE (16 * 1024 * 1024)
+#define JIT_MAX_BLOCK_INSNS 64
+#define JIT_MAX_BLOCK_BYTES (16 * 1024) // folga para o pior caso de um bloco
+#define JIT_MAX_EXITS 65536
+
+// Valores de retorno de jit_enter(). Qualquer outro valor é um jit_exit_t*
+// de uma saída que ainda pode ser encadeada ao próximo bloco.
+#define JIT_EXIT_DONE 0 // pc já atualizado (salto indireto, MMIO ou trap)
+#define JIT_EXIT_BAIL 1 // a cabeça do bloco recusou; pc aponta para o bloco
+
+// Marca de pc que não começa um bloco (primeira instrução não traduzível).
+#define JIT_NO_BLOCK ((uint8_t*)1)
+
+typedef struct {
+    uint8_t *patch;     // rel32 do jmp a ser ligado ao próximo bloco
+    uint32_t target;    // pc do próximo bloco
+    uint32_t loop_tail; // desvio que fecha um laço curto (ver idle_check), ou 0
+} jit_exit_t;
+
+typedef uintptr_t (*jit_entry_t)(uint8_t *block);
+
+// Um cache de código por hart: o trampolim fixa os endereços do estado do hart.
+__thread uint8_t *jit_code = NULL;
+__thread uint8_t *jit_blocks_start; // primeiro byte depois do trampolim
+__thread uint8_t *jit_ptr;
+__thread uint8_t *jit_exit_stub;
+__thread jit_entry_t jit_enter;
+__thread uint8_t **jit_lookup; // bloco de cada palavra da RAM (mem_reserve)
+__thread jit_exit_t jit_exits[JIT_MAX_EXITS];
+__thread uint32_t jit_exit_count = 0;
+__thread jit_exit_t *jit_pending_link = NULL;
+__thread uint32_t jit_generation = 0;
+
+void jit_flush() {
+    if (!jit_code) return;
+    jit_ptr = jit_blocks_start;
+    // Todo pc com entrada em jit_lookup fica num pedaço marcado no code_map.
+    if (code_lo < code_hi) {
+        uint32_t words = (1u << CODE_CHUNK_SHIFT) / 4;
+        mem_discard(jit_lookup + (size_t)code_lo * words, (size_t)(code_hi - code_lo) * words * sizeof(uint8_t*));
+    }
+    jit_exit_count = 0;
+    jit_pending_link = NULL;
+    jit_generation++;
+    for (uint32_t i = code_lo; i < code_hi; i++) code_map[i] &= ~CODE_MAP_JIT;
+}
+
+// Fim da thread: devolve o cache de código.
+void jit_release() {
+    if (!jit_code) return;
+    munmap(jit_code, JIT_CODE_SIZE);
+    munmap(jit_lookup, (size_t)(memory_size / 4) * sizeof(uint8_t*));
+    jit_code = NULL;
+}
+
+// --- Emissão de Código ---
+void jit_emit8(uint8_t b) { *jit_ptr++ = b; }
+void jit_emit32(uint32_t v) { memcpy(jit_ptr, &v, 4); jit_ptr += 4; }
+void jit_emit64(uint64_t v) { memcpy(jit_ptr, &v, 8); jit_ptr += 8; }
+void jit_emit_bytes(const char *bytes, int n) { memcpy(jit_ptr, bytes, n); jit_ptr += n; }
+
+// Um jcc/jmp rel32 emitido com destino em aberto; jit_patch() o resolve.
+uint8_t *jit_emit_jcc(uint8_t cc) { jit_emit8(0x0F); jit_emit8(cc); jit_emit32(0); return jit_ptr - 4; }
+uint8_t *jit_emit_jmp() { jit_emit8(0xE9); jit_emit32(0); return jit_ptr - 4; }
+void jit_patch(uint8_t *rel, uint8_t *target) {
+    int32_t disp = (int32_t)(target - (rel + 4));
+    memcpy(rel, &disp, 4);
+}
+
+// mov eax/ecx/edx, [rbx + 4*r]
+void jit_load_reg(uint8_t host, uint32_t r) { jit_emit8(0x8B); jit_emit8(0x43 | (host << 3)); jit_emit8(r * 4); }
+// mov [rbx + 4*r], eax
+void jit_store_eax(uint32_t r) { if (r != 0) { jit_emit8(0x89); jit_emit8(0x43); jit_emit8(r * 4); } }
+// mov dword [rbx + 4*r], imm32
+void jit_store_imm(uint32_t r, uint32_t v) { if (r != 0) { jit_emit8(0xC7); jit_emit8(0x43); jit_emit8(r * 4); jit_emit32(v); } }
+// add/sub qword [r13], n
+void jit_mtime_add(uint32_t n) { jit_emit_bytes("\x49\x83\x45\x00", 4); jit_emit8(n); }
+void jit_mtime_sub(uint32_t n) { jit_emit_bytes("\x49\x83\x6D\x00", 4); jit_emit8(n); }
+// mov dword [r14], imm32
+void jit_set_pc(uint32_t v) { jit_emit_bytes("\x41\xC7\x06", 3); jit_emit32(v); }
+// mov rax, imm64; call rax. O endereço da função vem como inteiro: em ISO C
+// ponteiro de função não vira void *.
+void jit_call(uintptr_t fn) { jit_emit8(0x48); jit_emit8(0xB8); jit_emit64(fn); jit_emit8(0xFF); jit_emit8(0xD0); }
+// xor eax, eax; jmp jit_exit_stub
+void jit_exit_done() { jit_emit8(0x31); jit_emit8(0xC0); jit_patch(jit_emit_jmp(), jit_exit_stub); }
+
+// eax = regs[rs1] + imm
+void jit_load_address(const decoded_insn_t *d) {
+    jit_load_reg(0, d->rs1);
+    if (d->imm != 0) { jit_emit8(0x05); jit_emit32(d->imm); }
+}
+
+// Saída para um pc conhecido depois de 'count' instruções do bloco. O jmp cai
+// inicialmente no stub logo abaixo, que devolve o controle ao despachante; o
+// despachante depois liga o jmp direto à cabeça do bloco de destino. Desvios
+// para trás que podem fechar um laço ocioso só são ligados depois que
+// idle_check() os descarta, para a checagem acontecer como no interpretador.
+void jit_emit_chain_exit(uint32_t target, uint32_t count, uint32_t exit_pc) {
+    jit_mtime_add(count);
+    uint8_t *rel = jit_emit_jmp();
+    jit_exit_t *e = &jit_exits[jit_exit_count++];
+    e->patch = rel;
+    e->target = target;
+    e->loop_tail = (target < exit_pc && exit_pc - target < IDLE_MAX_INSNS * 4) ? exit_pc : 0;
+    jit_set_pc(target);
+    jit_emit8(0x48); jit_emit8(0xB8); jit_emit64((uint64_t)(uintptr_t)e); // mov rax, e
+    jit_patch(jit_emit_jmp(), jit_exit_stub);
+}
+
+// --- Funções Chamadas pelos Blocos ---
+uint32_t jit_div(uint32_t a, uint32_t b) {
+    if (b == 0) return -1;
+    if (a == 0x80000000 && b == 0xFFFFFFFF) return 0x80000000;
+    return (int32_t)a / (int32_t)b;
+}
+uint32_t jit_divu(uint32_t a, uint32_t b) { return (b == 0) ? 0xFFFFFFFF : a / b; }
+uint32_t jit_rem(uint32_t a, uint32_t b) {
+    if (b == 0) return a;
+    if (a == 0x80000000 && b == 0xFFFFFFFF) return 0;
+    return (int32_t)a % (int32_t)b;
+}
+uint32_t jit_remu(uint32_t a, uint32_t b) { return (b == 0) ? a : a % b; }
+
+// Escritas que não couberam no caminho rápido (MMIO, falhas ou pedaços com
+// código). Retorna 1 quando o bloco precisa sair: trap, MMIO (pode mudar o
+// estado de interrupções) ou código traduzido apagado pela escrita.
+int jit_store_done(uint32_t address, uint32_t current_pc, uint32_t generation) {
+    if (hart->trap_pending_print) return 1;
+    if (address - PC_START_ADDRESS < memory_size && generation == jit_generation) return 0;
+    hart->pc = current_pc + 4;
+    return 1;
+}
+int jit_store_byte(uint32_t address, uint32_t value, uint32_t current_pc) {
+    uint32_t generation = jit_generation;
+    memory_write_byte(address, (uint8_t)value, current_pc);
+    return jit_store_done(address, current_pc, generation);
+}
+int jit_store_halfword(uint32_t address, uint32_t value, uint32_t current_pc) {
+    uint32_t generation = jit_generation;
+    memory_write_halfword(address, (uint16_t)value, current_pc);
+    return jit_store_done(address, current_pc, generation);
+}
+int jit_store_word(uint32_t address, uint32_t value, uint32_t current_pc) {
+    uint32_t generation = jit_generation;
+    memory_write_word(address, value, current_pc);
+    return jit_store_done(address, current_pc, generation);
+}
+
+// --- Tradução ---
+// Loads: caminho rápido direto em memory[] para endereços alinhados na RAM e
+// memory_read_* (UART, CLINT, PLIC e falhas) no caminho lento. O caminho lento
+// sempre termina o bloco: ler a UART pode mudar o pedido de interrupção.
+void jit_emit_load(const decoded_insn_t *d, uint32_t current_pc, uint32_t index) {
+    uint32_t size = 4, sign = 0;
+    uintptr_t fn = (uintptr_t)memory_read_word;
+    if (d->handler == exec_lb || d->handler == exec_lbu) { size = 1; fn = (uintptr_t)memory_read_byte; }
+    else if (d->handler == exec_lh || d->handler == exec_lhu) { size = 2; fn = (uintptr_t)memory_read_halfword; }
+    if (d->handler == exec_lb || d->handler == exec_lh) sign = 1;
+    // movzx/movsx eax, byte/word; o word não precisa de extensão
+    uint8_t extend = (size == 1) ? (sign ? 0xBE : 0xB6) : (sign ? 0xBF : 0xB7);
+
+    jit_load_address(d);
+    jit_emit_bytes("\x89\xC1", 2);                                 // mov ecx, eax
+    jit_emit_bytes("\x81\xE9", 2); jit_emit32(PC_START_ADDRESS);   // sub ecx, START
+    jit_emit_bytes("\x81\xF9", 2); jit_emit32(memory_size - size); // cmp ecx, SIZE - size
+    uint8_t *slow1 = jit_emit_jcc(0x87);                           // ja slow
+    uint8_t *slow2 = NULL;
+    if (size > 1) {
+        jit_emit_bytes("\xF6\xC1", 2); jit_emit8(size - 1);        // test cl, size - 1
+        slow2 = jit_emit_jcc(0x85);                                // jnz slow
+    }
+    if (size == 4) jit_emit_bytes("\x41\x8B\x04\x0C", 4);          // mov eax, [r12 + rcx]
+    else { jit_emit_bytes("\x41\x0F", 2); jit_emit8(extend); jit_emit_bytes("\x04\x0C", 2); }
+    jit_store_eax(d->rd);
+    uint8_t *done = jit_emit_jmp();
+
+    jit_patch(slow1, jit_ptr);
+    if (slow2) jit_patch(slow2, jit_ptr);
+    jit_mtime_add(index + 1); // clint_read() lê mtime
+    jit_emit_bytes("\x89\xC7", 2);                                 // mov edi, eax
+    jit_emit8(0xBE); jit_emit32(current_pc);                       // mov esi, pc
+    jit_call(fn);
+    if (size < 4) { jit_emit8(0x0F); jit_emit8(extend); jit_emit8(0xC0); }
+    jit_store_eax(d->rd); // em falha o load também zera rd
+    jit_emit_bytes("\x41\x83\x3F\x00", 4);                         // cmp dword [r15], 0
+    uint8_t *trap = jit_emit_jcc(0x85);                            // jne trap (pc já é o do handler)
+    jit_set_pc(current_pc + 4);
+    jit_patch(trap, jit_ptr);
+    jit_exit_done();
+    jit_patch(done, jit_ptr);
+}
+
+// Stores: o caminho rápido também exige que o pedaço de 64 bytes não tenha
+// código decodificado ou traduzido, senão a escrita passa por memory_write_*
+// para invalidar o cache.
+void jit_emit_store(const decoded_insn_t *d, uint32_t current_pc, uint32_t index) {
+    uint32_t size = 4;
+    uintptr_t fn = (uintptr_t)jit_store_word;
+    if (d->handler == exec_sb) { size = 1; fn = (uintptr_t)jit_store_byte; }
+    else if (d->handler == exec_sh) { size = 2; fn = (uintptr_t)jit_store_halfword; }
+
+    jit_load_address(d);
+    jit_load_reg(2, d->rs2);                                       // mov edx, regs[rs2]
+    jit_emit_bytes("\x89\xC1", 2);                                 // mov ecx, eax
+    jit_emit_bytes("\x81\xE9", 2); jit_emit32(PC_START_ADDRESS);   // sub ecx, START
+    jit_emit_bytes("\x81\xF9", 2); jit_emit32(memory_size - size); // cmp ecx, SIZE - size
+    uint8_t *slow1 = jit_emit_jcc(0x87);                           // ja slow
+    uint8_t *slow2 = NULL;
+    if (size > 1) {
+        jit_emit_bytes("\xF6\xC1", 2); jit_emit8(size - 1);        // test cl, size - 1
+        slow2 = jit_emit_jcc(0x85);                                // jnz slow
+    }
+    jit_emit_bytes("\x89\xCE", 2);                                 // mov esi, ecx
+    jit_emit_bytes("\xC1\xEE", 2); jit_emit8(CODE_CHUNK_SHIFT);    // shr esi, CODE_CHUNK_SHIFT
+    jit_emit_bytes("\x80\x7C\x35\x00\x00", 5);                     // cmp byte [rbp + rsi], 0
+    uint8_t *slow3 = jit_emit_jcc(0x85);                           // jne slow
+    if (size == 1) jit_emit_bytes("\x41\x88\x14\x0C", 4);          // mov [r12 + rcx], dl
+    else if (size == 2) jit_emit_bytes("\x66\x41\x89\x14\x0C", 5); // mov [r12 + rcx], dx
+    else jit_emit_bytes("\x41\x89\x14\x0C", 4);                    // mov [r12 + rcx], edx
+    uint8_t *done = jit_emit_jmp();
+
+    jit_patch(slow1, jit_ptr);
+    if (slow2) jit_patch(slow2, jit_ptr);
+    jit_patch(slow3, jit_ptr);
+    jit_mtime_add(index + 1);
+    jit_emit_bytes("\x89\xC7", 2);                                 // mov edi, eax
+    jit_emit_bytes("\x89\xD6", 2);                                 // mov esi, edx
+    jit_emit8(0xBA); jit_emit32(current_pc);                       // mov edx, pc
+    jit_call(fn);
+    jit_emit_bytes("\x85\xC0", 2);                                 // test eax, eax
+    uint8_t *stay = jit_emit_jcc(0x84);                            // jz stay
+    jit_exit_done();
+    jit_patch(stay, jit_ptr);
+    jit_mtime_sub(index + 1);
+    jit_patch(done, jit_ptr);
+}
+
+// Operações com imediato: eax = regs[rs1] op imm.
+void jit_emit_alu_imm(const decoded_insn_t *d) {
+    insn_handler_t h = d->handler;
+    jit_load_reg(0, d->rs1);
+    if (h == exec_addi)      { jit_emit8(0x05); jit_emit32(d->imm); }
+    else if (h == exec_xori) { jit_emit8(0x35); jit_emit32(d->imm); }
+    else if (h == exec_ori)  { jit_emit8(0x0D); jit_emit32(d->imm); }
+    else if (h == exec_andi) { jit_emit8(0x25); jit_emit32(d->imm); }
+    else if (h == exec_slli) { jit_emit_bytes("\xC1\xE0", 2); jit_emit8(d->imm); }
+    else if (h == exec_srli) { jit_emit_bytes("\xC1\xE8", 2); jit_emit8(d->imm); }
+    else if (h == exec_srai) { jit_emit_bytes("\xC1\xF8", 2); jit_emit8(d->imm); }
+    else {
+        jit_emit8(0x3D); jit_emit32(d->imm);                          // cmp eax, imm
+        jit_emit_bytes(h == exec_slti ? "\x0F\x9C\xC0" : "\x0F\x92\xC0", 3); // setl/setb al
+        jit_emit_bytes("\x0F\xB6\xC0", 3);                            // movzx eax, al
+    }
+}
+
+// Operações entre registradores: eax = regs[rs1] op regs[rs2].
+void jit_emit_alu_reg(const decoded_insn_t *d) {
+    insn_handler_t h = d->handler;
+    uintptr_t fn = 0;
+    if (h == exec_div) fn = (uintptr_t)jit_div;
+    else if (h == exec_divu) fn = (uintptr_t)jit_divu;
+    else if (h == exec_rem) fn = (uintptr_t)jit_rem;
+    else if (h == exec_remu) fn = (uintptr_t)jit_remu;
+    if (fn) {
+        jit_emit_bytes("\x8B\x7B", 2); jit_emit8(d->rs1 * 4);         // mov edi, regs[rs1]
+        jit_emit_bytes("\x8B\x73", 2); jit_emit8(d->rs2 * 4);         // mov esi, regs[rs2]
+        jit_call(fn);
+        return;
+    }
+
+    jit_load_reg(0, d->rs1);
+    jit_load_reg(1, d->rs2);
+    if (h == exec_add)       jit_emit_bytes("\x01\xC8", 2);          // add eax, ecx
+    else if (h == exec_sub)  jit_emit_bytes("\x29\xC8", 2);          // sub eax, ecx
+    else if (h == exec_xor)  jit_emit_bytes("\x31\xC8", 2);          // xor eax, ecx
+    else if (h == exec_or)   jit_emit_bytes("\x09\xC8", 2);          // or eax, ecx
+    else if (h == exec_and)  jit_emit_bytes("\x21\xC8", 2);          // and eax, ecx
+    else if (h == exec_sll)  jit_emit_bytes("\xD3\xE0", 2);          // shl eax, cl
+    else if (h == exec_srl)  jit_emit_bytes("\xD3\xE8", 2);          // shr eax, cl
+    else if (h == exec_sra)  jit_emit_bytes("\xD3\xF8", 2);          // sar eax, cl
+    else if (h == exec_mul)  jit_emit_bytes("\x0F\xAF\xC1", 3);      // imul eax, ecx
+    else if (h == exec_slt || h == exec_sltu) {
+        jit_emit_bytes("\x39\xC8", 2);                                // cmp eax, ecx
+        jit_emit_bytes(h == exec_slt ? "\x0F\x9C\xC0" : "\x0F\x92\xC0", 3); // setl/setb al
+        jit_emit_bytes("\x0F\xB6\xC0", 3);                            // movzx eax, al
+    } else {
+        // mulh, mulhsu, mulhu: produto de 64 bits, parte alta
+        if (h != exec_mulhu) jit_emit_bytes("\x48\x63\xC0", 3);       // movsxd rax, eax
+        if (h == exec_mulh) jit_emit_bytes("\x48\x63\xC9", 3);        // movsxd rcx, ecx
+        jit_emit_bytes("\x48\x0F\xAF\xC1", 4);                        // imul rax, rcx
+        jit_emit_bytes("\x48\xC1\xE8\x20", 4);                        // shr rax, 32
+    }
+}
+
+// Traduz o bloco que começa em start_pc. Retorna JIT_NO_BLOCK se a primeira
+// instrução não puder ser traduzida (SYSTEM, fence.i ou ilegal), que ficam
+// sempre com o interpretador.
+uint8_t *jit_translate(uint32_t start_pc) {
+    if (jit_ptr + JIT_MAX_BLOCK_BYTES > jit_code + JIT_CODE_SIZE || jit_exit_count + 2 > JIT_MAX_EXITS) {
+        jit_flush();
+    }
+
+    uint8_t *block = jit_ptr;
+    jit_emit_bytes("\x49\x8B\x45\x00", 4);                         // mov rax, [r13]
+    jit_emit_bytes("\x48\x05", 2);                                 // add rax, N
+    uint8_t *count_imm = jit_ptr; jit_emit32(0);
+    jit_emit_bytes("\x48\xBA", 2); jit_emit64((uint64_t)(uintptr_t)&hart->irq_next_check); // mov rdx, &irq_next_check
+    jit_emit_bytes("\x48\x3B\x02", 3);                             // cmp rax, [rdx]
+    uint8_t *bail = jit_emit_jcc(0x83);                            // jae bail
+
+    uint32_t count = 0, current_pc = start_pc, ended = 0;
+    while (!ended && count < JIT_MAX_BLOCK_INSNS && current_pc - PC_START_ADDRESS <= memory_size - 4) {
+        // --ff-pc: o pc de parada nunca fica dentro de um bloco nem começa um,
+        // então cada chegada nele passa pelo despachante (hart_running).
+        if (hart->stop_pc_hits && current_pc == hart->stop_pc) break;
+        uint32_t offset = current_pc - PC_START_ADDRESS;
+        uint32_t instruction;
+        memcpy(&instruction, &machine->memory[offset], 4);
+        decoded_insn_t d;
+        decode_instruction(instruction, &d);
+        insn_handler_t h = d.handler;
+        uint32_t opcode = get_opcode(instruction);
+
+        if (h == exec_nop) {
+        } else if (h == exec_lui) {
+            jit_store_imm(d.rd, d.imm);
+        } else if (h == exec_auipc) {
+            jit_store_imm(d.rd, current_pc + d.imm);
+        } else if (h == exec_lb || h == exec_lh || h == exec_lw || h == exec_lbu || h == exec_lhu) {
+            jit_emit_load(&d, current_pc, count);
+        } else if (h == exec_sb || h == exec_sh || h == exec_sw) {
+            jit_emit_store(&d, current_pc, count);
+        } else if (opcode == 0x13 || opcode == 0x33) {
+            // Com rd == zero o resultado é descartado e não há efeito colateral.
+            if (d.rd != 0) {
+                if (opcode == 0x13) jit_emit_alu_imm(&d);
+                else jit_emit_alu_reg(&d);
+                jit_store_eax(d.rd);
+            }
+        } else if (h == exec_jal) {
+            // Salto para o próprio pc cai no "pc += 4" do laço principal.
+            uint32_t target = (d.imm == 0) ? current_pc + 4 : current_pc + d.imm;
+            jit_store_imm(d.rd, current_pc + 4);
+            jit_emit_chain_exit(target, count + 1, current_pc);
+            ended = 1;
+        } else if (h == exec_jalr) {
+            jit_load_address(&d);
+            jit_emit8(0x25); jit_emit32(~1u);                      // and eax, ~1
+            jit_store_imm(d.rd, current_pc + 4);
+            jit_emit8(0x3D); jit_emit32(current_pc);               // cmp eax, pc
+            jit_emit_bytes("\x75\x05", 2);                         // jne +5
+            jit_emit8(0xB8); jit_emit32(current_pc + 4);           // mov eax, pc + 4
+            jit_emit_bytes("\x41\x89\x06", 3);                     // mov [r14], eax
+            jit_mtime_add(count + 1);
+            jit_exit_done();
+            ended = 1;
+        } else if (h == exec_beq || h == exec_bne || h == exec_blt || h == exec_bge || h == exec_bltu || h == exec_bgeu) {
+            uint8_t cc = (h == exec_beq) ? 0x84 : (h == exec_bne) ? 0x85 : (h == exec_blt) ? 0x8C :
+                         (h == exec_bge) ? 0x8D : (h == exec_bltu) ? 0x82 : 0x83;
+            uint32_t target = (d.imm == 0) ? current_pc + 4 : current_pc + d.imm;
+            jit_load_reg(0, d.rs1);
+            jit_emit_bytes("\x3B\x43", 2); jit_emit8(d.rs2 * 4);   // cmp eax, regs[rs2]
+            uint8_t *taken = jit_emit_jcc(cc);
+            jit_emit_chain_exit(current_pc + 4, count + 1, current_pc);
+            jit_patch(taken, jit_ptr);
+            jit_emit_chain_exit(target, count + 1, current_pc);
+            ended = 1;
+        } else {
+            break;
+        }
+        code_mark(offset, CODE_MAP_JIT);
+        count++;
+        current_pc += 4;
+    }
+
+    code_mark(start_pc - PC_START_ADDRESS, CODE_MAP_JIT);
+    if (count == 0) {
+        jit_ptr = block;
+        return JIT_NO_BLOCK;
+    }
+    if (!ended) jit_emit_chain_exit(current_pc, count, current_pc - 4);
+
+    memcpy(count_imm, &count, 4);
+    jit_patch(bail, jit_ptr);
+    jit_set_pc(start_pc);
+    jit_emit8(0xB8); jit_emit32(JIT_EXIT_BAIL);                    // mov eax, JIT_EXIT_BAIL
+    jit_patch(jit_emit_jmp(), jit_exit_stub);
+    return block;
+}
+
+// Aloca o cache de código (uma vez por thread) e gera o trampolim de
+// entrada/saída para o hart atual. Os blocos de uma execução anterior da mesma
+// thread (outra máquina no --batch) são descartados.
+int jit_init() {
+    if (!jit_code) {
+        void *mem = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) return 0;
+        jit_code = (uint8_t*)mem;
+        jit_lookup = (uint8_t**)mem_reserve((size_t)(memory_size / 4) * sizeof(uint8_t*));
+    }
+    jit_ptr = jit_code;
+
+    jit_enter = (jit_entry_t)(uintptr_t)jit_ptr;
+    jit_emit_bytes("\x53\x55\x41\x54\x41\x55\x41\x56\x41\x57", 10); // push rbx, rbp, r12-r15
+    jit_emit_bytes("\x48\x83\xEC\x08", 4);                          // sub rsp, 8
+    jit_emit_bytes("\x48\xBB", 2); jit_emit64((uint64_t)(uintptr_t)hart->regs);
+    jit_emit_bytes("\x48\xBD", 2); jit_emit64((uint64_t)(uintptr_t)(machine->lockstep ? lockstep_code_map : code_map));
+    jit_emit_bytes("\x49\xBC", 2); jit_emit64((uint64_t)(uintptr_t)machine->memory);
+    jit_emit_bytes("\x49\xBD", 2); jit_emit64((uint64_t)(uintptr_t)&hart->mtime);
+    jit_emit_bytes("\x49\xBE", 2); jit_emit64((uint64_t)(uintptr_t)&hart->pc);
+    jit_emit_bytes("\x49\xBF", 2); jit_emit64((uint64_t)(uintptr_t)&hart->trap_pending_print);
+    jit_emit_bytes("\xFF\xE7", 2);                                  // jmp rdi
+
+    jit_exit_stub = jit_ptr;
+    jit_emit_bytes("\x48\x83\xC4\x08", 4);                          // add rsp, 8
+    jit_emit_bytes("\x41\x5F\x41\x5E\x41\x5D\x41\x5C\x5D\x5B", 10); // pop r15-r12, rbp, rbx
+    jit_emit8(0xC3);                                                // ret
+
+    jit_blocks_start = jit_ptr;
+    jit_flush();
+    return 1;
+}
+
+uint8_t *jit_block_for(uint32_t offset) {
+    uint8_t *block = jit_lookup[offset >> 2];
+    if (!block) {
+        block = jit_translate(hart->pc);
+        jit_lookup[offset >> 2] = block;
+    }
+    return (block == JIT_NO_BLOCK) ? NULL : block;
+}
+
+// Laço do JIT. Instruções não traduzíveis, interrupções e fetch fora da RAM
+// passam pelo mesmo passo do cache de instruções, assim como tudo o que roda
+// com Sv32 (os blocos usam endereços físicos).
+static inline __attribute__((always_inline))
+void run_jit(FILE *outfile, const int trace_level, const int binary) {
+    while (hart_running()) {
+        uint32_t offset = hart->pc - PC_START_ADDRESS;
+        uint8_t *block = NULL;
+        if (offset <= memory_size - 4 && (hart->pc % 4) == 0 && !hart->translate) block = jit_block_for(offset);
+        if (!block) {
+            jit_pending_link = NULL;
+            step_cached(outfile, trace_level, binary, 0, 0);
+            continue;
+        }
+        if (jit_pending_link && jit_pending_link->target == hart->pc) jit_patch(jit_pending_link->patch, block);
+        jit_pending_link = NULL;
+
+        uintptr_t ret = jit_enter(block);
+        if (ret == JIT_EXIT_BAIL) step_cached(outfile, trace_level, binary, 0, 0);
+        else if (ret != JIT_EXIT_DONE) {
+            jit_exit_t *e = (jit_exit_t*)ret;
+            if (e->loop_tail && machine->idle_skip && !idle_rejected[(e->loop_tail - PC_START_ADDRESS) >> 2]) {
+                idle_check(e->target, e->loop_tail);
+            } else {
+                jit_pending_link = e;
+            }
+        } else if (hart->trap_pending_print) finish_trap(outfile, trace_level, binary);
+    }
+}
+
+void run_jit_traps(FILE *outfile)     { run_jit(outfile, TRACE_TRAPS, 0); }
+void run_jit_traps_bin(FILE *outfile) { run_jit(outfile, TRACE_TRAPS, 1); }
+void run_jit_silent(FILE *outfile)    { run_jit(outfile, TRACE_NONE, 0); }
+
+#else
+
+void jit_flush() { }
+void jit_release() { }
+
+#endif
+
+// --- Tradução Antecipada (AOT) ---
+// Blocos básicos de um programa fixo traduzidos para C pelo poxim-aot (ver
+// poxim_aot.h e "Geração do C" abaixo) e compilados junto com o simulador.
+// Valem as mesmas regras do JIT; o que não virou bloco fica com o
+// interpretador.
+//
+// A tradução vale para a RAM do momento da geração. Na ligação e a cada
+// fence.i (aot_validate) os blocos cujas palavras não conferem com a RAM vão
+// para aot_stale, e uma escrita sobre uma palavra de bloco vivo faz o mesmo
+// (aot_invalidate): a cabeça de um bloco marcado sempre recusa.
+
+// Tradução compilada junto com o poxim.c (símbolo fraco: sem ela, NULL).
+extern const poxim_aot_t poxim_aot_image __attribute__((weak));
+
+_Static_assert(POXIM_AOT_CHUNK_SHIFT == CODE_CHUNK_SHIFT, "code_map do poxim_aot.h");
+
+#define AOT_STALE_CODE 1 // palavras diferentes das da geração
+#define AOT_STALE_STOP 2 // contém o pc de parada (--ff-pc, poxim_set_breakpoint)
+
+// Como o cache de instruções, por hart (__thread). aot_stale (por bloco) e
+// aot_words (palavras de blocos vivos) são reservadas com as outras tabelas da
+// thread (thread_caches_init).
+__thread const poxim_aot_t *aot_image = NULL;
+__thread uint32_t aot_generation = 0;
+
+// Tradução gerada para este mapa de memória e esta versão do poxim_aot.h.
+int aot_usable(const poxim_aot_t *image) {
+    return image->abi == POXIM_AOT_ABI && image->memory_base == PC_START_ADDRESS &&
+           image->memory_size == memory_size && image->block_count <= memory_size / 4;
+}
+
+// Palavra de uma instrução traduzida (busca binária em words[]); 0 se não há.
+static int aot_word_at(uint32_t pc, uint32_t *word) {
+    uint32_t lo = 0, hi = aot_image->word_count;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (aot_image->words[mid][0] < pc) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == aot_image->word_count || aot_image->words[lo][0] != pc) return 0;
+    *word = aot_image->words[lo][1];
+    return 1;
+}
+
+// Só as palavras da tradução podem estar marcadas em aot_words.
+void aot_clear_words(const poxim_aot_t *image) {
+    for (uint32_t i = 0; i < image->word_count; i++) aot_words[(image->words[i][0] - PC_START_ADDRESS) >> 2] = 0;
+}
+
+// Confere todos os blocos com a RAM e marca no code_map os pedaços dos vivos.
+void aot_validate() {
+    if (!aot_image) return;
+    const poxim_aot_t *image = aot_image;
+    for (uint32_t i = 0; i < image->word_count; i++) {
+        uint32_t offset = image->words[i][0] - PC_START_ADDRESS;
+        aot_words[offset >> 2] = mem_load_le(machine->memory + offset, 4) == image->words[i][1];
+    }
+    for (uint32_t b = 0; b < image->block_count; b++) {
+        uint32_t first = (image->blocks[b][0] - PC_START_ADDRESS) >> 2;
+        aot_stale[b] &= ~AOT_STALE_CODE;
+        for (uint32_t i = 0; i < image->blocks[b][1]; i++) {
+            if (!aot_words[first + i]) aot_stale[b] |= AOT_STALE_CODE;
+        }
+    }
+    aot_clear_words(image);
+    for (uint32_t b = 0; b < image->block_count; b++) {
+        if (aot_stale[b] & AOT_STALE_CODE) continue;
+        uint32_t first = (image->blocks[b][0] - PC_START_ADDRESS) >> 2;
+        for (uint32_t i = 0; i < image->blocks[b][1]; i++) {
+            aot_words[first + i] = 1;
+            code_mark((first + i) << 2, CODE_MAP_AOT);
+        }
+    }
+    aot_generation++;
+}
+
+// Escrita na RAM num pedaço com blocos AOT. Reescrever a mesma palavra não
+// muda nada; senão todo bloco que cobre a palavra deixa de valer.
+void aot_invalidate(uint32_t ram_offset) {
+    uint32_t word = ram_offset >> 2, pc = PC_START_ADDRESS + (word << 2), expected;
+    if (!aot_image || !aot_words[word]) return;
+    if (aot_word_at(pc, &expected) && mem_load_le(machine->memory + (word << 2), 4) == expected) return;
+    for (uint32_t b = 0; b < aot_image->block_count; b++) {
+        if (pc - aot_image->blocks[b][0] < aot_image->blocks[b][1] * 4) aot_stale[b] |= AOT_STALE_CODE;
+    }
+    aot_words[word] = 0;
+    aot_generation++;
+}
+
+// Liga a tradução à thread (NULL desliga).
+void aot_attach(const poxim_aot_t *image) {
+    if (aot_image) aot_clear_words(aot_image);
+    aot_image = image;
+    if (image) memset(aot_stale, 0, image->block_count);
+    for (uint32_t i = code_lo; i < code_hi; i++) code_map[i] &= ~CODE_MAP_AOT;
+    aot_validate();
+}
+
+// O pc de parada nunca fica dentro de um bloco vivo, como no JIT: os blocos
+// que o cobrem recusam enquanto a parada estiver armada.
+void aot_mark_stop() {
+    for (uint32_t b = 0; b < aot_image->block_count; b++) {
+        aot_stale[b] &= ~AOT_STALE_STOP;
+        if (hart->stop_pc_hits && hart->stop_pc - aot_image->blocks[b][0] < aot_image->blocks[b][1] * 4) {
+            aot_stale[b] |= AOT_STALE_STOP;
+        }
+    }
+}
+
+// --- Funções Chamadas pelos Blocos AOT ---
+uint32_t aot_load(uint32_t address, uint32_t size, uint32_t current_pc) {
+    return memory_read(address, size, current_pc);
+}
+
+// Como jit_store_done: 1 quando o bloco precisa sair.
+int aot_store(uint32_t address, uint32_t value, uint32_t size, uint32_t current_pc) {
+    uint32_t generation = aot_generation;
+    if (size == 1) memory_write_byte(address, (uint8_t)value, current_pc);
+    else if (size == 2) memory_write_halfword(address, (uint16_t)value, current_pc);
+    else memory_write_word(address, value, current_pc);
+    if (hart->trap_pending_print) return 1;
+    if (address - PC_START_ADDRESS < memory_size && generation == aot_generation) return 0;
+    hart->pc = current_pc + 4;
+    return 1;
+}
+
+// Laço da tradução antecipada. Depois de blocos encadeados por goto a chegada
+// no pc ainda não passou por hart_running, então a recusa confere antes de
+// executar no interpretador. Com Sv32 tudo roda no interpretador.
+static inline __attribute__((always_inline))
+void run_aot(FILE *outfile, const int trace_level, const int binary) {
+    poxim_aot_ctx_t ctx = {
+        hart->regs, machine->memory, &hart->pc, &hart->mtime, &hart->irq_next_check,
+        &hart->trap_pending_print, machine->lockstep ? lockstep_code_map : code_map, aot_stale, idle_rejected, machine->idle_skip,
+        aot_load, aot_store
+    };
+    aot_mark_stop();
+    while (hart_running()) {
+        if (hart->translate) {
+            step_cached(outfile, trace_level, binary, 0, 0);
+            continue;
+        }
+        uint64_t start = hart->mtime;
+        uintptr_t ret = aot_image->enter(&ctx);
+        if (ret == POXIM_AOT_BAIL) {
+            if (hart->mtime == start || hart_running()) step_cached(outfile, trace_level, binary, 0, 0);
+        } else if (ret != POXIM_AOT_DONE) {
+            idle_check(hart->pc, (uint32_t)ret);
+        } else if (hart->trap_pending_print) finish_trap(outfile, trace_level, binary);
+    }
+}
+
+void run_aot_traps(FILE *outfile)     { run_aot(outfile, TRACE_TRAPS, 0); }
+void run_aot_traps_bin(FILE *outfile) { run_aot(outfile, TRACE_TRAPS, 1); }
+void run_aot_silent(FILE *outfile)    { run_aot(outfile, TRACE_NONE, 0); }
+
+// --- Geração do C (poxim-aot) ---
+// Percorre o código alcançável a partir do pc de entrada e dos alvos dados
+// (saltos indiretos e entradas de traps vistos num perfil, <prefixo>.targets)
+// e grava um bloco por cabeça com as regras do jit_translate. São cabeças os
+// alvos de jal e desvios, a instrução depois de um desvio ou de um jal com rd
+// (retorno), a depois de uma instrução que fica com o interpretador e a que
+// passa de AOT_MAX_BLOCK_INSNS. Um bloco que chega noutra cabeça termina
+// nela com um goto.
+#define AOT_MAX_BLOCK_INSNS 64
+
+#define AOT_INSN_NONE 0 // fica com o interpretador
+#define AOT_INSN_NEXT 1
+#define AOT_INSN_END  2 // jal, jalr e desvios
+
+static inline int aot_in_ram(uint32_t pc) {
+    return pc - PC_START_ADDRESS <= memory_size - 4 && (pc & 3) == 0;
+}
+
+int aot_insn_kind(const decoded_insn_t *d) {
+    insn_handler_t h = d->handler;
+    uint32_t opcode = get_opcode(d->raw);
+    if (h == exec_jal || h == exec_jalr || h == exec_beq || h == exec_bne || h == exec_blt ||
+        h == exec_bge || h == exec_bltu || h == exec_bgeu) return AOT_INSN_END;
+    if (h == exec_nop || h == exec_lui || h == exec_auipc || h == exec_lb || h == exec_lh || h == exec_lw ||
+        h == exec_lbu || h == exec_lhu || h == exec_sb || h == exec_sh || h == exec_sw ||
+        opcode == 0x13 || opcode == 0x33) return AOT_INSN_NEXT;
+    return AOT_INSN_NONE;
+}
+
+static void aot_decode(machine_t *m, uint32_t pc, decoded_insn_t *d) {
+    decode_instruction(mem_load_le(m->memory + (pc - PC_START_ADDRESS), 4), d);
+}
+
+typedef struct {
+    uint8_t *head;       // por palavra: cabeça pedida
+    int32_t *block;      // por palavra: bloco que começa ali, ou -1
+    uint32_t *pending, pending_count;
+} aot_gen_t;
+
+static void aot_add_head(aot_gen_t *g, uint32_t pc) {
+    if (!aot_in_ram(pc)) return;
+    uint32_t word = (pc - PC_START_ADDRESS) >> 2;
+    if (g->head[word]) return;
+    g->head[word] = 1;
+    g->pending[g->pending_count++] = pc;
+}
+
+static inline uint32_t aot_branch_target(const decoded_insn_t *d, uint32_t pc) {
+    return (d->imm == 0) ? pc + 4 : pc + d->imm; // salto para o próprio pc cai no "pc += 4"
+}
+
+// Instruções do bloco que começa em pc (para antes de outra cabeça).
+static uint32_t aot_block_length(machine_t *m, aot_gen_t *g, uint32_t pc) {
+    uint32_t count = 0;
+    while (count < AOT_MAX_BLOCK_INSNS && aot_in_ram(pc)) {
+        if (count > 0 && g->head[(pc - PC_START_ADDRESS) >> 2]) break;
+        decoded_insn_t d;
+        aot_decode(m, pc, &d);
+        int kind = aot_insn_kind(&d);
+        if (kind == AOT_INSN_NONE) break;
+        count++;
+        if (kind == AOT_INSN_END) break;
+        pc += 4;
+    }
+    return count;
+}
+
+// Saída para um pc conhecido depois de 'count' instruções, como
+// jit_emit_chain_exit: desvios curtos para trás passam por idle_check até
+// ele os descartar.
+static void aot_emit_exit(FILE *out, aot_gen_t *g, uint32_t target, uint32_t count, uint32_t exit_pc) {
+    fprintf(out, "        *mtime += %u;", count);
+    if (target < exit_pc && exit_pc - target < IDLE_MAX_INSNS * 4) {
+        fprintf(out, " if (ctx->idle_skip && !ctx->idle_rejected[%u]) { *pc = 0x%08xu; return 0x%08xu; }",
+                (exit_pc - PC_START_ADDRESS) >> 2, target, exit_pc);
+    }
+    if (aot_in_ram(target) && g->block[(target - PC_START_ADDRESS) >> 2] >= 0) fprintf(out, " goto L%08x;\n", target);
+    else fprintf(out, " *pc = 0x%08xu; return POXIM_AOT_DONE;\n", target);
+}
+
+static void aot_emit_insn(FILE *out, aot_gen_t *g, const decoded_insn_t *d, uint32_t pc, uint32_t index) {
+    insn_handler_t h = d->handler;
+    uint32_t opcode = get_opcode(d->raw), imm = (uint32_t)d->imm;
+    uint32_t rd = d->rd, rs1 = d->rs1, rs2 = d->rs2;
+    fprintf(out, "    // 0x%08x: 0x%08x\n", pc, d->raw);
+
+    if (h == exec_nop) {
+    } else if (h == exec_lui || h == exec_auipc) {
+        if (rd) fprintf(out, "    r[%u] = 0x%08xu;\n", rd, h == exec_lui ? imm : pc + imm);
+    } else if (h == exec_lb || h == exec_lh || h == exec_lw || h == exec_lbu || h == exec_lhu) {
+        uint32_t size = (h == exec_lb || h == exec_lbu) ? 1 : (h == exec_lh || h == exec_lhu) ? 2 : 4;
+        const char *ext = (h == exec_lb) ? "(uint32_t)(int8_t)" : (h == exec_lh) ? "(uint32_t)(int16_t)" : "";
+        fprintf(out, "    a = r[%u] + 0x%08xu;\n", rs1, imm);
+        fprintf(out, "    if (a - RAM_BASE <= RAM_SIZE - %u%s) r[%u] = %spoxim_aot_ld(mem + (a - RAM_BASE), %u);\n",
+                size, size == 1 ? "" : size == 2 ? " && !(a & 1)" : " && !(a & 3)", rd, ext, size);
+        fprintf(out, "    else {\n");
+        fprintf(out, "        *mtime += %u; r[%u] = %sctx->load(a, %u, 0x%08xu);\n", index + 1, rd, ext, size, pc);
+        fprintf(out, "        if (!*ctx->trap_pending) *pc = 0x%08xu;\n", pc + 4);
+        fprintf(out, "        return POXIM_AOT_DONE;\n    }\n");
+    } else if (h == exec_sb || h == exec_sh || h == exec_sw) {
+        uint32_t size = (h == exec_sb) ? 1 : (h == exec_sh) ? 2 : 4;
+        fprintf(out, "    a = r[%u] + 0x%08xu;\n", rs1, imm);
+        fprintf(out, "    if (a - RAM_BASE <= RAM_SIZE - %u%s && !ctx->code_map[(a - RAM_BASE) >> POXIM_AOT_CHUNK_SHIFT])"
+                " poxim_aot_st(mem + (a - RAM_BASE), r[%u], %u);\n",
+                size, size == 1 ? "" : size == 2 ? " && !(a & 1)" : " && !(a & 3)", rs2, size);
+        fprintf(out, "    else {\n");
+        fprintf(out, "        *mtime += %u;\n", index + 1);
+        fprintf(out, "        if (ctx->store(a, r[%u], %u, 0x%08xu)) return POXIM_AOT_DONE;\n", rs2, size, pc);
+        fprintf(out, "        *mtime -= %u;\n    }\n", index + 1);
+    } else if (opcode == 0x13) {
+        if (!rd) return;
+        if (h == exec_addi)       fprintf(out, "    r[%u] = r[%u] + 0x%08xu;\n", rd, rs1, imm);
+        else if (h == exec_slti)  fprintf(out, "    r[%u] = (int32_t)r[%u] < %d;\n", rd, rs1, d->imm);
+        else if (h == exec_sltiu) fprintf(out, "    r[%u] = r[%u] < 0x%08xu;\n", rd, rs1, imm);
+        else if (h == exec_xori)  fprintf(out, "    r[%u] = r[%u] ^ 0x%08xu;\n", rd, rs1, imm);
+        else if (h == exec_ori)   fprintf(out, "    r[%u] = r[%u] | 0x%08xu;\n", rd, rs1, imm);
+        else if (h == exec_andi)  fprintf(out, "    r[%u] = r[%u] & 0x%08xu;\n", rd, rs1, imm);
+        else if (h == exec_slli)  fprintf(out, "    r[%u] = r[%u] << %u;\n", rd, rs1, imm);
+        else if (h == exec_srli)  fprintf(out, "    r[%u] = r[%u] >> %u;\n", rd, rs1, imm);
+        else                      fprintf(out, "    r[%u] = (uint32_t)((int32_t)r[%u] >> %u);\n", rd, rs1, imm);
+    } else if (opcode == 0x33) {
+        if (!rd) return;
+        const char *fmt =
+            (h == exec_add)    ? "r[%u] + r[%u]" :
+            (h == exec_sub)    ? "r[%u] - r[%u]" :
+            (h == exec_xor)    ? "r[%u] ^ r[%u]" :
+            (h == exec_or)     ? "r[%u] | r[%u]" :
+            (h == exec_and)    ? "r[%u] & r[%u]" :
+            (h == exec_sll)    ? "r[%u] << (r[%u] & 31)" :
+            (h == exec_srl)    ? "r[%u] >> (r[%u] & 31)" :
+            (h == exec_sra)    ? "(uint32_t)((int32_t)r[%u] >> (r[%u] & 31))" :
+            (h == exec_slt)    ? "(int32_t)r[%u] < (int32_t)r[%u]" :
+            (h == exec_sltu)   ? "r[%u] < r[%u]" :
+            (h == exec_mul)    ? "r[%u] * r[%u]" :
+            (h == exec_mulh)   ? "(uint32_t)((uint64_t)((int64_t)(int32_t)r[%u] * (int32_t)r[%u]) >> 32)" :
+            (h == exec_mulhsu) ? "(uint32_t)((uint64_t)((int64_t)(int32_t)r[%u] * (int64_t)r[%u]) >> 32)" :
+            (h == exec_mulhu)  ? "(uint32_t)(((uint64_t)r[%u] * r[%u]) >> 32)" :
+            (h == exec_div)    ? "poxim_aot_div(r[%u], r[%u])" :
+            (h == exec_divu)   ? "poxim_aot_divu(r[%u], r[%u])" :
+            (h == exec_rem)    ? "poxim_aot_rem(r[%u], r[%u])" : "poxim_aot_remu(r[%u], r[%u])";
+        fprintf(out, "    r[%u] = ", rd);
+        fprintf(out, fmt, rs1, rs2);
+        fprintf(out, ";\n");
+    } else if (h == exec_jal) {
+        if (rd) fprintf(out, "    r[%u] = 0x%08xu;\n", rd, pc + 4);
+        aot_emit_exit(out, g, aot_branch_target(d, pc), index + 1, pc);
+    } else if (h == exec_jalr) {
+        fprintf(out, "    a = (r[%u] + 0x%08xu) & ~1u;\n", rs1, imm);
+        if (rd) fprintf(out, "    r[%u] = 0x%08xu;\n", rd, pc + 4);
+        fprintf(out, "    *pc = (a == 0x%08xu) ? 0x%08xu : a;\n", pc, pc + 4);
+        fprintf(out, "    *mtime += %u; miss = POXIM_AOT_DONE; goto dispatch;\n", index + 1);
+    } else if (rs1 == rs2) {
+        // Comparação de um registrador com ele mesmo: o desvio é fixo.
+        int taken = h == exec_beq || h == exec_bge || h == exec_bgeu;
+        aot_emit_exit(out, g, taken ? aot_branch_target(d, pc) : pc + 4, index + 1, pc);
+    } else {
+        const char *cond =
+            (h == exec_beq)  ? "r[%u] == r[%u]" :
+            (h == exec_bne)  ? "r[%u] != r[%u]" :
+            (h == exec_blt)  ? "(int32_t)r[%u] < (int32_t)r[%u]" :
+            (h == exec_bge)  ? "(int32_t)r[%u] >= (int32_t)r[%u]" :
+            (h == exec_bltu) ? "r[%u] < r[%u]" : "r[%u] >= r[%u]";
+        fprintf(out, "    if (");
+        fprintf(out, cond, rs1, rs2);
+        fprintf(out, ") {\n");
+        aot_emit_exit(out, g, aot_branch_target(d, pc), index + 1, pc);
+        fprintf(out, "    }\n");
+        aot_emit_exit(out, g, pc + 4, index + 1, pc);
+    }
+}
+
+// Grava em 'out' a tradução do programa na RAM de m. 'name' é o símbolo do
+// poxim_aot_t. Retorna o número de blocos.
+uint32_t aot_generate(machine_t *m, FILE *out, const uint32_t *targets, size_t target_count, const char *name) {
+    aot_gen_t g;
+    g.head = (uint8_t*)calloc(memory_size / 4, 1);
+    g.block = (int32_t*)malloc(memory_size / 4 * sizeof(int32_t));
+    g.pending = (uint32_t*)malloc(memory_size / 4 * sizeof(uint32_t));
+    g.pending_count = 0;
+    uint8_t *covered = (uint8_t*)calloc(memory_size / 4, 1);
+
+    // Cabeças: percorre cada uma até o fim do seu bloco mais longo possível.
+    aot_add_head(&g, m->harts[0].pc);
+    for (size_t i = 0; i < target_count; i++) aot_add_head(&g, targets[i]);
+    while (g.pending_count) {
+        uint32_t pc = g.pending[--g.pending_count], count = 0;
+        while (aot_in_ram(pc)) {
+            decoded_insn_t d;
+            aot_decode(m, pc, &d);
+            int kind = aot_insn_kind(&d);
+            if (kind == AOT_INSN_NONE) {
+                // Depois do trap ou do CSR a execução volta aqui; de ilegais, do mret e do sret, não.
+                if (d.handler != exec_illegal && d.handler != exec_mret && d.handler != exec_sret) aot_add_head(&g, pc + 4);
+                break;
+            }
+            if (kind == AOT_INSN_END) {
+                if (d.handler == exec_jal) {
+                    aot_add_head(&g, aot_branch_target(&d, pc));
+                    if (d.rd) aot_add_head(&g, pc + 4);
+                } else if (d.handler != exec_jalr) {
+                    aot_add_head(&g, aot_branch_target(&d, pc));
+                    aot_add_head(&g, pc + 4);
+                }
+                break;
+            }
+            pc += 4;
+            if (++count == AOT_MAX_BLOCK_INSNS) {
+                aot_add_head(&g, pc);
+                break;
+            }
+        }
+    }
+
+    // Blocos: as cabeças com pelo menos uma instrução traduzível, em ordem de pc.
+    uint32_t block_count = 0, word_count = 0;
+    int indirect = 0; // algum bloco termina em jalr (usa o despachante)
+    for (uint32_t w = 0; w < memory_size / 4; w++) {
+        g.block[w] = -1;
+        if (!g.head[w]) continue;
+        uint32_t length = aot_block_length(m, &g, PC_START_ADDRESS + w * 4);
+        if (length == 0) continue;
+        g.block[w] = block_count++;
+        for (uint32_t i = 0; i < length; i++) covered[w + i] = 1;
+        decoded_insn_t d;
+        aot_decode(m, PC_START_ADDRESS + (w + length - 1) * 4, &d);
+        if (d.handler == exec_jalr) indirect = 1;
+    }
+
+    fprintf(out, "// Gerado pelo poxim-aot: %u blocos. Compilar junto com o poxim.c e rodar\n", block_count);
+    fprintf(out, "// com --engine=aot (ou passar &%s a poxim_set_aot).\n", name);
+    fprintf(out, "#include \"poxim_aot.h\"\n\n");
+    fprintf(out, "#define RAM_BASE 0x%08xu\n#define RAM_SIZE 0x%08xu\n\n", PC_START_ADDRESS, memory_size);
+
+    // C não aceita tabela vazia: sem blocos fica uma linha que não é contada.
+    fprintf(out, "static const uint32_t aot_blocks[][2] = {\n");
+    if (block_count == 0) fprintf(out, "    { 0, 0 },\n");
+    for (uint32_t w = 0; w < memory_size / 4; w++) {
+        if (g.block[w] < 0) continue;
+        fprintf(out, "    { 0x%08xu, %u },\n", PC_START_ADDRESS + w * 4, aot_block_length(m, &g, PC_START_ADDRESS + w * 4));
+    }
+    fprintf(out, "};\n\nstatic const uint32_t aot_words[][2] = {\n");
+    if (block_count == 0) fprintf(out, "    { 0, 0 },\n");
+    for (uint32_t w = 0; w < memory_size / 4; w++) {
+        if (!covered[w]) continue;
+        fprintf(out, "    { 0x%08xu, 0x%08xu },\n", PC_START_ADDRESS + w * 4, mem_load_le(m->memory + w * 4, 4));
+        word_count++;
+    }
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "static uintptr_t aot_enter(poxim_aot_ctx_t *ctx) {\n");
+    fprintf(out, "    uint32_t *const r = ctx->regs;\n");
+    fprintf(out, "    uint8_t *const mem = ctx->memory;\n");
+    fprintf(out, "    uint32_t *const pc = ctx->pc;\n");
+    fprintf(out, "    uint64_t *const mtime = ctx->mtime;\n");
+    fprintf(out, "    uintptr_t miss = POXIM_AOT_BAIL; // depois de um jalr o pc sem bloco volta ao despachante\n");
+    fprintf(out, "    uint32_t a;\n");
+    fprintf(out, "    (void)r; (void)mem; (void)a;\n\n");
+    if (indirect) fprintf(out, "dispatch:\n");
+    fprintf(out, "    switch (*pc) {\n");
+    for (uint32_t w = 0; w < memory_size / 4; w++) {
+        if (g.block[w] >= 0) fprintf(out, "    case 0x%08xu: goto L%08x;\n", PC_START_ADDRESS + w * 4, PC_START_ADDRESS + w * 4);
+    }
+    fprintf(out, "    }\n    return miss;\n");
+
+    for (uint32_t w = 0; w < memory_size / 4; w++) {
+        if (g.block[w] < 0) continue;
+        uint32_t start = PC_START_ADDRESS + w * 4, length = aot_block_length(m, &g, start), pc = start;
+        fprintf(out, "\nL%08x:\n", start);
+        fprintf(out, "    if (ctx->stale[%d] || *mtime + %u >= *ctx->irq_next_check) { *pc = 0x%08xu; return POXIM_AOT_BAIL; }\n",
+                g.block[w], length, start);
+        int ended = 0;
+        for (uint32_t i = 0; i < length; i++, pc += 4) {
+            decoded_insn_t d;
+            aot_decode(m, pc, &d);
+            aot_emit_insn(out, &g, &d, pc, i);
+            ended = aot_insn_kind(&d) == AOT_INSN_END;
+        }
+        if (!ended) aot_emit_exit(out, &g, pc, length, pc - 4);
+    }
+    fprintf(out, "}\n\n");
+
+    fprintf(out, "const poxim_aot_t %s = {\n", name);
+    fprintf(out, "    POXIM_AOT_ABI, RAM_BASE, RAM_SIZE, %u, %u, aot_blocks, aot_words, aot_enter\n};\n", block_count, word_count);
+
+    free(g.head);
+    free(g.block);
+    free(g.pending);
+    free(covered);
+    return block_count;
+}
+
+void print_usage(const char *prog) {
+    fprintf(stderr, "Uso: %s [opcoes] <hex_in> <trace_out> <term_in> <term_out>\n", prog);
+    fprintf(stderr, "     %s [opcoes] --batch <manifesto> [-j N]\n", prog);
+    fprintf(stderr, "     %s [opcoes] --fork <manifesto> [-j N] <hex_in> <trace_out> <term_in> <term_out>\n", prog);
+    fprintf(stderr, "Opcoes:\n");
+    fprintf(stderr, "  --engine=cache   executa com o cache de instrucoes pre-decodificadas (padrao)\n");
+    fprintf(stderr, "  --engine=ref     executa com o interpretador de referencia (decode_and_execute)\n");
+    fprintf(stderr, "  --engine=jit     traduz blocos basicos para x86-64; com --trace=full usa o\n");
+    fprintf(stderr, "                   cache de instrucoes\n");
+    fprintf(stderr, "  --engine=aot     roda os blocos do poxim-aot compilados junto com este\n");
+    fprintf(stderr, "                   binario; o resto (e --trace=full) fica no cache\n");
+    fprintf(stderr, "  --trace=full     grava instrucoes e traps no trace_out (padrao)\n");
+    fprintf(stderr, "  --trace=traps    grava somente os traps no trace_out\n");
+    fprintf(stderr, "  --no-trace       nao grava nada no trace_out (execucao mais rapida)\n");
+    fprintf(stderr, "  --uart-flush=N   grava a saida da UART a cada N ticks de mtime (padrao\n");
+    fprintf(stderr, "                   1000000; 0 grava a cada caractere)\n");
+    fprintf(stderr, "  --uart-char-time=N\n");
+    fprintf(stderr, "                   ticks de mtime por caractere transmitido com a FIFO\n");
+    fprintf(stderr, "                   ligada (padrao 64; 0 transmite na hora)\n");
+    fprintf(stderr, "  --no-idle-skip   executa lacos ociosos volta a volta, sem avancar mtime\n");
+    fprintf(stderr, "  --harts=N        simula N harts (1 a %d), cada um em uma thread; o trace\n", MAX_HARTS);
+    fprintf(stderr, "                   do hart i > 0 vai para <trace_out>.hart<i>\n");
+    fprintf(stderr, "  --ram=TAMANHO    RAM principal em 0x%08x (4K a 1G, sufixos K, M e G;\n", PC_START_ADDRESS);
+    fprintf(stderr, "                   padrao 128K); as paginas so ocupam memoria no host depois\n");
+    fprintf(stderr, "                   do primeiro acesso\n");
+    fprintf(stderr, "  --mem=BASE:TAMANHO\n");
+    fprintf(stderr, "                   outra regiao de RAM no mapa (repetivel); a pilha comeca no\n");
+    fprintf(stderr, "                   topo da RAM mais alta\n");
+    fprintf(stderr, "  --rom=BASE:ARQ   regiao so de leitura com o conteudo do arquivo, mapeado uma\n");
+    fprintf(stderr, "                   vez e dividido entre as maquinas (repetivel)\n");
+    fprintf(stderr, "  --trace-pc=A-B|simbolo[,...]\n");
+    fprintf(stderr, "                   com --trace=full, so as instrucoes com pc em [A, B) (em\n");
+    fprintf(stderr, "                   hex) ou na funcao (simbolos do ELF ou de --profile-symbols)\n");
+    fprintf(stderr, "  --trace-from=N --trace-count=M\n");
+    fprintf(stderr, "                   so as instrucoes N a N+M-1 de cada hart (contando de 0)\n");
+    fprintf(stderr, "  --trace-changes  so as instrucoes que mudam um registrador ou CSR\n");
+    fprintf(stderr, "  --trace-sample=K uma instrucao a cada K das que passam pelos outros filtros\n");
+    fprintf(stderr, "  --trace-format=text|bin\n");
+    fprintf(stderr, "                   formato do trace_out; bin e compacto e e convertido\n");
+    fprintf(stderr, "                   para texto com poxim-tracefmt (padrao: text)\n");
+    fprintf(stderr, "  --batch <manifesto>\n");
+    fprintf(stderr, "                   roda cada linha do manifesto (<hex_in> <trace_out> <term_in>\n");
+    fprintf(stderr, "                   <term_out>) como uma execucao independente e imprime um\n");
+    fprintf(stderr, "                   resumo com o status e as instrucoes de cada uma\n");
+    fprintf(stderr, "  --simd[=K]       no --batch, linhas seguidas com o mesmo hex_in rodam em\n");
+    fprintf(stderr, "                   grupos de ate K maquinas (2 a 8, padrao 8) que executam\n");
+    fprintf(stderr, "                   juntas as instrucoes em que estao no mesmo pc (um hart,\n");
+    fprintf(stderr, "                   --trace=traps ou --no-trace)\n");
+    fprintf(stderr, "  -j N             threads do --batch ou processos do --fork (padrao: numero\n");
+    fprintf(stderr, "                   de CPUs)\n");
+    fprintf(stderr, "  --blk=<imagem>   disco de blocos com DMA em 0x%08x (IRQ %d do PLIC) com a\n", BLK_BASE, BLK_IRQ);
+    fprintf(stderr, "                   imagem mapeada; gravacoes vao para o arquivo (com --batch,\n");
+    fprintf(stderr, "                   --fork e --lockstep ficam na execucao)\n");
+    fprintf(stderr, "  --semihosting    a sequencia slli/ebreak/srai do RISC-V chama o host (console,\n");
+    fprintf(stderr, "                   arquivos, memcpy/memset/strlen, exit com codigo)\n");
+    fprintf(stderr, "  --stats          imprime no stderr, ao fim, instrucoes, traps, ciclos, tempo\n");
+    fprintf(stderr, "                   no host e MIPS simulados (no --batch, somas do lote)\n");
+    fprintf(stderr, "  --timing[=chave=valor,...]\n");
+    fprintf(stderr, "                   modelo aproximado de ciclos (caches I e D, latencias de\n");
+    fprintf(stderr, "                   mul/div, previsao de desvios, MMIO) que avanca mcycle e mtime\n");
+    fprintf(stderr, "                   e imprime CPI e faltas por regiao no stderr ao fim; usa o\n");
+    fprintf(stderr, "                   cache de instrucoes. Chaves: icache/dcache=<bytes>:<vias>:\n");
+    fprintf(stderr, "                   <linha>|off (padrao 8192:2:32 e 8192:4:32), imiss, dmiss,\n");
+    fprintf(stderr, "                   mul, div, branch, mmio (padrao 20, 20, 3, 34, 3, 10 ciclos)\n");
+    fprintf(stderr, "  --profile=<prefixo>\n");
+    fprintf(stderr, "                   perfil do programa: grava <prefixo>.folded (flamegraph.pl)\n");
+    fprintf(stderr, "                   e <prefixo>.txt, mais <prefixo>.targets (alvos de saltos\n");
+    fprintf(stderr, "                   para o poxim-aot); usa o cache de instrucoes, sem --trace=full\n");
+    fprintf(stderr, "  --profile-period=N\n");
+    fprintf(stderr, "                   uma amostra a cada N ciclos (padrao 1: toda instrucao)\n");
+    fprintf(stderr, "  --profile-symbols=<arq>\n");
+    fprintf(stderr, "                   simbolos de um ELF ou mapa \"endereco [tipo] nome\" (padrao:\n");
+    fprintf(stderr, "                   o proprio programa, se for ELF)\n");
+    fprintf(stderr, "  --lockstep[=N]   roda tambem o interpretador de referencia e compara pc,\n");
+    fprintf(stderr, "                   registradores, CSRs, perifericos e RAM a cada N ciclos\n");
+    fprintf(stderr, "                   (padrao 1000); aponta a instrucao da primeira divergencia\n");
+    fprintf(stderr, "  --ff=N           avanca as primeiras N instrucoes do hart 0 no motor mais\n");
+    fprintf(stderr, "                   rapido, sem trace nem perfil, e so entao liga o motor, o\n");
+    fprintf(stderr, "                   trace e o perfil pedidos\n");
+    fprintf(stderr, "  --ff-pc=A|simbolo[:k]\n");
+    fprintf(stderr, "                   avanca ate a k-esima chegada no pc (padrao k=1)\n");
+    fprintf(stderr, "  --ff-ecall=k     avanca ate o k-esimo ecall (depois do trap dele)\n");
+    fprintf(stderr, "  --detail=M       a janela de detalhe tem M instrucoes (padrao: ate o fim)\n");
+    fprintf(stderr, "  --detail-then=stop|ff\n");
+    fprintf(stderr, "                   depois da janela, para (padrao) ou avanca ate o fim\n");
+    fprintf(stderr, "  --checkpoint-at=T\n");
+    fprintf(stderr, "                   para a maquina quando o mtime do hart 0 chega em T\n");
+    fprintf(stderr, "  --save-checkpoint=<arq>\n");
+    fprintf(stderr, "                   grava o estado da maquina em --checkpoint-at no arquivo\n");
+    fprintf(stderr, "  --restore=<arq>  comeca do checkpoint gravado (com o mesmo hex_in)\n");
+    fprintf(stderr, "  --fork <manifesto>\n");
+    fprintf(stderr, "                   roda ate o checkpoint e continua cada linha do manifesto\n");
+    fprintf(stderr, "                   (<trace_out> <term_in> <term_out>) num processo filho\n");
+}
+
+// --- Execução de um Hart ---
+int engine = ENGINE_CACHE;
+int trace_level = TRACE_FULL;
+int trace_binary = 0;
+
+// Máquina dona dos caches da thread (__thread). Uma thread que volta à mesma
+// máquina (--lockstep a roda em trechos) mantém o que já decodificou e traduziu.
+__thread uint64_t thread_machine_serial;
+__thread const hart_t *thread_trace_hart; // dono do trace_bin_state da thread
+
+// Roda o hart atual até a máquina parar, com o motor e o trace da máquina.
+void run_hart() {
+    FILE *outfile = hart->trace_file;
+    int hart_engine = machine->engine;
+    int level = machine->trace_level, binary = machine->trace_binary;
+
+    // A thread pode ter rodado outra máquina antes (--batch).
+    thread_caches_init();
+    int fresh = thread_machine_serial != machine->serial;
+    if (fresh) {
+        aot_attach(NULL);
+        icache_flush();
+        memset(idle_loops, 0, sizeof(idle_loops));
+        thread_machine_serial = machine->serial;
+    }
+
+    if (binary && level != TRACE_NONE) {
+        // O cabeçalho só se repete se outro hart usou o estado do trace
+        // binário desta thread: trocar o código (serial novo) não o invalida.
+        trace_bin_begin(outfile, thread_trace_hart != hart || !hart->trace_bin_open);
+        hart->trace_bin_open = 1;
+        thread_trace_hart = hart;
+    }
+
+    // O perfil só existe nos laços do cache de instruções.
+    if (machine->profile) {
+        if (!hart->profile) hart->profile = profile_new(profile_period, hart->pc);
+        hart->profile_next = hart->mtime + 1;
+        profile_block(hart->profile, hart->pc);
+        hart_engine = ENGINE_CACHE;
+    }
+    // O modelo de tempo também (ver "Modelo de Tempo").
+    if (machine->timing) {
+        if (!hart->timing) hart->timing = timing_new(hart);
+        hart_engine = ENGINE_CACHE;
+    }
+
+    // O JIT não gera trace por instrução; com --trace=full fica o cache.
+    if (hart_engine == ENGINE_JIT && level != TRACE_FULL) {
+#if defined(__x86_64__)
+        if ((fresh || !jit_code) && !jit_init()) {
+            fprintf(stderr, "Nao foi possivel alocar o cache do JIT; usando o cache de instrucoes\n");
+            hart_engine = ENGINE_CACHE;
+        }
+#else
+        fprintf(stderr, "O JIT so esta disponivel em x86-64; usando o cache de instrucoes\n");
+        hart_engine = ENGINE_CACHE;
+#endif
+    }
+    // Nem a tradução antecipada; sem tradução ligada tudo fica no cache.
+    if (hart_engine == ENGINE_AOT && level != TRACE_FULL) {
+        if (aot_image != machine->aot) aot_attach(machine->aot);
+        if (!aot_image) hart_engine = ENGINE_CACHE;
+    }
+
+    if (hart->profile && profile_period == 1 && level == TRACE_NONE) run_cached_profile_silent(outfile);
+    else if (hart->profile && profile_period == 1) binary ? run_cached_profile_traps_bin(outfile) : run_cached_profile_traps(outfile);
+    else if (machine->timing && level == TRACE_NONE) run_cached_timing_silent(outfile);
+    else if (machine->timing && level == TRACE_FULL) binary ? run_cached_timing_full_bin(outfile) : run_cached_timing_full(outfile);
+    else if (machine->timing) binary ? run_cached_timing_traps_bin(outfile) : run_cached_timing_traps(outfile);
+    else if (hart_engine == ENGINE_REF) run_reference(outfile, level);
+#if defined(__x86_64__)
+    else if (hart_engine == ENGINE_JIT && level == TRACE_NONE) run_jit_silent(outfile);
+    else if (hart_engine == ENGINE_JIT && level == TRACE_TRAPS) binary ? run_jit_traps_bin(outfile) : run_jit_traps(outfile);
+#endif
+    else if (hart_engine == ENGINE_AOT && level == TRACE_NONE) run_aot_silent(outfile);
+    else if (hart_engine == ENGINE_AOT && level == TRACE_TRAPS) binary ? run_aot_traps_bin(outfile) : run_aot_traps(outfile);
+    else if (level == TRACE_NONE) run_cached_silent(outfile);
+    else if (level == TRACE_FULL) binary ? run_cached_full_bin(outfile) : run_cached_full(outfile);
+    else binary ? run_cached_traps_bin(outfile) : run_cached_traps(outfile);
+
+    if (binary && level != TRACE_NONE) trace_bin_end(outfile);
+}
+
+void *hart_thread(void *arg) {
+    hart = (hart_t*)arg;
+    machine = hart->machine;
+    run_hart();
+    jit_release();
+    thread_caches_release();
+    return NULL;
+}
+
+// Os caches de cada thread (__thread) que não são reservados com mem_reserve
+// ficam junto da pilha dela, então as threads do simulador são criadas com uma
+// pilha folgada.
+#define THREAD_STACK_SIZE (32 * 1024 * 1024)
+
+int thread_start(pthread_t *thread, void *(*start)(void *), void *arg) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+    int ok = pthread_create(thread, &attr, start, arg) == 0;
+    pthread_attr_destroy(&attr);
+    return ok;
+}
+
+// --- Checkpoints ---
+// Um checkpoint guarda o estado inteiro da máquina num instante (harts e CSRs,
+// mtime/mtimecmp, PLIC, UART, deslocamentos do terminal e a RAM) para outras
+// execuções continuarem dali sem repetir o boot. A RAM é gravada em páginas, e
+// só as páginas que diferem da imagem do hex (base_image) vão para o arquivo:
+// a execução que restaura carrega o mesmo hex e aplica as páginas por cima.
+//
+// Formato (little-endian): "PXCK", versão, número de harts, tamanho da RAM e
+// da página, hash da imagem base, os campos de checkpoint_state(), o
+// deslocamento de term_in, a saída do terminal até ali e as páginas sujas
+// (índice + conteúdo).
+#define CHECKPOINT_MAGIC "PXCK"
+#define CHECKPOINT_VERSION 5
+#define CHECKPOINT_PAGE_SIZE 1024
+
+uint64_t checkpoint_at = UINT64_MAX;   // --checkpoint-at
+const char *checkpoint_save_path;      // --save-checkpoint
+const char *fork_manifest;             // --fork (ver "Variantes")
+uint8_t *checkpoint_data;              // --restore: o arquivo inteiro, lido uma vez
+size_t checkpoint_size;
+
+// Leitura e escrita usam as mesmas funções, então a lista de campos aparece
+// uma vez só (checkpoint_state).
+typedef struct {
+    uint8_t *data;
+    size_t len, cap, pos;
+    int writing, ok;
+} ckpt_io_t;
+
+void ckpt_bytes(ckpt_io_t *io, void *p, size_t n) {
+    if (io->writing) {
+        if (io->len + n > io->cap) {
+            while (io->len + n > io->cap) io->cap = io->cap ? io->cap * 2 : 4096;
+            io->data = (uint8_t*)realloc(io->data, io->cap);
+        }
+        memcpy(io->data + io->len, p, n);
+        io->len += n;
+    } else if (io->ok && io->len - io->pos >= n) {
+        memcpy(p, io->data + io->pos, n);
+        io->pos += n;
+    } else {
+        io->ok = 0;
+        memset(p, 0, n);
+    }
+}
+
+void ckpt_u8(ckpt_io_t *io, uint8_t *v)   { ckpt_bytes(io, v, 1); }
+void ckpt_u32(ckpt_io_t *io, uint32_t *v) { uint32_t x = htole32(*v); ckpt_bytes(io, &x, 4); *v = le32toh(x); }
+void ckpt_u64(ckpt_io_t *io, uint64_t *v) { uint64_t x = htole64(*v); ckpt_bytes(io, &x, 8); *v = le64toh(x); }
+void ckpt_int(ckpt_io_t *io, int *v)      { uint32_t x = (uint32_t)*v; ckpt_u32(io, &x); *v = (int)x; }
+
+// Estado da máquina numa fronteira de instrução. Fica de fora o que é
+// recalculado (irq_next_check, mem_regions) ou pertence ao host (arquivos,
+// buffers, threads).
+void checkpoint_state(ckpt_io_t *io, machine_t *m) {
+    for (uint32_t i = 0; i < m->hart_count; i++) {
+        hart_t *h = &m->harts[i];
+        ckpt_u32(io, &h->pc);
+        for (int r = 0; r < NUM_REGISTERS; r++) ckpt_u32(io, &h->regs[r]);
+        ckpt_u32(io, &h->mstatus); ckpt_u32(io, &h->mie);   ckpt_u32(io, &h->mtvec);
+        ckpt_u32(io, &h->mepc);    ckpt_u32(io, &h->mcause); ckpt_u32(io, &h->mtval);
+        ckpt_u32(io, &h->mscratch); ckpt_u32(io, &h->mip);  ckpt_u32(io, &h->misa);
+        ckpt_u32(io, &h->mhartid);
+        ckpt_u32(io, &h->priv);
+        ckpt_u32(io, &h->medeleg); ckpt_u32(io, &h->mideleg); ckpt_u32(io, &h->mcounteren);
+        ckpt_u32(io, &h->stvec);   ckpt_u32(io, &h->sepc);    ckpt_u32(io, &h->scause);
+        ckpt_u32(io, &h->stval);   ckpt_u32(io, &h->sscratch); ckpt_u32(io, &h->scounteren);
+        ckpt_u32(io, &h->satp);
+        ckpt_u64(io, &h->mtime);
+        ckpt_u64(io, &h->mtimecmp);
+        ckpt_u32(io, &h->last_trap_pc);
+        ckpt_u32(io, &h->last_trap_cause);
+        ckpt_u64(io, &h->wfi_ticks);
+        ckpt_u64(io, &h->trap_count);
+        ckpt_u64(io, &h->interrupt_count);
+        ckpt_u64(io, &h->stall_ticks);
+        for (int c = 0; c < 32; c++) ckpt_u64(io, &h->counter_offset[c]);
+        for (int c = 0; c < 32; c++) ckpt_u32(io, &h->hpm_event[c]);
+        ckpt_int(io, &h->reserved);
+        ckpt_u32(io, &h->reserved_address);
+        ckpt_u32(io, &h->reserved_value);
+        if (!io->writing) { // a TLB não vai para o arquivo: recomeça vazia
+            hart_t *current = hart;
+            hart = h;
+            tlb_flush(h);
+            mmu_update();
+            hart = current;
+        }
+    }
+
+    ckpt_u32(io, &m->plic_pending);
+    for (uint32_t i = 0; i < m->hart_count; i++) ckpt_u32(io, &m->plic_enable[i]);
+    ckpt_u32(io, &m->plic_claimed);
+    ckpt_bytes(io, m->plic_claimer, sizeof(m->plic_claimer));
+
+    ckpt_u8(io, &m->uart_ier);
+    ckpt_u8(io, &m->uart_lsr);
+    ckpt_u8(io, &m->uart_fcr);
+    ckpt_int(io, &m->uart_thre_pending);
+    ckpt_u32(io, &m->uart_tx_count);
+    ckpt_u64(io, &m->uart_tx_last);
+    ckpt_u32(io, &m->uart_rx_count);
+    ckpt_u64(io, &m->uart_rx_last);
+    ckpt_u64(io, &m->uart_rx_activity);
+    ckpt_u64(io, &m->uart_now);
+
+    // A imagem do --blk é do host, como term_in; só os registradores vão.
+    ckpt_u32(io, &m->blk_sector);
+    ckpt_u32(io, &m->blk_addr);
+    ckpt_u32(io, &m->blk_count);
+    ckpt_u32(io, &m->blk_cmd);
+    ckpt_u32(io, &m->blk_status);
+    ckpt_u32(io, &m->blk_ier);
+}
+
+// FNV-1a da RAM: confere que o checkpoint é do mesmo hex.
+uint64_t checkpoint_image_hash(const uint8_t *image) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (uint32_t i = 0; i < memory_size; i++) h = (h ^ image[i]) * 0x100000001b3ull;
+    return h;
+}
+
+void checkpoint_header(ckpt_io_t *io, uint32_t *harts, uint64_t *hash) {
+    uint8_t magic[4];
+    uint32_t version = CHECKPOINT_VERSION, ram_size = memory_size, page_size = CHECKPOINT_PAGE_SIZE;
+    memcpy(magic, CHECKPOINT_MAGIC, 4);
+    ckpt_bytes(io, magic, 4);
+    ckpt_u32(io, &version);
+    ckpt_u32(io, harts);
+    ckpt_u32(io, &ram_size);
+    ckpt_u32(io, &page_size);
+    ckpt_u64(io, hash);
+    if (memcmp(magic, CHECKPOINT_MAGIC, 4) != 0 || version != CHECKPOINT_VERSION ||
+        ram_size != memory_size || page_size != CHECKPOINT_PAGE_SIZE) {
+        io->ok = 0;
+    }
+}
+
+// Grava o estado da máquina parada (depois de machine_run). Retorna 0 em erro.
+int checkpoint_save(machine_t *m, const char *path) {
+    ckpt_io_t io;
+    memset(&io, 0, sizeof(io));
+    io.writing = io.ok = 1;
+    machine = m;
+    uart_host_flush();
+
+    uint32_t harts = m->hart_count;
+    uint64_t hash = checkpoint_image_hash(m->base_image);
+    checkpoint_header(&io, &harts, &hash);
+    checkpoint_state(&io, m);
+
+    uint64_t input_offset = m->uart_rx_read - (m->uart_rx_tail - m->uart_rx_head);
+    uint32_t output_len = (uint32_t)m->uart_log_len;
+    ckpt_u64(&io, &input_offset);
+    ckpt_u32(&io, &output_len);
+    ckpt_bytes(&io, m->uart_log, output_len);
+
+    uint32_t dirty = 0;
+    for (uint32_t off = 0; off < memory_size; off += CHECKPOINT_PAGE_SIZE) {
+        dirty += memcmp(m->memory + off, m->base_image + off, CHECKPOINT_PAGE_SIZE) != 0;
+    }
+    ckpt_u32(&io, &dirty);
+    for (uint32_t page = 0; page < memory_size / CHECKPOINT_PAGE_SIZE; page++) {
+        uint8_t *p = m->memory + page * CHECKPOINT_PAGE_SIZE;
+        if (memcmp(p, m->base_image + page * CHECKPOINT_PAGE_SIZE, CHECKPOINT_PAGE_SIZE) == 0) continue;
+        ckpt_u32(&io, &page);
+        ckpt_bytes(&io, p, CHECKPOINT_PAGE_SIZE);
+    }
+
+    FILE *f = fopen(path, "wb");
+    int ok = f && fwrite(io.data, 1, io.len, f) == io.len;
+    if (f && fclose(f) != 0) ok = 0;
+    if (!ok) perror("Erro ao gravar o checkpoint");
+    free(io.data);
+    return ok;
+}
+
+// Continua a E/S do terminal de onde o checkpoint parou: term_out recomeça com
+// a saída já produzida e term_in é lido a partir do deslocamento salvo (se não
+// aceita seek, como um pipe, a leitura começa do que ele tiver).
+void machine_resume_io(machine_t *m, const uint8_t *output, size_t output_len, uint64_t input_offset) {
+    machine = m;
+    if (output_len) uart_host_write(output, output_len);
+    m->uart_rx_head = m->uart_rx_tail = 0;
+    m->uart_rx_eof = 0;
+    m->uart_rx_read = input_offset;
+    if (m->uart_rx_fd >= 0) lseek(m->uart_rx_fd, (off_t)input_offset, SEEK_SET);
+    uart_host_fill();
+    // caracteres que já estavam na FIFO precisam estar no buffer
+    if (m->uart_rx_count > m->uart_rx_tail - m->uart_rx_head) m->uart_rx_count = m->uart_rx_tail - m->uart_rx_head;
+}
+
+// Aplica um checkpoint a uma máquina recém-aberta com o mesmo hex. Retorna 0
+// (com aviso) se o arquivo não serve para esta máquina.
+int checkpoint_restore(machine_t *m, uint8_t *data, size_t size) {
+    ckpt_io_t io;
+    memset(&io, 0, sizeof(io));
+    io.data = data;
+    io.len = size;
+    io.ok = 1;
+
+    uint32_t harts = 0;
+    uint64_t hash = 0;
+    checkpoint_header(&io, &harts, &hash);
+    if (!io.ok) {
+        fprintf(stderr, "Checkpoint invalido, de outra versao do poxim ou de outro --ram\n");
+        return 0;
+    }
+    if (harts != m->hart_count) {
+        fprintf(stderr, "O checkpoint tem %u harts (use --harts=%u)\n", harts, harts);
+        return 0;
+    }
+    if (hash != checkpoint_image_hash(m->memory)) {
+        fprintf(stderr, "O checkpoint foi gravado a partir de outro arquivo hex\n");
+        return 0;
+    }
+    checkpoint_state(&io, m);
+
+    uint64_t input_offset = 0;
+    uint32_t output_len = 0, dirty = 0;
+    ckpt_u64(&io, &input_offset);
+    ckpt_u32(&io, &output_len);
+    const uint8_t *output = data + io.pos;
+    if (io.ok && size - io.pos >= output_len) io.pos += output_len;
+    else io.ok = 0;
+    ckpt_u32(&io, &dirty);
+    for (uint32_t i = 0; i < dirty && io.ok; i++) {
+        uint32_t page = 0;
+        ckpt_u32(&io, &page);
+        if (page >= memory_size / CHECKPOINT_PAGE_SIZE) io.ok = 0;
+        else ckpt_bytes(&io, m->memory + page * CHECKPOINT_PAGE_SIZE, CHECKPOINT_PAGE_SIZE);
+    }
+    if (!io.ok) {
+        fprintf(stderr, "Checkpoint truncado\n");
+        return 0;
+    }
+    machine_resume_io(m, output, output_len, input_offset);
+    return 1;
+}
+
+// Lê o arquivo de --restore uma vez; todas as máquinas restauram dele.
+int checkpoint_load(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror("Erro ao abrir o checkpoint");
+        return 0;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    checkpoint_data = (uint8_t*)malloc(size > 0 ? size : 1);
+    checkpoint_size = fread(checkpoint_data, 1, size, f);
+    fclose(f);
+    return 1;
+}
+
+// Prepara uma máquina parada no checkpoint para seguir adiante.
+void machine_resume(machine_t *m) {
+    m->exit_reason = MACHINE_RUNNING;
+    for (uint32_t i = 0; i < m->hart_count; i++) {
+        m->harts[i].halt_flag = 0;
+        m->harts[i].irq_next_check = 0;
+        m->harts[i].stop_at = UINT64_MAX;
+    }
+}
+
+// --- Máquinas ---
+// Ciclo de vida de uma execução: machine_new, machine_open (arquivos e
+// programa), machine_run, machine_close e machine_free. Cada função torna a
+// máquina recebida a máquina da thread atual.
+uint32_t harts_per_machine = 1; // --harts
+uint64_t machine_serial;
+
+void machine_free(machine_t *m);
+
+machine_t *machine_new(uint32_t hart_count) {
+    machine_t *m = (machine_t*)calloc(1, sizeof(machine_t));
+    if (!m) return NULL;
+    machine = m;
+    // A RAM começa zerada sem tocar nas páginas que o programa não usa.
+    m->memory = (uint8_t*)mem_reserve(memory_size);
+    m->hart_count = hart_count;
+    m->engine = engine;
+    m->trace_level = trace_level;
+    m->trace_binary = trace_binary;
+    m->profile = profile_prefix != NULL;
+    m->timing = timing_enabled;
+    m->semihosting = semihosting_enabled;
+    // Laços ociosos só podem ser pulados quando ninguém mais mexe na memória.
+    m->idle_skip = idle_skip_enabled && hart_count == 1;
+    m->aot = (&poxim_aot_image && aot_usable(&poxim_aot_image)) ? &poxim_aot_image : NULL;
+    m->serial = __atomic_add_fetch(&machine_serial, 1, __ATOMIC_RELAXED);
+    pthread_mutex_init(&m->hart_lock, NULL);
+    pthread_cond_init(&m->hart_cond, NULL);
+    pthread_mutex_init(&m->mmio_lock, NULL);
+    m->uart_lsr = 1 << 5;
+    m->uart_rx_fd = -1;
+    for (uint32_t i = 0; i < SEMI_MAX_FILES; i++) m->semi_files[i] = -1;
+    if (!mem_init()) {
+        fprintf(stderr, "As regioes de --mem e --rom nao podem se sobrepor a RAM, aos perifericos ou umas as outras\n");
+        machine_free(m);
+        return NULL;
+    }
+
+    // Todos os harts começam com a pilha no topo da RAM mais alta do mapa e o
+    // mhartid em a0 para o programa separar as pilhas e o trabalho.
+    for (uint32_t i = 0; i < hart_count; i++) {
+        hart_t *h = &m->harts[i];
+        hart_init(h, i);
+        h->machine = m;
+        h->regs[2] = mem_stack_top();
+        h->regs[10] = i;
+    }
+    m->harts[0].stop_at = checkpoint_at;
+    hart = &m->harts[0];
+    return m;
+}
+
+// Grava o que sobrou da UART e fecha os arquivos da máquina.
+void machine_close(machine_t *m) {
+    machine = m;
+    uart_host_flush();
+    for (uint32_t i = 0; i < m->hart_count; i++) {
+        if (m->harts[i].trace_file) fclose(m->harts[i].trace_file);
+        m->harts[i].trace_file = NULL;
+        m->harts[i].trace_bin_open = 0;
+    }
+    if (m->uart_outfile) fclose(m->uart_outfile);
+    if (m->uart_infile) fclose(m->uart_infile);
+    m->uart_outfile = m->uart_infile = NULL;
+}
+
+// Abre os arquivos de trace e do terminal. Em caso de erro avisa no stderr,
+// fecha o que já abriu e retorna 0.
+int machine_open_files(machine_t *m, const char *trace_out, const char *term_in, const char *term_out) {
+    machine = m;
+    hart = &m->harts[0];
+
+    hart->trace_file = fopen(trace_out, m->trace_binary ? "wb" : "w");
+    if (!hart->trace_file) {
+        perror("Erro ao abrir arquivo de saida trace");
+        return 0;
+    }
+
+    // Abre o arquivo de entrada do terminal
+    m->uart_infile = fopen(term_in, "r");
+    if (!m->uart_infile) {
+        perror("Erro ao abrir arquivo de entrada do terminal");
+        machine_close(m);
+        return 0;
+    }
+
+    m->uart_outfile = fopen(term_out, "w");
+    if (!m->uart_outfile) {
+        perror("Erro ao criar arquivo de saida do terminal");
+        machine_close(m); // Garante que todos os arquivos abertos sejam fechados
+        return 0;
+    }
+    uart_init();
+
+    for (uint32_t i = 1; i < m->hart_count; i++) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s.hart%u", trace_out, i);
+        m->harts[i].trace_file = fopen(path, m->trace_binary ? "wb" : "w");
+        if (!m->harts[i].trace_file) {
+            perror("Erro ao abrir arquivo de saida trace");
+            machine_close(m);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Abre os arquivos de uma execução e carrega o programa (e o checkpoint de
+// --restore, se houver). Em caso de erro avisa no stderr, fecha o que já abriu
+// e retorna 0.
+int machine_open(machine_t *m, const char *hex_in, const char *trace_out, const char *term_in, const char *term_out) {
+    int program_fd = open(hex_in, O_RDONLY);
+    if (program_fd < 0) {
+        perror("Erro ao abrir arquivo de entrada hex");
+        return 0;
+    }
+    if (!machine_open_files(m, trace_out, term_in, term_out)) {
+        close(program_fd);
+        return 0;
+    }
+
+    int loaded = load_program(program_fd);
+    close(program_fd);
+    if (!loaded || (blk_path && !blk_open(blk_path))) {
+        machine_close(m);
+        return 0;
+    }
+    for (uint32_t i = 1; i < m->hart_count; i++) m->harts[i].pc = m->harts[0].pc;
+
+    if (checkpoint_save_path || fork_manifest) {
+        m->base_image = (uint8_t*)mem_reserve(memory_size);
+        mem_copy_touched(m->base_image, m->memory, memory_size);
+        m->uart_log_cap = 4096;
+        m->uart_log = (uint8_t*)malloc(m->uart_log_cap);
+    }
+    if (checkpoint_data && !checkpoint_restore(m, checkpoint_data, checkpoint_size)) {
+        machine_close(m);
+        return 0;
+    }
+    if (checkpoint_data && checkpoint_at <= m->harts[0].mtime) {
+        fprintf(stderr, "--checkpoint-at=%llu nao fica depois do checkpoint restaurado (mtime %llu)\n",
+                (unsigned long long)checkpoint_at, (unsigned long long)m->harts[0].mtime);
+        machine_close(m);
+        return 0;
+    }
+    return 1;
+}
+
+// Roda até a máquina parar: o hart 0 na thread atual e os outros em threads
+// próprias.
+void machine_run(machine_t *m) {
+    pthread_t threads[MAX_HARTS];
+    uint32_t started = 1;
+    machine = m;
+    for (; started < m->hart_count; started++) {
+        if (!thread_start(&threads[started], hart_thread, &m->harts[started])) {
+            fprintf(stderr, "Nao foi possivel criar a thread do hart %u\n", started);
+            machine_halt(MACHINE_ERROR);
+            break;
+        }
+    }
+    hart = &m->harts[0];
+    run_hart();
+    for (uint32_t i = 1; i < started; i++) pthread_join(threads[i], NULL);
+}
+
+void machine_free(machine_t *m) {
+    for (uint32_t i = 0; i < m->hart_count; i++) {
+        profile_free(m->harts[i].profile);
+        timing_free(m->harts[i].timing);
+    }
+    blk_close(m);
+    semi_close_all(m);
+    pthread_mutex_destroy(&m->hart_lock);
+    pthread_cond_destroy(&m->hart_cond);
+    pthread_mutex_destroy(&m->mmio_lock);
+    for (uint32_t i = 0; i < m->mem_region_count; i++) {
+        mem_region_t *r = &m->mem_regions[i];
+        if (r->host && r->host != m->memory && !(r->widths & MEM_READONLY)) munmap(r->host, r->size);
+        free(r->dirty);
+        free(r->dirty_pages);
+    }
+    munmap(m->memory, memory_size);
+    if (m->base_image) munmap(m->base_image, memory_size);
+    free(m->uart_log);
+    free(m);
+    if (machine == m) machine = NULL;
+}
+
+// --- Estatísticas (--stats) ---
+// Resumo no stderr ao fim da execução: instruções retiradas e traps de todos
+// os harts, ciclos (mtime do hart 0), tempo do host e MIPS simulados. Com
+// --restore conta só o que rodou depois do checkpoint.
+int stats_enabled = 0;
+
+typedef struct {
+    uint64_t instret, traps, interrupts, cycles;
+} run_stats_t;
+
+run_stats_t machine_stats(const machine_t *m) {
+    run_stats_t s = {0, 0, 0, m->harts[0].mtime};
+    for (uint32_t i = 0; i < m->hart_count; i++) {
+        s.instret += hart_instret(&m->harts[i]);
+        s.traps += m->harts[i].trap_count;
+        s.interrupts += m->harts[i].interrupt_count;
+    }
+    return s;
+}
+
+run_stats_t stats_diff(run_stats_t a, run_stats_t b) {
+    return (run_stats_t){a.instret - b.instret, a.traps - b.traps, a.interrupts - b.interrupts, a.cycles - b.cycles};
+}
+
+double host_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void print_stats(run_stats_t s, double seconds) {
+    fprintf(stderr, "--- estatisticas ---\n");
+    fprintf(stderr, "instrucoes:   %llu\n", (unsigned long long)s.instret);
+    fprintf(stderr, "traps:        %llu (%llu excecoes, %llu interrupcoes)\n", (unsigned long long)s.traps,
+            (unsigned long long)(s.traps - s.interrupts), (unsigned long long)s.interrupts);
+    fprintf(stderr, "ciclos:       %llu\n", (unsigned long long)s.cycles);
+    fprintf(stderr, "tempo (host): %.3f s\n", seconds);
+    fprintf(stderr, "MIPS:         %.2f\n", seconds > 0 ? s.instret / seconds / 1e6 : 0.0);
+}
+
+// --- Execução Vetorial (--simd) ---
+// Com --batch --simd, linhas seguidas do manifesto com o mesmo <hex_in> rodam
+// em grupos de até SIMD_LANES máquinas na mesma thread. O pc, os registradores
+// e o mtime do grupo ficam em estrutura de arrays (regs[r][lane]) e a cada
+// passo as lanes paradas no mesmo pc executam a instrução juntas: ALU, mul/div,
+// lui/auipc, desvios e saltos são operações em vetores (AVX2 quando o host tem,
+// vetores genéricos do GCC nos outros) e loads/stores alinhados na RAM usam a
+// RAM de cada lane. O resto (CSRs, SYSTEM, AMOs, fence.i, MMIO, falhas e o
+// passo em que chega o prazo do escalonador) vai para o cache de instruções,
+// uma lane por vez, com o estado copiado para o hart dela.
+//
+// O passo roda o menor pc entre as lanes que não pararam, para os caminhos
+// divergentes se reencontrarem (ver simd_pick). O cache de instruções é da thread e fica com as palavras da lane
+// que chegou primeiro; depois de uma escrita sobre código (code_written) cada
+// lane confere a sua palavra. As tabelas dos laços ociosos são de cada lane,
+// então o resultado de cada máquina é o mesmo de rodá-la sozinha.
+#define SIMD_LANES 8
+#define SIMD_MAX_WAIT 1024
+
+uint32_t simd_width = 0; // --simd: máquinas por grupo (0: desligado)
+
+typedef uint32_t simd_u32_t __attribute__((vector_size(SIMD_LANES * 4)));
+typedef int32_t simd_s32_t __attribute__((vector_size(SIMD_LANES * 4)));
+
+// Classe de cada instrução no passo vetorial.
+#define SIMD_OP_SCALAR 0 // uma lane por vez no cache de instruções
+#define SIMD_OP_NOP    1
+#define SIMD_OP_LUI    2
+#define SIMD_OP_AUIPC  3
+#define SIMD_OP_ADDI   4
+#define SIMD_OP_SLTI   5
+#define SIMD_OP_SLTIU  6
+#define SIMD_OP_XORI   7
+#define SIMD_OP_ORI    8
+#define SIMD_OP_ANDI   9
+#define SIMD_OP_SLLI   10
+#define SIMD_OP_SRLI   11
+#define SIMD_OP_SRAI   12
+#define SIMD_OP_ADD    13
+#define SIMD_OP_SUB    14
+#define SIMD_OP_SLL    15
+#define SIMD_OP_SLT    16
+#define SIMD_OP_SLTU   17
+#define SIMD_OP_XOR    18
+#define SIMD_OP_SRL    19
+#define SIMD_OP_SRA    20
+#define SIMD_OP_OR     21
+#define SIMD_OP_AND    22
+#define SIMD_OP_MUL    23
+#define SIMD_OP_MULH   24
+#define SIMD_OP_MULHSU 25
+#define SIMD_OP_MULHU  26
+#define SIMD_OP_DIV    27
+#define SIMD_OP_DIVU   28
+#define SIMD_OP_REM    29
+#define SIMD_OP_REMU   30
+#define SIMD_OP_JAL    31
+#define SIMD_OP_JALR   32
+#define SIMD_OP_BEQ    33
+#define SIMD_OP_BNE    34
+#define SIMD_OP_BLT    35
+#define SIMD_OP_BGE    36
+#define SIMD_OP_BLTU   37
+#define SIMD_OP_BGEU   38
+#define SIMD_OP_LB     39 // daqui em diante, loads e stores
+#define SIMD_OP_LH     40
+#define SIMD_OP_LW     41
+#define SIMD_OP_LBU    42
+#define SIMD_OP_LHU    43
+#define SIMD_OP_SB     44
+#define SIMD_OP_SH     45
+#define SIMD_OP_SW     46
+
+static const struct {
+    insn_handler_t handler;
+    uint8_t op;
+} simd_op_table[] = {
+    {exec_nop, SIMD_OP_NOP},     {exec_lui, SIMD_OP_LUI},       {exec_auipc, SIMD_OP_AUIPC},
+    {exec_addi, SIMD_OP_ADDI},   {exec_slti, SIMD_OP_SLTI},     {exec_sltiu, SIMD_OP_SLTIU},
+    {exec_xori, SIMD_OP_XORI},   {exec_ori, SIMD_OP_ORI},       {exec_andi, SIMD_OP_ANDI},
+    {exec_slli, SIMD_OP_SLLI},   {exec_srli, SIMD_OP_SRLI},     {exec_srai, SIMD_OP_SRAI},
+    {exec_add, SIMD_OP_ADD},     {exec_sub, SIMD_OP_SUB},       {exec_sll, SIMD_OP_SLL},
+    {exec_slt, SIMD_OP_SLT},     {exec_sltu, SIMD_OP_SLTU},     {exec_xor, SIMD_OP_XOR},
+    {exec_srl, SIMD_OP_SRL},     {exec_sra, SIMD_OP_SRA},       {exec_or, SIMD_OP_OR},
+    {exec_and, SIMD_OP_AND},     {exec_mul, SIMD_OP_MUL},       {exec_mulh, SIMD_OP_MULH},
+    {exec_mulhsu, SIMD_OP_MULHSU}, {exec_mulhu, SIMD_OP_MULHU}, {exec_div, SIMD_OP_DIV},
+    {exec_divu, SIMD_OP_DIVU},   {exec_rem, SIMD_OP_REM},       {exec_remu, SIMD_OP_REMU},
+    {exec_jal, SIMD_OP_JAL},     {exec_jalr, SIMD_OP_JALR},     {exec_beq, SIMD_OP_BEQ},
+    {exec_bne, SIMD_OP_BNE},     {exec_blt, SIMD_OP_BLT},       {exec_bge, SIMD_OP_BGE},
+    {exec_bltu, SIMD_OP_BLTU},   {exec_bgeu, SIMD_OP_BGEU},     {exec_lb, SIMD_OP_LB},
+    {exec_lh, SIMD_OP_LH},       {exec_lw, SIMD_OP_LW},         {exec_lbu, SIMD_OP_LBU},
+    {exec_lhu, SIMD_OP_LHU},     {exec_sb, SIMD_OP_SB},         {exec_sh, SIMD_OP_SH},
+    {exec_sw, SIMD_OP_SW},
+};
+
+uint8_t simd_classify(insn_handler_t handler) {
+    for (uint32_t i = 0; i < sizeof(simd_op_table) / sizeof(simd_op_table[0]); i++) {
+        if (simd_op_table[i].handler == handler) return simd_op_table[i].op;
+    }
+    return SIMD_OP_SCALAR;
+}
+
+typedef struct { uint32_t raw; uint8_t op; } simd_op_t;
+
+// Estado dos laços ociosos de uma lane (as tabelas da thread valem para a
+// lane que rodou idle_check por último naquela entrada).
+typedef struct {
+    idle_loop_t idle_loops[IDLE_SLOTS];
+    uint8_t *idle_rejected; // por palavra da RAM principal (mem_reserve)
+} simd_lane_t;
+
+// mtime de cada lane é base + ticks; o passo vetorial só roda a lane com
+// ticks < limit, então a checagem de interrupções do check_interrupts() só
+// acontece no passo do cache de instruções.
+typedef struct {
+    simd_u32_t regs[NUM_REGISTERS]; // regs[r][lane]
+    simd_u32_t pc;
+    simd_u32_t ticks, limit;        // passos desde simd_load_lane e até o prazo do escalonador
+    uint64_t base[SIMD_LANES];      // mtime em simd_load_lane
+    uint32_t running;               // lanes que não pararam
+    uint32_t paged;                 // lanes com Sv32: só no cache de instruções
+    uint32_t diverged, turn;        // passos sem todas as lanes e a vez da próxima lane atrasada
+    int level;                      // TRACE_NONE ou TRACE_TRAPS
+    machine_t *machines[SIMD_LANES];
+    simd_op_t *ops;                 // classe por palavra (mem_reserve)
+    uint8_t idle_owner[IDLE_SLOTS];
+    simd_lane_t lanes[SIMD_LANES];
+} simd_group_t;
+
+// Hart da lane -> grupo.
+void simd_load_lane(simd_group_t *g, uint32_t l) {
+    hart_t *h = &g->machines[l]->harts[0];
+    g->pc[l] = h->pc;
+    for (uint32_t r = 0; r < NUM_REGISTERS; r++) g->regs[r][l] = h->regs[r];
+    uint64_t left = h->irq_next_check > h->mtime + 1 ? h->irq_next_check - h->mtime - 1 : 0;
+    g->base[l] = h->mtime;
+    g->ticks[l] = 0;
+    g->limit[l] = left < UINT32_MAX ? left : UINT32_MAX;
+    if (h->halt_flag) g->running &= ~(1u << l);
+    else g->running |= 1u << l;
+    if (h->translate) g->paged |= 1u << l;
+    else g->paged &= ~(1u << l);
+}
+
+// Grupo -> hart da lane, que passa a ser o hart da thread.
+void simd_store_lane(simd_group_t *g, uint32_t l) {
+    machine = g->machines[l];
+    hart = &machine->harts[0];
+    hart->pc = g->pc[l];
+    for (uint32_t r = 0; r < NUM_REGISTERS; r++) hart->regs[r] = g->regs[r][l];
+    hart->mtime = g->base[l] + g->ticks[l];
+}
+
+// Põe nas tabelas da thread o que a lane sabe do laço que fecha em 'slot'.
+void simd_idle_enter(simd_group_t *g, uint32_t l, uint32_t slot) {
+    uint32_t entry = slot % IDLE_SLOTS, owner = g->idle_owner[entry];
+    if (owner != l) {
+        g->lanes[owner].idle_loops[entry] = idle_loops[entry];
+        idle_loops[entry] = g->lanes[l].idle_loops[entry];
+        g->idle_owner[entry] = l;
+    }
+    idle_rejected[slot] = g->lanes[l].idle_rejected[slot];
+}
+
+void simd_idle_leave(simd_group_t *g, uint32_t l, uint32_t slot) {
+    g->lanes[l].idle_rejected[slot] = idle_rejected[slot];
+}
+
+// Desvio para trás já feito pela lane no passo vetorial (mtime já contado).
+void simd_idle_check(simd_group_t *g, uint32_t l, uint32_t head, uint32_t tail) {
+    uint32_t slot = (tail - PC_START_ADDRESS) >> 2;
+    simd_store_lane(g, l);
+    simd_idle_enter(g, l, slot);
+    idle_check(head, tail);
+    simd_idle_leave(g, l, slot);
+    simd_load_lane(g, l);
+}
+
+// Um passo da lane no cache de instruções. Com Sv32 a palavra do pc é
+// conferida aqui quando a página está na TLB; senão, em fetch_decoded_slow.
+void simd_scalar_step(simd_group_t *g, uint32_t l) {
+    simd_store_lane(g, l);
+    uint32_t offset = hart->pc - PC_START_ADDRESS, slot = offset >> 2;
+    int in_ram = offset <= memory_size - 4 && !(hart->pc & 3), flush = 0, paged = hart->translate;
+    if (paged) {
+        const tlb_entry_t *e = &hart->tlb[(hart->pc >> 12) % TLB_ENTRIES];
+        in_ram = e->fetch == (hart->pc & 0xFFFFF003);
+        offset = e->ram_page + (hart->pc & 0xFFF);
+        slot = offset >> 2;
+    }
+    if (in_ram) {
+        // A entrada pode ter vindo da palavra de outra lane.
+        decoded_insn_t *d = &icache[slot];
+        uint32_t word = mem_load_le(machine->memory + offset, 4);
+        if (!d->handler || (code_written && d->raw != word)) {
+            decode_instruction(word, d);
+            code_mark(offset, CODE_MAP_DECODED);
+        }
+        flush = d->handler == exec_fence_i;
+        if (!paged) simd_idle_enter(g, l, slot);
+    }
+    if (g->level == TRACE_NONE) step_cached(hart->trace_file, TRACE_NONE, 0, 0, 0);
+    else step_cached(hart->trace_file, TRACE_TRAPS, 0, 0, 0);
+    if (in_ram && !paged) simd_idle_leave(g, l, slot);
+    if (flush) mem_discard(g->lanes[l].idle_rejected, memory_size / 4);
+    simd_load_lane(g, l);
+}
+
+static const simd_u32_t simd_lane_bits = {1, 2, 4, 8, 16, 32, 64, 128};
+
+// Máscara de lanes (bit l) -> vetor com -1 nas lanes marcadas.
+#define SIMD_MASK(lanes) ((simd_u32_t)((simd_lane_bits & (lanes)) != 0))
+
+// Vetor de -1/0 -> máscara de lanes. Os vetores passam por ponteiro: sem AVX
+// habilitado na unidade, vetores de 32 bytes por valor mudam a ABI.
+static inline __attribute__((always_inline)) uint32_t simd_bits(const simd_u32_t *p) {
+    simd_u32_t v = *p & simd_lane_bits;
+    v |= __builtin_shuffle(v, (simd_u32_t){4, 5, 6, 7, 0, 1, 2, 3});
+    v |= __builtin_shuffle(v, (simd_u32_t){2, 3, 0, 1, 6, 7, 4, 5});
+    v |= __builtin_shuffle(v, (simd_u32_t){1, 0, 3, 2, 5, 4, 7, 6});
+    return v[0];
+}
+
+// Executa d nas lanes dadas, todas em pc. Retorna as lanes que precisam do
+// passo no cache de instruções (load/store fora da RAM ou em pedaço com código).
+static inline __attribute__((always_inline))
+uint32_t simd_execute(simd_group_t *g, const decoded_insn_t *d, uint32_t op, uint32_t pc, uint32_t lanes) {
+    uint32_t slow = 0, imm = d->imm, next = pc + 4;
+
+    if (op >= SIMD_OP_LB) {
+        uint32_t size = (op == SIMD_OP_LW || op == SIMD_OP_SW) ? 4 :
+                        (op == SIMD_OP_LH || op == SIMD_OP_LHU || op == SIMD_OP_SH) ? 2 : 1;
+        simd_u32_t loaded = g->regs[d->rd];
+        for (uint32_t bits = lanes; bits; bits &= bits - 1) {
+            uint32_t l = __builtin_ctz(bits), address = g->regs[d->rs1][l] + imm;
+            uint32_t offset = address - PC_START_ADDRESS;
+            if (offset > memory_size - size || (address & (size - 1))) { slow |= 1u << l; continue; }
+            uint8_t *p = g->machines[l]->memory + offset;
+            if (op >= SIMD_OP_SB) {
+                if (code_map[offset >> CODE_CHUNK_SHIFT]) { slow |= 1u << l; continue; }
+                mem_store_le(p, g->regs[d->rs2][l], size);
+            } else {
+                uint32_t value = mem_load_le(p, size);
+                if (op == SIMD_OP_LB) value = (int32_t)(int8_t)value;
+                else if (op == SIMD_OP_LH) value = (int32_t)(int16_t)value;
+                loaded[l] = value;
+            }
+        }
+        simd_u32_t done = SIMD_MASK(lanes & ~slow);
+        if (op < SIMD_OP_SB) g->regs[d->rd] = loaded; // rd != 0: load em x0 é exec_nop
+        g->pc = (((simd_u32_t){} + next) & done) | (g->pc & ~done);
+        g->ticks -= done;
+        return slow;
+    }
+
+    simd_u32_t mask = SIMD_MASK(lanes);
+    simd_u32_t a = g->regs[d->rs1], b = g->regs[d->rs2], r = a, taken = mask;
+    simd_u32_t target = (simd_u32_t){} + (imm ? pc + imm : next); // pc igual: segue para pc + 4
+    int write = 1, branch = 0;
+    switch (op) {
+        case SIMD_OP_NOP:    write = 0; break;
+        case SIMD_OP_LUI:    r = (simd_u32_t){} + imm; break;
+        case SIMD_OP_AUIPC:  r = (simd_u32_t){} + (pc + imm); break;
+        case SIMD_OP_ADDI:   r = a + imm; break;
+        case SIMD_OP_SLTI:   r = (simd_u32_t)((simd_s32_t)a < (int32_t)imm) & 1; break;
+        case SIMD_OP_SLTIU:  r = (simd_u32_t)(a < imm) & 1; break;
+        case SIMD_OP_XORI:   r = a ^ imm; break;
+        case SIMD_OP_ORI:    r = a | imm; break;
+        case SIMD_OP_ANDI:   r = a & imm; break;
+        case SIMD_OP_SLLI:   r = a << imm; break;
+        case SIMD_OP_SRLI:   r = a >> imm; break;
+        case SIMD_OP_SRAI:   r = (simd_u32_t)((simd_s32_t)a >> imm); break;
+        case SIMD_OP_ADD:    r = a + b; break;
+        case SIMD_OP_SUB:    r = a - b; break;
+        case SIMD_OP_SLL:    r = a << (b & 0x1F); break;
+        case SIMD_OP_SLT:    r = (simd_u32_t)((simd_s32_t)a < (simd_s32_t)b) & 1; break;
+        case SIMD_OP_SLTU:   r = (simd_u32_t)(a < b) & 1; break;
+        case SIMD_OP_XOR:    r = a ^ b; break;
+        case SIMD_OP_SRL:    r = a >> (b & 0x1F); break;
+        case SIMD_OP_SRA:    r = (simd_u32_t)((simd_s32_t)a >> (simd_s32_t)(b & 0x1F)); break;
+        case SIMD_OP_OR:     r = a | b; break;
+        case SIMD_OP_AND:    r = a & b; break;
+        case SIMD_OP_MUL:    r = a * b; break;
+        case SIMD_OP_MULH:
+            for (uint32_t l = 0; l < SIMD_LANES; l++) r[l] = (uint32_t)(((int64_t)(int32_t)a[l] * (int64_t)(int32_t)b[l]) >> 32);
+            break;
+        case SIMD_OP_MULHSU:
+            for (uint32_t l = 0; l < SIMD_LANES; l++) r[l] = (uint32_t)(((int64_t)(int32_t)a[l] * (uint64_t)b[l]) >> 32);
+            break;
+        case SIMD_OP_MULHU:
+            for (uint32_t l = 0; l < SIMD_LANES; l++) r[l] = (uint32_t)(((uint64_t)a[l] * (uint64_t)b[l]) >> 32);
+            break;
+        // Divisões não existem em vetor: só as lanes do passo.
+        case SIMD_OP_DIV:
+            for (uint32_t bits = lanes; bits; bits &= bits - 1) r[__builtin_ctz(bits)] = poxim_aot_div(a[__builtin_ctz(bits)], b[__builtin_ctz(bits)]);
+            break;
+        case SIMD_OP_DIVU:
+            for (uint32_t bits = lanes; bits; bits &= bits - 1) r[__builtin_ctz(bits)] = poxim_aot_divu(a[__builtin_ctz(bits)], b[__builtin_ctz(bits)]);
+            break;
+        case SIMD_OP_REM:
+            for (uint32_t bits = lanes; bits; bits &= bits - 1) r[__builtin_ctz(bits)] = poxim_aot_rem(a[__builtin_ctz(bits)], b[__builtin_ctz(bits)]);
+            break;
+        case SIMD_OP_REMU:
+            for (uint32_t bits = lanes; bits; bits &= bits - 1) r[__builtin_ctz(bits)] = poxim_aot_remu(a[__builtin_ctz(bits)], b[__builtin_ctz(bits)]);
+            break;
+        case SIMD_OP_JAL:
+            r = (simd_u32_t){} + next;
+            branch = 1;
+            break;
+        case SIMD_OP_JALR:
+            target = (a + imm) & ~1u;
+            target = ((simd_u32_t)(target == pc) & (next ^ target)) ^ target;
+            r = (simd_u32_t){} + next;
+            branch = 1;
+            break;
+        case SIMD_OP_BEQ:  taken = (simd_u32_t)(a == b); write = 0; branch = 1; break;
+        case SIMD_OP_BNE:  taken = (simd_u32_t)(a != b); write = 0; branch = 1; break;
+        case SIMD_OP_BLT:  taken = (simd_u32_t)((simd_s32_t)a < (simd_s32_t)b); write = 0; branch = 1; break;
+        case SIMD_OP_BGE:  taken = (simd_u32_t)((simd_s32_t)a >= (simd_s32_t)b); write = 0; branch = 1; break;
+        case SIMD_OP_BLTU: taken = (simd_u32_t)(a < b); write = 0; branch = 1; break;
+        case SIMD_OP_BGEU: taken = (simd_u32_t)(a >= b); write = 0; branch = 1; break;
+    }
+    if (write && d->rd) g->regs[d->rd] = (r & mask) | (g->regs[d->rd] & ~mask);
+    simd_u32_t next_pc = (simd_u32_t){} + next;
+    if (branch) next_pc = (taken & target) | (~taken & next_pc);
+    g->pc = (next_pc & mask) | (g->pc & ~mask);
+    g->ticks -= mask;
+
+    // Desvio ou jal para trás: pode fechar um laço ocioso (jalr nunca fecha).
+    if (branch && op != SIMD_OP_JALR && (int32_t)imm < 0 && -imm < IDLE_MAX_INSNS * 4 && g->machines[0]->idle_skip) {
+        uint32_t slot = (pc - PC_START_ADDRESS) >> 2;
+        for (uint32_t bits = lanes; bits; bits &= bits - 1) {
+            uint32_t l = __builtin_ctz(bits);
+            if (taken[l] && !g->lanes[l].idle_rejected[slot]) simd_idle_check(g, l, pc + imm, pc);
+        }
+    }
+    return slow;
+}
+
+// Caminhos divergentes: roda o menor pc, e a cada SIMD_MAX_WAIT passos assim
+// o pc da próxima lane na vez, para nenhuma ficar parada para sempre.
+static inline __attribute__((always_inline))
+uint32_t simd_pick(simd_group_t *g, uint32_t *lanes) {
+    uint32_t pc;
+    if (++g->diverged >= SIMD_MAX_WAIT) {
+        g->diverged = 0;
+        do g->turn = (g->turn + 1) % SIMD_LANES; while (!((g->running >> g->turn) & 1));
+        pc = g->pc[g->turn];
+    } else {
+        simd_u32_t v = g->pc | ~SIMD_MASK(g->running), s, less; // as paradas não contam
+        s = __builtin_shuffle(v, (simd_u32_t){4, 5, 6, 7, 0, 1, 2, 3});
+        less = (simd_u32_t)(s < v);
+        v = (s & less) | (v & ~less);
+        s = __builtin_shuffle(v, (simd_u32_t){2, 3, 0, 1, 6, 7, 4, 5});
+        less = (simd_u32_t)(s < v);
+        v = (s & less) | (v & ~less);
+        s = __builtin_shuffle(v, (simd_u32_t){1, 0, 3, 2, 5, 4, 7, 6});
+        less = (simd_u32_t)(s < v);
+        v = (s & less) | (v & ~less);
+        pc = v[0];
+    }
+    simd_u32_t here = (simd_u32_t)(g->pc == pc);
+    *lanes = simd_bits(&here) & g->running;
+    return pc;
+}
+
+static inline __attribute__((always_inline))
+void simd_loop(simd_group_t *g) {
+    while (g->running) {
+        uint32_t pc = g->pc[__builtin_ctz(g->running)];
+        simd_u32_t here = (simd_u32_t)(g->pc == pc), early = (simd_u32_t)(g->ticks < g->limit);
+        uint32_t lanes = simd_bits(&here) & g->running;
+        if (lanes != g->running) pc = simd_pick(g, &lanes);
+        // O prazo do escalonador chega neste passo (check_interrupts) ou a lane
+        // usa Sv32: passo no cache.
+        uint32_t scalar = (lanes & ~simd_bits(&early)) | (lanes & g->paged);
+        lanes &= ~scalar;
+
+        uint32_t offset = pc - PC_START_ADDRESS;
+        if (lanes && offset <= memory_size - 4 && !(pc & 3)) {
+            decoded_insn_t *d = &icache[offset >> 2];
+            if (!d->handler) {
+                decode_instruction(mem_load_le(g->machines[__builtin_ctz(lanes)]->memory + offset, 4), d);
+                code_mark(offset, CODE_MAP_DECODED);
+            }
+            if (code_written) {
+                for (uint32_t bits = lanes; bits; bits &= bits - 1) {
+                    uint32_t l = __builtin_ctz(bits);
+                    if (mem_load_le(g->machines[l]->memory + offset, 4) != d->raw) {
+                        lanes &= ~(1u << l);
+                        scalar |= 1u << l;
+                    }
+                }
+            }
+            if (g->ops[offset >> 2].raw != d->raw) {
+                g->ops[offset >> 2].raw = d->raw;
+                g->ops[offset >> 2].op = simd_classify(d->handler);
+            }
+            uint32_t op = g->ops[offset >> 2].op;
+            if (op == SIMD_OP_SCALAR) scalar |= lanes;
+            else if (lanes) scalar |= simd_execute(g, d, op, pc, lanes);
+        } else {
+            scalar |= lanes; // fetch fora da RAM ou desalinhado: o trap fica com o cache
+        }
+        for (uint32_t bits = scalar; bits; bits &= bits - 1) simd_scalar_step(g, __builtin_ctz(bits));
+    }
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) void simd_loop_avx2(simd_group_t *g) { simd_loop(g); }
+#endif
+void simd_loop_generic(simd_group_t *g) { simd_loop(g); }
+
+// Roda as máquinas (já abertas, um hart cada) até todas pararem.
+void simd_run(machine_t **machines, uint32_t count) {
+    simd_group_t *g;
+    if (posix_memalign((void**)&g, 64, sizeof(simd_group_t))) {
+        for (uint32_t l = 0; l < count; l++) machine_run(machines[l]);
+        return;
+    }
+    memset(g, 0, sizeof(simd_group_t));
+    g->level = machines[0]->trace_level;
+    size_t words = memory_size / 4;
+    g->ops = (simd_op_t*)mem_reserve(words * sizeof(simd_op_t));
+    for (uint32_t l = 0; l < count; l++) g->lanes[l].idle_rejected = (uint8_t*)mem_reserve(words);
+
+    // Caches da thread: começam vazios e não ficam para a próxima máquina.
+    thread_caches_init();
+    aot_attach(NULL);
+    icache_flush();
+    memset(idle_loops, 0, sizeof(idle_loops));
+    thread_machine_serial = 0;
+    code_written = 0;
+
+    for (uint32_t l = 0; l < count; l++) {
+        g->machines[l] = machines[l];
+        simd_load_lane(g, l);
+    }
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) simd_loop_avx2(g);
+    else simd_loop_generic(g);
+#else
+    simd_loop_generic(g);
+#endif
+    for (uint32_t l = 0; l < count; l++) {
+        simd_store_lane(g, l);
+        munmap(g->lanes[l].idle_rejected, words);
+    }
+    munmap(g->ops, words * sizeof(simd_op_t));
+    free(g);
+}
+
+// --- Execução em Lote (--batch) ---
+// Cada linha do manifesto é uma execução independente, com os mesmos quatro
+// arquivos da linha de comando: <hex_in> <trace_out> <term_in> <term_out>
+// (linhas vazias ou começando com # são ignoradas). As execuções rodam num
+// pool de threads com roubo de trabalho: cada worker começa com uma faixa
+// contígua de grupos e, quando ela acaba, rouba a metade final da faixa do
+// worker que tem mais grupos sobrando. Um grupo é um job, ou com --simd até
+// simd_width jobs seguidos com o mesmo <hex_in> (ver "Execução Vetorial"). As
+// opções valem para todos os jobs.
+typedef struct {
+    char *args[4];
+    int status;          // MACHINE_* (MACHINE_ERROR: não rodou)
+    run_stats_t stats;
+} batch_job_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    uint32_t next, end;  // grupos [next, end) ainda não iniciados
+} batch_queue_t;
+
+batch_job_t *batch_jobs;
+uint32_t batch_job_count;
+uint32_t *batch_groups;  // primeiro job de cada grupo, mais batch_job_count no fim
+uint32_t batch_group_count;
+batch_queue_t *batch_queues;
+uint32_t batch_worker_count;
+
+int batch_take(uint32_t worker, uint32_t *group) {
+    batch_queue_t *own = &batch_queues[worker];
+    for (;;) {
+        pthread_mutex_lock(&own->lock);
+        if (own->next < own->end) {
+            *group = own->next++;
+            pthread_mutex_unlock(&own->lock);
+            return 1;
+        }
+        pthread_mutex_unlock(&own->lock);
+
+        // Vítima: quem tem mais grupos sobrando (lido sem lock, conferido com).
+        uint32_t victim = worker, most = 0;
+        for (uint32_t i = 0; i < batch_worker_count; i++) {
+            uint32_t left = batch_queues[i].end - batch_queues[i].next;
+            if (i != worker && batch_queues[i].end > batch_queues[i].next && left > most) {
+                victim = i;
+                most = left;
+            }
+        }
+        if (victim == worker) return 0;
+
+        batch_queue_t *v = &batch_queues[victim];
+        uint32_t start = 0, end = 0;
+        pthread_mutex_lock(&v->lock);
+        if (v->next < v->end) {
+            end = v->end;
+            start = end - (v->end - v->next + 1) / 2;
+            v->end = start;
+        }
+        pthread_mutex_unlock(&v->lock);
+        if (start == end) continue;
+
+        pthread_mutex_lock(&own->lock);
+        own->next = start;
+        own->end = end;
+        pthread_mutex_unlock(&own->lock);
+    }
+}
+
+void batch_run_job(batch_job_t *job) {
+    machine_t *m = machine_new(harts_per_machine);
+    job->status = MACHINE_ERROR;
+    if (!m) return;
+    if (machine_open(m, job->args[0], job->args[1], job->args[2], job->args[3])) {
+        machine_run(m);
+        job->status = m->exit_reason;
+        job->stats = machine_stats(m);
+        machine_close(m);
+    }
+    machine_free(m);
+}
+
+// Os jobs do grupo que abriram rodam juntos no passo vetorial.
+void batch_run_group(uint32_t group) {
+    uint32_t first = batch_groups[group], count = batch_groups[group + 1] - first, lanes = 0;
+    if (count == 1) {
+        batch_run_job(&batch_jobs[first]);
+        return;
+    }
+    machine_t *machines[SIMD_LANES];
+    batch_job_t *jobs[SIMD_LANES];
+    for (uint32_t i = 0; i < count; i++) {
+        batch_job_t *job = &batch_jobs[first + i];
+        machine_t *m = machine_new(1);
+        job->status = MACHINE_ERROR;
+        if (!m) continue;
+        if (!machine_open(m, job->args[0], job->args[1], job->args[2], job->args[3])) {
+            machine_free(m);
+            continue;
+        }
+        machines[lanes] = m;
+        jobs[lanes++] = job;
+    }
+    if (lanes) simd_run(machines, lanes);
+    for (uint32_t l = 0; l < lanes; l++) {
+        jobs[l]->status = machines[l]->exit_reason;
+        jobs[l]->stats = machine_stats(machines[l]);
+        machine_close(machines[l]);
+        machine_free(machines[l]);
+    }
+}
+
+void *batch_worker(void *arg) {
+    uint32_t worker = (uint32_t)(uintptr_t)arg, group;
+    while (batch_take(worker, &group)) batch_run_group(group);
+    jit_release();
+    thread_caches_release();
+    return NULL;
+}
+
+// Lê o manifesto inteiro; os campos de cada job apontam para o próprio buffer.
+// Cada linha precisa ter exatamente 'expected' arquivos, descritos em 'usage'.
+int batch_load(const char *path, int expected, const char *usage) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror("Erro ao abrir o manifesto do lote");
+        return 0;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *text = (char*)malloc(size + 1);
+    size = fread(text, 1, size, f);
+    text[size] = '\0';
+    fclose(f);
+
+    uint32_t capacity = 64, line_no = 0;
+    batch_jobs = (batch_job_t*)malloc(capacity * sizeof(batch_job_t));
+    batch_job_count = 0;
+    for (char *line = text, *next; line; line = next) {
+        next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+        line_no++;
+
+        batch_job_t job;
+        int fields = 0;
+        memset(&job, 0, sizeof(job));
+        for (char *tok = strtok(line, " \t\r"); tok && tok[0] != '#'; tok = strtok(NULL, " \t\r")) {
+            if (fields == expected) { fields++; break; }
+            job.args[fields++] = tok;
+        }
+        if (fields == 0) continue;
+        if (fields != expected) {
+            fprintf(stderr, "Manifesto %s, linha %u: esperados %d arquivos (%s)\n", path, line_no, expected, usage);
+            return 0;
+        }
+        if (batch_job_count == capacity) {
+            capacity *= 2;
+            batch_jobs = (batch_job_t*)realloc(batch_jobs, capacity * sizeof(batch_job_t));
+        }
+        batch_jobs[batch_job_count++] = job;
+    }
+    return 1;
+}
+
+const char *batch_status_name(int status) {
+    switch (status) {
+        case MACHINE_EBREAK: return "ebreak";
+        case MACHINE_DOUBLE_FAULT: return "double_fault";
+        case MACHINE_IDLE: return "ocioso";
+        case MACHINE_ERROR: return "erro";
+        case MACHINE_CHECKPOINT: return "checkpoint";
+        case MACHINE_EXIT: return "exit";
+        default: return "parado";
+    }
+}
+
+// Roda o lote e imprime o resumo no stdout. Falha se algum job não pôde rodar.
+int batch_main(const char *manifest, uint32_t workers) {
+    if (!batch_load(manifest, 4, "hex_in trace_out term_in term_out")) return EXIT_FAILURE;
+    batch_groups = (uint32_t*)malloc((batch_job_count + 1) * sizeof(uint32_t));
+    batch_group_count = 0;
+    for (uint32_t i = 0; i < batch_job_count; i++) {
+        uint32_t first = batch_group_count ? batch_groups[batch_group_count - 1] : 0;
+        if (batch_group_count == 0 || i - first >= (simd_width ? simd_width : 1) ||
+            strcmp(batch_jobs[first].args[0], batch_jobs[i].args[0]) != 0) {
+            batch_groups[batch_group_count++] = i;
+        }
+    }
+    batch_groups[batch_group_count] = batch_job_count;
+    if (workers > batch_group_count) workers = batch_group_count;
+    if (workers == 0) workers = 1;
+
+    batch_worker_count = workers;
+    batch_queues = (batch_queue_t*)calloc(workers, sizeof(batch_queue_t));
+    for (uint32_t w = 0; w < workers; w++) {
+        pthread_mutex_init(&batch_queues[w].lock, NULL);
+        batch_queues[w].next = (uint64_t)batch_group_count * w / workers;
+        batch_queues[w].end = (uint64_t)batch_group_count * (w + 1) / workers;
+    }
+
+    double start = host_seconds();
+    pthread_t *threads = (pthread_t*)malloc(workers * sizeof(pthread_t));
+    uint32_t started = 0;
+    for (; started < workers; started++) {
+        if (!thread_start(&threads[started], batch_worker, (void*)(uintptr_t)started)) break;
+    }
+    if (started == 0) batch_worker((void*)(uintptr_t)0); // sem threads: roda tudo aqui
+    for (uint32_t w = 0; w < started; w++) pthread_join(threads[w], NULL);
+    free(threads);
+    double seconds = host_seconds() - start;
+
+    int failed = 0;
+    run_stats_t total = {0, 0, 0, 0};
+    printf("job    status        instrucoes      traps  hex_in\n");
+    for (uint32_t i = 0; i < batch_job_count; i++) {
+        batch_job_t *job = &batch_jobs[i];
+        printf("%-6u %-13s %12llu %10llu  %s\n", i, batch_status_name(job->status),
+               (unsigned long long)job->stats.instret, (unsigned long long)job->stats.traps, job->args[0]);
+        total.instret += job->stats.instret;
+        total.traps += job->stats.traps;
+        total.interrupts += job->stats.interrupts;
+        total.cycles += job->stats.cycles;
+        if (job->status == MACHINE_ERROR) failed++;
+    }
+    printf("total: %u jobs, %u com erro, %llu instrucoes, %llu traps, %u threads\n", batch_job_count, failed,
+           (unsigned long long)total.instret, (unsigned long long)total.traps, workers);
+    if (stats_enabled) print_stats(total, seconds); // somas de todos os jobs, tempo do lote inteiro
+    free(batch_queues);
+    free(batch_groups);
+    free(batch_jobs);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+// --- Variantes (--fork) ---
+// A máquina da linha de comando roda uma vez até o checkpoint (--checkpoint-at,
+// ou direto do --restore) e cada linha do manifesto, <trace_out> <term_in>
+// <term_out>, continua dali num processo filho criado com fork(). O kernel
+// compartilha a RAM e o resto do estado copy-on-write, então criar uma variante
+// não copia nada além das páginas que ela mesma escrever. Até -j filhos rodam
+// ao mesmo tempo; cada um termina com o código MACHINE_* da sua parada.
+
+// No processo filho: troca os arquivos da máquina pelos da variante e roda.
+void fork_child(machine_t *m, batch_job_t *job, uint64_t input_offset) {
+    uint8_t *output = m->uart_log;
+    size_t output_len = m->uart_log_len;
+    int status = MACHINE_ERROR;
+
+    // Os arquivos da execução base continuam com o processo pai (os buffers do
+    // stdio foram esvaziados antes do fork).
+    machine_close(m);
+    m->uart_log_cap = 0;
+    if (machine_open_files(m, job->args[0], job->args[1], job->args[2])) {
+        machine_resume_io(m, output, output_len, input_offset);
+        machine_resume(m);
+        machine_run(m);
+        status = m->exit_reason;
+        machine_close(m);
+    }
+    _exit(status);
+}
+
+int fork_main(machine_t *m, const char *manifest, uint32_t workers) {
+    if (!batch_load(manifest, 3, "trace_out term_in term_out")) return EXIT_FAILURE;
+    if (workers > batch_job_count) workers = batch_job_count;
+    if (workers == 0) workers = 1;
+
+    if (!checkpoint_data || checkpoint_at != UINT64_MAX) machine_run(m);
+    if (m->exit_reason != MACHINE_CHECKPOINT && m->exit_reason != MACHINE_RUNNING) {
+        fprintf(stderr, "A simulacao terminou (%s) antes do checkpoint; nenhuma variante foi criada\n",
+                batch_status_name(m->exit_reason));
+        return EXIT_FAILURE;
+    }
+    machine = m;
+    uart_host_flush();
+    uint64_t input_offset = m->uart_rx_read - (m->uart_rx_tail - m->uart_rx_head);
+    fflush(NULL);
+
+    pid_t *pids = (pid_t*)malloc(batch_job_count * sizeof(pid_t));
+    uint32_t running = 0, failed = 0;
+    for (uint32_t i = 0; i <= batch_job_count; i++) {
+        // espera um filho quando já há 'workers' rodando (e todos no fim)
+        while (running > 0 && (running == workers || i == batch_job_count)) {
+            int wstatus;
+            pid_t pid = wait(&wstatus);
+            if (pid < 0) break;
+            for (uint32_t j = 0; j < i; j++) {
+                if (pids[j] != pid) continue;
+                batch_jobs[j].status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : MACHINE_ERROR;
+            }
+            running--;
+        }
+        if (i == batch_job_count) break;
+
+        batch_jobs[i].status = MACHINE_ERROR;
+        pids[i] = fork();
+        if (pids[i] == 0) fork_child(m, &batch_jobs[i], input_offset);
+        if (pids[i] < 0) perror("Erro ao criar o processo da variante");
+        else running++;
+    }
+
+    printf("variante status        term_out\n");
+    for (uint32_t i = 0; i < batch_job_count; i++) {
+        printf("%-8u %-13s %s\n", i, batch_status_name(batch_jobs[i].status), batch_jobs[i].args[2]);
+        if (batch_jobs[i].status == MACHINE_ERROR) failed++;
+    }
+    printf("total: %u variantes, %u com erro, checkpoint em mtime %llu, %u processos\n", batch_job_count, failed,
+           (unsigned long long)m->harts[0].mtime, workers);
+    free(pids);
+    free(batch_jobs);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+// --- Avanço Rápido (--ff) ---
+// Para regiões de interesse atrás de um boot longo: a máquina roda em fases,
+// sempre com o mesmo estado. O avanço rápido vai com o motor mais rápido
+// (o JIT em x86-64), sem trace e sem perfil, até a instrução N do hart 0
+// (--ff), até a k-ésima chegada num pc (--ff-pc) ou até o k-ésimo ecall
+// (--ff-ecall), o que vier primeiro. Dali a janela de detalhe roda com o
+// motor, o trace e o perfil da linha de comando por --detail instruções e a
+// máquina para ou avança de novo até o fim (--detail-then=ff).
+//
+// Cada fase para pelo mesmo caminho do --checkpoint-at (MACHINE_CHECKPOINT) e
+// a próxima retoma com machine_resume; os caches da thread recomeçam, porque
+// as entradas decodificadas dependem do perfil e os blocos do JIT, do pc de
+// parada.
+#if defined(__x86_64__)
+#define FF_ENGINE ENGINE_JIT
+#else
+#define FF_ENGINE ENGINE_CACHE
+#endif
+
+int ff_enabled;                     // alguma das opções abaixo
+uint64_t ff_instructions;           // --ff=N; 0 = sem limite
+const char *ff_pc_spec;             // --ff-pc=A|simbolo[:k], resolvido em ff_resolve_pc
+uint32_t ff_pc;
+uint64_t ff_pc_hits;
+uint64_t ff_ecalls;                 // --ff-ecall=k
+uint64_t ff_detail = UINT64_MAX;    // --detail=M
+int ff_after_detail;                // --detail-then=ff
+
+// --ff-pc: endereço ou símbolo (de --profile-symbols ou do ELF), com o número
+// de chegadas depois de ':' (padrão 1).
+int ff_resolve_pc(const char *program) {
+    char *copy = strdup(ff_pc_spec), *end;
+    char *hits = strchr(copy, ':');
+    int ok = 1;
+    ff_pc_hits = 1;
+    if (hits) {
+        *hits++ = '\0';
+        ff_pc_hits = strtoull(hits, &end, 0);
+        ok = *end == '\0' && ff_pc_hits > 0;
+    }
+    ff_pc = strtoul(copy, &end, 0);
+    if (ok && (end == copy || *end != '\0')) {
+        trace_range_t r;
+        if (profile_symbols_path) profile_load_symbols(profile_symbols_path, 1);
+        else profile_load_symbols(program, 0);
+        ok = trace_symbol_range(copy, &r);
+        ff_pc = r.lo;
+        profile_free_symbols();
+    }
+    if (!ok) fprintf(stderr, "Endereco invalido ou simbolo desconhecido em --ff-pc: %s\n", ff_pc_spec);
+    free(copy);
+    return ok;
+}
+
+// Um marcador (--ff-pc ou --ff-ecall) foi alcançado.
+int ff_marker_reached(const hart_t *h) {
+    return (ff_pc_hits && !h->stop_pc_hits) || (ff_ecalls && !h->stop_ecalls);
+}
+
+// Roda uma fase com o motor, o trace, o perfil e o modelo de tempo dados até
+// a instrução 'instructions' do hart 0, um marcador (com 'markers') ou o fim
+// do programa. Retorna 1 se a máquina parou por um limite da fase e pode
+// continuar.
+int ff_phase(machine_t *m, const char *name, int phase_engine, int level, int profile, int timing,
+             uint64_t instructions, int markers) {
+    hart_t *h = &m->harts[0];
+    m->engine = phase_engine;
+    m->trace_level = level;
+    m->profile = profile;
+    m->timing = timing;
+    m->serial = __atomic_add_fetch(&machine_serial, 1, __ATOMIC_RELAXED);
+
+    run_stats_t before = machine_stats(m);
+    double start = host_seconds();
+    // A parada por instruções acontece no passo da instrução; se ele virou
+    // trap, falta uma e a fase continua.
+    do {
+        machine_resume(m);
+        h->stop_instret = instructions;
+        machine_run(m);
+    } while (m->exit_reason == MACHINE_CHECKPOINT && hart_instret(h) < instructions &&
+             !(markers && ff_marker_reached(h)));
+    h->stop_instret = UINT64_MAX;
+    if (stats_enabled) {
+        fprintf(stderr, "fase: %s\n", name);
+        print_stats(stats_diff(machine_stats(m), before), host_seconds() - start);
+    }
+    return m->exit_reason == MACHINE_CHECKPOINT;
+}
+
+int ff_main(machine_t *m, const char *program) {
+    hart_t *h = &m->harts[0];
+    int detail_engine = m->engine, detail_level = m->trace_level, detail_profile = m->profile;
+    int detail_timing = m->timing;
+    int status = EXIT_SUCCESS;
+
+    if (ff_instructions || ff_pc_hits || ff_ecalls) {
+        h->stop_pc = ff_pc;
+        h->stop_pc_hits = ff_pc_hits;
+        h->stop_ecalls = ff_ecalls;
+        int more = ff_phase(m, "avanco rapido", FF_ENGINE, TRACE_NONE, 0, 0, ff_instructions ? ff_instructions : UINT64_MAX, 1);
+        const char *reason = (ff_pc_hits && !h->stop_pc_hits) ? "pc" : (ff_ecalls && !h->stop_ecalls) ? "ecall" : "contagem";
+        h->stop_pc_hits = h->stop_ecalls = 0;
+        if (!more) {
+            fprintf(stderr, "--ff: o programa terminou (%s) antes do fim do avanco rapido\n",
+                    batch_status_name(m->exit_reason));
+            return status;
+        }
+        fprintf(stderr, "--ff: detalhe a partir da instrucao %llu (pc 0x%08x, ciclo %llu, %s)\n",
+                (unsigned long long)hart_instret(h), h->pc, (unsigned long long)h->mtime, reason);
+    }
+
+    uint64_t first = hart_instret(h);
+    uint64_t last = (ff_detail > UINT64_MAX - first) ? UINT64_MAX : first + ff_detail;
+    int more = ff_phase(m, "detalhe", detail_engine, detail_level, detail_profile, detail_timing, last, 0);
+    if (more) {
+        fprintf(stderr, "--ff: fim do detalhe na instrucao %llu (pc 0x%08x, ciclo %llu)\n",
+                (unsigned long long)hart_instret(h), h->pc, (unsigned long long)h->mtime);
+    }
+
+    // O perfil e o modelo de tempo são só da janela; o resto roda sem eles.
+    if (detail_timing) timing_report(stderr, m);
+    if (detail_profile && !profile_write(m, profile_prefix, program)) status = EXIT_FAILURE;
+    for (uint32_t i = 0; i < m->hart_count; i++) {
+        profile_free(m->harts[i].profile);
+        m->harts[i].profile = NULL;
+    }
+    if (more && ff_after_detail) ff_phase(m, "resto", FF_ENGINE, TRACE_NONE, 0, 0, UINT64_MAX, 0);
+    return status;
+}
+
+
+// --- Lockstep (--lockstep) ---
+// A máquina da linha de comando (com o motor de --engine) e uma cópia com o
+// interpretador de referência rodam lado a lado, cada uma na sua thread, em
+// trechos de N ciclos. As duas param no mesmo mtime pelo mesmo prazo do
+// --checkpoint-at e, a cada parada, pc, registradores, CSRs, PLIC, UART, a
+// saída do terminal e a RAM são comparados. Na primeira diferença a execução
+// é refeita desde o início (tudo vem dos arquivos, então é determinística) até
+// o último ponto igual e dali um ciclo por vez, para mostrar a instrução em
+// que os motores se separaram.
+#define LOCKSTEP_CONTEXT 8    // instruções mostradas antes da divergência
+#define LOCKSTEP_MAX_WORDS 8  // palavras da RAM listadas numa divergência
+
+uint64_t lockstep_interval; // --lockstep=N; 0 = desligado
+
+// O mesmo estado de checkpoint_state (num hart só), com nomes para o relatório.
+typedef struct {
+    const char *name;
+    size_t offset, size; // tamanho de cada elemento
+    uint32_t count;
+    int in_hart;
+} lockstep_field_t;
+
+#define LOCKSTEP_HART(f) { #f, offsetof(hart_t, f), sizeof(((hart_t*)0)->f), 1, 1 }
+#define LOCKSTEP_HART_ARRAY(f) \
+    { #f, offsetof(hart_t, f), sizeof(((hart_t*)0)->f[0]), sizeof(((hart_t*)0)->f) / sizeof(((hart_t*)0)->f[0]), 1 }
+#define LOCKSTEP_MACHINE(f) { #f, offsetof(machine_t, f), sizeof(((machine_t*)0)->f), 1, 0 }
+
+const lockstep_field_t lockstep_fields[] = {
+    LOCKSTEP_HART(pc), LOCKSTEP_HART_ARRAY(regs),
+    LOCKSTEP_HART(mstatus), LOCKSTEP_HART(mie), LOCKSTEP_HART(mip), LOCKSTEP_HART(mtvec),
+    LOCKSTEP_HART(mepc), LOCKSTEP_HART(mcause), LOCKSTEP_HART(mtval), LOCKSTEP_HART(mscratch),
+    LOCKSTEP_HART(medeleg), LOCKSTEP_HART(mideleg), LOCKSTEP_HART(mcounteren), LOCKSTEP_HART(priv),
+    LOCKSTEP_HART(stvec), LOCKSTEP_HART(sepc), LOCKSTEP_HART(scause), LOCKSTEP_HART(stval),
+    LOCKSTEP_HART(sscratch), LOCKSTEP_HART(scounteren), LOCKSTEP_HART(satp),
+    LOCKSTEP_HART(mtime), LOCKSTEP_HART(mtimecmp),
+    LOCKSTEP_HART(last_trap_pc), LOCKSTEP_HART(last_trap_cause),
+    LOCKSTEP_HART(wfi_ticks), LOCKSTEP_HART(trap_count), LOCKSTEP_HART(interrupt_count), LOCKSTEP_HART(stall_ticks),
+    LOCKSTEP_HART_ARRAY(counter_offset), LOCKSTEP_HART_ARRAY(hpm_event),
+    LOCKSTEP_HART(reserved), LOCKSTEP_HART(reserved_address), LOCKSTEP_HART(reserved_value),
+    LOCKSTEP_MACHINE(plic_pending), LOCKSTEP_MACHINE(plic_enable[0]), LOCKSTEP_MACHINE(plic_claimed),
+    LOCKSTEP_MACHINE(uart_ier), LOCKSTEP_MACHINE(uart_lsr), LOCKSTEP_MACHINE(uart_fcr),
+    LOCKSTEP_MACHINE(uart_thre_pending), LOCKSTEP_MACHINE(uart_tx_count), LOCKSTEP_MACHINE(uart_tx_last),
+    LOCKSTEP_MACHINE(uart_rx_count), LOCKSTEP_MACHINE(uart_rx_last), LOCKSTEP_MACHINE(uart_rx_activity),
+    LOCKSTEP_MACHINE(uart_now), LOCKSTEP_MACHINE(uart_rx_read),
+    LOCKSTEP_MACHINE(blk_sector), LOCKSTEP_MACHINE(blk_addr), LOCKSTEP_MACHINE(blk_count),
+    LOCKSTEP_MACHINE(blk_cmd), LOCKSTEP_MACHINE(blk_status), LOCKSTEP_MACHINE(blk_ier),
+};
+
+const char *engine_names[] = { "cache", "ref", "jit", "aot" };
+
+typedef struct {
+    machine_t *fast, *ref;
+    uint64_t compares;
+    uint64_t good;   // mtime da última comparação igual
+    uint64_t output; // bytes do terminal já conferidos
+    // Início dos últimos trechos (pc da referência e mtime do fim): com
+    // trechos de um ciclo, as últimas instruções antes da divergência.
+    uint32_t context_pc[LOCKSTEP_CONTEXT];
+    uint64_t context_mtime[LOCKSTEP_CONTEXT];
+    uint32_t context_count;
+} lockstep_t;
+
+// A thread da referência roda lockstep_ref_machine a cada trecho; NULL a encerra.
+machine_t *lockstep_ref_machine;
+pthread_barrier_t lockstep_go, lockstep_done;
+
+void *lockstep_thread(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_barrier_wait(&lockstep_go);
+        if (!lockstep_ref_machine) return NULL;
+        machine_run(lockstep_ref_machine);
+        pthread_barrier_wait(&lockstep_done);
+    }
+}
+
+uint64_t lockstep_value(const machine_t *m, const lockstep_field_t *f, uint32_t i) {
+    const uint8_t *p = (f->in_hart ? (const uint8_t*)&m->harts[0] : (const uint8_t*)m) + f->offset + i * f->size;
+    uint32_t v32;
+    uint64_t v64;
+    switch (f->size) {
+        case 1: return *p;
+        case 4: memcpy(&v32, p, 4); return v32;
+        default: memcpy(&v64, p, 8); return v64;
+    }
+}
+
+// Soma a 'words' as palavras diferentes em [start, end) de uma RAM e, com
+// 'report', lista as primeiras.
+void lockstep_compare_ram(const mem_region_t *ra, const mem_region_t *rb, uint32_t start, uint32_t end,
+                          int report, const char *name, uint32_t *words) {
+    if (memcmp(ra->host + start, rb->host + start, end - start) == 0) return;
+    for (uint32_t off = start; off < end; off += 4) {
+        uint32_t va = mem_load_le(&ra->host[off], 4), vb = mem_load_le(&rb->host[off], 4);
+        if (va == vb) continue;
+        if (report && *words < LOCKSTEP_MAX_WORDS) {
+            fprintf(stderr, "  RAM 0x%08x      %s 0x%08x, ref 0x%08x\n", ra->base + off, name, va, vb);
+        }
+        (*words)++;
+    }
+}
+
+// Conta as diferenças entre as duas máquinas e, com 'report', lista cada uma.
+uint32_t lockstep_compare(const lockstep_t *l, int report) {
+    const machine_t *a = l->fast, *b = l->ref;
+    const char *name = engine_names[a->engine];
+    uint32_t diffs = 0;
+
+    if (a->exit_reason != b->exit_reason) {
+        diffs++;
+        if (report) fprintf(stderr, "  parada: %s %s, ref %s\n", name, batch_status_name(a->exit_reason),
+                            batch_status_name(b->exit_reason));
+    }
+    for (size_t i = 0; i < sizeof(lockstep_fields) / sizeof(lockstep_fields[0]); i++) {
+        const lockstep_field_t *f = &lockstep_fields[i];
+        for (uint32_t j = 0; j < f->count; j++) {
+            uint64_t va = lockstep_value(a, f, j), vb = lockstep_value(b, f, j);
+            if (va == vb) continue;
+            diffs++;
+            if (!report) continue;
+            char label[32];
+            if (f->offset == offsetof(hart_t, regs) && f->in_hart) snprintf(label, sizeof(label), "x%u (%s)", j, abi_name[j]);
+            else if (f->count > 1) snprintf(label, sizeof(label), "%s[%u]", f->name, j);
+            else snprintf(label, sizeof(label), "%s", f->name);
+            int width = (int)f->size * 2;
+            fprintf(stderr, "  %-18s %s 0x%0*llx, ref 0x%0*llx\n", label, name, width, (unsigned long long)va,
+                    width, (unsigned long long)vb);
+        }
+    }
+
+    if (a->uart_log_len != b->uart_log_len || memcmp(a->uart_log, b->uart_log, a->uart_log_len) != 0) {
+        diffs++;
+        if (report) {
+            size_t k = 0;
+            while (k < a->uart_log_len && k < b->uart_log_len && a->uart_log[k] == b->uart_log[k]) k++;
+            fprintf(stderr, "  saida do terminal difere a partir do byte %llu (%s +%zu bytes, ref +%zu bytes)\n",
+                    (unsigned long long)(l->output + k), name, a->uart_log_len, b->uart_log_len);
+        }
+    }
+
+    // As RAMs do mapa (as duas máquinas têm o mesmo). Até a última comparação
+    // igual elas eram iguais, então basta olhar as páginas que uma das duas
+    // escreveu desde então; o relatório confere tudo, em ordem de endereço.
+    uint32_t words = 0;
+    for (uint32_t i = 0; i < a->mem_region_count; i++) {
+        const mem_region_t *ra = &a->mem_regions[i], *rb = &b->mem_regions[i];
+        if (!ra->dirty) continue;
+        if (report) {
+            lockstep_compare_ram(ra, rb, 0, ra->size, report, name, &words);
+            continue;
+        }
+        for (uint32_t k = 0; k < ra->dirty_count + rb->dirty_count; k++) {
+            uint32_t page = (k < ra->dirty_count) ? ra->dirty_pages[k] : rb->dirty_pages[k - ra->dirty_count];
+            if (k >= ra->dirty_count && ra->dirty[page]) continue; // já vista na lista de 'a'
+            uint32_t start = page << 12;
+            lockstep_compare_ram(ra, rb, start, (ra->size - start < 4096) ? ra->size : start + 4096, 0, name, &words);
+        }
+    }
+    if (report && words > LOCKSTEP_MAX_WORDS) fprintf(stderr, "  ... e mais %u palavras da RAM\n", words - LOCKSTEP_MAX_WORDS);
+    diffs += words;
+    return diffs;
+}
+
+// Máquina de um hart com o motor dado, sem trace nem saída do terminal (a
+// referência, ou as duas quando a execução é refeita). NULL em erro.
+machine_t *lockstep_open(const char *hex_in, const char *term_in, int machine_engine) {
+    machine_t *m = machine_new(1);
+    if (!m) return NULL;
+    m->engine = machine_engine;
+    m->quiet = 1;
+    if (machine_engine == ENGINE_REF) m->trace_binary = 0;
+    if (!machine_open(m, hex_in, "/dev/null", term_in, "/dev/null")) {
+        machine_free(m);
+        return NULL;
+    }
+    return m;
+}
+
+// Depois de uma comparação igual nenhuma página conta como escrita. A TLB só
+// guarda stores de páginas já marcadas, então as etiquetas de store saem e o
+// próximo store de cada página passa de novo por memory_write_slow.
+void lockstep_clean(machine_t *m) {
+    for (uint32_t i = 0; i < m->mem_region_count; i++) {
+        mem_region_t *r = &m->mem_regions[i];
+        if (!r->dirty) continue;
+        for (uint32_t k = 0; k < r->dirty_count; k++) r->dirty[r->dirty_pages[k]] = 0;
+        r->dirty_count = 0;
+    }
+    for (uint32_t i = 0; i < TLB_ENTRIES; i++) m->harts[0].tlb[i].store = TLB_EMPTY;
+}
+
+// A saída do terminal de cada trecho vai para uart_log para ser comparada, e
+// as RAMs marcam as páginas escritas. Os stores do JIT e do AOT vão todos pelo
+// caminho lento (lockstep_code_map).
+void lockstep_prepare(machine_t *m) {
+    if (!m->uart_log_cap) {
+        m->uart_log_cap = 4096;
+        m->uart_log = (uint8_t*)malloc(m->uart_log_cap);
+    }
+    m->uart_log_len = 0;
+    if (!lockstep_code_map) {
+        lockstep_code_map = (uint8_t*)malloc(memory_size >> CODE_CHUNK_SHIFT);
+        memset(lockstep_code_map, 1, memory_size >> CODE_CHUNK_SHIFT);
+    }
+    for (uint32_t i = 0; i < m->mem_region_count; i++) {
+        mem_region_t *r = &m->mem_regions[i];
+        if (!r->host || (r->widths & MEM_READONLY) || r->dirty) continue;
+        uint32_t pages = (uint32_t)(((uint64_t)r->size + 4095) >> 12);
+        r->dirty = (uint8_t*)calloc(pages, 1);
+        r->dirty_pages = (uint32_t*)malloc(pages * sizeof(uint32_t));
+    }
+    m->lockstep = 1;
+    lockstep_clean(m);
+}
+
+void lockstep_close(machine_t *m) {
+    if (!m) return;
+    machine_close(m);
+    machine_free(m);
+}
+
+// As duas máquinas seguem enquanto só pararam no fim dos trechos.
+int lockstep_running(const lockstep_t *l) {
+    const machine_t *m = l->fast;
+    return m->exit_reason == MACHINE_RUNNING ||
+           (m->exit_reason == MACHINE_CHECKPOINT && m->harts[0].mtime < checkpoint_at);
+}
+
+// Um trecho: as duas máquinas rodam até o mtime 'until' (ou até pararem) e
+// são comparadas. Retorna 1 se ficaram iguais.
+int lockstep_chunk(lockstep_t *l, uint64_t until) {
+    machine_t *machines[2] = { l->fast, l->ref };
+    l->context_pc[l->context_count % LOCKSTEP_CONTEXT] = l->ref->harts[0].pc;
+    l->context_mtime[l->context_count % LOCKSTEP_CONTEXT] = until;
+    l->context_count++;
+    for (int i = 0; i < 2; i++) {
+        machine_resume(machines[i]);
+        machines[i]->harts[0].stop_at = (until < checkpoint_at) ? until : checkpoint_at;
+    }
+    lockstep_ref_machine = l->ref;
+    pthread_barrier_wait(&lockstep_go);
+    machine_run(l->fast);
+    pthread_barrier_wait(&lockstep_done);
+    for (int i = 0; i < 2; i++) {
+        machine = machines[i];
+        uart_host_flush();
+    }
+    machine = l->fast;
+
+    l->compares++;
+    if (lockstep_compare(l, 0) != 0) return 0;
+    lockstep_clean(l->fast);
+    lockstep_clean(l->ref);
+    l->good = l->fast->harts[0].mtime;
+    l->output += l->fast->uart_log_len;
+    l->fast->uart_log_len = l->ref->uart_log_len = 0;
+    return 1;
+}
+
+// Trechos de 'interval' ciclos até as máquinas pararem. Retorna 0 na primeira
+// diferença. Um trecho quase todo parado em wfi faz o próximo ter o dobro do
+// tamanho, para um prazo distante não virar milhões de trechos vazios.
+int lockstep_run(lockstep_t *l, uint64_t interval) {
+    uint64_t length = interval;
+    while (lockstep_running(l)) {
+        uint64_t now = l->fast->harts[0].mtime, instret = hart_instret(&l->ref->harts[0]);
+        if (!lockstep_chunk(l, (length > UINT64_MAX - now) ? UINT64_MAX : now + length)) return 0;
+        int idle = hart_instret(&l->ref->harts[0]) - instret < length / 2;
+        length = (idle && length <= UINT64_MAX / 2) ? length * 2 : interval;
+    }
+    return 1;
+}
+
+// Refaz a execução até o último ponto igual de 'coarse' e dali um ciclo por
+// vez. Retorna 1 se a divergência apareceu de novo (em 'fine').
+int lockstep_narrow(const lockstep_t *coarse, lockstep_t *fine, const char *hex_in, const char *term_in) {
+    fine->fast = lockstep_open(hex_in, term_in, coarse->fast->engine);
+    fine->ref = lockstep_open(hex_in, term_in, ENGINE_REF);
+    if (!fine->fast || !fine->ref) return 0;
+    lockstep_prepare(fine->fast);
+    lockstep_prepare(fine->ref);
+
+    uint64_t limit = coarse->fast->harts[0].mtime;
+    if (coarse->ref->harts[0].mtime > limit) limit = coarse->ref->harts[0].mtime;
+    if (coarse->good > fine->fast->harts[0].mtime && !lockstep_chunk(fine, coarse->good)) return 0;
+    fine->context_count = 0;
+    while (lockstep_running(fine) && fine->fast->harts[0].mtime < limit) {
+        if (!lockstep_chunk(fine, fine->fast->harts[0].mtime + 1)) return 1;
+    }
+    return 0;
+}
+
+void lockstep_report(const lockstep_t *l, int exact) {
+    const char *name = engine_names[l->fast->engine];
+    if (!exact) {
+        fprintf(stderr, "lockstep: %s diverge do ref entre os ciclos %llu e %llu (nao reproduziu ciclo a ciclo)\n",
+                name, (unsigned long long)l->good, (unsigned long long)l->fast->harts[0].mtime);
+        lockstep_compare(l, 1);
+        return;
+    }
+    fprintf(stderr, "lockstep: %s diverge do ref no ciclo %llu\n", name, (unsigned long long)l->fast->harts[0].mtime);
+    fprintf(stderr, "  ultimos ciclos (pc da referencia):\n");
+    uint32_t first = (l->context_count > LOCKSTEP_CONTEXT) ? l->context_count - LOCKSTEP_CONTEXT : 0;
+    for (uint32_t i = first; i < l->context_count; i++) {
+        uint32_t pc = l->context_pc[i % LOCKSTEP_CONTEXT];
+        char mnemonic[32], text[160] = "";
+        if (pc >= PC_START_ADDRESS && pc - PC_START_ADDRESS <= memory_size - 4 && pc % 4 == 0) {
+            profile_disasm(profile_ram_word(l->ref, pc), mnemonic, text);
+        }
+        fprintf(stderr, "  %c %12llu  0x%08x  %s\n", i + 1 == l->context_count ? '>' : ' ',
+                (unsigned long long)l->context_mtime[i % LOCKSTEP_CONTEXT], pc, text);
+    }
+    lockstep_compare(l, 1);
+}
+
+// Roda 'fast' (já aberta com os arquivos da linha de comando) contra a
+// referência. Falha na primeira divergência.
+int lockstep_main(machine_t *fast, const char *hex_in, const char *term_in) {
+    struct stat st;
+    if (stat(term_in, &st) != 0 || (!S_ISREG(st.st_mode) && !S_ISCHR(st.st_mode))) {
+        fprintf(stderr, "--lockstep le <term_in> duas vezes: use um arquivo comum\n");
+        return EXIT_FAILURE;
+    }
+    pthread_t thread;
+    pthread_barrier_init(&lockstep_go, NULL, 2);
+    pthread_barrier_init(&lockstep_done, NULL, 2);
+    if (!thread_start(&thread, lockstep_thread, NULL)) {
+        fprintf(stderr, "Nao foi possivel criar a thread do --lockstep\n");
+        return EXIT_FAILURE;
+    }
+
+    int status = EXIT_FAILURE;
+    lockstep_t coarse, fine;
+    memset(&coarse, 0, sizeof(coarse));
+    memset(&fine, 0, sizeof(fine));
+    coarse.fast = fast;
+    coarse.ref = lockstep_open(hex_in, term_in, ENGINE_REF);
+    if (coarse.ref) {
+        lockstep_prepare(fast);
+        lockstep_prepare(coarse.ref);
+        coarse.good = fast->harts[0].mtime;
+        if (lockstep_run(&coarse, lockstep_interval)) {
+            fprintf(stderr, "lockstep: %s e ref iguais em %llu comparacoes (ate o ciclo %llu)\n",
+                    engine_names[fast->engine], (unsigned long long)coarse.compares,
+                    (unsigned long long)fast->harts[0].mtime);
+            status = EXIT_SUCCESS;
+        } else if (lockstep_interval > 1 && lockstep_narrow(&coarse, &fine, hex_in, term_in)) {
+            lockstep_report(&fine, 1);
+        } else {
+            lockstep_report(&coarse, lockstep_interval == 1);
+        }
+    }
+
+    lockstep_ref_machine = NULL;
+    pthread_barrier_wait(&lockstep_go);
+    pthread_join(thread, NULL);
+    pthread_barrier_destroy(&lockstep_go);
+    pthread_barrier_destroy(&lockstep_done);
+    lockstep_close(coarse.ref);
+    lockstep_close(fine.fast);
+    lockstep_close(fine.ref);
+    machine = fast;
+    return status;
+}
+
+
+// --- Biblioteca (libpoxim) ---
+// A API de poxim.h sobre as mesmas funções da linha de comando: poxim_new é o
+// machine_new sem arquivos, poxim_run é o machine_run com o limite de
+// instruções do --ff (stop_instret) e o breakpoint do --ff-pc (stop_pc), e os
+// callbacks substituem os FILE* da UART e do trace. O trace continua sendo um
+// FILE* para os motores: um fopencookie que entrega os bytes ao callback.
+
+// Os motivos de parada da máquina valem direto como POXIM_STOP_*, menos o
+// MACHINE_CHECKPOINT (limite ou breakpoint).
+_Static_assert(POXIM_STOP_EBREAK == MACHINE_EBREAK && POXIM_STOP_DOUBLE_FAULT == MACHINE_DOUBLE_FAULT &&
+               POXIM_STOP_IDLE == MACHINE_IDLE && POXIM_STOP_ERROR == MACHINE_ERROR && POXIM_STOP_EXIT == MACHINE_EXIT,
+               "motivos de parada da API");
+
+static void poxim_discard(void *user, const void *data, size_t len) { (void)user; (void)data; (void)len; }
+
+static ssize_t trace_cookie_write(void *cookie, const char *data, size_t len) {
+    hart_t *h = (hart_t*)cookie;
+    h->machine->trace_fn(h->machine->trace_user, h->mhartid, data, len);
+    return len;
+}
+
+// Torna m a máquina da thread, com o hart 0 como atual.
+static inline machine_t *poxim_enter(poxim_t *m) {
+    machine = m;
+    hart = &m->harts[0];
+    return m;
+}
+
+POXIM_API poxim_t *poxim_new(const poxim_config_t *config) {
+    poxim_config_t defaults = { 1, POXIM_ENGINE_CACHE, 0, 0 };
+    if (!config) config = &defaults;
+    uint32_t harts = config->harts ? config->harts : 1;
+    if (harts > MAX_HARTS || config->engine < POXIM_ENGINE_CACHE || config->engine > POXIM_ENGINE_AOT) return NULL;
+    machine_t *m = machine_new(harts);
+    if (!m) return NULL;
+    m->engine = config->engine;
+    m->trace_level = TRACE_NONE;
+    m->trace_binary = 0;
+    m->profile = 0;
+    m->semihosting = config->semihosting;
+    m->quiet = config->quiet;
+    m->harts[0].stop_at = UINT64_MAX;
+    m->uart_tx_fn = poxim_discard;
+    m->breakpoint = UINT32_MAX;
+    return m;
+}
+
+POXIM_API void poxim_free(poxim_t *m) {
+    if (!m) return;
+    machine_close(poxim_enter(m));
+    machine_free(m);
+}
+
+POXIM_API int poxim_load(poxim_t *m, const void *image, size_t len) {
+    poxim_enter(m);
+    const uint8_t *data = (const uint8_t*)image;
+    int ok = 1;
+    if (len >= SELFMAG && memcmp(data, ELFMAG, SELFMAG) == 0) ok = load_program_elf(data, len);
+    else load_program_hex(data, len);
+    for (uint32_t i = 1; i < m->hart_count; i++) m->harts[i].pc = m->harts[0].pc;
+    m->serial = __atomic_add_fetch(&machine_serial, 1, __ATOMIC_RELAXED); // nada do que foi decodificado vale
+    return ok ? 0 : -1;
+}
+
+POXIM_API int poxim_run(poxim_t *m, uint64_t instructions) {
+    hart_t *h = &poxim_enter(m)->harts[0];
+    if (m->exit_reason != MACHINE_RUNNING && m->exit_reason != MACHINE_CHECKPOINT &&
+        m->exit_reason != MACHINE_EBREAK && m->exit_reason != MACHINE_IDLE) {
+        return m->exit_reason;
+    }
+    if (instructions == 0) return POXIM_STOP_LIMIT;
+    machine_resume(m);
+    uint64_t start = hart_instret(h);
+    h->stop_instret = instructions > UINT64_MAX - start ? UINT64_MAX : start + instructions;
+    // Em cima do breakpoint a primeira chegada é a própria partida.
+    h->stop_pc = m->breakpoint;
+    h->stop_pc_hits = m->breakpoint == UINT32_MAX ? 0 : h->pc == m->breakpoint ? 2 : 1;
+
+    machine_run(m);
+
+    int at_breakpoint = h->stop_pc_hits == 0 && m->breakpoint != UINT32_MAX && h->pc == m->breakpoint;
+    h->stop_instret = UINT64_MAX;
+    h->stop_pc_hits = 0;
+    uart_host_flush();
+    for (uint32_t i = 0; i < m->hart_count; i++) {
+        if (m->harts[i].trace_file) fflush(m->harts[i].trace_file);
+    }
+    if (m->exit_reason != MACHINE_CHECKPOINT) return m->exit_reason;
+    return at_breakpoint ? POXIM_STOP_BREAKPOINT : POXIM_STOP_LIMIT;
+}
+
+POXIM_API void poxim_set_breakpoint(poxim_t *m, uint32_t pc) { m->breakpoint = pc; }
+
+POXIM_API uint64_t poxim_instret(poxim_t *m, uint32_t hart) {
+    return hart < m->hart_count ? hart_instret(&m->harts[hart]) : 0;
+}
+
+POXIM_API int poxim_exit_code(poxim_t *m) { return m->exit_code; }
+
+POXIM_API uint32_t poxim_get_reg(poxim_t *m, uint32_t hart, uint32_t reg) {
+    if (hart >= m->hart_count || reg > POXIM_REG_PC) return 0;
+    return reg == POXIM_REG_PC ? m->harts[hart].pc : m->harts[hart].regs[reg];
+}
+
+POXIM_API int poxim_set_reg(poxim_t *m, uint32_t hart, uint32_t reg, uint32_t value) {
+    if (hart >= m->hart_count || reg > POXIM_REG_PC) return -1;
+    if (reg == POXIM_REG_PC) m->harts[hart].pc = value;
+    else if (reg != 0) m->harts[hart].regs[reg] = value;
+    return 0;
+}
+
+POXIM_API int poxim_read_memory(poxim_t *m, uint32_t address, void *out, size_t len) {
+    uint32_t offset = address - PC_START_ADDRESS;
+    if (offset > memory_size || len > memory_size - offset) return -1;
+    memcpy(out, m->memory + offset, len);
+    return 0;
+}
+
+POXIM_API int poxim_write_memory(poxim_t *m, uint32_t address, const void *data, size_t len) {
+    uint32_t offset = address - PC_START_ADDRESS;
+    if (offset > memory_size || len > memory_size - offset) return -1;
+    poxim_enter(m);
+    memcpy(m->memory + offset, data, len);
+    // Os caches decodificados são das threads que rodaram a máquina, não desta.
+    if (len) m->serial = __atomic_add_fetch(&machine_serial, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+POXIM_API void poxim_set_uart_tx(poxim_t *m, poxim_write_fn fn, void *user) {
+    poxim_enter(m);
+    uart_host_flush();
+    m->uart_tx_fn = fn ? fn : poxim_discard;
+    m->uart_tx_user = user;
+}
+
+POXIM_API void poxim_set_uart_rx(poxim_t *m, poxim_read_fn fn, void *user) {
+    m->uart_rx_fn = fn;
+    m->uart_rx_user = user;
+    m->uart_rx_eof = 0;
+}
+
+POXIM_API size_t poxim_uart_input(poxim_t *m, const void *data, size_t len) {
+    if (m->uart_rx_head == m->uart_rx_tail) m->uart_rx_head = m->uart_rx_tail = 0;
+    if (m->uart_rx_head > 0 && len > UART_HOST_BUFFER - m->uart_rx_tail) {
+        memmove(m->uart_rx_buf, m->uart_rx_buf + m->uart_rx_head, m->uart_rx_tail - m->uart_rx_head);
+        m->uart_rx_tail -= m->uart_rx_head;
+        m->uart_rx_head = 0;
+    }
+    if (len > UART_HOST_BUFFER - m->uart_rx_tail) len = UART_HOST_BUFFER - m->uart_rx_tail;
+    memcpy(m->uart_rx_buf + m->uart_rx_tail, data, len);
+    m->uart_rx_tail += len;
+    m->uart_rx_read += len;
+    return len;
+}
+
+POXIM_API int poxim_set_trace(poxim_t *m, int level, int binary, poxim_trace_fn fn, void *user) {
+    if (level < POXIM_TRACE_NONE || level > POXIM_TRACE_FULL || (binary && m->engine == ENGINE_REF) ||
+        (level != POXIM_TRACE_NONE && !fn)) {
+        return -1;
+    }
+    cookie_io_functions_t io = { NULL, trace_cookie_write, NULL, NULL };
+    for (uint32_t i = 0; i < m->hart_count; i++) {
+        hart_t *h = &m->harts[i];
+        if (h->trace_file) fclose(h->trace_file);
+        h->trace_file = level == POXIM_TRACE_NONE ? NULL : fopencookie(h, "w", io);
+        h->trace_bin_open = 0;
+    }
+    m->trace_fn = fn;
+    m->trace_user = user;
+    m->trace_level = level;
+    m->trace_binary = binary;
+    m->serial = __atomic_add_fetch(&machine_serial, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+POXIM_API int poxim_set_aot(poxim_t *m, const poxim_aot_t *image) {
+    if (image && !aot_usable(image)) return -1;
+    m->aot = image;
+    return 0;
+}
+
+POXIM_API int poxim_aot_generate(poxim_t *m, const char *path, const uint32_t *targets, size_t count, const char *name) {
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        perror("Erro ao criar o arquivo da traducao");
+        return -1;
+    }
+    uint32_t blocks = aot_generate(m, out, targets, count, name ? name : "poxim_aot_image");
+    if (fclose(out) != 0) {
+        perror("Erro ao gravar o arquivo da traducao");
+        return -1;
+    }
+    return (int)blocks;
+}
+
+#ifndef POXIM_LIBRARY
+// --- CÓDIGO CORRIGIDO ---
+int main(int argc, char *argv[]) {
+    const char *batch_manifest = NULL, *restore_path = NULL;
+    long batch_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int argi = 1;
+    for (; argi < argc && argv[argi][0] == '-'; argi++) {
+        if (strcmp(argv[argi], "--engine=cache") == 0) {
+            engine = ENGINE_CACHE;
+        } else if (strcmp(argv[argi], "--engine=ref") == 0) {
+            engine = ENGINE_REF;
+        } else if (strcmp(argv[argi], "--engine=jit") == 0) {
+            engine = ENGINE_JIT;
+        } else if (strcmp(argv[argi], "--engine=aot") == 0) {
+            engine = ENGINE_AOT;
+        } else if (strcmp(argv[argi], "--trace=full") == 0) {
+            trace_level = TRACE_FULL;
+        } else if (strcmp(argv[argi], "--trace=traps") == 0) {
+            trace_level = TRACE_TRAPS;
+        } else if (strcmp(argv[argi], "--no-trace") == 0 || strcmp(argv[argi], "--trace=none") == 0) {
+            trace_level = TRACE_NONE;
+        } else if (strcmp(argv[argi], "--trace-format=text") == 0) {
+            trace_binary = 0;
+        } else if (strcmp(argv[argi], "--trace-format=bin") == 0) {
+            trace_binary = 1;
+        } else if (strncmp(argv[argi], "--trace-pc=", 11) == 0) {
+            if (trace_pc_spec_count == TRACE_MAX_RANGES) {
+                fprintf(stderr, "Faixas demais em --trace-pc (maximo %d)\n", TRACE_MAX_RANGES);
+                return EXIT_FAILURE;
+            }
+            trace_pc_specs[trace_pc_spec_count++] = argv[argi] + 11;
+            trace_filtered = 1;
+        } else if (strncmp(argv[argi], "--trace-from=", 13) == 0) {
+            trace_from = strtoull(argv[argi] + 13, NULL, 0);
+            trace_filtered = 1;
+        } else if (strncmp(argv[argi], "--trace-count=", 14) == 0) {
+            trace_count = strtoull(argv[argi] + 14, NULL, 0);
+            trace_filtered = 1;
+        } else if (strcmp(argv[argi], "--trace-changes") == 0) {
+            trace_changes_only = 1;
+            trace_filtered = 1;
+        } else if (strncmp(argv[argi], "--trace-sample=", 15) == 0) {
+            trace_sample = strtoull(argv[argi] + 15, NULL, 0);
+            trace_filtered = 1;
+            if (trace_sample < 1) {
+                fprintf(stderr, "Intervalo do --trace-sample invalido\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strncmp(argv[argi], "--uart-flush=", 13) == 0) {
+            uart_flush_interval = strtoull(argv[argi] + 13, NULL, 0);
+        } else if (strncmp(argv[argi], "--uart-char-time=", 17) == 0) {
+            uart_char_time = strtoull(argv[argi] + 17, NULL, 0);
+        } else if (strcmp(argv[argi], "--no-idle-skip") == 0) {
+            idle_skip_enabled = 0;
+        } else if (strncmp(argv[argi], "--harts=", 8) == 0) {
+            harts_per_machine = strtoul(argv[argi] + 8, NULL, 0);
+            if (harts_per_machine < 1 || harts_per_machine > MAX_HARTS) {
+                fprintf(stderr, "Numero de harts invalido (1 a %d)\n", MAX_HARTS);
+                return EXIT_FAILURE;
+            }
+        } else if (strncmp(argv[argi], "--ram=", 6) == 0) {
+            if (!mem_set_ram(argv[argi] + 6)) return EXIT_FAILURE;
+        } else if (strncmp(argv[argi], "--mem=", 6) == 0) {
+            if (!mem_layout_add(argv[argi] + 6, 0)) return EXIT_FAILURE;
+        } else if (strncmp(argv[argi], "--rom=", 6) == 0) {
+            if (!mem_layout_add(argv[argi] + 6, 1)) return EXIT_FAILURE;
+        } else if (strcmp(argv[argi], "--batch") == 0 && argi + 1 < argc) {
+            batch_manifest = argv[++argi];
+        } else if (strcmp(argv[argi], "--simd") == 0) {
+            simd_width = SIMD_LANES;
+        } else if (strncmp(argv[argi], "--simd=", 7) == 0) {
+            simd_width = strtoul(argv[argi] + 7, NULL, 0);
+            if (simd_width < 2 || simd_width > SIMD_LANES) {
+                fprintf(stderr, "Largura do --simd invalida (2 a %d)\n", SIMD_LANES);
+                return EXIT_FAILURE;
+            }
+        } else if (strncmp(argv[argi], "--checkpoint-at=", 16) == 0) {
+            checkpoint_at = strtoull(argv[argi] + 16, NULL, 0);
+        } else if (strncmp(argv[argi], "--save-checkpoint=", 18) == 0) {
+            checkpoint_save_path = argv[argi] + 18;
+        } else if (strncmp(argv[argi], "--restore=", 10) == 0) {
+            restore_path = argv[argi] + 10;
+        } else if (strcmp(argv[argi], "--fork") == 0 && argi + 1 < argc) {
+            fork_manifest = argv[++argi];
+        } else if (strncmp(argv[argi], "--profile=", 10) == 0) {
+            profile_prefix = argv[argi] + 10;
+        } else if (strncmp(argv[argi], "--profile-period=", 17) == 0) {
+            profile_period = strtoull(argv[argi] + 17, NULL, 0);
+        } else if (strncmp(argv[argi], "--profile-symbols=", 18) == 0) {
+            profile_symbols_path = argv[argi] + 18;
+        } else if (strcmp(argv[argi], "--lockstep") == 0) {
+            lockstep_interval = 1000;
+        } else if (strncmp(argv[argi], "--lockstep=", 11) == 0) {
+            lockstep_interval = strtoull(argv[argi] + 11, NULL, 0);
+            if (lockstep_interval < 1) {
+                fprintf(stderr, "Intervalo do --lockstep invalido\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strncmp(argv[argi], "--ff=", 5) == 0) {
+            ff_instructions = strtoull(argv[argi] + 5, NULL, 0);
+            ff_enabled = 1;
+        } else if (strncmp(argv[argi], "--ff-pc=", 8) == 0) {
+            ff_pc_spec = argv[argi] + 8;
+            ff_enabled = 1;
+        } else if (strncmp(argv[argi], "--ff-ecall=", 11) == 0) {
+            ff_ecalls = strtoull(argv[argi] + 11, NULL, 0);
+            ff_enabled = 1;
+        } else if (strncmp(argv[argi], "--detail=", 9) == 0) {
+            ff_detail = strtoull(argv[argi] + 9, NULL, 0);
+            ff_enabled = 1;
+        } else if (strcmp(argv[argi], "--detail-then=stop") == 0) {
+            ff_after_detail = 0;
+        } else if (strcmp(argv[argi], "--detail-then=ff") == 0) {
+            ff_after_detail = 1;
+            ff_enabled = 1;
+        } else if (strncmp(argv[argi], "--blk=", 6) == 0) {
+            blk_path = argv[argi] + 6;
+        } else if (strcmp(argv[argi], "--semihosting") == 0) {
+            semihosting_enabled = 1;
+        } else if (strcmp(argv[argi], "--stats") == 0) {
+            stats_enabled = 1;
+        } else if (strcmp(argv[argi], "--timing") == 0) {
+            timing_enabled = 1;
+        } else if (strncmp(argv[argi], "--timing=", 9) == 0) {
+            timing_enabled = 1;
+            if (!timing_parse(argv[argi] + 9)) return EXIT_FAILURE;
+        } else if (strcmp(argv[argi], "-j") == 0 && argi + 1 < argc) {
+            batch_threads = strtol(argv[++argi], NULL, 0);
+        } else {
+            fprintf(stderr, "Opcao desconhecida: %s\n", argv[argi]);
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (argc - argi != (batch_manifest ? 0 : 4)) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (trace_binary && engine == ENGINE_REF) {
+        fprintf(stderr, "O trace binario nao esta disponivel com --engine=ref\n");
+        return EXIT_FAILURE;
+    }
+    if (batch_manifest && (checkpoint_save_path || fork_manifest)) {
+        fprintf(stderr, "--batch nao pode ser usado com --save-checkpoint ou --fork\n");
+        return EXIT_FAILURE;
+    }
+    if (simd_width && (!batch_manifest || harts_per_machine > 1 || trace_level == TRACE_FULL || trace_binary)) {
+        fprintf(stderr, "--simd vale so com --batch, um hart por maquina e --trace=traps ou --no-trace\n"
+                        "(trace em texto)\n");
+        return EXIT_FAILURE;
+    }
+    int extra_ram = 0;
+    for (uint32_t i = 0; i < mem_layout_count; i++) extra_ram |= !mem_layout[i].rom;
+    if (extra_ram && (checkpoint_save_path || restore_path || fork_manifest)) {
+        fprintf(stderr, "Os checkpoints guardam so a RAM principal: --save-checkpoint, --restore e --fork\n"
+                        "nao valem com --mem\n");
+        return EXIT_FAILURE;
+    }
+    if (checkpoint_save_path && (checkpoint_at == UINT64_MAX || fork_manifest)) {
+        fprintf(stderr, "--save-checkpoint precisa de --checkpoint-at (e nao vale com --fork)\n");
+        return EXIT_FAILURE;
+    }
+    if (fork_manifest && checkpoint_at == UINT64_MAX && !restore_path) {
+        fprintf(stderr, "--fork precisa de --checkpoint-at ou --restore\n");
+        return EXIT_FAILURE;
+    }
+    if (profile_prefix && (batch_manifest || fork_manifest || trace_level == TRACE_FULL)) {
+        fprintf(stderr, "--profile nao vale com --batch, --fork ou --trace=full\n");
+        return EXIT_FAILURE;
+    }
+    if (timing_enabled && (batch_manifest || fork_manifest || lockstep_interval || (profile_prefix && profile_period == 1))) {
+        fprintf(stderr, "--timing nao vale com --batch, --fork, --lockstep ou --profile com --profile-period=1\n");
+        return EXIT_FAILURE;
+    }
+    if (lockstep_interval && (batch_manifest || fork_manifest || checkpoint_save_path || profile_prefix ||
+                              harts_per_machine > 1 || engine == ENGINE_REF)) {
+        fprintf(stderr, "--lockstep compara --engine=cache, jit ou aot com o ref num hart so, sem --batch, --fork,\n"
+                        "--save-checkpoint ou --profile\n");
+        return EXIT_FAILURE;
+    }
+    if (engine == ENGINE_AOT && !&poxim_aot_image) {
+        fprintf(stderr, "--engine=aot precisa do C gerado pelo poxim-aot compilado junto com o poxim.c\n");
+        return EXIT_FAILURE;
+    }
+    if (engine == ENGINE_AOT && !aot_usable(&poxim_aot_image)) {
+        fprintf(stderr, "A traducao AOT foi gerada para outra versao do poxim ou outro mapa de memoria\n");
+        return EXIT_FAILURE;
+    }
+    if (trace_filtered && trace_level != TRACE_FULL) {
+        fprintf(stderr, "Os filtros do trace (--trace-pc, --trace-from, --trace-count, --trace-changes,\n"
+                        "--trace-sample) valem so com --trace=full\n");
+        return EXIT_FAILURE;
+    }
+    if (trace_pc_spec_count && !trace_resolve_ranges(batch_manifest ? NULL : argv[argi])) return EXIT_FAILURE;
+    if (ff_enabled && (batch_manifest || fork_manifest || lockstep_interval || checkpoint_at != UINT64_MAX)) {
+        fprintf(stderr, "--ff, --ff-pc, --ff-ecall e --detail nao valem com --batch, --fork, --lockstep ou\n"
+                        "--checkpoint-at\n");
+        return EXIT_FAILURE;
+    }
+    if (ff_pc_spec && !ff_resolve_pc(argv[argi])) return EXIT_FAILURE;
+    if (profile_period < 1) {
+        fprintf(stderr, "Periodo do perfil invalido\n");
+        return EXIT_FAILURE;
+    }
+    if (batch_threads < 1) {
+        fprintf(stderr, "Numero de threads invalido: %ld\n", batch_threads);
+        return EXIT_FAILURE;
+    }
+    if (restore_path && !checkpoint_load(restore_path)) return EXIT_FAILURE;
+    // O mapa de memória é conferido uma vez, antes de qualquer execução.
+    machine_t *probe = mem_layout_count ? machine_new(1) : NULL;
+    if (mem_layout_count && !probe) return EXIT_FAILURE;
+    if (probe) machine_free(probe);
+    // Várias máquinas com a mesma imagem: cada uma grava na sua cópia.
+    blk_private = batch_manifest || fork_manifest || lockstep_interval;
+
+    if (batch_manifest) return batch_main(batch_manifest, (uint32_t)batch_threads);
+
+    argv += argi - 1;
+    machine_t *m = machine_new(harts_per_machine);
+    if (!m || !machine_open(m, argv[1], argv[2], argv[3], argv[4])) return EXIT_FAILURE;
+    int status = EXIT_SUCCESS;
+    if (fork_manifest) {
+        status = fork_main(m, fork_manifest, (uint32_t)batch_threads);
+    } else if (lockstep_interval) {
+        status = lockstep_main(m, argv[1], argv[3]);
+    } else if (ff_enabled) {
+        status = ff_main(m, argv[1]);
+    } else {
+        run_stats_t before = machine_stats(m);
+        double start = host_seconds();
+        machine_run(m);
+        if (stats_enabled) print_stats(stats_diff(machine_stats(m), before), host_seconds() - start);
+        if (timing_enabled) timing_report(stderr, m);
+        if (profile_prefix && !profile_write(m, profile_prefix, argv[1])) status = EXIT_FAILURE;
+        if (checkpoint_save_path) {
+            if (m->exit_reason != MACHINE_CHECKPOINT) {
+                fprintf(stderr, "A simulacao terminou (%s) antes de --checkpoint-at; nenhum checkpoint foi gravado\n",
+                        batch_status_name(m->exit_reason));
+                status = EXIT_FAILURE;
+            } else if (!checkpoint_save(m, checkpoint_save_path)) {
+                status = EXIT_FAILURE;
+            }
+        }
+    }
+
+    // SYS_EXIT do semihosting: o código do guest vira o do processo
+    if (!fork_manifest && status == EXIT_SUCCESS && m->exit_reason == MACHINE_EXIT) status = m->exit_code & 0xFF;
+
+    // Fecha todos os arquivos abertos
+    machine_close(m);
+    machine_free(m);
+    return status;
+}
+#endif
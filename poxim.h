@@ -0,0 +1,119 @@
+#ifndef POXIM_H
+#define POXIM_H
+
+// API da libpoxim: o simulador embutido num programa, sem arquivos nem
+// processos. A biblioteca é o próprio poxim.c compilado com -DPOXIM_LIBRARY
+// (sem o main da linha de comando); ver "Biblioteca (libpoxim)" no README.
+//
+// Uma máquina (poxim_t) é criada vazia, recebe o programa de um buffer na
+// memória e roda em trechos de N instruções do hart 0 ou até um evento. A
+// entrada e a saída da UART e o trace passam por callbacks. Cada função pode
+// ser chamada de qualquer thread, mas uma máquina só pode estar em uso numa
+// thread por vez; máquinas diferentes rodam em paralelo sem problema.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(POXIM_LIBRARY) && defined(__GNUC__)
+#define POXIM_API __attribute__((visibility("default")))
+#else
+#define POXIM_API
+#endif
+
+typedef struct machine poxim_t;
+struct poxim_aot; // tradução do poxim-aot (poxim_aot.h)
+
+// Motores (como --engine)
+#define POXIM_ENGINE_CACHE 0
+#define POXIM_ENGINE_REF   1
+#define POXIM_ENGINE_JIT   2
+#define POXIM_ENGINE_AOT   3 // blocos de poxim_set_aot
+
+// Níveis do trace (como --trace)
+#define POXIM_TRACE_NONE  0
+#define POXIM_TRACE_TRAPS 1
+#define POXIM_TRACE_FULL  2
+
+// Motivo da volta de poxim_run
+#define POXIM_STOP_LIMIT        0 // executou as instruções pedidas
+#define POXIM_STOP_EBREAK       1
+#define POXIM_STOP_DOUBLE_FAULT 2
+#define POXIM_STOP_IDLE         3 // esperando uma interrupção que nunca vem
+#define POXIM_STOP_ERROR        4
+#define POXIM_STOP_BREAKPOINT   5 // chegou no pc de poxim_set_breakpoint
+#define POXIM_STOP_EXIT         6 // SYS_EXIT do semihosting (poxim_exit_code)
+
+#define POXIM_REG_PC 32 // índice do pc em poxim_get_reg/poxim_set_reg
+
+typedef struct {
+    uint32_t harts;   // 1 a 32 (0 vale 1)
+    int engine;       // POXIM_ENGINE_*
+    int semihosting;  // como --semihosting
+    int quiet;        // sem avisos no stderr
+} poxim_config_t;
+
+// Saída (UART ou trace): recebe os bytes em blocos.
+typedef void (*poxim_write_fn)(void *user, const void *data, size_t len);
+// Trace de um hart: cada hart tem o seu fluxo.
+typedef void (*poxim_trace_fn)(void *user, uint32_t hart, const void *data, size_t len);
+// Entrada da UART: copia até len bytes para buf e retorna quantos copiou;
+// 0 é "nada agora" e um valor negativo é o fim da entrada.
+typedef long (*poxim_read_fn)(void *user, void *buf, size_t len);
+
+// config NULL: um hart, cache de instruções, sem semihosting.
+POXIM_API poxim_t *poxim_new(const poxim_config_t *config);
+POXIM_API void poxim_free(poxim_t *m);
+
+// Programa em hex ou ELF32 (o mesmo formato do <hex_in>). Define o pc de todos
+// os harts. Retorna 0, ou -1 com o motivo no stderr.
+POXIM_API int poxim_load(poxim_t *m, const void *image, size_t len);
+
+// Roda até o hart 0 executar mais 'instructions' instruções (UINT64_MAX: sem
+// limite) ou até um evento. Depois de POXIM_STOP_LIMIT, POXIM_STOP_BREAKPOINT,
+// POXIM_STOP_EBREAK ou POXIM_STOP_IDLE a máquina pode continuar com outra
+// chamada; depois dos outros motivos devolve o mesmo motivo sem rodar.
+POXIM_API int poxim_run(poxim_t *m, uint64_t instructions);
+
+// Para antes de executar o pc (UINT32_MAX desliga). Continuar de cima dele
+// executa a instrução normalmente.
+POXIM_API void poxim_set_breakpoint(poxim_t *m, uint32_t pc);
+
+POXIM_API uint64_t poxim_instret(poxim_t *m, uint32_t hart);
+POXIM_API int poxim_exit_code(poxim_t *m);
+
+// Registradores x0-x31 e o pc (POXIM_REG_PC). poxim_set_reg retorna -1 para
+// hart ou registrador inválido; escritas em x0 são ignoradas.
+POXIM_API uint32_t poxim_get_reg(poxim_t *m, uint32_t hart, uint32_t reg);
+POXIM_API int poxim_set_reg(poxim_t *m, uint32_t hart, uint32_t reg, uint32_t value);
+
+// Cópia de/para a RAM. Retorna -1, sem copiar nada, se o trecho não estiver
+// inteiro na RAM. Escritas sobre código já executado valem na próxima
+// execução, como um store.
+POXIM_API int poxim_read_memory(poxim_t *m, uint32_t address, void *out, size_t len);
+POXIM_API int poxim_write_memory(poxim_t *m, uint32_t address, const void *data, size_t len);
+
+// Saída da UART (sem callback ela é descartada).
+POXIM_API void poxim_set_uart_tx(poxim_t *m, poxim_write_fn fn, void *user);
+// Entrada da UART por callback, chamado quando o guest quer mais dados.
+POXIM_API void poxim_set_uart_rx(poxim_t *m, poxim_read_fn fn, void *user);
+// Acrescenta bytes à entrada da UART; retorna quantos couberam no buffer.
+POXIM_API size_t poxim_uart_input(poxim_t *m, const void *data, size_t len);
+
+// Trace no formato do --trace-format (binary = 0 texto, 1 binário) com o nível
+// dado. O trace binário não vale com POXIM_ENGINE_REF e precisa que a thread
+// não rode outra máquina entre dois poxim_run desta. Retorna 0 ou -1.
+POXIM_API int poxim_set_trace(poxim_t *m, int level, int binary, poxim_trace_fn fn, void *user);
+
+// Tradução usada por POXIM_ENGINE_AOT (NULL desliga; compilada junto com a
+// biblioteca estática, ela já vem ligada). Retorna -1 se ela foi gerada para
+// outra versão do poxim.
+POXIM_API int poxim_set_aot(poxim_t *m, const struct poxim_aot *image);
+
+// Grava em 'path' o C da tradução antecipada do programa carregado (é o que o
+// poxim-aot faz): o código alcançável do pc do hart 0 e dos 'count' alvos
+// dados, como os saltos indiretos de um <prefixo>.targets do --profile. 'name'
+// é o símbolo gerado (NULL: poxim_aot_image). Retorna o número de blocos, ou
+// -1 com o motivo no stderr.
+POXIM_API int poxim_aot_generate(poxim_t *m, const char *path, const uint32_t *targets, size_t count, const char *name);
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef POXIM_AOT_H
+#define POXIM_AOT_H
+
+// Interface entre o poxim e o C gerado pelo poxim-aot (tradução antecipada de
+// um programa fixo; ver "Tradução Antecipada (AOT)" no README).
+//
+// O arquivo gerado define 'poxim_aot_image' com a tabela de blocos, as
+// palavras de onde eles saíram e a função de entrada. Compilado junto com o
+// poxim.c (ou passado a poxim_set_aot na libpoxim), --engine=aot roda os
+// blocos e o resto fica com o interpretador: pcs que não começam um bloco,
+// CSRs, SYSTEM, AMOs, fence.i, MMIO e traps.
+//
+// Os blocos seguem as regras do JIT: a cabeça confere se mtime não alcança
+// irq_next_check dentro do bloco e mtime só é atualizado nas saídas e antes
+// de chamar o poxim.
+
+#include <stdint.h>
+
+#define POXIM_AOT_ABI 1
+#define POXIM_AOT_CHUNK_SHIFT 6 // pedaços do code_map (CODE_CHUNK_SHIFT)
+
+// Retorno de enter(). Qualquer outro valor é o pc de um desvio para trás que
+// pode fechar um laço ocioso (pc já é o destino; o poxim roda idle_check).
+#define POXIM_AOT_DONE 0 // pc atualizado (salto, MMIO, trap ou pc sem bloco)
+#define POXIM_AOT_BAIL 1 // pc sem bloco ou cabeça recusou: uma instrução no interpretador
+
+// Estado do hart atual, montado pelo poxim a cada execução.
+typedef struct {
+    uint32_t *regs;
+    uint8_t *memory;              // a RAM, em memory_base
+    uint32_t *pc;
+    uint64_t *mtime;
+    const uint64_t *irq_next_check;
+    const int *trap_pending;      // trap gerado por load/store (pc já é o do handler)
+    const uint8_t *code_map;      // pedaços com código: stores vão por store()
+    const uint8_t *stale;         // por bloco: código mudou ou pc de parada dentro
+    const uint8_t *idle_rejected; // por palavra: desvios que não fecham laço ocioso
+    int idle_skip;
+    // Caminho lento: MMIO, falhas e pedaços com código. load retorna o valor
+    // sem extensão de sinal; store retorna 1 quando o bloco precisa sair.
+    uint32_t (*load)(uint32_t address, uint32_t size, uint32_t pc);
+    int (*store)(uint32_t address, uint32_t value, uint32_t size, uint32_t pc);
+} poxim_aot_ctx_t;
+
+typedef struct poxim_aot {
+    uint32_t abi;                 // POXIM_AOT_ABI
+    uint32_t memory_base, memory_size;
+    uint32_t block_count, word_count;
+    const uint32_t (*blocks)[2];  // pc e instruções cobertas de cada bloco
+    const uint32_t (*words)[2];   // pc e palavra de cada instrução traduzida, em ordem
+    uintptr_t (*enter)(poxim_aot_ctx_t *ctx);
+} poxim_aot_t;
+
+// --- Funções Usadas pelos Blocos ---
+static inline uint32_t poxim_aot_ld(const uint8_t *p, uint32_t size) {
+    uint32_t v = p[0];
+    if (size > 1) v |= (uint32_t)p[1] << 8;
+    if (size > 2) v |= ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+    return v;
+}
+
+static inline void poxim_aot_st(uint8_t *p, uint32_t v, uint32_t size) {
+    p[0] = (uint8_t)v;
+    if (size > 1) p[1] = (uint8_t)(v >> 8);
+    if (size > 2) { p[2] = (uint8_t)(v >> 16); p[3] = (uint8_t)(v >> 24); }
+}
+
+static inline uint32_t poxim_aot_div(uint32_t a, uint32_t b) {
+    if (b == 0) return -1;
+    if (a == 0x80000000 && b == 0xFFFFFFFF) return 0x80000000;
+    return (int32_t)a / (int32_t)b;
+}
+static inline uint32_t poxim_aot_divu(uint32_t a, uint32_t b) { return (b == 0) ? 0xFFFFFFFF : a / b; }
+static inline uint32_t poxim_aot_rem(uint32_t a, uint32_t b) {
+    if (b == 0) return a;
+    if (a == 0x80000000 && b == 0xFFFFFFFF) return 0;
+    return (int32_t)a % (int32_t)b;
+}
+static inline uint32_t poxim_aot_remu(uint32_t a, uint32_t b) { return (b == 0) ? a : a % b; }
+
+#endif
@@ -0,0 +1,383 @@
+#ifndef POXIM_TRACE_H
+#define POXIM_TRACE_H
+
+// Partes do trace compartilhadas entre o simulador (poxim.c) e o conversor
+// offline do trace binário (poxim-tracefmt.c): nomes de registradores/CSRs,
+// extração de campos da instrução, formatação das linhas de texto e o
+// formato binário compacto.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+// --- Nomes ---
+static const char *abi_name[32] = {
+    "zero", "ra", "sp", "gp", "tp", "t0", "t1", "t2",
+    "s0", "s1", "a0", "a1", "a2", "a3", "a4", "a5",
+    "a6", "a7", "s2", "s3", "s4", "s5", "s6", "s7",
+    "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6"};
+
+// Contadores, pelo índice (csr & 0x1F); o índice 1 só existe como time.
+#define CSR_HPM_NAMES(p, s) \
+    p "3" s,  p "4" s,  p "5" s,  p "6" s,  p "7" s,  p "8" s,  p "9" s, \
+    p "10" s, p "11" s, p "12" s, p "13" s, p "14" s, p "15" s, p "16" s, \
+    p "17" s, p "18" s, p "19" s, p "20" s, p "21" s, p "22" s, p "23" s, \
+    p "24" s, p "25" s, p "26" s, p "27" s, p "28" s, p "29" s, p "30" s, \
+    p "31" s
+static const char *csr_counter_names[4][32] = {
+    {"mcycle",  NULL,    "minstret",  CSR_HPM_NAMES("mhpmcounter", "")},
+    {"mcycleh", NULL,    "minstreth", CSR_HPM_NAMES("mhpmcounter", "h")},
+    {"cycle",   "time",  "instret",   CSR_HPM_NAMES("hpmcounter", "")},
+    {"cycleh",  "timeh", "instreth",  CSR_HPM_NAMES("hpmcounter", "h")}};
+static const char *csr_hpmevent_names[32] = {NULL, NULL, NULL, CSR_HPM_NAMES("mhpmevent", "")};
+
+static const char *get_csr_name(uint32_t csr_addr) {
+    const char *name = NULL;
+    if ((csr_addr & ~0x9Fu) == 0xB00 || (csr_addr & ~0x9Fu) == 0xC00)
+        name = csr_counter_names[((csr_addr >> 10) & 1) * 2 + ((csr_addr >> 7) & 1)][csr_addr & 0x1F];
+    else if (csr_addr >= 0x323 && csr_addr <= 0x33F)
+        name = csr_hpmevent_names[csr_addr & 0x1F];
+    if (name) return name;
+    switch (csr_addr) {
+        case 0x300: return "mstatus"; case 0x304: return "mie";
+        case 0x305: return "mtvec";   case 0x341: return "mepc";
+        case 0x342: return "mcause";  case 0x343: return "mtval";
+        case 0x340: return "mscratch";case 0x301: return "misa";
+        case 0x344: return "mip";     case 0xF14: return "mhartid";
+        case 0x302: return "medeleg"; case 0x303: return "mideleg";
+        case 0x306: return "mcounteren";
+        case 0x100: return "sstatus"; case 0x104: return "sie";
+        case 0x105: return "stvec";   case 0x106: return "scounteren";
+        case 0x140: return "sscratch";case 0x141: return "sepc";
+        case 0x142: return "scause";  case 0x143: return "stval";
+        case 0x144: return "sip";     case 0x180: return "satp";
+        default: return "unknown_csr";
+    }
+}
+
+// Extensão A, pelo funct5 (NULL = não existe).
+static const char *amo_name(uint32_t funct5) {
+    switch (funct5) {
+        case 0x02: return "lr.w";      case 0x03: return "sc.w";
+        case 0x01: return "amoswap.w"; case 0x00: return "amoadd.w";
+        case 0x04: return "amoxor.w";  case 0x0C: return "amoand.w";
+        case 0x08: return "amoor.w";   case 0x10: return "amomin.w";
+        case 0x14: return "amomax.w";  case 0x18: return "amominu.w";
+        case 0x1C: return "amomaxu.w";
+        default: return NULL;
+    }
+}
+
+static const char *get_trap_name(uint32_t cause) {
+    if (cause & 0x80000000) {
+        switch (cause & 0x7FFFFFFF) {
+            case 1: return "interrupt:supervisor_software";
+            case 3: return "interrupt:software";
+            case 5: return "interrupt:supervisor_timer";
+            case 7: return "interrupt:timer";
+            case 9: return "interrupt:supervisor_external";
+            case 11: return "interrupt:external";
+            default: return "interrupt:unknown";
+        }
+    } else {
+        switch (cause) {
+            case 1: return "exception:instruction_fault";
+            case 2: return "exception:illegal_instruction";
+            case 5: return "exception:load_fault";
+            case 7: return "exception:store_fault";
+            case 8: return "exception:environment_call_user";
+            case 9: return "exception:environment_call_supervisor";
+            case 11: return "exception:environment_call";
+            case 12: return "exception:instruction_page_fault";
+            case 13: return "exception:load_page_fault";
+            case 15: return "exception:store_page_fault";
+            default: return "exception:unknown";
+        }
+    }
+}
+
+// --- Campos da Instrução ---
+static inline uint32_t get_opcode(uint32_t i) { return i & 0x7F; }
+static inline uint32_t get_rd(uint32_t i) { return (i >> 7) & 0x1F; }
+static inline uint32_t get_rs1(uint32_t i) { return (i >> 15) & 0x1F; }
+static inline uint32_t get_rs2(uint32_t i) { return (i >> 20) & 0x1F; }
+static inline uint32_t get_funct3(uint32_t i) { return (i >> 12) & 0x7; }
+static inline uint32_t get_funct7(uint32_t i) { return (i >> 25) & 0x7F; }
+
+static inline int32_t get_imm_I(uint32_t instruction) {
+    return (int32_t)(instruction) >> 20;
+}
+
+static inline int32_t get_imm_S(uint32_t instruction) {
+    int32_t imm = ((instruction >> 25) << 5) | ((instruction >> 7) & 0x1F);
+    return (int32_t)(imm << 20) >> 20;
+}
+
+static inline int32_t get_imm_B(uint32_t instruction) {
+    int32_t imm = (((instruction >> 31) & 0x1) << 12) |
+                  (((instruction >> 7) & 0x1) << 11) |
+                  (((instruction >> 25) & 0x3F) << 5)|
+                  (((instruction >> 8) & 0xF) << 1);
+    return (int32_t)(imm << 19) >> 19;
+}
+
+static inline int32_t get_imm_U(uint32_t instruction) {
+    return (int32_t)(instruction & 0xFFFFF000);
+}
+
+static inline int32_t get_imm_J(uint32_t instruction) {
+    int32_t imm = (((instruction >> 31) & 0x1) << 20) |
+                  (((instruction >> 12) & 0xFF) << 12) |
+                  (((instruction >> 20) & 0x1) << 11) |
+                  (((instruction >> 21) & 0x3FF) << 1);
+    return (int32_t)(imm << 11) >> 11;
+}
+
+// --- Formatação do Trace ---
+// Valores observados ao redor da execução de uma instrução. É tudo o que
+// format_trace_details() precisa para reproduzir a linha do trace.
+typedef struct {
+    uint32_t pc, instruction;
+    uint32_t rs1_val, rs2_val;  // operandos antes da execução
+    uint32_t rd_val;            // valor escrito em rd (mesmo quando rd == zero)
+    uint32_t next_pc;           // pc logo após a execução (antes do pc += 4)
+    uint32_t csr_old, csr_new;  // valor do CSR antes e depois (Zicsr)
+} trace_info_t;
+
+// Gera o mesmo texto que decode_and_execute() escreve em details_buffer.
+static void format_trace_details(const trace_info_t *t, char *details_buffer) {
+    uint32_t instruction = t->instruction;
+    uint32_t opcode = get_opcode(instruction), rd = get_rd(instruction), rs1 = get_rs1(instruction),
+             rs2 = get_rs2(instruction), funct3 = get_funct3(instruction), funct7 = get_funct7(instruction);
+    int32_t imm_i_sext = get_imm_I(instruction);
+    uint32_t current_pc = t->pc, rs1_val = t->rs1_val, rs2_val = t->rs2_val, result_val = t->rd_val;
+    uint32_t rd_print = rd != 0 ? t->rd_val : 0;
+    const char *rdn = abi_name[rd], *rs1n = abi_name[rs1], *rs2n = abi_name[rs2];
+
+    details_buffer[0] = '\0';
+    switch (opcode) {
+        case 0x37:
+            sprintf(details_buffer, "lui    %s,0x%05x          %s=0x%08x", rdn, (get_imm_U(instruction) >> 12) & 0xFFFFF, rdn, rd_print);
+            break;
+        case 0x17:
+            sprintf(details_buffer, "auipc  %s,0x%05x          %s=0x%08x+0x%08x=0x%08x", rdn, (get_imm_U(instruction) >> 12) & 0xFFFFF, rdn, current_pc, get_imm_U(instruction), rd_print);
+            break;
+        case 0x6F:
+            sprintf(details_buffer, "jal    %s,0x%05x        pc=0x%08x,%s=0x%08x", rdn, (uint32_t)get_imm_J(instruction) & 0x1FFFFF, t->next_pc, rdn, rd_print);
+            break;
+        case 0x67:
+            sprintf(details_buffer, "jalr   %s,%s,0x%03x       pc=0x%08x+0x%08x,%s=0x%08x", rdn, rs1n, (uint32_t)imm_i_sext & 0xFFF, rs1_val, (uint32_t)imm_i_sext, rdn, rd_print);
+            break;
+        case 0x63:
+            {
+                static const char *names[8] = { "beq", "bne", "?", "?", "blt", "bge", "bltu", "bgeu" };
+                static const char *ops[8] = { "==", "!=", "?", "?", "<", ">=", "<", ">=" };
+                int taken = 0;
+                switch (funct3) {
+                    case 0x0: taken = rs1_val == rs2_val; break;
+                    case 0x1: taken = rs1_val != rs2_val; break;
+                    case 0x4: taken = (int32_t)rs1_val < (int32_t)rs2_val; break;
+                    case 0x5: taken = (int32_t)rs1_val >= (int32_t)rs2_val; break;
+                    case 0x6: taken = rs1_val < rs2_val; break;
+                    case 0x7: taken = rs1_val >= rs2_val; break;
+                }
+                sprintf(details_buffer, "%-7s%s,%s,0x%03x       (%s(0x%08x)%s%s(0x%08x))=%u->pc=0x%08x", names[funct3], rs1n, rs2n, (uint32_t)get_imm_B(instruction) & 0x1FFF, (funct3 >= 6 ? "u" : ""), rs1_val, ops[funct3], (funct3 >= 6 ? "u" : ""), rs2_val, taken, t->next_pc);
+            }
+            break;
+        case 0x03:
+            {
+                static const char *names[8] = { "lb", "lh", "lw", "?", "lbu", "lhu", "?", "?" };
+                sprintf(details_buffer, "%-7s%s,0x%03x(%s)      %s=mem[0x%08x]=0x%08x", names[funct3], rdn, imm_i_sext & 0xFFF, rs1n, rdn, rs1_val + imm_i_sext, rd_print);
+            }
+            break;
+        case 0x23:
+            {
+                int32_t imm_s_sext = get_imm_S(instruction);
+                uint32_t effective_address = rs1_val + imm_s_sext;
+                switch (funct3) {
+                    case 0x0: sprintf(details_buffer, "sb     %s,0x%03x(%s)        mem[0x%08x]=0x%02x", rs2n, imm_s_sext & 0xFFF, rs1n, effective_address, rs2_val & 0xFF); break;
+                    case 0x1: sprintf(details_buffer, "sh     %s,0x%03x(%s)        mem[0x%08x]=0x%04x", rs2n, imm_s_sext & 0xFFF, rs1n, effective_address, rs2_val & 0xFFFF); break;
+                    case 0x2: sprintf(details_buffer, "sw     %s,0x%03x(%s)        mem[0x%08x]=0x%08x", rs2n, imm_s_sext & 0xFFF, rs1n, effective_address, rs2_val); break;
+                }
+            }
+            break;
+        case 0x13:
+            {
+                uint32_t shamt = imm_i_sext & 0x1F;
+                switch (funct3) {
+                    case 0x0: sprintf(details_buffer, "addi   %s,%s,0x%x       %s=0x%08x+0x%08x=0x%08x", rdn, rs1n, (uint32_t)imm_i_sext & 0xFFF, rdn, rs1_val, imm_i_sext, result_val); break;
+                    case 0x1: sprintf(details_buffer, "slli   %s,%s,%d          %s=0x%08x<<%d=0x%08x", rdn, rs1n, shamt, rdn, rs1_val, shamt, result_val); break;
+                    case 0x2: sprintf(details_buffer, "slti   %s,%s,%d       %s=(0x%08x<%d)=%u", rdn, rs1n, imm_i_sext, rdn, rs1_val, imm_i_sext, result_val); break;
+                    case 0x3: sprintf(details_buffer, "sltiu  %s,%s,%d       %s=(0x%08x<%u)=%u", rdn, rs1n, imm_i_sext, rdn, rs1_val, (uint32_t)imm_i_sext, result_val); break;
+                    case 0x4: sprintf(details_buffer, "xori   %s,%s,0x%03x       %s=0x%08x^0x%03x=0x%08x", rdn, rs1n, imm_i_sext & 0xFFF, rdn, rs1_val, imm_i_sext & 0xFFF, result_val); break;
+                    case 0x5:
+                        if ((instruction >> 30) == 0x00) sprintf(details_buffer, "srli   %s,%s,%d          %s=0x%08x>>%d=0x%08x", rdn, rs1n, shamt, rdn, rs1_val, shamt, result_val);
+                        else sprintf(details_buffer, "srai   %s,%s,%d          %s=0x%08x>>>%d=0x%08x", rdn, rs1n, shamt, rdn, rs1_val, shamt, result_val);
+                        break;
+                    case 0x6: sprintf(details_buffer, "ori    %s,%s,0x%03x       %s=0x%08x|0x%03x=0x%08x", rdn, rs1n, imm_i_sext & 0xFFF, rdn, rs1_val, imm_i_sext & 0xFFF, result_val); break;
+                    case 0x7: sprintf(details_buffer, "andi   %s,%s,0x%03x       %s=0x%08x&0x%03x=0x%08x", rdn, rs1n, imm_i_sext & 0xFFF, rdn, rs1_val, imm_i_sext & 0xFFF, result_val); break;
+                }
+            }
+            break;
+        case 0x33:
+            if (funct7 == 0x01) {
+                static const char *names[8] = { "mul    ", "mulh   ", "mulhsu ", "mulhu  ", "div    ", "divu   ", "rem    ", "remu   " };
+                static const char *ops[8] = { "*", "*", "*", "*", "/", "/", "%", "%" };
+                sprintf(details_buffer, "%s%s,%s,%s         %s=0x%08x%s0x%08x=0x%08x", names[funct3], rdn, rs1n, rs2n, rdn, rs1_val, ops[funct3], rs2_val, result_val);
+            } else {
+                uint32_t shamt = rs2_val & 0x1F;
+                switch (funct3) {
+                    case 0x0:
+                        if (funct7 == 0x20) sprintf(details_buffer, "sub    %s,%s,%s         %s=0x%08x-0x%08x=0x%08x", rdn, rs1n, rs2n, rdn, rs1_val, rs2_val, result_val);
+                        else sprintf(details_buffer, "add    %s,%s,%s         %s=0x%08x+0x%08x=0x%08x", rdn, rs1n, rs2n, rdn, rs1_val, rs2_val, result_val);
+                        break;
+                    case 0x1: sprintf(details_buffer, "sll    %s,%s,%s         %s=0x%08x<<%d=0x%08x", rdn, rs1n, rs2n, rdn, rs1_val, shamt, result_val); break;
+                    case 0x2: sprintf(details_buffer, "slt    %s,%s,%s         %s=(0x%08x<0x%08x)=%u", rdn, rs1n, rs2n, rdn, rs1_val, rs2_val, result_val); break;
+                    case 0x3: sprintf(details_buffer, "sltu   %s,%s,%s         %s=(0x%08x<0x%08x)=%u", rdn, rs1n, rs2n, rdn, rs1_val, rs2_val, result_val); break;
+                    case 0x4: sprintf(details_buffer, "xor    %s,%s,%s         %s=0x%08x^0x%08x=0x%08x", rdn, rs1n, rs2n, rdn, rs1_val, rs2_val, result_val); break;
+                    case 0x5:
+                        if (funct7 == 0x20) sprintf(details_buffer, "sra    %s,%s,%s         %s=0x%08x>>>%d=0x%08x", rdn, rs1n, rs2n, rdn, rs1_val, shamt, result_val);
+                        else sprintf(details_buffer, "srl    %s,%s,%s         %s=0x%08x>>%d=0x%08x", rdn, rs1n, rs2n, rdn, rs1_val, shamt, result_val);
+                        break;
+                    case 0x6: sprintf(details_buffer, "or     %s,%s,%s         %s=0x%08x|0x%08x=0x%08x", rdn, rs1n, rs2n, rdn, rs1_val, rs2_val, result_val); break;
+                    case 0x7: sprintf(details_buffer, "and    %s,%s,%s         %s=0x%08x&0x%08x=0x%08x", rdn, rs1n, rs2n, rdn, rs1_val, rs2_val, result_val); break;
+                }
+            }
+            break;
+        case 0x73:
+            {
+                uint32_t csr_addr = (uint32_t)imm_i_sext & 0xFFF;
+                const char *csrn = get_csr_name(csr_addr);
+                uint32_t uimm = rs1;
+                switch (funct3) {
+                    case 0x0:
+                        if (imm_i_sext == 0x0) sprintf(details_buffer, "ecall");
+                        else if (imm_i_sext == 0x1) sprintf(details_buffer, "ebreak");
+                        else if (imm_i_sext == 0x302) sprintf(details_buffer, "mret                       pc=0x%08x", t->next_pc);
+                        else if (imm_i_sext == 0x102) sprintf(details_buffer, "sret                       pc=0x%08x", t->next_pc);
+                        else if (imm_i_sext == 0x105) sprintf(details_buffer, "wfi");
+                        else if (funct7 == 0x09) sprintf(details_buffer, "sfence.vma");
+                        break;
+                    case 0x1: sprintf(details_buffer, "csrrw  %s,%s,%s       %s=%s=0x%08x,%s=0x%08x", rdn, csrn, rs1n, rdn, csrn, t->csr_old, csrn, rs1_val); break;
+                    case 0x2: sprintf(details_buffer, "csrrs  %s,%s,%s      %s=%s=0x%08x,%s|=0x%08x=0x%08x", rdn, csrn, rs1n, rdn, csrn, t->csr_old, csrn, rs1_val, t->csr_new); break;
+                    case 0x3: sprintf(details_buffer, "csrrc  %s,%s,%s       %s=%s=0x%08x,%s&=~0x%08x=0x%08x", rdn, csrn, rs1n, rdn, csrn, t->csr_old, csrn, rs1_val, t->csr_new); break;
+                    case 0x5: sprintf(details_buffer, "csrrwi %s,%s,%u      %s=%s=0x%08x,%s=%u", rdn, csrn, uimm, rdn, csrn, t->csr_old, csrn, uimm); break;
+                    case 0x6: sprintf(details_buffer, "csrrsi %s,%s,%u      %s=%s=0x%08x,%s|=%u=0x%08x", rdn, csrn, uimm, rdn, csrn, t->csr_old, csrn, uimm, t->csr_new); break;
+                    case 0x7: sprintf(details_buffer, "csrrci %s,%s,%u      %s=%s=0x%08x,csr&=~%u=0x%08x", rdn, csrn, uimm, rdn, csrn, t->csr_old, uimm, t->csr_new); break;
+                }
+            }
+            break;
+        case 0x0F:
+            if (funct3 == 0x0) sprintf(details_buffer, "fence");
+            else if (funct3 == 0x1) sprintf(details_buffer, "fence.i");
+            break;
+        case 0x2F:
+            if ((funct7 >> 2) == 0x02) sprintf(details_buffer, "lr.w   %s,(%s)             %s=mem[0x%08x]=0x%08x", rdn, rs1n, rdn, rs1_val, rd_print);
+            else if ((funct7 >> 2) == 0x03) sprintf(details_buffer, "sc.w   %s,%s,(%s)          mem[0x%08x]=0x%08x,%s=%u", rdn, rs2n, rs1n, rs1_val, rs2_val, rdn, rd_print);
+            else sprintf(details_buffer, "%-10s%s,%s,(%s)    %s=mem[0x%08x]=0x%08x,src=0x%08x", amo_name(funct7 >> 2), rdn, rs2n, rs1n, rdn, rs1_val, rd_print, rs2_val);
+            break;
+    }
+}
+
+// Linhas de trap e de double fault (iguais no simulador e no conversor).
+#define TRACE_TRAP_FMT   ">%s                   cause=0x%08x,epc=0x%08x,tval=0x%08x\n"
+#define TRACE_FATAL_LINE ">FATAL: Double fault detected. Halting simulation.\n"
+
+// --- Trace Binário ---
+// Arquivo: "PXTB", byte de versão, os 32 registradores iniciais e o pc inicial
+// (varints). Depois uma sequência de registros, cada um começando por um byte
+// de tag cujos 2 bits baixos dão o tipo:
+//
+//   INSN  [delta do pc] [palavra da instrução] [delta de rd] [CSR antigo/novo] [próximo pc]
+//   TRAP  cause epc tval
+//   FATAL (sem campos)
+//   REG   rd delta        (rd alterado por uma instrução que gerou trap, ex.: load com falha)
+//
+// Os campos entre colchetes só aparecem quando necessários. Quem lê e quem
+// escreve mantêm o mesmo trace_bin_state_t, então tudo que pode ser deduzido
+// do estado (pc sequencial, instrução já vista nesse pc, destino de desvios,
+// operandos rs1/rs2) não é gravado. Valores de rd são gravados como diferença
+// zigzag em relação ao valor anterior do registrador.
+#define TRACE_BIN_MAGIC   "PXTB"
+#define TRACE_BIN_VERSION 1
+
+#define TRACE_REC_INSN  0
+#define TRACE_REC_TRAP  1
+#define TRACE_REC_FATAL 2
+#define TRACE_REC_REG   3
+#define TRACE_REC_KIND  0x03
+
+#define TRACE_FLAG_PC   0x04  // pc diferente do esperado: segue delta zigzag
+#define TRACE_FLAG_RAW  0x08  // segue a palavra da instrução (4 bytes little-endian)
+#define TRACE_FLAG_NEXT 0x10  // segue o próximo pc (não dedutível: mret, sret)
+
+#define TRACE_REC_MAX   32    // tamanho máximo de um registro codificado
+
+#define TRACE_INSN_CACHE_SIZE 65536
+
+typedef struct {
+    uint32_t regs[32];        // registradores reconstruídos
+    uint32_t expected_pc;     // pc da próxima instrução se não houver desvio/trap
+    struct { uint32_t pc, insn; } insn_cache[TRACE_INSN_CACHE_SIZE]; // última instrução vista por pc
+} trace_bin_state_t;
+
+// Estado inicial: nenhuma instrução vista (pc ímpar nunca casa).
+static inline void trace_bin_state_init(trace_bin_state_t *st) {
+    memset(st, 0, sizeof(*st));
+    for (int i = 0; i < TRACE_INSN_CACHE_SIZE; i++) st->insn_cache[i].pc = 1;
+}
+
+static inline uint32_t trace_zigzag(int32_t v) { return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31); }
+static inline int32_t trace_unzigzag(uint32_t v) { return (int32_t)(v >> 1) ^ -(int32_t)(v & 1); }
+
+static inline uint8_t *trace_put_varint(uint8_t *p, uint32_t v) {
+    while (v >= 0x80) { *p++ = (uint8_t)(v | 0x80); v >>= 7; }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+// Instruções cujo valor de rd aparece no trace.
+static inline int trace_insn_writes_rd(uint32_t insn) {
+    switch (get_opcode(insn)) {
+        case 0x37: case 0x17: case 0x6F: case 0x67: case 0x03: case 0x13: case 0x33: case 0x2F: return 1;
+        case 0x73: return get_funct3(insn) != 0;
+        default: return 0;
+    }
+}
+
+static inline int trace_insn_is_csr(uint32_t insn) {
+    return get_opcode(insn) == 0x73 && get_funct3(insn) != 0;
+}
+
+static inline uint32_t trace_insn_slot(uint32_t pc) { return (pc >> 2) & (TRACE_INSN_CACHE_SIZE - 1); }
+
+// Próximo pc deduzido a partir dos registradores reconstruídos. Mantém a
+// convenção do trace de texto: desvio não tomado mostra o próprio pc.
+static inline uint32_t trace_predict_next_pc(const trace_bin_state_t *st, uint32_t pc, uint32_t insn) {
+    uint32_t a = st->regs[get_rs1(insn)], b = st->regs[get_rs2(insn)];
+    int taken = 0;
+    switch (get_opcode(insn)) {
+        case 0x6F: return pc + get_imm_J(insn);
+        case 0x67: return (a + get_imm_I(insn)) & ~1u;
+        case 0x63:
+            switch (get_funct3(insn)) {
+                case 0x0: taken = a == b; break;
+                case 0x1: taken = a != b; break;
+                case 0x4: taken = (int32_t)a < (int32_t)b; break;
+                case 0x5: taken = (int32_t)a >= (int32_t)b; break;
+                case 0x6: taken = a < b; break;
+                case 0x7: taken = a >= b; break;
+            }
+            return taken ? pc + get_imm_B(insn) : pc;
+        default: return pc;
+    }
+}
+
+// Atualiza o estado depois de uma instrução (igual dos dois lados).
+static inline void trace_bin_retire(trace_bin_state_t *st, const trace_info_t *t) {
+    uint32_t rd = get_rd(t->instruction);
+    if (rd != 0 && trace_insn_writes_rd(t->instruction)) st->regs[rd] = t->rd_val;
+    st->expected_pc = (t->next_pc == t->pc) ? t->pc + 4 : t->next_pc;
+}
+
+#endif
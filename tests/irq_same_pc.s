@@ -0,0 +1,33 @@
+# Interrupções repetidas no mesmo pc não são double fault: o handler deixa o
+# mtimecmp vencido, então o timer volta três vezes no "nop" depois do csrsi,
+# sempre com o mesmo mepc.
+.text
+_start:
+  la t0, handler
+  csrw mtvec, t0
+  li s0, 0x02004000        # mtimecmp do hart 0
+  li s2, 0                 # interrupções tratadas
+  sw zero, 4(s0)
+  sw zero, 0(s0)           # já vencido
+  li t0, 0x80              # MTIE
+  csrw mie, t0
+1:csrsi mstatus, 8
+  nop
+  j 1b
+
+handler:
+  addi s2, s2, 1
+  addi a0, s2, '0'
+  call putc
+  li t0, 3
+  beq s2, t0, 2f
+  mret
+2:ebreak
+
+putc:
+  li t6, 0x10000000
+1:lbu t5, 5(t6)            # LSR.THRE
+  andi t5, t5, 0x20
+  beqz t5, 1b
+  sb a0, 0(t6)
+  ret
@@ -0,0 +1,44 @@
+// poxim_write_memory sobre código já executado, chamada de outra thread: a
+// próxima execução na thread que rodou a máquina precisa ver o código novo.
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include "poxim.h"
+
+// li a0, 1; ebreak
+static const char program[] = "@80000000\n13 05 10 00 73 00 10 00\n";
+
+static poxim_t *machine;
+
+// li a0, 2 no lugar do li a0, 1
+static void *patch(void *arg) {
+    static const unsigned char li_a0_2[4] = { 0x13, 0x05, 0x20, 0x00 };
+    (void)arg;
+    poxim_write_memory(machine, 0x80000000, li_a0_2, sizeof(li_a0_2));
+    return NULL;
+}
+
+static int run(int engine) {
+    poxim_config_t config;
+    memset(&config, 0, sizeof(config));
+    config.engine = engine;
+    config.quiet = 1;
+    machine = poxim_new(&config);
+    if (!machine || poxim_load(machine, program, sizeof(program) - 1) != 0) return 0;
+
+    int ok = poxim_run(machine, UINT64_MAX) == POXIM_STOP_EBREAK && poxim_get_reg(machine, 0, 10) == 1;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, patch, NULL) != 0) return 0;
+    pthread_join(thread, NULL);
+    poxim_set_reg(machine, 0, POXIM_REG_PC, 0x80000000);
+    ok = ok && poxim_run(machine, UINT64_MAX) == POXIM_STOP_EBREAK && poxim_get_reg(machine, 0, 10) == 2;
+    poxim_free(machine);
+    if (!ok) fprintf(stderr, "lib_threads: motor %d rodou o codigo antigo\n", engine);
+    return ok;
+}
+
+int main(void) {
+    int ok = run(POXIM_ENGINE_CACHE);
+    ok = run(POXIM_ENGINE_JIT) && ok;
+    return ok ? 0 : 1;
+}
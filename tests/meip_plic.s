@@ -0,0 +1,48 @@
+# MEIP acompanha o PLIC: uma escrita do software em mip não fica, e depois do
+# complete o bit cai sozinho se a UART não pedir de novo. Cada caractere de
+# meip_plic.in gera uma interrupção; uma interrupção sem fonte imprime '?'.
+.text
+_start:
+  la t0, handler
+  csrw mtvec, t0
+  li s0, 0x0C200004        # claim/complete do contexto 0
+  li s1, 0x10000000        # UART
+  li s2, 0                 # caracteres recebidos
+  li t0, 0x800             # MEIE
+  csrw mie, t0
+  csrs mip, t0             # sem pedido no PLIC: não interrompe
+  csrsi mstatus, 8
+  nop
+  csrci mstatus, 8
+  li t0, 1 << 10           # fonte da UART
+  li t1, 0x0C002000
+  sw t0, 0(t1)
+  li t0, 1                 # IER: recepção
+  sb t0, 1(s1)
+1:csrsi mstatus, 8
+  li t0, 2
+  bne s2, t0, 1b
+  li a0, '.'
+  call putc
+  ebreak
+
+handler:
+  lw t2, 0(s0)             # claim
+  li t0, 10
+  bne t2, t0, 2f
+  lbu a0, 0(s1)
+  call putc
+  addi s2, s2, 1
+  sw t2, 0(s0)             # complete
+  mret
+2:li a0, '?'
+  call putc
+  mret
+
+putc:
+  li t6, 0x10000000
+1:lbu t5, 5(t6)            # LSR.THRE
+  andi t5, t5, 0x20
+  beqz t5, 1b
+  sb a0, 0(t6)
+  ret
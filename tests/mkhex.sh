@@ -0,0 +1,16 @@
+#!/bin/sh
+# Remonta os .hex dos testes a partir dos .s (precisa de llvm-mc e
+# llvm-objcopy); cada .hex fica ao lado do seu .s. Uso: tests/mkhex.sh [teste.s...]
+set -e
+dir=$(dirname "$0")
+[ $# -gt 0 ] || set -- "$dir"/*.s
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+for s in "$@"; do
+    name=$(basename "$s" .s)
+    llvm-mc -triple=riscv32 -mattr=+m,-relax -filetype=obj "$s" -o "$tmp/$name.o"
+    llvm-objcopy -O binary -j .text "$tmp/$name.o" "$tmp/$name.bin"
+    out=$(dirname "$s")/$name.hex
+    { echo "@80000000"; od -An -v -tx1 -w16 "$tmp/$name.bin" | sed 's/^ //' | tr a-f A-F; } > "$out"
+    echo "$out"
+done
@@ -0,0 +1,90 @@
+# mret: MIE = MPIE, MPIE = 1 e MPP = U. Primeiro um mret de M para M mostra
+# os bits de mstatus ("IUP"); depois o programa desce para o modo U, faz um
+# ecall ("8") e o mret do handler volta para U com MIE ligado, onde o timer
+# interrompe ("TU": MPP do trap é U).
+.text
+_start:
+  la t0, handler
+  csrw mtvec, t0
+  li s0, 0x02004000        # mtimecmp do hart 0
+  li s1, 0x0200BFF8        # mtime
+  li t0, -1
+  sw t0, 4(s0)             # timer desligado até o ecall
+  li t0, 0x80              # MTIE
+  csrw mie, t0
+
+  # M -> M: MIE = 0, MPIE = 1, MPP = M
+  csrci mstatus, 8
+  li t0, 0x1880
+  csrs mstatus, t0
+  la t0, 1f
+  csrw mepc, t0
+  mret
+1:csrr s2, mstatus
+  li a0, 'i'
+  andi t0, s2, 0x8
+  beqz t0, 2f
+  li a0, 'I'
+2:call putc
+  call print_mpp
+  li a0, 'p'
+  andi t0, s2, 0x80
+  beqz t0, 3f
+  li a0, 'P'
+3:call putc
+
+  # M -> U com MPIE = 1
+  csrci mstatus, 8
+  li t0, 0x1800
+  csrc mstatus, t0
+  li t0, 0x80
+  csrs mstatus, t0
+  la t0, user
+  csrw mepc, t0
+  mret
+
+user:
+  ecall
+4:nop                      # espera o timer ("j ." não volta: o pc não muda)
+  j 4b
+
+handler:
+  csrr t0, mcause
+  bltz t0, timer
+  addi a0, t0, '0'         # ecall do modo U: causa 8
+  call putc
+  csrr t0, mepc
+  addi t0, t0, 4
+  csrw mepc, t0
+  lw t0, 0(s1)
+  addi t0, t0, 100
+  sw t0, 0(s0)
+  sw zero, 4(s0)
+  mret
+
+timer:
+  li a0, 'T'
+  call putc
+  csrr s2, mstatus
+  call print_mpp
+  ebreak
+
+# 'U' ou 'M' conforme o MPP de s2.
+print_mpp:
+  mv s3, ra
+  li t0, 0x1800
+  and t0, s2, t0
+  li a0, 'U'
+  beqz t0, 1f
+  li a0, 'M'
+1:call putc
+  mv ra, s3
+  ret
+
+putc:
+  li t6, 0x10000000
+1:lbu t5, 5(t6)            # LSR.THRE
+  andi t5, t5, 0x20
+  beqz t5, 1b
+  sb a0, 0(t6)
+  ret
@@ -0,0 +1,42 @@
+#!/bin/sh
+# Roda os programas de expected.txt e confere a saída da UART de cada um; um
+# <teste>.in, se existir, é o <term_in>. Depois compila e roda os testes da
+# libpoxim (lib_*.c), que retornam 0 quando passam.
+# Uso: tests/run.sh [poxim] [opções do poxim...]   (padrão: ./poxim)
+dir=$(dirname "$0")
+case "$1" in
+    ''|-*) poxim=./poxim ;;
+    *) poxim=$1; shift ;;
+esac
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+: > "$tmp/in"
+
+fail=0
+while read -r name expected opts; do
+    case "$name" in ''|'#'*) continue ;; esac
+    input="$dir/$name.in"
+    [ -f "$input" ] || input="$tmp/in"
+    timeout 60 "$poxim" --no-trace $opts "$@" "$dir/$name.hex" /dev/null "$input" "$tmp/out" 2> /dev/null
+    out=$(cat "$tmp/out")
+    if [ "$out" = "$expected" ]; then
+        status=ok
+    else
+        status="ERRO (esperado $expected, saiu $out)"
+        fail=1
+    fi
+    printf '%-16s %s\n' "$name" "$status"
+done < "$dir/expected.txt"
+
+for src in "$dir"/lib_*.c; do
+    [ -f "$src" ] || continue
+    name=$(basename "$src" .c)
+    if ${CC:-cc} -O2 -pthread -DPOXIM_LIBRARY -I "$dir/.." -o "$tmp/$name" "$src" "$dir/../poxim.c" && timeout 60 "$tmp/$name"; then
+        status=ok
+    else
+        status=ERRO
+        fail=1
+    fi
+    printf '%-16s %s\n' "$name" "$status"
+done
+exit $fail
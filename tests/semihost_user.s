@@ -0,0 +1,37 @@
+# O semihosting só atende o modo M: a mesma sequência SYS_WRITEC escreve "M"
+# no modo M e, no modo U, é um ebreak comum que para a simulação antes do "u".
+.text
+_start:
+  li a0, 0x03              # SYS_WRITEC
+  la a1, char_m
+  slli x0, x0, 0x1f
+  ebreak
+  srai x0, x0, 7
+
+  # M -> U
+  li t0, 0x1800
+  csrc mstatus, t0
+  la t0, user
+  csrw mepc, t0
+  mret
+
+user:
+  li a0, 0x03
+  la a1, char_x
+  slli x0, x0, 0x1f
+  ebreak
+  srai x0, x0, 7
+  li a0, 'u'               # só chega aqui se o host atendeu a chamada
+  call putc
+  ebreak
+
+putc:
+  li t6, 0x10000000
+1:lbu t5, 5(t6)            # LSR.THRE
+  andi t5, t5, 0x20
+  beqz t5, 1b
+  sb a0, 0(t6)
+  ret
+
+char_m: .byte 'M'
+char_x: .byte 'X'